@@ -31,6 +31,7 @@
 #include "bio.h"
 #include "rio.h"
 
+#include <ctype.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -40,159 +41,771 @@
 #include <sys/wait.h>
 #include <sys/param.h>
 
-void aofUpdateCurrentSize(void);
-void aofClosePipes(void);
+int aofFileExist(char *filename);
+int aofWriteFormatHeader(int fd, int format);
+int aofFileFormat(char *filepath);
+int rewriteAppendOnlyFile(char *filename);
+off_t getAppendOnlyFileSize(sds filename, int *status);
 
 /* ----------------------------------------------------------------------------
- * AOF rewrite buffer implementation.
+ * AOF manifest implementation.
  *
- * The following code implement a simple buffer used in order to accumulate
- * changes while the background process is rewriting the AOF file.
+ * The AOF is a set of files living in the 'appenddirname' directory:
  *
- * We only need to append, but can't just use realloc with a large block
- * because 'huge' reallocs are not always handled as one could expect
- * (via remapping of pages at OS level) but may involve copying data.
+ * BASE: a snapshot of the dataset created by the last AOF rewrite, in the
+ * RDB format (or in the AOF format if aof-use-rdb-preamble is off). There
+ * is at most one BASE file, and it is always loaded first.
  *
- * For this reason we use a list of blocks, every block is
- * AOF_RW_BUF_BLOCK_SIZE bytes.
+ * INCR: the commands executed after the last successful rewrite. A rewrite
+ * starts by opening a new INCR file, so there are usually one or two of
+ * them, more if some rewrite failed.
+ *
+ * HISTORY: the BASE and INCR files made obsolete by a successful rewrite,
+ * that are going to be deleted.
+ *
+ * The manifest file lists them, one per line, for instance:
+ *
+ *  file appendonly.aof.3.base.rdb seq 3 type b
+ *  file appendonly.aof.6.incr.aof seq 6 type i
+ *  file appendonly.aof.7.incr.aof seq 7 type i
+ *
+ * Since a rewrite only needs to open a new INCR file while the child writes
+ * the new BASE, the parent no longer accumulates the writes performed during
+ * the rewrite in memory, nor sends them to the child.
  * ------------------------------------------------------------------------- */
 
-#define AOF_RW_BUF_BLOCK_SIZE (1024*1024*10)    /* 10 MB per block */
+#define BASE_FILE_SUFFIX           ".base"
+#define INCR_FILE_SUFFIX           ".incr"
+#define RDB_FORMAT_SUFFIX          ".rdb"
+#define AOF_FORMAT_SUFFIX          ".aof"
+#define MANIFEST_NAME_SUFFIX       ".manifest"
+#define TEMP_FILE_NAME_PREFIX      "temp-"
+#define MANIFEST_MAX_LINE          1024
+
+/* Keys of the manifest lines. */
+#define AOF_MANIFEST_KEY_FILE_NAME   "file"
+#define AOF_MANIFEST_KEY_FILE_SEQ    "seq"
+#define AOF_MANIFEST_KEY_FILE_TYPE   "type"
+
+aofInfo *aofInfoCreate(void) {
+    return zcalloc(sizeof(aofInfo));
+}
+
+void aofInfoFree(aofInfo *ai) {
+    serverAssert(ai != NULL);
+    if (ai->file_name) sdsfree(ai->file_name);
+    zfree(ai);
+}
+
+aofInfo *aofInfoDup(aofInfo *orig) {
+    serverAssert(orig != NULL);
+    aofInfo *ai = aofInfoCreate();
+    ai->file_name = sdsdup(orig->file_name);
+    ai->file_seq = orig->file_seq;
+    ai->file_type = orig->file_type;
+    return ai;
+}
+
+/* Return true if the file name can't be written as is in the manifest,
+ * because sdssplitargs() would not parse it back. */
+static int aofFileNameNeedsRepr(sds name) {
+    for (size_t j = 0; j < sdslen(name); j++) {
+        unsigned char c = name[j];
+        if (!isprint(c) || isspace(c) || c == '"' || c == '\'' || c == '\\')
+            return 1;
+    }
+    return 0;
+}
+
+/* Append the manifest line describing 'ai' to 'buf'. */
+sds aofInfoFormat(sds buf, aofInfo *ai) {
+    sds filename_repr = NULL;
+
+    if (aofFileNameNeedsRepr(ai->file_name))
+        filename_repr = sdscatrepr(sdsempty(), ai->file_name,
+                                   sdslen(ai->file_name));
+
+    buf = sdscatprintf(buf, "%s %s %s %lld %s %c\n",
+        AOF_MANIFEST_KEY_FILE_NAME,
+        filename_repr ? filename_repr : ai->file_name,
+        AOF_MANIFEST_KEY_FILE_SEQ, ai->file_seq,
+        AOF_MANIFEST_KEY_FILE_TYPE, ai->file_type);
+    if (filename_repr) sdsfree(filename_repr);
+    return buf;
+}
+
+void aofListFree(void *item) {
+    aofInfoFree((aofInfo *)item);
+}
+
+void *aofListDup(void *item) {
+    return aofInfoDup(item);
+}
+
+aofManifest *aofManifestCreate(void) {
+    aofManifest *am = zcalloc(sizeof(aofManifest));
+    am->incr_aof_list = listCreate();
+    am->history_aof_list = listCreate();
+    listSetFreeMethod(am->incr_aof_list, aofListFree);
+    listSetDupMethod(am->incr_aof_list, aofListDup);
+    listSetFreeMethod(am->history_aof_list, aofListFree);
+    listSetDupMethod(am->history_aof_list, aofListDup);
+    return am;
+}
 
-typedef struct aofrwblock {
-    unsigned long used, free;
-    char buf[AOF_RW_BUF_BLOCK_SIZE];
-} aofrwblock;
+void aofManifestFree(aofManifest *am) {
+    if (am->base_aof_info) aofInfoFree(am->base_aof_info);
+    if (am->incr_aof_list) listRelease(am->incr_aof_list);
+    if (am->history_aof_list) listRelease(am->history_aof_list);
+    zfree(am);
+}
 
-/* This function free the old AOF rewrite buffer if needed, and initialize
- * a fresh new one. It tests for server.aof_rewrite_buf_blocks equal to NULL
- * so can be used for the first initialization as well. */
-void aofRewriteBufferReset(void) {
-    if (server.aof_rewrite_buf_blocks)
-        listRelease(server.aof_rewrite_buf_blocks);
+/* The manifest changes are performed on a copy, that replaces the
+ * server one only once it was persisted on disk. */
+aofManifest *aofManifestDup(aofManifest *orig) {
+    serverAssert(orig != NULL);
+    aofManifest *am = zcalloc(sizeof(aofManifest));
+
+    am->curr_base_file_seq = orig->curr_base_file_seq;
+    am->curr_incr_file_seq = orig->curr_incr_file_seq;
+    am->dirty = orig->dirty;
+    if (orig->base_aof_info) am->base_aof_info = aofInfoDup(orig->base_aof_info);
+    am->incr_aof_list = listDup(orig->incr_aof_list);
+    am->history_aof_list = listDup(orig->history_aof_list);
+    serverAssert(am->incr_aof_list != NULL);
+    serverAssert(am->history_aof_list != NULL);
+    return am;
+}
 
-    server.aof_rewrite_buf_blocks = listCreate();
-    listSetFreeMethod(server.aof_rewrite_buf_blocks,zfree);
+/* Replace server.aof_manifest with 'am', freeing the previous one. */
+void aofManifestFreeAndUpdate(aofManifest *am) {
+    serverAssert(am != NULL);
+    if (server.aof_manifest) aofManifestFree(server.aof_manifest);
+    server.aof_manifest = am;
 }
 
-/* Return the current size of the AOF rewrite buffer. */
-unsigned long aofRewriteBufferSize(void) {
+sds getAofManifestFileName(void) {
+    return sdscatprintf(sdsempty(), "%s%s", server.aof_filename,
+                        MANIFEST_NAME_SUFFIX);
+}
+
+sds getTempAofManifestFileName(void) {
+    return sdscatprintf(sdsempty(), "%s%s%s", TEMP_FILE_NAME_PREFIX,
+                        server.aof_filename, MANIFEST_NAME_SUFFIX);
+}
+
+/* The INCR file written while the AOF is in the AOF_WAIT_REWRITE state:
+ * it only makes it into the manifest once the rewrite succeeded. */
+sds getTempIncrAofName(void) {
+    return sdscatprintf(sdsempty(), "%s%s%s", TEMP_FILE_NAME_PREFIX,
+                        server.aof_filename, INCR_FILE_SUFFIX);
+}
+
+/* Return the manifest content as a string. */
+sds getAofManifestAsString(aofManifest *am) {
+    serverAssert(am != NULL);
+    sds buf = sdsempty();
     listNode *ln;
     listIter li;
-    unsigned long size = 0;
 
-    listRewind(server.aof_rewrite_buf_blocks,&li);
-    while((ln = listNext(&li))) {
-        aofrwblock *block = listNodeValue(ln);
-        size += block->used;
+    /* The BASE file first. */
+    if (am->base_aof_info) buf = aofInfoFormat(buf, am->base_aof_info);
+
+    /* The HISTORY files, so that they are deleted on restart if we
+     * crashed before deleting them. */
+    listRewind(am->history_aof_list, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        buf = aofInfoFormat(buf, (aofInfo*)ln->value);
     }
-    return size;
+
+    /* The INCR files, in the order they must be loaded. */
+    listRewind(am->incr_aof_list, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        buf = aofInfoFormat(buf, (aofInfo*)ln->value);
+    }
+
+    return buf;
 }
 
-/* Event handler used to send data to the child process doing the AOF
- * rewrite. We send pieces of our AOF differences buffer so that the final
- * write when the child finishes the rewrite will be small. */
-void aofChildWriteDiffData(aeEventLoop *el, int fd, void *privdata, int mask) {
-    listNode *ln;
-    aofrwblock *block;
-    ssize_t nwritten;
-    UNUSED(el);
-    UNUSED(fd);
-    UNUSED(privdata);
-    UNUSED(mask);
+/* Parse the manifest file at 'am_filepath'. Any error is fatal, since
+ * loading only a part of the AOF would silently lose data. */
+aofManifest *aofLoadManifestFromFile(sds am_filepath) {
+    const char *err = NULL;
+    long long maxseq = 0;
+    aofManifest *am = aofManifestCreate();
+    aofInfo *ai = NULL;
+    sds line = NULL;
+    sds *argv = NULL;
+    int argc, linenum = 0;
+    char buf[MANIFEST_MAX_LINE+1];
+
+    FILE *fp = fopen(am_filepath, "r");
+    if (fp == NULL) {
+        serverLog(LL_WARNING, "Fatal error: can't open the AOF manifest "
+            "file %s for reading: %s", am_filepath, strerror(errno));
+        exit(1);
+    }
 
-    while(1) {
-        ln = listFirst(server.aof_rewrite_buf_blocks);
-        block = ln ? ln->value : NULL;
-        if (server.aof_stop_sending_diff || !block) {
-            aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,
-                              AE_WRITABLE);
-            return;
+    while (1) {
+        if (fgets(buf, MANIFEST_MAX_LINE+1, fp) == NULL) {
+            if (feof(fp)) {
+                if (linenum == 0) {
+                    err = "Found an empty AOF manifest";
+                    goto loaded_error;
+                }
+                break;
+            }
+            err = "Read AOF manifest failed";
+            goto loaded_error;
         }
-        if (block->used > 0) {
-            nwritten = write(server.aof_pipe_write_data_to_child,
-                             block->buf,block->used);
-            if (nwritten <= 0) return;
-            memmove(block->buf,block->buf+nwritten,block->used-nwritten);
-            block->used -= nwritten;
-            block->free += nwritten;
+
+        linenum++;
+
+        /* Skip comments lines */
+        if (buf[0] == '#') continue;
+
+        if (strchr(buf, '\n') == NULL) {
+            err = "The AOF manifest file contains too long line";
+            goto loaded_error;
         }
-        if (block->used == 0) listDelNode(server.aof_rewrite_buf_blocks,ln);
-    }
-}
 
-/* Append data to the AOF rewrite buffer, allocating new blocks if needed. */
-void aofRewriteBufferAppend(unsigned char *s, unsigned long len) {
-    listNode *ln = listLast(server.aof_rewrite_buf_blocks);
-    aofrwblock *block = ln ? ln->value : NULL;
+        line = sdstrim(sdsnew(buf), " \t\r\n");
+        if (!sdslen(line)) {
+            err = "Invalid AOF manifest file format";
+            goto loaded_error;
+        }
 
-    while(len) {
-        /* If we already got at least an allocated block, try appending
-         * at least some piece into it. */
-        if (block) {
-            unsigned long thislen = (block->free < len) ? block->free : len;
-            if (thislen) {  /* The current block is not already full. */
-                memcpy(block->buf+block->used, s, thislen);
-                block->used += thislen;
-                block->free -= thislen;
-                s += thislen;
-                len -= thislen;
+        argv = sdssplitargs(line, &argc);
+        /* We only require the three keys we know about, so that unknown
+         * ones can be added in the future. */
+        if (argv == NULL || argc < 6 || (argc % 2)) {
+            err = "Invalid AOF manifest file format";
+            goto loaded_error;
+        }
+
+        ai = aofInfoCreate();
+        for (int i = 0; i < argc; i += 2) {
+            if (!strcasecmp(argv[i], AOF_MANIFEST_KEY_FILE_NAME)) {
+                if (ai->file_name) sdsfree(ai->file_name);
+                ai->file_name = sdsnew(argv[i+1]);
+                if (!pathIsBaseName(ai->file_name)) {
+                    err = "File can't be a path, just a filename";
+                    goto loaded_error;
+                }
+            } else if (!strcasecmp(argv[i], AOF_MANIFEST_KEY_FILE_SEQ)) {
+                ai->file_seq = atoll(argv[i+1]);
+            } else if (!strcasecmp(argv[i], AOF_MANIFEST_KEY_FILE_TYPE)) {
+                ai->file_type = (argv[i+1])[0];
             }
         }
 
-        if (len) { /* First block to allocate, or need another block. */
-            int numblocks;
+        /* We have to make sure we load all the information. */
+        if (!ai->file_name || !ai->file_seq || !ai->file_type) {
+            err = "Invalid AOF manifest file format";
+            goto loaded_error;
+        }
 
-            block = zmalloc(sizeof(*block));
-            block->free = AOF_RW_BUF_BLOCK_SIZE;
-            block->used = 0;
-            listAddNodeTail(server.aof_rewrite_buf_blocks,block);
+        sdsfreesplitres(argv, argc);
+        argv = NULL;
 
-            /* Log every time we cross more 10 or 100 blocks, respectively
-             * as a notice or warning. */
-            numblocks = listLength(server.aof_rewrite_buf_blocks);
-            if (((numblocks+1) % 10) == 0) {
-                int level = ((numblocks+1) % 100) == 0 ? LL_WARNING :
-                                                         LL_NOTICE;
-                serverLog(level,"Background AOF buffer size: %lu MB",
-                    aofRewriteBufferSize()/(1024*1024));
+        if (ai->file_type == AOF_FILE_TYPE_BASE) {
+            if (am->base_aof_info) {
+                err = "Found duplicate base file information";
+                goto loaded_error;
             }
+            am->base_aof_info = ai;
+            am->curr_base_file_seq = ai->file_seq;
+        } else if (ai->file_type == AOF_FILE_TYPE_HIST) {
+            listAddNodeTail(am->history_aof_list, ai);
+        } else if (ai->file_type == AOF_FILE_TYPE_INCR) {
+            if (ai->file_seq <= maxseq) {
+                err = "Found a non-monotonic sequence number";
+                goto loaded_error;
+            }
+            listAddNodeTail(am->incr_aof_list, ai);
+            am->curr_incr_file_seq = ai->file_seq;
+            maxseq = ai->file_seq;
+        } else {
+            err = "Unknown AOF file type";
+            goto loaded_error;
         }
+
+        sdsfree(line);
+        line = NULL;
+        ai = NULL;
     }
 
-    /* Install a file event to send data to the rewrite child if there is
-     * not one already. */
-    if (!server.aof_stop_sending_diff &&
-        aeGetFileEvents(server.el,server.aof_pipe_write_data_to_child) == 0)
-    {
-        aeCreateFileEvent(server.el, server.aof_pipe_write_data_to_child,
-            AE_WRITABLE, aofChildWriteDiffData, NULL);
+    fclose(fp);
+    return am;
+
+loaded_error:
+    serverLog(LL_WARNING, "%s at line %d in the AOF manifest %s",
+        err, linenum, am_filepath);
+    exit(1);
+}
+
+/* Load the manifest of the AOF directory into server.aof_manifest. When
+ * there is no manifest yet, an empty one is created. */
+void aofLoadManifestFromDisk(void) {
+    aofManifestFreeAndUpdate(aofManifestCreate());
+    if (!dirExists(server.aof_dirname)) {
+        serverLog(LL_DEBUG, "The AOF directory %s doesn't exist",
+            server.aof_dirname);
+        return;
     }
+
+    sds am_name = getAofManifestFileName();
+    sds am_filepath = makePath(server.aof_dirname, am_name);
+    if (!fileExist(am_filepath)) {
+        serverLog(LL_DEBUG, "The AOF manifest file %s doesn't exist", am_name);
+    } else {
+        aofManifestFreeAndUpdate(aofLoadManifestFromFile(am_filepath));
+    }
+    sdsfree(am_name);
+    sdsfree(am_filepath);
+}
+
+/* Make the current BASE file (if any) a HISTORY file, and add a new BASE
+ * file to the manifest. Its name is returned. */
+sds getNewBaseFileNameAndMarkPreAsHistory(aofManifest *am) {
+    serverAssert(am != NULL);
+    if (am->base_aof_info) {
+        serverAssert(am->base_aof_info->file_type == AOF_FILE_TYPE_BASE);
+        am->base_aof_info->file_type = AOF_FILE_TYPE_HIST;
+        listAddNodeHead(am->history_aof_list, am->base_aof_info);
+    }
+
+    char *format_suffix = server.aof_use_rdb_preamble ?
+        RDB_FORMAT_SUFFIX : AOF_FORMAT_SUFFIX;
+
+    aofInfo *ai = aofInfoCreate();
+    ai->file_name = sdscatprintf(sdsempty(), "%s.%lld%s%s", server.aof_filename,
+                        ++am->curr_base_file_seq, BASE_FILE_SUFFIX, format_suffix);
+    ai->file_seq = am->curr_base_file_seq;
+    ai->file_type = AOF_FILE_TYPE_BASE;
+    am->base_aof_info = ai;
+    am->dirty = 1;
+    return am->base_aof_info->file_name;
+}
+
+/* Add a new INCR file to the manifest and return its name. */
+sds getNewIncrAofName(aofManifest *am) {
+    aofInfo *ai = aofInfoCreate();
+    ai->file_type = AOF_FILE_TYPE_INCR;
+    ai->file_name = sdscatprintf(sdsempty(), "%s.%lld%s%s", server.aof_filename,
+                        ++am->curr_incr_file_seq, INCR_FILE_SUFFIX, AOF_FORMAT_SUFFIX);
+    ai->file_seq = am->curr_incr_file_seq;
+    listAddNodeTail(am->incr_aof_list, ai);
+    am->dirty = 1;
+    return ai->file_name;
 }
 
-/* Write the buffer (possibly composed of multiple blocks) into the specified
- * fd. If a short write or any other error happens -1 is returned,
- * otherwise the number of bytes written is returned. */
-ssize_t aofRewriteBufferWrite(int fd) {
+/* Return the name of the last INCR file, adding one to the manifest if
+ * there is none. */
+sds getLastIncrAofName(aofManifest *am) {
+    serverAssert(am != NULL);
+
+    if (!listLength(am->incr_aof_list)) return getNewIncrAofName(am);
+
+    listNode *lastnode = listIndex(am->incr_aof_list, -1);
+    aofInfo *ai = listNodeValue(lastnode);
+    return ai->file_name;
+}
+
+/* Called when a rewrite succeeded: the INCR files it made obsolete become
+ * HISTORY files. The last INCR file is the one opened when the rewrite
+ * started, that is still being written, unless the AOF is off. */
+void markRewrittenIncrAofAsHistory(aofManifest *am) {
+    serverAssert(am != NULL);
+    if (!listLength(am->incr_aof_list)) return;
+
     listNode *ln;
     listIter li;
-    ssize_t count = 0;
 
-    listRewind(server.aof_rewrite_buf_blocks,&li);
-    while((ln = listNext(&li))) {
-        aofrwblock *block = listNodeValue(ln);
-        ssize_t nwritten;
-
-        if (block->used) {
-            nwritten = write(fd,block->buf,block->used);
-            if (nwritten != (ssize_t)block->used) {
-                if (nwritten == 0) errno = EIO;
-                return -1;
-            }
-            count += nwritten;
+    listRewindTail(am->incr_aof_list, &li);
+
+    /* "server.aof_fd != -1" means AOF enabled, then we must skip the
+     * last AOF, because this file is our currently writing. */
+    if (server.aof_fd != -1) {
+        ln = listNext(&li);
+        serverAssert(ln != NULL);
+    }
+
+    /* Move aofInfo from 'incr_aof_list' to 'history_aof_list'. */
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = (aofInfo*)ln->value;
+        serverAssert(ai->file_type == AOF_FILE_TYPE_INCR);
+
+        aofInfo *hai = aofInfoDup(ai);
+        hai->file_type = AOF_FILE_TYPE_HIST;
+        listAddNodeHead(am->history_aof_list, hai);
+        listDelNode(am->incr_aof_list, ln);
+    }
+
+    am->dirty = 1;
+}
+
+/* Write the manifest in a temp file that is then atomically renamed into
+ * the manifest, and fsync both the file and the directory. */
+int writeAofManifestFile(sds buf) {
+    int ret = C_OK;
+    ssize_t nwritten;
+    int len;
+
+    sds am_name = getAofManifestFileName();
+    sds am_filepath = makePath(server.aof_dirname, am_name);
+    sds tmp_am_name = getTempAofManifestFileName();
+    sds tmp_am_filepath = makePath(server.aof_dirname, tmp_am_name);
+
+    int fd = open(tmp_am_filepath, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+    if (fd == -1) {
+        serverLog(LL_WARNING, "Can't open the AOF manifest file %s: %s",
+            tmp_am_name, strerror(errno));
+        ret = C_ERR;
+        goto cleanup;
+    }
+
+    len = sdslen(buf);
+    while(len) {
+        nwritten = write(fd, buf, len);
+
+        if (nwritten < 0) {
+            if (errno == EINTR) continue;
+
+            serverLog(LL_WARNING, "Error trying to write the temporary AOF manifest file %s: %s",
+                tmp_am_name, strerror(errno));
+            ret = C_ERR;
+            goto cleanup;
         }
+
+        len -= nwritten;
+        buf += nwritten;
+    }
+
+    if (redis_fsync(fd) == -1) {
+        serverLog(LL_WARNING, "Fail to fsync the temp AOF file %s: %s.",
+            tmp_am_name, strerror(errno));
+        ret = C_ERR;
+        goto cleanup;
+    }
+
+    if (rename(tmp_am_filepath, am_filepath) != 0) {
+        serverLog(LL_WARNING,
+            "Error trying to rename the temporary AOF manifest file %s into %s: %s",
+            tmp_am_name, am_name, strerror(errno));
+        ret = C_ERR;
+        goto cleanup;
+    }
+
+    /* Also sync the AOF directory as new AOF files may be added in the directory */
+    if (fsyncFileDir(am_filepath) == -1) {
+        serverLog(LL_WARNING, "Fail to fsync AOF directory %s: %s.",
+            am_filepath, strerror(errno));
+        ret = C_ERR;
+        goto cleanup;
     }
-    return count;
+
+cleanup:
+    if (fd != -1) close(fd);
+    sdsfree(am_name);
+    sdsfree(am_filepath);
+    sdsfree(tmp_am_name);
+    sdsfree(tmp_am_filepath);
+    return ret;
+}
+
+/* Persist the manifest 'am' if it changed. */
+int persistAofManifest(aofManifest *am) {
+    if (am->dirty == 0) return C_OK;
+
+    sds amstr = getAofManifestAsString(am);
+    int ret = writeAofManifestFile(amstr);
+    sdsfree(amstr);
+    if (ret == C_OK) am->dirty = 0;
+    return ret;
+}
+
+/* Called at startup, before loading the AOF: when the old single file AOF
+ * 'appendfilename' exists in the working directory and the AOF directory
+ * has no manifest, it is moved into the AOF directory as the BASE file of
+ * a new manifest. The next rewrite will turn it into a proper BASE. */
+void aofUpgradePrepare(aofManifest *am) {
+    serverAssert(!aofFileExist(server.aof_filename));
+
+    /* Create AOF directory use 'server.aof_dirname' as the name. */
+    if (dirCreateIfMissing(server.aof_dirname) == -1) {
+        serverLog(LL_WARNING, "Can't open or create append-only dir %s: %s",
+            server.aof_dirname, strerror(errno));
+        exit(1);
+    }
+
+    /* Manually construct a BASE type aofInfo and add it to aofManifest. */
+    if (am->base_aof_info) aofInfoFree(am->base_aof_info);
+    aofInfo *ai = aofInfoCreate();
+    ai->file_name = sdsnew(server.aof_filename);
+    ai->file_seq = 1;
+    ai->file_type = AOF_FILE_TYPE_BASE;
+    am->base_aof_info = ai;
+    am->curr_base_file_seq = 1;
+    am->dirty = 1;
+
+    /* Persist the manifest file to AOF directory. */
+    if (persistAofManifest(am) != C_OK) {
+        exit(1);
+    }
+
+    /* Move the old AOF file to AOF directory. */
+    sds aof_filepath = makePath(server.aof_dirname, server.aof_filename);
+    if (rename(server.aof_filename, aof_filepath) == -1) {
+        serverLog(LL_WARNING,
+            "Error trying to rename the existing AOF to the AOF directory %s: %s",
+            server.aof_dirname, strerror(errno));
+        sdsfree(aof_filepath);
+        exit(1);
+    }
+    sdsfree(aof_filepath);
+
+    serverLog(LL_NOTICE, "Successfully migrated an old-style AOF into the AOF directory %s.",
+        server.aof_dirname);
+}
+
+/* Delete the HISTORY files of the manifest, and persist it. */
+int aofDelHistoryFiles(void) {
+    if (server.aof_manifest == NULL ||
+        listLength(server.aof_manifest->history_aof_list) == 0)
+    {
+        return C_OK;
+    }
+
+    listNode *ln;
+    listIter li;
+
+    listRewind(server.aof_manifest->history_aof_list, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = (aofInfo*)ln->value;
+        serverAssert(ai->file_type == AOF_FILE_TYPE_HIST);
+        serverLog(LL_NOTICE, "Removing the history file %s in the background", ai->file_name);
+        sds aof_filepath = makePath(server.aof_dirname, ai->file_name);
+        bg_unlink(aof_filepath);
+        sdsfree(aof_filepath);
+        listDelNode(server.aof_manifest->history_aof_list, ln);
+    }
+
+    server.aof_manifest->dirty = 1;
+    return persistAofManifest(server.aof_manifest);
+}
+
+/* Used to clean up the temp INCR file when a rewrite started while in the
+ * AOF_WAIT_REWRITE state fails or is killed. */
+void aofDelTempIncrAofFile(void) {
+    sds aof_filename = getTempIncrAofName();
+    sds aof_filepath = makePath(server.aof_dirname, aof_filename);
+    serverLog(LL_NOTICE, "Removing the temp incr aof file %s in the background", aof_filename);
+    bg_unlink(aof_filepath);
+    sdsfree(aof_filepath);
+    sdsfree(aof_filename);
+}
+
+/* Called at startup after the AOF was loaded: open the last INCR file for
+ * appending. If there are no AOF files at all, a BASE file holding the
+ * dataset (that may have been loaded from the RDB) is created first, so
+ * that the AOF always reflects the dataset. */
+void aofOpenIfNeededOnServerStart(void) {
+    if (server.aof_state != AOF_ON) return;
+
+    if (dirCreateIfMissing(server.aof_dirname) == -1) {
+        serverLog(LL_WARNING, "Can't open or create append-only dir %s: %s",
+            server.aof_dirname, strerror(errno));
+        exit(1);
+    }
+
+    /* If we start with an empty dataset, we will force create a BASE file. */
+    if (!server.aof_manifest->base_aof_info &&
+        !listLength(server.aof_manifest->incr_aof_list))
+    {
+        sds base_name = getNewBaseFileNameAndMarkPreAsHistory(server.aof_manifest);
+        sds base_filepath = makePath(server.aof_dirname, base_name);
+        if (rewriteAppendOnlyFile(base_filepath) != C_OK) {
+            exit(1);
+        }
+        sdsfree(base_filepath);
+        serverLog(LL_NOTICE, "Creating AOF base file %s on server start",
+            base_name);
+        /* Like after loading, the BASE file is the rewrite base size. */
+        server.aof_current_size += getAppendOnlyFileSize(base_name, NULL);
+        server.aof_rewrite_base_size = server.aof_current_size;
+        server.aof_fsync_offset = server.aof_current_size;
+    }
+
+    /* We exit(1) if opening the AOF or persisting the manifest fails, so
+     * there is no need to work on a copy of the manifest here. */
+    sds aof_name = getLastIncrAofName(server.aof_manifest);
+
+    /* Here we should use 'O_APPEND' flag. */
+    sds aof_filepath = makePath(server.aof_dirname, aof_name);
+    server.aof_fd = open(aof_filepath, O_WRONLY|O_APPEND|O_CREAT, 0644);
+    if (server.aof_fd == -1) {
+        serverLog(LL_WARNING, "Can't open the append-only file %s: %s",
+            aof_name, strerror(errno));
+        exit(1);
+    }
+
+    /* Keep appending in the format of the file, aof-format only applies to
+     * the new INCR files. */
+    if (getAppendOnlyFileSize(aof_name, NULL) == 0) {
+        if (aofWriteFormatHeader(server.aof_fd, server.aof_format) == C_ERR) {
+            serverLog(LL_WARNING, "Can't write the append-only file %s: %s",
+                aof_name, strerror(errno));
+            exit(1);
+        }
+        server.aof_incr_format = server.aof_format;
+        /* The signature is part of the AOF size. */
+        if (server.aof_format == AOF_FORMAT_BINARY)
+            server.aof_current_size += AOF_BINARY_MAGIC_LEN;
+    } else {
+        server.aof_incr_format = aofFileFormat(aof_filepath);
+    }
+    sdsfree(aof_filepath);
+
+    /* Persist our changes. */
+    int ret = persistAofManifest(server.aof_manifest);
+    if (ret != C_OK) {
+        exit(1);
+    }
+
+    server.aof_last_incr_size = getAppendOnlyFileSize(aof_name, NULL);
+}
+
+/* Write the signature of the new INCR file 'fd' if 'format' is binary. */
+int aofWriteFormatHeader(int fd, int format) {
+    if (format == AOF_FORMAT_BINARY &&
+        write(fd,AOF_BINARY_MAGIC,AOF_BINARY_MAGIC_LEN) != AOF_BINARY_MAGIC_LEN)
+    {
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Return the format of the AOF file at 'filepath', detected by its
+ * signature. */
+int aofFileFormat(char *filepath) {
+    char sig[AOF_BINARY_MAGIC_LEN];
+    int fd = open(filepath, O_RDONLY);
+    int format = AOF_FORMAT_RESP;
+
+    if (fd == -1) return format;
+    if (read(fd,sig,sizeof(sig)) == sizeof(sig) &&
+        memcmp(sig,AOF_BINARY_MAGIC,sizeof(sig)) == 0)
+    {
+        format = AOF_FORMAT_BINARY;
+    }
+    close(fd);
+    return format;
+}
+
+/* Return true if 'filename' exists in the AOF directory. */
+int aofFileExist(char *filename) {
+    sds file_path = makePath(server.aof_dirname, filename);
+    int ret = fileExist(file_path);
+    sdsfree(file_path);
+    return ret;
+}
+
+/* Called by rewriteAppendOnlyFileBackground() before forking: open a new
+ * INCR file, where the writes performed during the rewrite are going to
+ * be appended, and make it the current AOF file. The previous file is
+ * fsynced and closed in the background.
+ *
+ * When the AOF is in the AOF_WAIT_REWRITE state there is no AOF yet, so
+ * a temp INCR file is used, that becomes part of the manifest only once
+ * the rewrite succeeded. */
+int openNewIncrAofForAppend(void) {
+    serverAssert(server.aof_manifest != NULL);
+    int newfd = -1;
+    aofManifest *temp_am = NULL;
+    sds new_aof_name = NULL;
+
+    /* Only open new INCR AOF when AOF enabled. */
+    if (server.aof_state == AOF_OFF) return C_OK;
+
+    /* While rewrites keep failing, the INCR file opened by the last failed
+     * attempt is reused if nothing was written to it yet, so that retries
+     * don't pile up empty INCR files in the manifest. A file holding some
+     * command can't be reused, since the new BASE file will include it. */
+    if (server.aof_state == AOF_ON && server.aof_fd != -1 &&
+        server.stat_aofrw_consecutive_failures &&
+        server.aof_incr_format == server.aof_format &&
+        sdslen(server.aof_buf) == 0 &&
+        server.aof_last_incr_size == (server.aof_incr_format ==
+            AOF_FORMAT_BINARY ? AOF_BINARY_MAGIC_LEN : 0))
+    {
+        return C_OK;
+    }
+
+    /* Open new AOF. */
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        /* Use a temporary INCR AOF file to accumulate data during AOF_WAIT_REWRITE. */
+        new_aof_name = getTempIncrAofName();
+    } else {
+        /* Dup a temp aof_manifest to modify. */
+        temp_am = aofManifestDup(server.aof_manifest);
+        new_aof_name = sdsdup(getNewIncrAofName(temp_am));
+    }
+    sds new_aof_filepath = makePath(server.aof_dirname, new_aof_name);
+    newfd = open(new_aof_filepath, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+    sdsfree(new_aof_filepath);
+    if (newfd == -1) {
+        serverLog(LL_WARNING, "Can't open the append-only file %s: %s",
+            new_aof_name, strerror(errno));
+        goto cleanup;
+    }
+
+    /* Switch to the configured format, unless there is still data in the
+     * AOF buffer, that is in the format of the previous file. */
+    int format = sdslen(server.aof_buf) ? server.aof_incr_format :
+                                          server.aof_format;
+    if (aofWriteFormatHeader(newfd, format) == C_ERR) {
+        serverLog(LL_WARNING, "Can't write the append-only file %s: %s",
+            new_aof_name, strerror(errno));
+        goto cleanup;
+    }
+
+    if (temp_am) {
+        /* Persist AOF Manifest. */
+        if (persistAofManifest(temp_am) == C_ERR) {
+            goto cleanup;
+        }
+    }
+
+    /* If reaches here, we can safely modify the `server.aof_manifest`
+     * and `server.aof_fd`. */
+
+    /* fsync and close old aof_fd if needed. In fsync everysec it's ok to delay
+     * the fsync as long as we guarantee it happens, and in fsync always the file
+     * is already synced at this point so fsync doesn't matter. */
+    if (server.aof_fd != -1) {
+        bioCreateCloseJob(server.aof_fd, server.aof_fsync != AOF_FSYNC_NO);
+        server.aof_fsync_offset = server.aof_current_size;
+        server.aof_last_fsync = server.unixtime;
+    }
+    server.aof_fd = newfd;
+    server.aof_incr_format = format;
+
+    /* Reset the aof_last_incr_size. The signature of a binary file is part
+     * of the AOF size as well. */
+    server.aof_last_incr_size = format == AOF_FORMAT_BINARY ?
+                                AOF_BINARY_MAGIC_LEN : 0;
+    server.aof_current_size += server.aof_last_incr_size;
+    /* Update `server.aof_manifest`. */
+    if (temp_am) aofManifestFreeAndUpdate(temp_am);
+    sdsfree(new_aof_name);
+    return C_OK;
+
+cleanup:
+    if (new_aof_name) sdsfree(new_aof_name);
+    if (newfd != -1) close(newfd);
+    if (temp_am) aofManifestFree(temp_am);
+    return C_ERR;
 }
 
 /* ----------------------------------------------------------------------------
@@ -208,7 +821,141 @@ int aofFsyncInProgress(void) {
 /* Starts a background task that performs fsync() against the specified
  * file descriptor (the one of the AOF file) in another thread. */
 void aof_background_fsync(int fd) {
-    bioCreateFsyncJob(fd);
+    bioCreateFsyncJob(fd,0);
+}
+
+/* ----------------------------------------------------------------------------
+ * AOF group commit
+ *
+ * With appendfsync always, every event loop iteration writes the AOF and
+ * fsyncs it before the replies are sent, so the throughput is bound by the
+ * fsync latency and the server is blocked meanwhile. With aof-group-commit
+ * the fsync is performed by the AOF fsync thread instead: the main thread
+ * keeps serving clients, while the replies of the clients that wrote to
+ * the AOF are held, like WAIT does, until an fsync covering their writes
+ * completes. The writes performed during an fsync are synced together by
+ * the next one, so the more clients, the larger the batches.
+ *
+ * Offsets are counted in server.aof_written_offset, that grows with every
+ * byte written to the AOF since the server started.
+ * ------------------------------------------------------------------------- */
+
+int aofGroupCommitEnabled(void) {
+    return server.aof_group_commit && server.aof_fsync == AOF_FSYNC_ALWAYS &&
+           server.aof_state != AOF_OFF;
+}
+
+/* Send the replies of the clients whose writes are fsynced. */
+static void aofGroupCommitReleaseClients(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients_waiting_aof_fsync,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        if (c->aof_fsync_offset > server.aof_fsynced_offset) continue;
+        c->flags &= ~CLIENT_PENDING_AOF_FSYNC;
+        listDelNode(server.clients_waiting_aof_fsync,ln);
+        if (clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+    }
+}
+
+/* Called when the AOF data was fsynced, or doesn't need to be anymore. */
+static void aofGroupCommitSynced(long long offset) {
+    if (offset > server.aof_fsynced_offset) server.aof_fsynced_offset = offset;
+    if (listLength(server.clients_waiting_aof_fsync))
+        aofGroupCommitReleaseClients();
+}
+
+/* Called when the group commit is disabled, or the AOF is stopped: the
+ * AOF is synced on the spot and all the held replies are sent. */
+void aofGroupCommitReleaseAll(void) {
+    if (server.aof_fd != -1 && server.aof_fsynced_offset != server.aof_written_offset)
+        redis_fsync(server.aof_fd);
+    aofGroupCommitSynced(server.aof_written_offset);
+}
+
+/* Start an fsync of what was written so far, unless one is in progress:
+ * it will be started when the current one completes. */
+static void aofGroupCommitFsync(void) {
+    if (server.aof_group_commit_inflight || server.aof_fd == -1 ||
+        server.aof_written_offset == server.aof_fsynced_offset) return;
+
+    server.aof_group_commit_inflight = 1;
+    server.stat_aof_group_commits++;
+    bioCreateFsyncJob(server.aof_fd,server.aof_written_offset);
+}
+
+/* The AOF fsync thread completed a group commit fsync. */
+static void aofGroupCommitPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[128];
+    long long offset;
+    int status;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) == sizeof(buf));
+    server.aof_group_commit_inflight = 0;
+
+    /* Same as the fsync failing in flushAppendOnlyFile(): the clients
+     * were promised their writes are on disk. */
+    atomicGet(server.aof_bio_fsync_status,status);
+    if (status == C_ERR) {
+        int err;
+        atomicGet(server.aof_bio_fsync_errno,err);
+        serverLog(LL_WARNING,"Can't persist AOF for fsync error when the "
+          "AOF fsync policy is 'always': %s. Exiting...", strerror(err));
+        exit(1);
+    }
+
+    atomicGet(server.aof_bio_fsynced_offset,offset);
+    server.aof_last_fsync = server.unixtime;
+    aofGroupCommitSynced(offset);
+
+    /* Sync what was written during this fsync. */
+    if (aofGroupCommitEnabled()) aofGroupCommitFsync();
+}
+
+/* The replies of the client 'c' depend on all the writes performed so far:
+ * they must wait for them to be fsynced. Besides the clients performing the
+ * writes, this is the case of the clients unblocked by the writes of
+ * others, that would otherwise reply before the data they got is durable. */
+void aofGroupCommitWaitWrites(client *c) {
+    if (!aofGroupCommitEnabled()) return;
+    c->aof_fsync_offset = server.aof_written_offset + sdslen(server.aof_buf);
+}
+
+/* Called before writing the replies of a client: if they must wait for
+ * the AOF to be fsynced, the client is queued and 1 is returned. */
+int aofGroupCommitHoldClient(client *c) {
+    if (c->aof_fsync_offset <= server.aof_fsynced_offset) return 0;
+
+    if (!(c->flags & CLIENT_PENDING_AOF_FSYNC)) {
+        c->flags |= CLIENT_PENDING_AOF_FSYNC;
+        listAddNodeTail(server.clients_waiting_aof_fsync,c);
+    }
+    return 1;
+}
+
+void aofGroupCommitInit(void) {
+    server.clients_waiting_aof_fsync = listCreate();
+    if (pipe(server.aof_group_commit_pipe) == -1) {
+        serverLog(LL_WARNING,
+            "Can't create the pipe for the AOF group commit: %s",
+            strerror(errno));
+        exit(1);
+    }
+    /* Neither the fsync thread nor the event loop must block on it. */
+    anetNonBlock(NULL,server.aof_group_commit_pipe[0]);
+    anetNonBlock(NULL,server.aof_group_commit_pipe[1]);
+    anetCloexec(server.aof_group_commit_pipe[0]);
+    anetCloexec(server.aof_group_commit_pipe[1]);
+    if (aeCreateFileEvent(server.el,server.aof_group_commit_pipe[0],AE_READABLE,
+        aofGroupCommitPipeReadable,NULL) == AE_ERR)
+    {
+        serverPanic("Error registering the readable event for the AOF group commit.");
+    }
 }
 
 /* Kills an AOFRW child process if exists */
@@ -222,13 +969,9 @@ void killAppendOnlyChild(void) {
     if (kill(server.child_pid,SIGUSR1) != -1) {
         while(waitpid(-1, &statloc, 0) != server.child_pid);
     }
-    /* Reset the buffer accumulating changes while the child saves. */
-    aofRewriteBufferReset();
     aofRemoveTempFile(server.child_pid);
     resetChildState();
     server.aof_rewrite_time_start = -1;
-    /* Close pipes used for IPC between the two processes. */
-    aofClosePipes();
 }
 
 /* Called when the user switches from "appendonly yes" to "appendonly no"
@@ -236,13 +979,21 @@ void killAppendOnlyChild(void) {
 void stopAppendOnly(void) {
     serverAssert(server.aof_state != AOF_OFF);
     flushAppendOnlyFile(1);
-    if (redis_fsync(server.aof_fd) == -1) {
-        serverLog(LL_WARNING,"Fail to fsync the AOF file: %s",strerror(errno));
-    } else {
-        server.aof_fsync_offset = server.aof_current_size;
-        server.aof_last_fsync = server.unixtime;
+    if (server.aof_fd != -1) {
+        if (redis_fsync(server.aof_fd) == -1) {
+            serverLog(LL_WARNING,"Fail to fsync the AOF file: %s",strerror(errno));
+        } else {
+            server.aof_fsync_offset = server.aof_current_size;
+            server.aof_last_fsync = server.unixtime;
+        }
+        close(server.aof_fd);
     }
-    close(server.aof_fd);
+    aofGroupCommitSynced(server.aof_written_offset);
+
+    /* The temp INCR file of a rewrite that was switching the AOF on is
+     * not part of the AOF yet. */
+    if (server.aof_state == AOF_WAIT_REWRITE && server.aof_fd != -1)
+        aofDelTempIncrAofFile();
 
     server.aof_fd = -1;
     server.aof_selected_db = -1;
@@ -256,22 +1007,11 @@ void stopAppendOnly(void) {
 /* Called when the user switches from "appendonly no" to "appendonly yes"
  * at runtime using the CONFIG command. */
 int startAppendOnly(void) {
-    char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
-    int newfd;
-
-    newfd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     serverAssert(server.aof_state == AOF_OFF);
-    if (newfd == -1) {
-        char *cwdp = getcwd(cwd,MAXPATHLEN);
 
-        serverLog(LL_WARNING,
-            "Redis needs to enable the AOF but can't open the "
-            "append only file %s (in server root dir %s): %s",
-            server.aof_filename,
-            cwdp ? cwdp : "unknown",
-            strerror(errno));
-        return C_ERR;
-    }
+    /* The AOF waits for the rewrite creating its BASE file, that also
+     * opens the INCR file where the commands are appended meanwhile. */
+    server.aof_state = AOF_WAIT_REWRITE;
     if (hasActiveChildProcess() && server.child_type != CHILD_TYPE_AOF) {
         server.aof_rewrite_scheduled = 1;
         serverLog(LL_WARNING,"AOF was enabled but there is already another background operation. An AOF background was scheduled to start when possible.");
@@ -284,16 +1024,12 @@ int startAppendOnly(void) {
             killAppendOnlyChild();
         }
         if (rewriteAppendOnlyFileBackground() == C_ERR) {
-            close(newfd);
+            server.aof_state = AOF_OFF;
             serverLog(LL_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
             return C_ERR;
         }
     }
-    /* We correctly switched on AOF, now wait for the rewrite to be complete
-     * in order to append data on disk. */
-    server.aof_state = AOF_WAIT_REWRITE;
     server.aof_last_fsync = server.unixtime;
-    server.aof_fd = newfd;
 
     /* If AOF fsync error in bio job, we just ignore it and log the event. */
     int aof_bio_fsync_status;
@@ -458,7 +1194,7 @@ void flushAppendOnlyFile(int force) {
                                        (long long)sdslen(server.aof_buf));
             }
 
-            if (ftruncate(server.aof_fd, server.aof_current_size) == -1) {
+            if (ftruncate(server.aof_fd, server.aof_last_incr_size) == -1) {
                 if (can_log) {
                     serverLog(LL_WARNING, "Could not remove short write "
                              "from the append-only file.  Redis may refuse "
@@ -492,6 +1228,8 @@ void flushAppendOnlyFile(int force) {
              * was no way to undo it with ftruncate(2). */
             if (nwritten > 0) {
                 server.aof_current_size += nwritten;
+                server.aof_last_incr_size += nwritten;
+                server.aof_written_offset += nwritten;
                 sdsrange(server.aof_buf,nwritten,-1);
             }
             return; /* We'll try again on the next call... */
@@ -506,6 +1244,8 @@ void flushAppendOnlyFile(int force) {
         }
     }
     server.aof_current_size += nwritten;
+    server.aof_last_incr_size += nwritten;
+    server.aof_written_offset += nwritten;
 
     /* Re-use AOF buffer when it is small enough. The maximum comes from the
      * arena size of 4k minus some overhead (but is otherwise arbitrary). */
@@ -519,11 +1259,16 @@ void flushAppendOnlyFile(int force) {
 try_fsync:
     /* Don't fsync if no-appendfsync-on-rewrite is set to yes and there are
      * children doing I/O in the background. */
-    if (server.aof_no_fsync_on_rewrite && hasActiveChildProcess())
+    if (server.aof_no_fsync_on_rewrite && hasActiveChildProcess()) {
+        aofGroupCommitSynced(server.aof_written_offset);
         return;
+    }
 
     /* Perform the fsync if needed. */
-    if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
+    if (server.aof_fsync == AOF_FSYNC_ALWAYS && aofGroupCommitEnabled() && !force) {
+        /* The replies wait for the fsync, performed in a thread. */
+        aofGroupCommitFsync();
+    } else if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
         /* redis_fsync is defined as fdatasync() for Linux in order to avoid
          * flushing metadata. */
         latencyStartMonitor(latency);
@@ -539,6 +1284,7 @@ try_fsync:
         latencyAddSampleIfNeeded("aof-fsync-always",latency);
         server.aof_fsync_offset = server.aof_current_size;
         server.aof_last_fsync = server.unixtime;
+        aofGroupCommitSynced(server.aof_written_offset);
     } else if ((server.aof_fsync == AOF_FSYNC_EVERYSEC &&
                 server.unixtime > server.aof_last_fsync)) {
         if (!sync_in_progress) {
@@ -574,6 +1320,68 @@ sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv) {
     return dst;
 }
 
+/* Append the command to 'dst' as a binary AOF record:
+ *
+ *   <body len:8> <timestamp:8> <argc:4> [<arg len:8> <arg>]... <crc64:8>
+ *
+ * Integers are little endian. The body is everything after the timestamp
+ * and before the CRC, that covers all the bytes of the record before it.
+ * The timestamp is the unix time in milliseconds of the command, so that
+ * redis-check-aof can truncate a binary file at a given time.
+ *
+ * Unlike RESP no number formatting is needed, except for integer encoded
+ * arguments, and on loading the records are checked against corruption. */
+sds catAppendOnlyBinaryCommand(sds dst, int argc, robj **argv) {
+    size_t start = sdslen(dst);
+    char llbuf[LONG_STR_SIZE];
+    uint64_t u64;
+    uint32_t u32;
+    int j;
+
+    /* The header is filled once the length of the body is known. */
+    dst = sdsMakeRoomFor(dst,AOF_BINARY_HDR_LEN);
+    sdsIncrLen(dst,AOF_BINARY_HDR_LEN);
+    u32 = argc;
+    memrev32ifbe(&u32);
+    dst = sdscatlen(dst,&u32,sizeof(u32));
+
+    for (j = 0; j < argc; j++) {
+        robj *o = argv[j];
+        const char *ptr;
+        size_t len;
+
+        if (sdsEncodedObject(o)) {
+            ptr = o->ptr;
+            len = sdslen(o->ptr);
+        } else {
+            len = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+            ptr = llbuf;
+        }
+        u64 = len;
+        memrev64ifbe(&u64);
+        dst = sdscatlen(dst,&u64,sizeof(u64));
+        dst = sdscatlen(dst,ptr,len);
+    }
+
+    u64 = sdslen(dst)-start-AOF_BINARY_HDR_LEN;
+    memrev64ifbe(&u64);
+    memcpy(dst+start,&u64,sizeof(u64));
+    u64 = server.mstime;
+    memrev64ifbe(&u64);
+    memcpy(dst+start+8,&u64,sizeof(u64));
+    u64 = crc64(0,(unsigned char*)dst+start,sdslen(dst)-start);
+    memrev64ifbe(&u64);
+    return sdscatlen(dst,&u64,sizeof(u64));
+}
+
+/* Append the command to 'dst' in the format of the INCR file we are
+ * appending to. */
+sds catAppendOnlyCommand(sds dst, int argc, robj **argv) {
+    if (server.aof_incr_format == AOF_FORMAT_BINARY)
+        return catAppendOnlyBinaryCommand(dst,argc,argv);
+    return catAppendOnlyGenericCommand(dst,argc,argv);
+}
+
 /* Create the sds representation of a PEXPIREAT command, using
  * 'seconds' as time to live and 'cmd' to understand what command
  * we are translating into a PEXPIREAT.
@@ -605,7 +1413,7 @@ sds catAppendOnlyExpireAtCommand(sds buf, struct redisCommand *cmd, robj *key, r
     argv[0] = shared.pexpireat;
     argv[1] = key;
     argv[2] = createStringObjectFromLongLong(when);
-    buf = catAppendOnlyGenericCommand(buf, 3, argv);
+    buf = catAppendOnlyCommand(buf, 3, argv);
     decrRefCount(argv[2]);
     return buf;
 }
@@ -615,11 +1423,21 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
     /* The DB this command was targeting is not the same as the last command
      * we appended. To issue a SELECT command is needed. */
     if (dictid != server.aof_selected_db) {
-        char seldb[64];
+        if (server.aof_incr_format == AOF_FORMAT_BINARY) {
+            robj *selectargv[2];
+
+            selectargv[0] = createStringObject("SELECT",6);
+            selectargv[1] = createStringObjectFromLongLong(dictid);
+            buf = catAppendOnlyBinaryCommand(buf,2,selectargv);
+            decrRefCount(selectargv[0]);
+            decrRefCount(selectargv[1]);
+        } else {
+            char seldb[64];
 
-        snprintf(seldb,sizeof(seldb),"%d",dictid);
-        buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
-            (unsigned long)strlen(seldb),seldb);
+            snprintf(seldb,sizeof(seldb),"%d",dictid);
+            buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
+                (unsigned long)strlen(seldb),seldb);
+        }
         server.aof_selected_db = dictid;
     }
 
@@ -650,30 +1468,34 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
             newargs[2] = argv[2];
             newargs[3] = shared.pxat;
             newargs[4] = createStringObjectFromLongLong(when);
-            buf = catAppendOnlyGenericCommand(buf,5,newargs);
+            buf = catAppendOnlyCommand(buf,5,newargs);
             decrRefCount(newargs[4]);
         } else {
-            buf = catAppendOnlyGenericCommand(buf,argc,argv);
+            buf = catAppendOnlyCommand(buf,argc,argv);
         }
     } else {
         /* All the other commands don't need translation or need the
          * same translation already operated in the command vector
          * for the replication itself. */
-        buf = catAppendOnlyGenericCommand(buf,argc,argv);
+        buf = catAppendOnlyCommand(buf,argc,argv);
     }
 
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
-     * positive reply about the operation performed. */
-    if (server.aof_state == AOF_ON)
+     * positive reply about the operation performed.
+     *
+     * While the rewrite switching the AOF on is in progress, the commands
+     * are appended to the temp INCR file it opened, that will follow the
+     * BASE file it is creating. */
+    if (server.aof_state == AOF_ON ||
+        (server.aof_state == AOF_WAIT_REWRITE && server.child_type == CHILD_TYPE_AOF))
+    {
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
 
-    /* If a background append only file rewriting is in progress we want to
-     * accumulate the differences between the child DB and the current one
-     * in a buffer, so that when the child process will do its work we
-     * can append the differences to the new append only file. */
-    if (server.child_type == CHILD_TYPE_AOF)
-        aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
+        /* The reply of the client must wait for this command to be synced. */
+        if (server.current_client)
+            aofGroupCommitWaitWrites(server.current_client);
+    }
 
     sdsfree(buf);
 }
@@ -747,32 +1569,455 @@ void freeFakeClient(struct client *c) {
     zfree(c);
 }
 
-/* Replay the append log file. On success C_OK is returned. On non fatal
- * error (the append only file is zero-length) C_ERR is returned. On
- * fatal error an error message is logged and the program exists. */
-int loadAppendOnlyFile(char *filename) {
+/* The commands of the AOF are read in large chunks and parsed in batches,
+ * by a dedicated thread when aof-load-parse-thread is enabled, while the
+ * main thread executes them. */
+#define AOF_LOAD_CHUNK_SIZE (8*1024*1024) /* Size of the read() calls. */
+#define AOF_LOAD_MAX_LINE 1024 /* Max length of the "*<argc>" / "$<len>" lines. */
+#define AOF_LOAD_BATCH_CMDS 1024 /* Max commands in a batch. */
+#define AOF_LOAD_BATCH_BYTES (4*1024*1024) /* Max file bytes of a batch. */
+#define AOF_LOAD_MAX_BATCHES 8 /* Max batches waiting to be executed. */
+
+/* Parsing results. */
+#define AOF_PARSE_CMD 0     /* A command was parsed. */
+#define AOF_PARSE_EOF 1     /* End of file at the start of a command. */
+#define AOF_PARSE_UXEOF 2   /* End of file in the middle of a command. */
+#define AOF_PARSE_FMTERR 3  /* Bad protocol. */
+#define AOF_PARSE_READERR 4 /* The read() failed. */
+#define AOF_PARSE_CRCERR 5  /* Checksum mismatch of a binary record. */
+
+typedef struct aofLoadCmd {
+    int argc;
+    robj **argv;    /* The parser stores the arguments as sds strings: the
+                       objects are created by the main thread, since they
+                       often become the values of the dataset (SET keeps
+                       its argument), and only the main thread allocates
+                       them from the slabs, other threads fall back to
+                       zmalloc(). */
+    off_t end;      /* File offset right after the command. */
+} aofLoadCmd;
+
+typedef struct aofLoadBatch {
+    int count;      /* Number of commands. */
+    int status;     /* AOF_PARSE_CMD, or how the parsing ended after the
+                       commands of the batch. */
+    int err;        /* errno of AOF_PARSE_READERR. */
+    off_t erroff;   /* Offset of the record that failed to parse. */
+    struct aofLoadBatch *next;
+    aofLoadCmd cmd[AOF_LOAD_BATCH_CMDS];
+} aofLoadBatch;
+
+typedef struct aofLoader {
+    int fd;
+    char *buf;          /* Read buffer of AOF_LOAD_CHUNK_SIZE bytes. */
+    size_t pos, len;    /* The data still to parse is buf[pos..len-1]. */
+    off_t offset;       /* File offset of buf[pos]. */
+    int eof;            /* read() returned 0. */
+    int err;            /* errno of the failed read(), or 0. */
+    int binary;         /* The file has the binary format. */
+    off_t size;         /* File size when the loading started. */
+    /* Queue of the parsed batches, used with the parsing thread. */
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* Signaled when the queue changes. */
+    aofLoadBatch *head, *tail;
+    int queued;
+    int stop;           /* Set by the main thread to stop the parser. */
+} aofLoader;
+
+/* Read up to 'len' bytes at 'dst'. Returns the number of bytes read, or 0
+ * on EOF and errors, setting l->eof / l->err. */
+static size_t aofLoaderRead(aofLoader *l, char *dst, size_t len) {
+    ssize_t nread;
+
+    if (l->eof || l->err) return 0;
+    do {
+        nread = read(l->fd,dst,len);
+    } while (nread == -1 && errno == EINTR);
+    if (nread <= 0) {
+        if (nread == 0) l->eof = 1;
+        else l->err = errno;
+        return 0;
+    }
+    return nread;
+}
+
+/* Read more data in the buffer, after moving the data still to parse at
+ * its start. Returns 0 on EOF and errors. */
+static int aofLoaderFill(aofLoader *l) {
+    if (l->pos) {
+        memmove(l->buf,l->buf+l->pos,l->len-l->pos);
+        l->len -= l->pos;
+        l->pos = 0;
+    }
+    size_t nread = aofLoaderRead(l,l->buf+l->len,AOF_LOAD_CHUNK_SIZE-l->len);
+    l->len += nread;
+    return nread != 0;
+}
+
+/* Error after running out of data: an EOF at the very start of a command
+ * is the normal end of the file. */
+static int aofLoaderShortRead(aofLoader *l, int cmdstart) {
+    if (l->err) return AOF_PARSE_READERR;
+    return (cmdstart && l->pos == l->len) ? AOF_PARSE_EOF : AOF_PARSE_UXEOF;
+}
+
+/* Consume the next line, setting '*line' to it. The line is null
+ * terminated in place of the '\n', and is valid until the next read. */
+static int aofLoaderReadLine(aofLoader *l, char **line, int cmdstart) {
+    while(1) {
+        char *nl = memchr(l->buf+l->pos,'\n',l->len-l->pos);
+        if (nl) {
+            size_t linelen = nl-(l->buf+l->pos)+1;
+            *nl = '\0';
+            *line = l->buf+l->pos;
+            l->pos += linelen;
+            l->offset += linelen;
+            return AOF_PARSE_CMD;
+        }
+        if (l->len-l->pos > AOF_LOAD_MAX_LINE) return AOF_PARSE_FMTERR;
+        if (!aofLoaderFill(l)) return aofLoaderShortRead(l,cmdstart);
+    }
+}
+
+/* Consume 'len' bytes, copying them at 'dst'. Big reads are performed
+ * straight into 'dst'. */
+static int aofLoaderReadExact(aofLoader *l, char *dst, size_t len, int cmdstart) {
+    size_t copied = 0, n;
+
+    while (copied < len) {
+        if (l->pos == l->len) {
+            if (len-copied >= AOF_LOAD_CHUNK_SIZE) {
+                n = aofLoaderRead(l,dst+copied,len-copied);
+                if (n == 0) return aofLoaderShortRead(l,0);
+                l->offset += n;
+                copied += n;
+                continue;
+            }
+            if (!aofLoaderFill(l))
+                return aofLoaderShortRead(l,cmdstart && copied == 0);
+        }
+        n = l->len-l->pos;
+        if (n > len-copied) n = len-copied;
+        memcpy(dst+copied,l->buf+l->pos,n);
+        l->pos += n;
+        l->offset += n;
+        copied += n;
+    }
+    return AOF_PARSE_CMD;
+}
+
+/* Consume a bulk of 'len' bytes and the CRLF following it, returning it
+ * in '*bulk'. */
+static int aofLoaderReadBulk(aofLoader *l, size_t len, sds *bulk) {
+    sds s = sdsnewlen(SDS_NOINIT,len);
+    char crlf[2];
+    int status = aofLoaderReadExact(l,s,len,0);
+
+    if (status == AOF_PARSE_CMD) status = aofLoaderReadExact(l,crlf,2,0);
+    if (status != AOF_PARSE_CMD) {
+        sdsfree(s);
+        return status;
+    }
+    *bulk = s;
+    return AOF_PARSE_CMD;
+}
+
+/* Parse the next record of a binary AOF into 'cmd', checking its length
+ * fields and its checksum, see catAppendOnlyBinaryCommand(). */
+static int aofLoaderParseBinaryCommand(aofLoader *l, aofLoadCmd *cmd) {
+    unsigned char hdr[AOF_BINARY_HDR_LEN];
+    uint64_t bodylen, arglen, crc, expected;
+    uint32_t argc;
+    size_t consumed;
+    int j, status;
+    sds arg;
+
+    status = aofLoaderReadExact(l,(char*)hdr,sizeof(hdr),1);
+    if (status != AOF_PARSE_CMD) return status;
+    memcpy(&bodylen,hdr,sizeof(bodylen));
+    memrev64ifbe(&bodylen);
+    crc = crc64(0,hdr,sizeof(hdr));
+
+    /* A record going past the end of the file is a truncated one. This
+     * also avoids allocating huge arguments for corrupted lengths. */
+    if (bodylen > (uint64_t)(l->size-l->offset)) return AOF_PARSE_UXEOF;
+
+    if (bodylen < sizeof(argc)) return AOF_PARSE_FMTERR;
+    status = aofLoaderReadExact(l,(char*)&argc,sizeof(argc),0);
+    if (status != AOF_PARSE_CMD) return status;
+    crc = crc64(crc,(unsigned char*)&argc,sizeof(argc));
+    memrev32ifbe(&argc);
+    if (argc < 1 || argc > bodylen/sizeof(arglen)) return AOF_PARSE_FMTERR;
+    consumed = sizeof(argc);
+
+    cmd->argv = zmalloc(sizeof(robj*)*argc);
+    for (j = 0; j < (int)argc; j++) {
+        if (consumed+sizeof(arglen) > bodylen) {
+            status = AOF_PARSE_FMTERR;
+            break;
+        }
+        status = aofLoaderReadExact(l,(char*)&arglen,sizeof(arglen),0);
+        if (status != AOF_PARSE_CMD) break;
+        crc = crc64(crc,(unsigned char*)&arglen,sizeof(arglen));
+        memrev64ifbe(&arglen);
+        consumed += sizeof(arglen);
+        if (arglen > bodylen-consumed) {
+            status = AOF_PARSE_FMTERR;
+            break;
+        }
+
+        arg = sdsnewlen(SDS_NOINIT,arglen);
+        status = aofLoaderReadExact(l,arg,arglen,0);
+        if (status != AOF_PARSE_CMD) {
+            sdsfree(arg);
+            break;
+        }
+        crc = crc64(crc,(unsigned char*)arg,arglen);
+        consumed += arglen;
+        cmd->argv[j] = (robj*)arg;
+    }
+    if (status == AOF_PARSE_CMD && consumed != bodylen)
+        status = AOF_PARSE_FMTERR;
+    if (status == AOF_PARSE_CMD)
+        status = aofLoaderReadExact(l,(char*)&expected,sizeof(expected),0);
+    if (status == AOF_PARSE_CMD) {
+        memrev64ifbe(&expected);
+        if (crc != expected) status = AOF_PARSE_CRCERR;
+    }
+    if (status != AOF_PARSE_CMD) {
+        while (j--) sdsfree((sds)cmd->argv[j]);
+        zfree(cmd->argv);
+        return status;
+    }
+    cmd->argc = argc;
+    cmd->end = l->offset;
+    return AOF_PARSE_CMD;
+}
+
+/* Parse the next command of the AOF into 'cmd'. */
+static int aofLoaderParseCommand(aofLoader *l, aofLoadCmd *cmd) {
+    char *line;
+    int argc, j, status;
+    long long len;
+    sds bulk;
+
+    if (l->binary) return aofLoaderParseBinaryCommand(l,cmd);
+    status = aofLoaderReadLine(l,&line,1);
+    if (status != AOF_PARSE_CMD) return status;
+    if (line[0] != '*') return AOF_PARSE_FMTERR;
+    argc = atoi(line+1);
+    if (argc < 1) return AOF_PARSE_FMTERR;
+
+    cmd->argv = zmalloc(sizeof(robj*)*argc);
+    for (j = 0; j < argc; j++) {
+        status = aofLoaderReadLine(l,&line,0);
+        if (status == AOF_PARSE_CMD) {
+            len = strtoll(line+1,NULL,10);
+            if (line[0] != '$' || len < 0)
+                status = AOF_PARSE_FMTERR;
+            else
+                status = aofLoaderReadBulk(l,len,&bulk);
+        }
+        if (status != AOF_PARSE_CMD) {
+            while (j--) sdsfree((sds)cmd->argv[j]);
+            zfree(cmd->argv);
+            return status;
+        }
+        cmd->argv[j] = (robj*)bulk;
+    }
+    cmd->argc = argc;
+    cmd->end = l->offset;
+    return AOF_PARSE_CMD;
+}
+
+/* Parse the next batch of commands. */
+static aofLoadBatch *aofLoaderParseBatch(aofLoader *l) {
+    aofLoadBatch *b = zmalloc(sizeof(*b));
+    off_t start = l->offset;
+
+    b->count = 0;
+    b->status = AOF_PARSE_CMD;
+    b->err = 0;
+    b->erroff = 0;
+    b->next = NULL;
+    while (b->count < AOF_LOAD_BATCH_CMDS &&
+           l->offset-start < AOF_LOAD_BATCH_BYTES)
+    {
+        off_t recstart = l->offset;
+        int status = aofLoaderParseCommand(l,b->cmd+b->count);
+        if (status != AOF_PARSE_CMD) {
+            b->status = status;
+            b->err = l->err;
+            b->erroff = recstart;
+            break;
+        }
+        b->count++;
+    }
+    return b;
+}
+
+/* Free the batch, with the arguments of the commands starting from
+ * 'first', the ones that were not executed. */
+static void aofLoadBatchFree(aofLoadBatch *b, int first) {
+    for (int i = first; i < b->count; i++) {
+        for (int j = 0; j < b->cmd[i].argc; j++)
+            sdsfree((sds)b->cmd[i].argv[j]);
+        zfree(b->cmd[i].argv);
+    }
+    zfree(b);
+}
+
+static void *aofLoaderThreadMain(void *arg) {
+    aofLoader *l = arg;
+
+    redis_set_thread_title("aof_load");
+    while(1) {
+        aofLoadBatch *b = aofLoaderParseBatch(l);
+        int last = b->status != AOF_PARSE_CMD;
+
+        pthread_mutex_lock(&l->lock);
+        while (l->queued == AOF_LOAD_MAX_BATCHES && !l->stop)
+            pthread_cond_wait(&l->cond,&l->lock);
+        if (l->stop) {
+            pthread_mutex_unlock(&l->lock);
+            aofLoadBatchFree(b,0);
+            break;
+        }
+        if (l->tail) l->tail->next = b;
+        else l->head = b;
+        l->tail = b;
+        l->queued++;
+        pthread_cond_broadcast(&l->cond);
+        pthread_mutex_unlock(&l->lock);
+        if (last) break;
+    }
+    return NULL;
+}
+
+static void aofLoaderInit(aofLoader *l) {
+    memset(l,0,sizeof(*l));
+    l->fd = -1;
+}
+
+/* Start parsing the file 'fd' from 'offset', in a new thread if
+ * 'threaded' is true. 'binary' is the format of the file. */
+static int aofLoaderStart(aofLoader *l, int fd, off_t offset, int binary, int threaded) {
+    struct redis_stat sb;
+
+    if (redis_fstat(fd,&sb) == -1 || lseek(fd,offset,SEEK_SET) == -1)
+        return C_ERR;
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(fd,offset,0,POSIX_FADV_SEQUENTIAL);
+#endif
+    l->fd = fd;
+    l->offset = offset;
+    l->binary = binary;
+    l->size = sb.st_size;
+    l->buf = zmalloc(AOF_LOAD_CHUNK_SIZE);
+    if (!threaded) return C_OK;
+
+    pthread_mutex_init(&l->lock,NULL);
+    pthread_cond_init(&l->cond,NULL);
+    if (pthread_create(&l->thread,NULL,aofLoaderThreadMain,l) != 0) {
+        serverLog(LL_WARNING,"Can't create the AOF parsing thread, "
+                             "parsing the AOF in the main thread.");
+        pthread_mutex_destroy(&l->lock);
+        pthread_cond_destroy(&l->cond);
+        return C_OK;
+    }
+    l->threaded = 1;
+    return C_OK;
+}
+
+/* Return the next batch of commands to execute. */
+static aofLoadBatch *aofLoaderNextBatch(aofLoader *l) {
+    if (!l->threaded) return aofLoaderParseBatch(l);
+
+    pthread_mutex_lock(&l->lock);
+    while (l->head == NULL) pthread_cond_wait(&l->cond,&l->lock);
+    aofLoadBatch *b = l->head;
+    l->head = b->next;
+    if (l->head == NULL) l->tail = NULL;
+    l->queued--;
+    pthread_cond_broadcast(&l->cond);
+    pthread_mutex_unlock(&l->lock);
+    return b;
+}
+
+/* Stop the parsing thread and free the batches it parsed in advance. */
+static void aofLoaderStop(aofLoader *l) {
+    if (l->threaded) {
+        pthread_mutex_lock(&l->lock);
+        l->stop = 1;
+        pthread_cond_broadcast(&l->cond);
+        pthread_mutex_unlock(&l->lock);
+        pthread_join(l->thread,NULL);
+        while (l->head) {
+            aofLoadBatch *b = l->head;
+            l->head = b->next;
+            aofLoadBatchFree(b,0);
+        }
+        pthread_mutex_destroy(&l->lock);
+        pthread_cond_destroy(&l->cond);
+        l->threaded = 0;
+    }
+    zfree(l->buf);
+    l->buf = NULL;
+}
+
+/* Bytes of the AOF files already loaded by loadAppendOnlyFiles(), so that
+ * the loading progress covers all of them. */
+static off_t aof_loaded_files_size = 0;
+
+/* Replay the append only file 'filename' of the AOF directory. Returns:
+ *
+ * AOF_OK: the file was loaded.
+ * AOF_NOT_EXIST: the file does not exist.
+ * AOF_OPEN_ERR: the file can't be opened.
+ * AOF_EMPTY: the file is zero-length.
+ * AOF_TRUNCATED: the file was truncated, and loaded anyway because
+ *                aof-load-truncated is enabled.
+ * AOF_FAILED: the file is corrupted.
+ *
+ * On errors a message is logged, but it's up to the caller to exit. */
+int loadSingleAppendOnlyFile(char *filename) {
     struct client *fakeClient;
-    FILE *fp = fopen(filename,"r");
     struct redis_stat sb;
     int old_aof_state = server.aof_state;
     long loops = 0;
     off_t valid_up_to = 0; /* Offset of latest well-formed command loaded. */
     off_t valid_before_multi = 0; /* Offset before MULTI command loaded. */
+    int ret = AOF_OK;
+    aofLoader loader;
+    aofLoadBatch *batch = NULL;
+    int i, j, next = 0, status, err, binary = 0;
+    off_t erroff;
+    sds aof_filepath = makePath(server.aof_dirname, filename);
+    FILE *fp = fopen(aof_filepath,"r");
 
     if (fp == NULL) {
-        serverLog(LL_WARNING,"Fatal error: can't open the append log file for reading: %s",strerror(errno));
-        exit(1);
+        int en = errno;
+        if (redis_stat(aof_filepath, &sb) == 0 || errno != ENOENT) {
+            serverLog(LL_WARNING,"Fatal error: can't open the append log file %s for reading: %s", filename, strerror(en));
+            sdsfree(aof_filepath);
+            return AOF_OPEN_ERR;
+        } else {
+            serverLog(LL_WARNING,"The append log file %s doesn't exist: %s", filename, strerror(errno));
+            sdsfree(aof_filepath);
+            return AOF_NOT_EXIST;
+        }
     }
 
     /* Handle a zero-length AOF file as a special case. An empty AOF file
      * is a valid AOF because an empty server with AOF enabled will create
      * a zero length file at startup, that will remain like that if no write
      * operation is received. */
-    if (fp && redis_fstat(fileno(fp),&sb) != -1 && sb.st_size == 0) {
-        server.aof_current_size = 0;
-        server.aof_fsync_offset = server.aof_current_size;
+    if (redis_fstat(fileno(fp),&sb) != -1 && sb.st_size == 0) {
         fclose(fp);
-        return C_ERR;
+        sdsfree(aof_filepath);
+        return AOF_EMPTY;
     }
 
     /* Temporarily disable AOF, to prevent EXEC from feeding a MULTI
@@ -780,128 +2025,118 @@ int loadAppendOnlyFile(char *filename) {
     server.aof_state = AOF_OFF;
 
     fakeClient = createAOFClient();
-    startLoadingFile(fp, filename, RDBFLAGS_AOF_PREAMBLE);
+    aofLoaderInit(&loader);
 
     /* Check if this AOF file has an RDB preamble. In that case we need to
      * load the RDB file and later continue loading the AOF tail. */
-    char sig[5]; /* "REDIS" */
-    if (fread(sig,1,5,fp) != 5 || memcmp(sig,"REDIS",5) != 0) {
+    char sig[AOF_BINARY_MAGIC_LEN]; /* "REDIS" or AOF_BINARY_MAGIC */
+    size_t siglen = fread(sig,1,sizeof(sig),fp);
+    if (siglen == sizeof(sig) &&
+        memcmp(sig,AOF_BINARY_MAGIC,AOF_BINARY_MAGIC_LEN) == 0)
+    {
+        /* Binary AOF, the records follow the signature. */
+        binary = 1;
+        valid_up_to = AOF_BINARY_MAGIC_LEN;
+    } else if (siglen < 5 || memcmp(sig,"REDIS",5) != 0) {
         /* No RDB preamble, seek back at 0 offset. */
         if (fseek(fp,0,SEEK_SET) == -1) goto readerr;
     } else {
         /* RDB preamble. Pass loading the RDB functions. */
         rio rdb;
 
-        serverLog(LL_NOTICE,"Reading RDB preamble from AOF file...");
+        serverLog(LL_NOTICE,"Reading RDB base file on AOF loading...");
         if (fseek(fp,0,SEEK_SET) == -1) goto readerr;
         rioInitWithFile(&rdb,fp);
         if (rdbLoadRio(&rdb,RDBFLAGS_AOF_PREAMBLE,NULL) != C_OK) {
-            serverLog(LL_WARNING,"Error reading the RDB preamble of the AOF file, AOF loading aborted");
+            serverLog(LL_WARNING,"Error reading the RDB base file %s, AOF loading aborted", filename);
             goto readerr;
         } else {
+            loadingProgress(aof_loaded_files_size + ftello(fp));
             serverLog(LL_NOTICE,"Reading the remaining AOF tail...");
         }
     }
 
-    /* Read the actual AOF file, in REPL format, command by command. */
+    /* Read the actual AOF file, in REPL format, batch by batch. */
+    if (aofLoaderStart(&loader,fileno(fp),ftello(fp),binary,
+                       server.aof_load_parse_thread) == C_ERR) goto readerr;
     while(1) {
-        int argc, j;
-        unsigned long len;
-        robj **argv;
-        char buf[128];
-        sds argsds;
-        struct redisCommand *cmd;
-
-        /* Serve the clients from time to time */
-        if (!(loops++ % 1000)) {
-            loadingProgress(ftello(fp));
-            processEventsWhileBlocked();
-            processModuleLoadingProgressEvent(1);
-        }
-
-        if (fgets(buf,sizeof(buf),fp) == NULL) {
-            if (feof(fp))
-                break;
-            else
-                goto readerr;
-        }
-        if (buf[0] != '*') goto fmterr;
-        if (buf[1] == '\0') goto readerr;
-        argc = atoi(buf+1);
-        if (argc < 1) goto fmterr;
-
-        /* Load the next command in the AOF as our fake client
-         * argv. */
-        argv = zmalloc(sizeof(robj*)*argc);
-        fakeClient->argc = argc;
-        fakeClient->argv = argv;
-
-        for (j = 0; j < argc; j++) {
-            /* Parse the argument len. */
-            char *readres = fgets(buf,sizeof(buf),fp);
-            if (readres == NULL || buf[0] != '$') {
-                fakeClient->argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                if (readres == NULL)
-                    goto readerr;
-                else
-                    goto fmterr;
+        batch = aofLoaderNextBatch(&loader);
+        for (i = 0; i < batch->count; i++) {
+            aofLoadCmd *lc = batch->cmd+i;
+            struct redisCommand *cmd;
+
+            /* Serve the clients from time to time */
+            if (!(loops++ % 1000)) {
+                loadingProgress(aof_loaded_files_size + lc->end);
+                processEventsWhileBlocked();
+                processModuleLoadingProgressEvent(1);
             }
-            len = strtol(buf+1,NULL,10);
 
-            /* Read it into a string object. */
-            argsds = sdsnewlen(SDS_NOINIT,len);
-            if (len && fread(argsds,len,1,fp) == 0) {
-                sdsfree(argsds);
-                fakeClient->argc = j; /* Free up to j-1. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr;
-            }
-            argv[j] = createObject(OBJ_STRING,argsds);
+            /* Load the command as our fake client argv. */
+            for (j = 0; j < lc->argc; j++)
+                lc->argv[j] = createObject(OBJ_STRING,(sds)lc->argv[j]);
+            fakeClient->argc = lc->argc;
+            fakeClient->argv = lc->argv;
+            next = i+1;
 
-            /* Discard CRLF. */
-            if (fread(buf,2,1,fp) == 0) {
-                fakeClient->argc = j+1; /* Free up to j. */
+            /* Command lookup */
+            cmd = lookupCommand(fakeClient->argv[0]->ptr);
+            if (!cmd) {
+                serverLog(LL_WARNING,
+                    "Unknown command '%s' reading the append only file %s",
+                    (char*)fakeClient->argv[0]->ptr, filename);
                 freeFakeClientArgv(fakeClient);
-                goto readerr;
+                ret = AOF_FAILED;
+                goto cleanup;
             }
-        }
 
-        /* Command lookup */
-        cmd = lookupCommand(argv[0]->ptr);
-        if (!cmd) {
-            serverLog(LL_WARNING,
-                "Unknown command '%s' reading the append only file",
-                (char*)argv[0]->ptr);
-            exit(1);
-        }
+            if (cmd == server.multiCommand) valid_before_multi = valid_up_to;
 
-        if (cmd == server.multiCommand) valid_before_multi = valid_up_to;
+            /* Run the command in the context of a fake client, calling
+             * the command implementation directly: the stats, the
+             * propagation and the slowlog of call() are not needed. */
+            fakeClient->cmd = fakeClient->lastcmd = cmd;
+            if (fakeClient->flags & CLIENT_MULTI &&
+                fakeClient->cmd->proc != execCommand)
+            {
+                queueMultiCommand(fakeClient);
+            } else {
+                cmd->proc(fakeClient);
+            }
 
-        /* Run the command in the context of a fake client */
-        fakeClient->cmd = fakeClient->lastcmd = cmd;
-        if (fakeClient->flags & CLIENT_MULTI &&
-            fakeClient->cmd->proc != execCommand)
-        {
-            queueMultiCommand(fakeClient);
-        } else {
-            cmd->proc(fakeClient);
-        }
+            /* The fake client should not have a reply */
+            serverAssert(fakeClient->bufpos == 0 &&
+                         listLength(fakeClient->reply) == 0);
 
-        /* The fake client should not have a reply */
-        serverAssert(fakeClient->bufpos == 0 &&
-                     listLength(fakeClient->reply) == 0);
+            /* The fake client should never get blocked */
+            serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
 
-        /* The fake client should never get blocked */
-        serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
+            /* Clean up. Command code may have changed argv/argc so we use
+             * the argv/argc of the client instead of the local variables. */
+            freeFakeClientArgv(fakeClient);
+            fakeClient->cmd = NULL;
+            if (server.aof_load_truncated) valid_up_to = lc->end;
+            if (server.key_load_delay)
+                debugDelay(server.key_load_delay);
+        }
 
-        /* Clean up. Command code may have changed argv/argc so we use the
-         * argv/argc of the client instead of the local variables. */
-        freeFakeClientArgv(fakeClient);
-        fakeClient->cmd = NULL;
-        if (server.aof_load_truncated) valid_up_to = ftello(fp);
-        if (server.key_load_delay)
-            debugDelay(server.key_load_delay);
+        status = batch->status;
+        err = batch->err;
+        erroff = batch->erroff;
+        aofLoadBatchFree(batch,batch->count);
+        batch = NULL;
+        if (status == AOF_PARSE_EOF) break;
+        if (status == AOF_PARSE_UXEOF) goto uxeof;
+        if (status == AOF_PARSE_FMTERR) goto fmterr;
+        if (status == AOF_PARSE_CRCERR) {
+            serverLog(LL_WARNING,"Checksum mismatch of the record at offset "
+                "%lld of the append only file %s", (long long)erroff, filename);
+            goto fmterr;
+        }
+        if (status == AOF_PARSE_READERR) {
+            errno = err;
+            goto readerr;
+        }
     }
 
     /* This point can only be reached when EOF is reached without errors.
@@ -915,59 +2150,235 @@ int loadAppendOnlyFile(char *filename) {
         goto uxeof;
     }
 
-loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
-    fclose(fp);
-    freeFakeClient(fakeClient);
-    server.aof_state = old_aof_state;
-    stopLoading(1);
-    aofUpdateCurrentSize();
-    server.aof_rewrite_base_size = server.aof_current_size;
-    server.aof_fsync_offset = server.aof_current_size;
-    return C_OK;
+loaded_ok: /* DB loaded, cleanup and return success (AOF_OK or AOF_TRUNCATED). */
+    loadingProgress(aof_loaded_files_size + (loader.buf ? loader.offset : ftello(fp)));
+    goto cleanup;
 
 readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
     if (!feof(fp)) {
-        if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
-        fclose(fp);
-        serverLog(LL_WARNING,"Unrecoverable error reading the append only file: %s", strerror(errno));
-        exit(1);
+        serverLog(LL_WARNING,"Unrecoverable error reading the append only file %s: %s", filename, strerror(errno));
+        ret = AOF_FAILED;
+        goto cleanup;
     }
 
 uxeof: /* Unexpected AOF end of file. */
     if (server.aof_load_truncated) {
-        serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file !!!");
-        serverLog(LL_WARNING,"!!! Truncating the AOF at offset %llu !!!",
-            (unsigned long long) valid_up_to);
-        if (valid_up_to == -1 || truncate(filename,valid_up_to) == -1) {
+        serverLog(LL_WARNING,"!!! Warning: short read while loading the AOF file %s!!!", filename);
+        serverLog(LL_WARNING,"!!! Truncating the AOF %s at offset %llu !!!",
+            filename, (unsigned long long) valid_up_to);
+        if (valid_up_to == -1 || truncate(aof_filepath,valid_up_to) == -1) {
             if (valid_up_to == -1) {
                 serverLog(LL_WARNING,"Last valid command offset is invalid");
             } else {
-                serverLog(LL_WARNING,"Error truncating the AOF file: %s",
-                    strerror(errno));
+                serverLog(LL_WARNING,"Error truncating the AOF file %s: %s",
+                    filename, strerror(errno));
             }
         } else {
             /* Make sure the AOF file descriptor points to the end of the
              * file after the truncate call. */
             if (server.aof_fd != -1 && lseek(server.aof_fd,0,SEEK_END) == -1) {
-                serverLog(LL_WARNING,"Can't seek the end of the AOF file: %s",
-                    strerror(errno));
+                serverLog(LL_WARNING,"Can't seek the end of the AOF file %s: %s",
+                    filename, strerror(errno));
             } else {
                 serverLog(LL_WARNING,
-                    "AOF loaded anyway because aof-load-truncated is enabled");
+                    "AOF %s loaded anyway because aof-load-truncated is enabled", filename);
+                ret = AOF_TRUNCATED;
                 goto loaded_ok;
             }
         }
     }
-    if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
-    fclose(fp);
-    serverLog(LL_WARNING,"Unexpected end of file reading the append only file. You can: 1) Make a backup of your AOF file, then use ./redis-check-aof --fix <filename>. 2) Alternatively you can set the 'aof-load-truncated' configuration option to yes and restart the server.");
-    exit(1);
+    serverLog(LL_WARNING,"Unexpected end of file reading the append only file %s. You can: 1) Make a backup of your AOF file, then use ./redis-check-aof --fix <filename>. 2) Alternatively you can set the 'aof-load-truncated' configuration option to yes and restart the server.", filename);
+    ret = AOF_FAILED;
+    goto cleanup;
 
 fmterr: /* Format error. */
-    if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
+    serverLog(LL_WARNING,"Bad file format reading the append only file %s: make a backup of your AOF file, then use ./redis-check-aof --fix <filename>", filename);
+    ret = AOF_FAILED;
+    /* fall through to cleanup. */
+
+cleanup:
+    if (batch) aofLoadBatchFree(batch,next);
+    aofLoaderStop(&loader);
+    if (fakeClient) freeFakeClient(fakeClient);
+    server.aof_state = old_aof_state;
     fclose(fp);
-    serverLog(LL_WARNING,"Bad file format reading the append only file: make a backup of your AOF file, then use ./redis-check-aof --fix <filename>");
-    exit(1);
+    sdsfree(aof_filepath);
+    return ret;
+}
+
+/* Return the size of the AOF file 'filename' of the AOF directory, or 0
+ * when it can't be stat'ed. If 'status' is not NULL, it is set to AOF_OK,
+ * or to AOF_NOT_EXIST / AOF_OPEN_ERR on errors. */
+off_t getAppendOnlyFileSize(sds filename, int *status) {
+    struct redis_stat sb;
+    off_t size;
+    mstime_t latency;
+
+    sds aof_filepath = makePath(server.aof_dirname, filename);
+    latencyStartMonitor(latency);
+    if (redis_stat(aof_filepath, &sb) == -1) {
+        if (status) *status = errno == ENOENT ? AOF_NOT_EXIST : AOF_OPEN_ERR;
+        serverLog(LL_WARNING, "Unable to obtain the AOF file %s length. stat: %s",
+            filename, strerror(errno));
+        size = 0;
+    } else {
+        if (status) *status = AOF_OK;
+        size = sb.st_size;
+    }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("aof-fstat", latency);
+    sdsfree(aof_filepath);
+    return size;
+}
+
+/* Return the total size of the BASE and INCR files of the manifest. */
+off_t getBaseAndIncrAppendOnlyFilesSize(aofManifest *am, int *status) {
+    off_t size = 0;
+    listNode *ln;
+    listIter li;
+
+    if (am->base_aof_info) {
+        serverAssert(am->base_aof_info->file_type == AOF_FILE_TYPE_BASE);
+
+        size += getAppendOnlyFileSize(am->base_aof_info->file_name, status);
+        if (*status != AOF_OK) return 0;
+    }
+
+    listRewind(am->incr_aof_list, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        aofInfo *ai = (aofInfo*)ln->value;
+        serverAssert(ai->file_type == AOF_FILE_TYPE_INCR);
+        size += getAppendOnlyFileSize(ai->file_name, status);
+        if (*status != AOF_OK) return 0;
+    }
+
+    return size;
+}
+
+/* Load the BASE file and then the INCR files of the manifest 'am'.
+ * Returns AOF_NOT_EXIST when the manifest has no files, AOF_EMPTY when
+ * they are all empty, otherwise the result of the loading, see
+ * loadSingleAppendOnlyFile(). Only the last file can be truncated: a
+ * truncated file followed by others is a fatal error (AOF_FAILED). */
+int loadAppendOnlyFiles(aofManifest *am) {
+    serverAssert(am != NULL);
+    int status, ret = AOF_OK;
+    long long start;
+    off_t total_size = 0, base_size = 0;
+    sds aof_name;
+    int total_num, aof_num = 0, last_file;
+
+    /* If the 'server.aof_filename' file exists in the working directory,
+     * we are starting with an AOF written before the AOF directory was
+     * introduced: migrate it, unless the AOF directory already has files. */
+    if (fileExist(server.aof_filename)) {
+        if (!dirExists(server.aof_dirname) ||
+            (am->base_aof_info == NULL && listLength(am->incr_aof_list) == 0) ||
+            (am->base_aof_info != NULL && listLength(am->incr_aof_list) == 0 &&
+             !strcmp(am->base_aof_info->file_name, server.aof_filename) &&
+             !aofFileExist(server.aof_filename)))
+        {
+            aofUpgradePrepare(am);
+        }
+    }
+
+    if (am->base_aof_info == NULL && listLength(am->incr_aof_list) == 0) {
+        return AOF_NOT_EXIST;
+    }
+
+    total_num = (am->base_aof_info ? 1 : 0) + listLength(am->incr_aof_list);
+
+    /* Here we calculate the total size of all BASE and INCR files in
+     * advance, it will be set to `server.loading_total_bytes`. */
+    total_size = getBaseAndIncrAppendOnlyFilesSize(am, &status);
+    if (status != AOF_OK) {
+        /* If an AOF exists in the manifest but not on the disk, we consider this to be a fatal error. */
+        if (status == AOF_NOT_EXIST) status = AOF_FAILED;
+        return status;
+    } else if (total_size == 0) {
+        return AOF_EMPTY;
+    }
+
+    startLoading(total_size, RDBFLAGS_AOF_PREAMBLE);
+    aof_loaded_files_size = 0;
+
+    /* Load BASE AOF if needed. */
+    if (am->base_aof_info) {
+        serverAssert(am->base_aof_info->file_type == AOF_FILE_TYPE_BASE);
+        aof_name = am->base_aof_info->file_name;
+        base_size = getAppendOnlyFileSize(aof_name, NULL);
+        last_file = ++aof_num == total_num;
+        start = ustime();
+        ret = loadSingleAppendOnlyFile(aof_name);
+        if (ret == AOF_OK || (ret == AOF_TRUNCATED && last_file)) {
+            serverLog(LL_NOTICE, "DB loaded from base file %s: %.3f seconds",
+                aof_name, (float)(ustime()-start)/1000000);
+        }
+
+        /* An empty BASE file is fine as long as some INCR file has data. */
+        if (ret == AOF_EMPTY) ret = AOF_OK;
+
+        /* If the truncated file is not the last file, we consider this to be a fatal error. */
+        if (ret == AOF_TRUNCATED && !last_file) {
+            ret = AOF_FAILED;
+            serverLog(LL_WARNING, "Fatal error: the truncated file is not the last file");
+        }
+
+        if (ret == AOF_OPEN_ERR || ret == AOF_FAILED) {
+            goto cleanup;
+        }
+        aof_loaded_files_size += base_size;
+    }
+
+    /* Load INCR AOFs if needed. */
+    if (listLength(am->incr_aof_list)) {
+        listNode *ln;
+        listIter li;
+
+        listRewind(am->incr_aof_list, &li);
+        while ((ln = listNext(&li)) != NULL) {
+            aofInfo *ai = (aofInfo*)ln->value;
+            serverAssert(ai->file_type == AOF_FILE_TYPE_INCR);
+            aof_name = ai->file_name;
+            last_file = ++aof_num == total_num;
+            start = ustime();
+            ret = loadSingleAppendOnlyFile(aof_name);
+            if (ret == AOF_OK || (ret == AOF_TRUNCATED && last_file)) {
+                serverLog(LL_NOTICE, "DB loaded from incr file %s: %.3f seconds",
+                    aof_name, (float)(ustime()-start)/1000000);
+            }
+
+            /* We know that (at least) one of the AOF files has data (total_size > 0),
+             * so empty incr AOF file doesn't count as a AOF_EMPTY result */
+            if (ret == AOF_EMPTY) ret = AOF_OK;
+
+            /* If the truncated file is not the last file, we consider this to be a fatal error. */
+            if (ret == AOF_TRUNCATED && !last_file) {
+                ret = AOF_FAILED;
+                serverLog(LL_WARNING, "Fatal error: the truncated file is not the last file");
+            }
+
+            if (ret == AOF_OPEN_ERR || ret == AOF_FAILED) {
+                goto cleanup;
+            }
+            aof_loaded_files_size += getAppendOnlyFileSize(aof_name, NULL);
+        }
+    }
+
+    /* A truncated file was truncated on disk, so its size changed. */
+    if (ret == AOF_TRUNCATED)
+        total_size = getBaseAndIncrAppendOnlyFilesSize(am, &status);
+    server.aof_current_size = total_size;
+    /* The rewrite base size should be the AOF size at the end of the last
+     * rewrite, that is not persisted anywhere: the size of the BASE file
+     * is the closest thing we have. At worst, the first rewrite happens a
+     * bit early. */
+    server.aof_rewrite_base_size = base_size;
+    server.aof_fsync_offset = server.aof_current_size;
+
+cleanup:
+    stopLoading(ret == AOF_OK || ret == AOF_TRUNCATED);
+    return ret;
 }
 
 /* ----------------------------------------------------------------------------
@@ -1433,25 +2844,29 @@ int rewriteModuleObject(rio *r, robj *key, robj *o) {
     return io.error ? 0 : 1;
 }
 
-/* This function is called by the child rewriting the AOF file to read
- * the difference accumulated from the parent into a buffer, that is
- * concatenated at the end of the rewrite. */
-ssize_t aofReadDiffFromParent(void) {
-    char buf[65536]; /* Default pipe buffer size on most Linux systems. */
-    ssize_t nread, total = 0;
-
-    while ((nread =
-            read(server.aof_pipe_read_data_from_parent,buf,sizeof(buf))) > 0) {
-        server.aof_child_diff = sdscatlen(server.aof_child_diff,buf,nread);
-        total += nread;
-    }
-    return total;
+/* Emit the command needed to rebuild a compressed bitmap. Since there is no
+ * command able to set many bits at once, and the bitmap can't be expressed
+ * as a plain string without losing its encoding, we emit a RESTORE with
+ * the DUMP payload of the object. The function returns 0 on error, 1 on
+ * success. */
+int rewriteBitmapObject(rio *r, robj *key, robj *o) {
+    rio payload;
+    int retval = 1;
+
+    createDumpPayload(&payload,o,key);
+    sds dump = payload.io.buffer.ptr;
+    if (!rioWriteBulkCount(r,'*',4) ||
+        !rioWriteBulkString(r,"RESTORE",7) ||
+        !rioWriteBulkObject(r,key) ||
+        !rioWriteBulkLongLong(r,0) ||
+        !rioWriteBulkString(r,dump,sdslen(dump))) retval = 0;
+    sdsfree(dump);
+    return retval;
 }
 
 int rewriteAppendOnlyFileRio(rio *aof) {
     dictIterator *di = NULL;
     dictEntry *de;
-    size_t processed = 0;
     int j;
     long key_count = 0;
     long long updated_time = 0;
@@ -1499,6 +2914,8 @@ int rewriteAppendOnlyFileRio(rio *aof) {
                 if (rewriteStreamObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_MODULE) {
                 if (rewriteModuleObject(aof,&key,o) == 0) goto werr;
+            } else if (o->type == OBJ_BITMAP) {
+                if (rewriteBitmapObject(aof,&key,o) == 0) goto werr;
             } else {
                 serverPanic("Unknown object type");
             }
@@ -1509,12 +2926,6 @@ int rewriteAppendOnlyFileRio(rio *aof) {
                 if (rioWriteBulkObject(aof,&key) == 0) goto werr;
                 if (rioWriteBulkLongLong(aof,expiretime) == 0) goto werr;
             }
-            /* Read some diff from the parent process from time to time. */
-            if (aof->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES) {
-                processed = aof->processed_bytes;
-                aofReadDiffFromParent();
-            }
-
             /* Update info every 1 second (approximately).
              * in order to avoid calling mstime() on each iteration, we will
              * check the diff every 1024 keys */
@@ -1547,7 +2958,6 @@ int rewriteAppendOnlyFile(char *filename) {
     rio aof;
     FILE *fp = NULL;
     char tmpfile[256];
-    char byte;
 
     /* Note that we have to use a different temp name here compared to the
      * one used by rewriteAppendOnlyFileBackground() function. */
@@ -1558,7 +2968,6 @@ int rewriteAppendOnlyFile(char *filename) {
         return C_ERR;
     }
 
-    server.aof_child_diff = sdsempty();
     rioInitWithFile(&aof,fp);
 
     if (server.aof_rewrite_incremental_fsync)
@@ -1576,74 +2985,6 @@ int rewriteAppendOnlyFile(char *filename) {
         if (rewriteAppendOnlyFileRio(&aof) == C_ERR) goto werr;
     }
 
-    /* Do an initial slow fsync here while the parent is still sending
-     * data, in order to make the next final fsync faster. */
-    if (fflush(fp) == EOF) goto werr;
-    if (fsync(fileno(fp)) == -1) goto werr;
-
-    /* Read again a few times to get more data from the parent.
-     * We can't read forever (the server may receive data from clients
-     * faster than it is able to send data to the child), so we try to read
-     * some more data in a loop as soon as there is a good chance more data
-     * will come. If it looks like we are wasting time, we abort (this
-     * happens after 20 ms without new data). */
-    int nodata = 0;
-    mstime_t start = mstime();
-    while(mstime()-start < 1000 && nodata < 20) {
-        if (aeWait(server.aof_pipe_read_data_from_parent, AE_READABLE, 1) <= 0)
-        {
-            nodata++;
-            continue;
-        }
-        nodata = 0; /* Start counting from zero, we stop on N *contiguous*
-                       timeouts. */
-        aofReadDiffFromParent();
-    }
-
-    /* Ask the master to stop sending diffs. */
-    if (write(server.aof_pipe_write_ack_to_parent,"!",1) != 1) goto werr;
-    if (anetNonBlock(NULL,server.aof_pipe_read_ack_from_parent) != ANET_OK)
-        goto werr;
-    /* We read the ACK from the server using a 5 seconds timeout. Normally
-     * it should reply ASAP, but just in case we lose its reply, we are sure
-     * the child will eventually get terminated. */
-    if (syncRead(server.aof_pipe_read_ack_from_parent,&byte,1,5000) != 1 ||
-        byte != '!') goto werr;
-    serverLog(LL_NOTICE,"Parent agreed to stop sending diffs. Finalizing AOF...");
-
-    /* Read the final diff if any. */
-    aofReadDiffFromParent();
-
-    /* Write the received diff to the file. */
-    serverLog(LL_NOTICE,
-        "Concatenating %.2f MB of AOF diff received from parent.",
-        (double) sdslen(server.aof_child_diff) / (1024*1024));
-
-    /* Now we write the entire AOF buffer we received from the parent
-     * via the pipe during the life of this fork child.
-     * once a second, we'll take a break and send updated COW info to the parent */
-    size_t bytes_to_write = sdslen(server.aof_child_diff);
-    const char *buf = server.aof_child_diff;
-    long long cow_updated_time = mstime();
-    long long key_count = dbTotalServerKeyCount();
-    while (bytes_to_write) {
-        /* We write the AOF buffer in chunk of 8MB so that we can check the time in between them */
-        size_t chunk_size = bytes_to_write < (8<<20) ? bytes_to_write : (8<<20);
-
-        if (rioWrite(&aof,buf,chunk_size) == 0)
-            goto werr;
-
-        bytes_to_write -= chunk_size;
-        buf += chunk_size;
-
-        /* Update COW info */
-        long long now = mstime();
-        if (now - cow_updated_time >= 1000) {
-            sendChildInfo(CHILD_INFO_TYPE_CURRENT_INFO, key_count, "AOF rewrite");
-            cow_updated_time = now;
-        }
-    }
-
     /* Make sure data will not remain on the OS's output buffers */
     if (fflush(fp)) goto werr;
     if (fsync(fileno(fp))) goto werr;
@@ -1671,100 +3012,84 @@ werr:
 }
 
 /* ----------------------------------------------------------------------------
- * AOF rewrite pipes for IPC
- * -------------------------------------------------------------------------- */
-
-/* This event handler is called when the AOF rewriting child sends us a
- * single '!' char to signal we should stop sending buffer diffs. The
- * parent sends a '!' as well to acknowledge. */
-void aofChildPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
-    char byte;
-    UNUSED(el);
-    UNUSED(privdata);
-    UNUSED(mask);
+ * AOF background rewrite
+ * ------------------------------------------------------------------------- */
 
-    if (read(fd,&byte,1) == 1 && byte == '!') {
-        serverLog(LL_NOTICE,"AOF rewrite child asks to stop sending diffs.");
-        server.aof_stop_sending_diff = 1;
-        if (write(server.aof_pipe_write_ack_to_child,"!",1) != 1) {
-            /* If we can't send the ack, inform the user, but don't try again
-             * since in the other side the children will use a timeout if the
-             * kernel can't buffer our write, or, the children was
-             * terminated. */
-            serverLog(LL_WARNING,"Can't send ACK to AOF child: %s",
-                strerror(errno));
-        }
+/* Return 1 if the automatic rewrites are limited because the last ones
+ * failed: after AOF_REWRITE_LIMIT_THRESHOLD consecutive failures, the next
+ * attempt is delayed by one minute, doubling the delay at every failure up
+ * to AOF_REWRITE_LIMIT_MAX_MINUTES. Otherwise every cron cycle would start
+ * a new rewrite, opening a new INCR file, until the problem is fixed.
+ * A rewrite requested with BGREWRITEAOF is never limited. */
+int aofRewriteLimited(void) {
+    static int next_delay_minutes = 0;
+    static time_t next_rewrite_time = 0;
+
+    if (server.stat_aofrw_consecutive_failures < AOF_REWRITE_LIMIT_THRESHOLD) {
+        /* We may be recovering from the limited state. */
+        next_delay_minutes = 0;
+        next_rewrite_time = 0;
+        return 0;
     }
-    /* Remove the handler since this can be called only one time during a
-     * rewrite. */
-    aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
-}
-
-/* Create the pipes used for parent - child process IPC during rewrite.
- * We have a data pipe used to send AOF incremental diffs to the child,
- * and two other pipes used by the children to signal it finished with
- * the rewrite so no more data should be written, and another for the
- * parent to acknowledge it understood this new condition. */
-int aofCreatePipes(void) {
-    int fds[6] = {-1, -1, -1, -1, -1, -1};
-    int j;
 
-    if (pipe(fds) == -1) goto error; /* parent -> children data. */
-    if (pipe(fds+2) == -1) goto error; /* children -> parent ack. */
-    if (pipe(fds+4) == -1) goto error; /* parent -> children ack. */
-    /* Parent -> children data is non blocking. */
-    if (anetNonBlock(NULL,fds[0]) != ANET_OK) goto error;
-    if (anetNonBlock(NULL,fds[1]) != ANET_OK) goto error;
-    if (aeCreateFileEvent(server.el, fds[2], AE_READABLE, aofChildPipeReadable, NULL) == AE_ERR) goto error;
-
-    server.aof_pipe_write_data_to_child = fds[1];
-    server.aof_pipe_read_data_from_parent = fds[0];
-    server.aof_pipe_write_ack_to_parent = fds[3];
-    server.aof_pipe_read_ack_from_child = fds[2];
-    server.aof_pipe_write_ack_to_child = fds[5];
-    server.aof_pipe_read_ack_from_parent = fds[4];
-    server.aof_stop_sending_diff = 0;
-    return C_OK;
-
-error:
-    serverLog(LL_WARNING,"Error opening /setting AOF rewrite IPC pipes: %s",
-        strerror(errno));
-    for (j = 0; j < 6; j++) if(fds[j] != -1) close(fds[j]);
-    return C_ERR;
-}
+    /* Limited: allow an attempt once the delay elapsed. */
+    if (next_rewrite_time != 0) {
+        if (server.unixtime < next_rewrite_time) return 1;
+        next_rewrite_time = 0;
+        return 0;
+    }
 
-void aofClosePipes(void) {
-    aeDeleteFileEvent(server.el,server.aof_pipe_read_ack_from_child,AE_READABLE);
-    aeDeleteFileEvent(server.el,server.aof_pipe_write_data_to_child,AE_WRITABLE);
-    close(server.aof_pipe_write_data_to_child);
-    close(server.aof_pipe_read_data_from_parent);
-    close(server.aof_pipe_write_ack_to_parent);
-    close(server.aof_pipe_read_ack_from_child);
-    close(server.aof_pipe_write_ack_to_child);
-    close(server.aof_pipe_read_ack_from_parent);
+    next_delay_minutes = next_delay_minutes ? next_delay_minutes*2 : 1;
+    if (next_delay_minutes > AOF_REWRITE_LIMIT_MAX_MINUTES)
+        next_delay_minutes = AOF_REWRITE_LIMIT_MAX_MINUTES;
+    next_rewrite_time = server.unixtime + next_delay_minutes*60;
+    serverLog(LL_WARNING,
+        "Background AOF rewrite has repeatedly failed, will retry in %d minutes",
+        next_delay_minutes);
+    return 1;
 }
 
-/* ----------------------------------------------------------------------------
- * AOF background rewrite
- * ------------------------------------------------------------------------- */
-
 /* This is how rewriting of the append only file in background works:
  *
  * 1) The user calls BGREWRITEAOF
- * 2) Redis calls this function, that forks():
- *    2a) the child rewrite the append only file in a temp file.
- *    2b) the parent accumulates differences in server.aof_rewrite_buf.
+ * 2) Redis calls this function, that opens a new INCR file, where the
+ *    writes are appended from now on, and forks():
+ *    2a) the child writes the dataset in a temp file, the new BASE file.
+ *    2b) the parent keeps appending to the new INCR file.
  * 3) When the child finished '2a' exists.
- * 4) The parent will trap the exit code, if it's OK, will append the
- *    data accumulated into server.aof_rewrite_buf into the temp file, and
- *    finally will rename(2) the temp file in the actual file name.
- *    The the new file is reopened as the new append only file. Profit!
+ * 4) The parent will trap the exit code, if it's OK, will rename(2) the
+ *    temp file into the new BASE file, and persist a manifest where the
+ *    previous BASE and INCR files are replaced by the new BASE file and
+ *    the INCR file opened at step 2. The previous files are then deleted
+ *    in the background. Profit!
  */
 int rewriteAppendOnlyFileBackground(void) {
     pid_t childpid;
 
     if (hasActiveChildProcess()) return C_ERR;
-    if (aofCreatePipes() != C_OK) return C_ERR;
+
+    if (dirCreateIfMissing(server.aof_dirname) == -1) {
+        serverLog(LL_WARNING, "Can't open or create append-only dir %s: %s",
+            server.aof_dirname, strerror(errno));
+        server.aof_lastbgrewrite_status = C_ERR;
+        server.stat_aofrw_consecutive_failures++;
+        return C_ERR;
+    }
+
+    /* We set aof_selected_db to -1 in order to force the next call to the
+     * feedAppendOnlyFile() to issue a SELECT command, so that the new INCR
+     * file is self contained. For the same reason the scripts cache is
+     * flushed, so that EVALSHA is not propagated for scripts the new INCR
+     * file does not define. */
+    server.aof_selected_db = -1;
+    replicationScriptCacheFlush();
+    flushAppendOnlyFile(1);
+    if (openNewIncrAofForAppend() != C_OK) {
+        server.aof_lastbgrewrite_status = C_ERR;
+        server.stat_aofrw_consecutive_failures++;
+        return C_ERR;
+    }
+
     if ((childpid = redisFork(CHILD_TYPE_AOF)) == 0) {
         char tmpfile[256];
 
@@ -1773,6 +3098,8 @@ int rewriteAppendOnlyFileBackground(void) {
         redisSetCpuAffinity(server.aof_rewrite_cpulist);
         snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof", (int) getpid());
         if (rewriteAppendOnlyFile(tmpfile) == C_OK) {
+            serverLog(LL_NOTICE,
+                "Successfully created the temporary AOF base file %s", tmpfile);
             sendChildCowInfo(CHILD_INFO_TYPE_AOF_COW_SIZE, "AOF rewrite");
             exitFromChild(0);
         } else {
@@ -1781,23 +3108,17 @@ int rewriteAppendOnlyFileBackground(void) {
     } else {
         /* Parent */
         if (childpid == -1) {
+            server.aof_lastbgrewrite_status = C_ERR;
+            server.stat_aofrw_consecutive_failures++;
             serverLog(LL_WARNING,
                 "Can't rewrite append only file in background: fork: %s",
                 strerror(errno));
-            aofClosePipes();
             return C_ERR;
         }
         serverLog(LL_NOTICE,
             "Background append only file rewriting started by pid %ld",(long) childpid);
         server.aof_rewrite_scheduled = 0;
         server.aof_rewrite_time_start = time(NULL);
-
-        /* We set appendseldb to -1 in order to force the next call to the
-         * feedAppendOnlyFile() to issue a SELECT command, so the differences
-         * accumulated by the parent into server.aof_rewrite_buf will start
-         * with a SELECT statement and it will be safe to merge. */
-        server.aof_selected_db = -1;
-        replicationScriptCacheFlush();
         return C_OK;
     }
     return C_OK; /* unreached */
@@ -1827,181 +3148,154 @@ void aofRemoveTempFile(pid_t childpid) {
     bg_unlink(tmpfile);
 }
 
-/* Update the server.aof_current_size field explicitly using stat(2)
- * to check the size of the file. This is useful after a rewrite or after
- * a restart, normally the size is updated just adding the write length
- * to the current length, that is much faster. */
-void aofUpdateCurrentSize(void) {
-    struct redis_stat sb;
-    mstime_t latency;
-
-    latencyStartMonitor(latency);
-    if (redis_fstat(server.aof_fd,&sb) == -1) {
-        serverLog(LL_WARNING,"Unable to obtain the AOF file length. stat: %s",
-            strerror(errno));
-    } else {
-        server.aof_current_size = sb.st_size;
-    }
-    latencyEndMonitor(latency);
-    latencyAddSampleIfNeeded("aof-fstat",latency);
-}
-
 /* A background append only file rewriting (BGREWRITEAOF) terminated its work.
  * Handle this. */
 void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     if (!bysignal && exitcode == 0) {
-        int newfd, oldfd;
         char tmpfile[256];
         long long now = ustime();
+        sds new_base_filepath = NULL;
+        sds new_incr_filepath = NULL;
+        aofManifest *temp_am;
         mstime_t latency;
 
         serverLog(LL_NOTICE,
             "Background AOF rewrite terminated with success");
 
-        /* Flush the differences accumulated by the parent to the
-         * rewritten AOF. */
-        latencyStartMonitor(latency);
         snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
             (int)server.child_pid);
-        newfd = open(tmpfile,O_WRONLY|O_APPEND);
-        if (newfd == -1) {
-            serverLog(LL_WARNING,
-                "Unable to open the temporary AOF produced by the child: %s", strerror(errno));
-            goto cleanup;
-        }
 
-        if (aofRewriteBufferWrite(newfd) == -1) {
+        serverAssert(server.aof_manifest != NULL);
+
+        /* Dup a temporary aof_manifest for subsequent modifications. */
+        temp_am = aofManifestDup(server.aof_manifest);
+
+        /* Get a new BASE file name and mark the previous (if we have)
+         * as the HISTORY type. */
+        sds new_base_filename = getNewBaseFileNameAndMarkPreAsHistory(temp_am);
+        serverAssert(new_base_filename != NULL);
+        new_base_filepath = makePath(server.aof_dirname, new_base_filename);
+
+        /* Rename the temporary aof file to 'new_base_filename'. */
+        latencyStartMonitor(latency);
+        if (rename(tmpfile, new_base_filepath) == -1) {
             serverLog(LL_WARNING,
-                "Error trying to flush the parent diff to the rewritten AOF: %s", strerror(errno));
-            close(newfd);
+                "Error trying to rename the temporary AOF base file %s into %s: %s",
+                tmpfile,
+                new_base_filename,
+                strerror(errno));
+            aofManifestFree(temp_am);
+            sdsfree(new_base_filepath);
+            server.aof_lastbgrewrite_status = C_ERR;
+            server.stat_aofrw_consecutive_failures++;
             goto cleanup;
         }
         latencyEndMonitor(latency);
-        latencyAddSampleIfNeeded("aof-rewrite-diff-write",latency);
-  
-        if (server.aof_fsync == AOF_FSYNC_EVERYSEC) {
-            aof_background_fsync(newfd);
-        } else if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
+        latencyAddSampleIfNeeded("aof-rename",latency);
+
+        /* The temp INCR file used while switching the AOF on becomes the
+         * first INCR file of the AOF. */
+        if (server.aof_state == AOF_WAIT_REWRITE) {
+            sds temp_incr_aof_name = getTempIncrAofName();
+            sds temp_incr_filepath = makePath(server.aof_dirname, temp_incr_aof_name);
+            sds new_incr_filename = getNewIncrAofName(temp_am);
+            new_incr_filepath = makePath(server.aof_dirname, new_incr_filename);
             latencyStartMonitor(latency);
-            if (redis_fsync(newfd) == -1) {
+            if (rename(temp_incr_filepath, new_incr_filepath) == -1) {
                 serverLog(LL_WARNING,
-                    "Error trying to fsync the parent diff to the rewritten AOF: %s", strerror(errno));
-                close(newfd);
+                    "Error trying to rename the temporary AOF incr file %s into %s: %s",
+                    temp_incr_aof_name,
+                    new_incr_filename,
+                    strerror(errno));
+                bg_unlink(new_base_filepath);
+                sdsfree(new_base_filepath);
+                aofManifestFree(temp_am);
+                sdsfree(temp_incr_filepath);
+                sdsfree(new_incr_filepath);
+                sdsfree(temp_incr_aof_name);
+                server.aof_lastbgrewrite_status = C_ERR;
+                server.stat_aofrw_consecutive_failures++;
                 goto cleanup;
             }
             latencyEndMonitor(latency);
-            latencyAddSampleIfNeeded("aof-rewrite-done-fsync",latency);
-        }
-
-        serverLog(LL_NOTICE,
-            "Residual parent diff successfully flushed to the rewritten AOF (%.2f MB)", (double) aofRewriteBufferSize() / (1024*1024));
-
-        /* The only remaining thing to do is to rename the temporary file to
-         * the configured file and switch the file descriptor used to do AOF
-         * writes. We don't want close(2) or rename(2) calls to block the
-         * server on old file deletion.
-         *
-         * There are two possible scenarios:
-         *
-         * 1) AOF is DISABLED and this was a one time rewrite. The temporary
-         * file will be renamed to the configured file. When this file already
-         * exists, it will be unlinked, which may block the server.
-         *
-         * 2) AOF is ENABLED and the rewritten AOF will immediately start
-         * receiving writes. After the temporary file is renamed to the
-         * configured file, the original AOF file descriptor will be closed.
-         * Since this will be the last reference to that file, closing it
-         * causes the underlying file to be unlinked, which may block the
-         * server.
-         *
-         * To mitigate the blocking effect of the unlink operation (either
-         * caused by rename(2) in scenario 1, or by close(2) in scenario 2), we
-         * use a background thread to take care of this. First, we
-         * make scenario 1 identical to scenario 2 by opening the target file
-         * when it exists. The unlink operation after the rename(2) will then
-         * be executed upon calling close(2) for its descriptor. Everything to
-         * guarantee atomicity for this switch has already happened by then, so
-         * we don't care what the outcome or duration of that close operation
-         * is, as long as the file descriptor is released again. */
-        if (server.aof_fd == -1) {
-            /* AOF disabled */
-
-            /* Don't care if this fails: oldfd will be -1 and we handle that.
-             * One notable case of -1 return is if the old file does
-             * not exist. */
-            oldfd = open(server.aof_filename,O_RDONLY|O_NONBLOCK);
-        } else {
-            /* AOF enabled */
-            oldfd = -1; /* We'll set this to the current AOF filedes later. */
+            latencyAddSampleIfNeeded("aof-rename",latency);
+            sdsfree(temp_incr_filepath);
+            sdsfree(temp_incr_aof_name);
         }
 
-        /* Rename the temporary file. This will not unlink the target file if
-         * it exists, because we reference it with "oldfd". */
-        latencyStartMonitor(latency);
-        if (rename(tmpfile,server.aof_filename) == -1) {
-            serverLog(LL_WARNING,
-                "Error trying to rename the temporary AOF file %s into %s: %s",
-                tmpfile,
-                server.aof_filename,
-                strerror(errno));
-            close(newfd);
-            if (oldfd != -1) close(oldfd);
+        /* The INCR files preceding the one opened when the rewrite started
+         * are now part of the new BASE file. */
+        markRewrittenIncrAofAsHistory(temp_am);
+
+        /* Persist our modifications. */
+        if (persistAofManifest(temp_am) == C_ERR) {
+            bg_unlink(new_base_filepath);
+            aofManifestFree(temp_am);
+            sdsfree(new_base_filepath);
+            if (new_incr_filepath) {
+                bg_unlink(new_incr_filepath);
+                sdsfree(new_incr_filepath);
+            }
+            server.aof_lastbgrewrite_status = C_ERR;
+            server.stat_aofrw_consecutive_failures++;
             goto cleanup;
         }
-        latencyEndMonitor(latency);
-        latencyAddSampleIfNeeded("aof-rename",latency);
+        sdsfree(new_base_filepath);
+        if (new_incr_filepath) sdsfree(new_incr_filepath);
 
-        if (server.aof_fd == -1) {
-            /* AOF disabled, we don't need to set the AOF file descriptor
-             * to this new file, so we can close it. */
-            close(newfd);
-        } else {
-            /* AOF enabled, replace the old fd with the new one. */
-            oldfd = server.aof_fd;
-            server.aof_fd = newfd;
-            server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
-            aofUpdateCurrentSize();
+        /* We can safely let `server.aof_manifest` point to 'temp_am' and free the previous one. */
+        aofManifestFreeAndUpdate(temp_am);
+
+        if (server.aof_fd != -1) {
+            /* AOF enabled. */
+            server.aof_current_size = getAppendOnlyFileSize(new_base_filename, NULL) +
+                                      server.aof_last_incr_size;
             server.aof_rewrite_base_size = server.aof_current_size;
             server.aof_fsync_offset = server.aof_current_size;
             server.aof_last_fsync = server.unixtime;
-
-            /* Clear regular AOF buffer since its contents was just written to
-             * the new AOF from the background rewrite buffer. */
-            sdsfree(server.aof_buf);
-            server.aof_buf = sdsempty();
         }
 
+        /* We don't care about the return value of `aofDelHistoryFiles`, because the history
+         * deletion failure will not cause any problems. */
+        aofDelHistoryFiles();
+
         server.aof_lastbgrewrite_status = C_OK;
+        server.stat_aofrw_consecutive_failures = 0;
 
         serverLog(LL_NOTICE, "Background AOF rewrite finished successfully");
         /* Change state from WAIT_REWRITE to ON if needed */
         if (server.aof_state == AOF_WAIT_REWRITE)
             server.aof_state = AOF_ON;
 
-        /* Asynchronously close the overwritten AOF. */
-        if (oldfd != -1) bioCreateCloseJob(oldfd);
-
         serverLog(LL_VERBOSE,
             "Background AOF rewrite signal handler took %lldus", ustime()-now);
     } else if (!bysignal && exitcode != 0) {
         server.aof_lastbgrewrite_status = C_ERR;
+        server.stat_aofrw_consecutive_failures++;
 
         serverLog(LL_WARNING,
             "Background AOF rewrite terminated with error");
     } else {
         /* SIGUSR1 is whitelisted, so we have a way to kill a child without
          * triggering an error condition. */
-        if (bysignal != SIGUSR1)
+        if (bysignal != SIGUSR1) {
             server.aof_lastbgrewrite_status = C_ERR;
+            server.stat_aofrw_consecutive_failures++;
+        }
 
         serverLog(LL_WARNING,
             "Background AOF rewrite terminated by signal %d", bysignal);
     }
 
 cleanup:
-    aofClosePipes();
-    aofRewriteBufferReset();
     aofRemoveTempFile(server.child_pid);
+    /* The commands accumulated while switching the AOF on are lost with
+     * the temp INCR file: the next rewrite will include them in its BASE. */
+    if (server.aof_state == AOF_WAIT_REWRITE) {
+        sdsfree(server.aof_buf);
+        server.aof_buf = sdsempty();
+        aofDelTempIncrAofFile();
+    }
     server.aof_rewrite_time_last = time(NULL)-server.aof_rewrite_time_start;
     server.aof_rewrite_time_start = -1;
     /* Schedule a new rewrite if we are waiting for it to switch the AOF ON. */
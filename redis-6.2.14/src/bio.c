@@ -24,6 +24,16 @@
  * recently inserted to the most recently inserted (older jobs processed
  * first).
  *
+ * The only exception are lazy free jobs, that are processed by a pool of
+ * 'lazyfree-threads' workers, in no particular order. Every worker has its
+ * own queue: new jobs are distributed round robin across the queues, every
+ * worker processes the jobs of its queue starting from the oldest, and idle
+ * workers steal the most recent jobs from the queues of the other workers,
+ * so that a job freeing a huge object does not delay the ones queued after
+ * it. The number of jobs not yet taken by a worker is tracked under the lazy
+ * free mutex, and a worker reserves a job decrementing it before looking for
+ * one in the queues, so the reserved job is guaranteed to be found.
+ *
  * Currently there is no way for the creator of the job to be notified about
  * the completion of the operation, this will only be added when/if needed.
  *
@@ -74,17 +84,35 @@ static list *bio_jobs[BIO_NUM_OPS];
  * the sensible operation. This data is also useful for reporting. */
 static unsigned long long bio_pending[BIO_NUM_OPS];
 
+/* Lazy free workers, see the top comment. */
+typedef struct bioWorker {
+    pthread_t thread;
+    pthread_mutex_t mutex;      /* Protects the jobs queue. */
+    list *jobs;
+} bioWorker;
+
+static bioWorker lazyfree_workers[BIO_LAZYFREE_MAX_THREADS];
+static int lazyfree_num_workers;
+static unsigned long long lazyfree_queued; /* Protected by the lazy free mutex. */
+static redisAtomic unsigned long lazyfree_next_worker;
+static redisAtomic unsigned long long lazyfree_stolen_jobs;
+
 /* This structure represents a background Job. It is only used locally to this
  * file as the API does not expose the internals at all. */
 struct bio_job {
     time_t time; /* Time at which the job was created. */
     /* Job specific arguments.*/
     int fd; /* Fd for file based background jobs */
+    int need_fsync; /* A flag to indicate that a fsync is required before
+                     * the file is closed. */
+    long long offset; /* AOF offset covered by an AOF fsync, or 0. */
     lazy_free_fn *free_fn; /* Function that will free the provided arguments */
-    void *free_args[]; /* List of arguments to be passed to the free function */
+    bio_job_fn *job_fn; /* Function run by the disk backlog thread. */
+    void *free_args[]; /* List of arguments to be passed to free_fn/job_fn */
 };
 
 void *bioProcessBackgroundJobs(void *arg);
+void *bioProcessLazyfreeJobs(void *arg);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
@@ -118,12 +146,26 @@ void bioInit(void) {
      * responsible of. */
     for (j = 0; j < BIO_NUM_OPS; j++) {
         void *arg = (void*)(unsigned long) j;
+        if (j == BIO_LAZY_FREE) continue; /* Spawned below. */
         if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
             serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
             exit(1);
         }
         bio_threads[j] = thread;
     }
+
+    /* Spawn the lazy free workers, passing the worker ID. */
+    lazyfree_num_workers = server.lazyfree_threads;
+    for (j = 0; j < lazyfree_num_workers; j++) {
+        void *arg = (void*)(unsigned long) j;
+        pthread_mutex_init(&lazyfree_workers[j].mutex,NULL);
+        lazyfree_workers[j].jobs = listCreate();
+        if (pthread_create(&thread,&attr,bioProcessLazyfreeJobs,arg) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
+            exit(1);
+        }
+        lazyfree_workers[j].thread = thread;
+    }
 }
 
 void bioSubmitJob(int type, struct bio_job *job) {
@@ -135,6 +177,24 @@ void bioSubmitJob(int type, struct bio_job *job) {
     pthread_mutex_unlock(&bio_mutex[type]);
 }
 
+/* Add a lazy free job to the queue of the next worker, round robin. */
+void bioSubmitLazyfreeJob(struct bio_job *job) {
+    unsigned long next;
+    atomicGetIncr(lazyfree_next_worker,next,1);
+    bioWorker *w = lazyfree_workers+(next % lazyfree_num_workers);
+
+    job->time = time(NULL);
+    pthread_mutex_lock(&w->mutex);
+    listAddNodeTail(w->jobs,job);
+    pthread_mutex_unlock(&w->mutex);
+
+    pthread_mutex_lock(&bio_mutex[BIO_LAZY_FREE]);
+    lazyfree_queued++;
+    bio_pending[BIO_LAZY_FREE]++;
+    pthread_cond_signal(&bio_newjob_cond[BIO_LAZY_FREE]);
+    pthread_mutex_unlock(&bio_mutex[BIO_LAZY_FREE]);
+}
+
 void bioCreateLazyFreeJob(lazy_free_fn free_fn, int arg_count, ...) {
     va_list valist;
     /* Allocate memory for the job structure and all required
@@ -147,27 +207,63 @@ void bioCreateLazyFreeJob(lazy_free_fn free_fn, int arg_count, ...) {
         job->free_args[i] = va_arg(valist, void *);
     }
     va_end(valist);
-    bioSubmitJob(BIO_LAZY_FREE, job);
+    bioSubmitLazyfreeJob(job);
+}
+
+/* Jobs of the disk backlog thread run one at a time, in the order they
+ * were submitted: a segment is closed only after all its writes. */
+void bioCreateReplBacklogJob(bio_job_fn job_fn, int arg_count, ...) {
+    va_list valist;
+    struct bio_job *job = zmalloc(sizeof(*job) + sizeof(void *) * (arg_count));
+    job->job_fn = job_fn;
+
+    va_start(valist, arg_count);
+    for (int i = 0; i < arg_count; i++) {
+        job->free_args[i] = va_arg(valist, void *);
+    }
+    va_end(valist);
+    bioSubmitJob(BIO_REPL_BACKLOG, job);
 }
 
-void bioCreateCloseJob(int fd) {
+void bioCreateCloseJob(int fd, int need_fsync) {
     struct bio_job *job = zmalloc(sizeof(*job));
     job->fd = fd;
+    job->need_fsync = need_fsync;
 
     bioSubmitJob(BIO_CLOSE_FILE, job);
 }
 
-void bioCreateFsyncJob(int fd) {
+/* When 'offset' is not zero, it is the AOF offset covered by the fsync,
+ * that is published in server.aof_bio_fsynced_offset once the fsync is
+ * done, waking up the event loop: see aof-group-commit. */
+void bioCreateFsyncJob(int fd, long long offset) {
     struct bio_job *job = zmalloc(sizeof(*job));
     job->fd = fd;
+    job->offset = offset;
 
     bioSubmitJob(BIO_AOF_FSYNC, job);
 }
 
+/* Setup performed by every bio thread before processing jobs. */
+static void bioThreadInit(const char *title) {
+    sigset_t sigset;
+
+    redis_set_thread_title(title);
+    redisSetCpuAffinity(server.bio_cpulist);
+    makeThreadKillable();
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in bio.c thread: %s", strerror(errno));
+}
+
 void *bioProcessBackgroundJobs(void *arg) {
     struct bio_job *job;
     unsigned long type = (unsigned long) arg;
-    sigset_t sigset;
 
     /* Check that the type is within the right interval. */
     if (type >= BIO_NUM_OPS) {
@@ -178,29 +274,17 @@ void *bioProcessBackgroundJobs(void *arg) {
 
     switch (type) {
     case BIO_CLOSE_FILE:
-        redis_set_thread_title("bio_close_file");
+        bioThreadInit("bio_close_file");
         break;
     case BIO_AOF_FSYNC:
-        redis_set_thread_title("bio_aof_fsync");
+        bioThreadInit("bio_aof_fsync");
         break;
-    case BIO_LAZY_FREE:
-        redis_set_thread_title("bio_lazy_free");
+    case BIO_REPL_BACKLOG:
+        bioThreadInit("bio_repl_backlog");
         break;
     }
 
-    redisSetCpuAffinity(server.bio_cpulist);
-
-    makeThreadKillable();
-
     pthread_mutex_lock(&bio_mutex[type]);
-    /* Block SIGALRM so we are sure that only the main thread will
-     * receive the watchdog signal. */
-    sigemptyset(&sigset);
-    sigaddset(&sigset, SIGALRM);
-    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
-        serverLog(LL_WARNING,
-            "Warning: can't mask SIGALRM in bio.c thread: %s", strerror(errno));
-
     while(1) {
         listNode *ln;
 
@@ -218,6 +302,7 @@ void *bioProcessBackgroundJobs(void *arg) {
 
         /* Process the job accordingly to its type. */
         if (type == BIO_CLOSE_FILE) {
+            if (job->need_fsync) redis_fsync(job->fd);
             close(job->fd);
         } else if (type == BIO_AOF_FSYNC) {
             /* The fd may be closed by main thread and reused for another
@@ -236,9 +321,19 @@ void *bioProcessBackgroundJobs(void *arg) {
                 }
             } else {
                 atomicSet(server.aof_bio_fsync_status,C_OK);
+                if (job->offset)
+                    atomicSet(server.aof_bio_fsynced_offset,job->offset);
+            }
+            /* Tell the main thread, even on errors, since clients wait
+             * for this fsync to get their replies. */
+            if (job->offset &&
+                write(server.aof_group_commit_pipe[1],"A",1) != 1)
+            {
+                /* The pipe is full: the main thread is going to be
+                 * woken up anyway. */
             }
-        } else if (type == BIO_LAZY_FREE) {
-            job->free_fn(job->free_args);
+        } else if (type == BIO_REPL_BACKLOG) {
+            job->job_fn(job->free_args);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
@@ -255,6 +350,59 @@ void *bioProcessBackgroundJobs(void *arg) {
     }
 }
 
+/* Lazy free worker main loop, see the top comment for the design. */
+void *bioProcessLazyfreeJobs(void *arg) {
+    int id = (unsigned long) arg;
+    bioWorker *self = lazyfree_workers+id;
+    char title[16];
+
+    snprintf(title,sizeof(title),"bio_lazy_free%d",id);
+    bioThreadInit(title);
+
+    while(1) {
+        struct bio_job *job = NULL;
+
+        /* Reserve a job, waiting for one if needed. */
+        pthread_mutex_lock(&bio_mutex[BIO_LAZY_FREE]);
+        while (lazyfree_queued == 0)
+            pthread_cond_wait(&bio_newjob_cond[BIO_LAZY_FREE],
+                              &bio_mutex[BIO_LAZY_FREE]);
+        lazyfree_queued--;
+        pthread_mutex_unlock(&bio_mutex[BIO_LAZY_FREE]);
+
+        /* Take the oldest job of our queue, or steal the most recent job
+         * from the queue of another worker. */
+        for (int j = 0; job == NULL; j++) {
+            bioWorker *w = lazyfree_workers+((id+j) % lazyfree_num_workers);
+            pthread_mutex_lock(&w->mutex);
+            listNode *ln = (w == self) ? listFirst(w->jobs) : listLast(w->jobs);
+            if (ln) {
+                job = ln->value;
+                listDelNode(w->jobs,ln);
+            }
+            pthread_mutex_unlock(&w->mutex);
+            if (job && w != self) atomicIncr(lazyfree_stolen_jobs,1);
+        }
+
+        job->free_fn(job->free_args);
+        zfree(job);
+
+        pthread_mutex_lock(&bio_mutex[BIO_LAZY_FREE]);
+        bio_pending[BIO_LAZY_FREE]--;
+        /* Unblock threads blocked on bioWaitStepOfType() if any. */
+        pthread_cond_broadcast(&bio_step_cond[BIO_LAZY_FREE]);
+        pthread_mutex_unlock(&bio_mutex[BIO_LAZY_FREE]);
+    }
+}
+
+/* Return the number of lazy free jobs a worker stole from the queue of
+ * another worker. */
+unsigned long long bioLazyfreeStolenJobs(void) {
+    unsigned long long val;
+    atomicGet(lazyfree_stolen_jobs,val);
+    return val;
+}
+
 /* Return the number of pending jobs of the specified type. */
 unsigned long long bioPendingJobsOfType(int type) {
     unsigned long long val;
@@ -306,4 +454,18 @@ void bioKillThreads(void) {
             }
         }
     }
+    for (j = 0; j < lazyfree_num_workers; j++) {
+        pthread_t thread = lazyfree_workers[j].thread;
+        if (thread == pthread_self()) continue;
+        if (thread && pthread_cancel(thread) == 0) {
+            if ((err = pthread_join(thread,NULL)) != 0) {
+                serverLog(LL_WARNING,
+                    "Bio lazy free worker #%d can not be joined: %s",
+                        j, strerror(err));
+            } else {
+                serverLog(LL_WARNING,
+                    "Bio lazy free worker #%d terminated",j);
+            }
+        }
+    }
 }
@@ -481,7 +481,7 @@ int getBitfieldTypeFromArgument(client *c, robj *o, int *sign, int *bits) {
 robj *lookupStringForBitCommand(client *c, uint64_t maxbit) {
     size_t byte = maxbit >> 3;
     robj *o = lookupKeyWrite(c->db,c->argv[1]);
-    if (checkType(c,o,OBJ_STRING)) return NULL;
+    if (o && o->type != OBJ_BITMAP && checkType(c,o,OBJ_STRING)) return NULL;
 
     if (o == NULL) {
         o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
@@ -524,6 +524,71 @@ unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf) {
     return p;
 }
 
+/* Lookup 'key' for a read only command able to work with both strings and
+ * compressed bitmaps, and return a roaring bitmap with its bits. Strings are
+ * converted on the fly and non existing keys are returned as empty bitmaps:
+ * in both cases '*owned' is set to 1 and the caller must free the returned
+ * bitmap. If the key holds a value of the wrong type NULL is returned and an
+ * error is sent to the client. */
+static roaring *lookupRoaringForBitCommand(client *c, robj *key, int *owned) {
+    robj *o = lookupKeyRead(c->db,key);
+
+    *owned = 1;
+    if (o == NULL) return roaringNew();
+    if (o->type == OBJ_BITMAP) {
+        *owned = 0;
+        return o->ptr;
+    }
+    if (checkType(c,o,OBJ_STRING)) return NULL;
+
+    long len;
+    char llbuf[LONG_STR_SIZE];
+    unsigned char *p = getObjectReadOnlyString(o,&len,llbuf);
+    return roaringFromBytes(p,len);
+}
+
+/* Compute BITOP when at least one of the sources is a compressed bitmap.
+ * String sources are converted on the fly, and the result is a compressed
+ * bitmap with the logical length of the longest source. */
+static roaring *bitopRoaring(unsigned long op, robj **objects,
+                             unsigned long numkeys, unsigned long maxlen)
+{
+    int rop = (op == BITOP_AND) ? ROARING_OP_AND :
+              (op == BITOP_OR) ? ROARING_OP_OR : ROARING_OP_XOR;
+    roaring *res = NULL;
+
+    for (unsigned long j = 0; j < numkeys; j++) {
+        roaring *r;
+        int owned = 1;
+
+        /* An empty intersection stays empty whatever the other sources. */
+        if (op == BITOP_AND && res && res->card == 0) break;
+
+        if (objects[j] == NULL) {
+            r = roaringNew();
+        } else if (objects[j]->type == OBJ_BITMAP) {
+            r = objects[j]->ptr;
+            owned = 0;
+        } else {
+            r = roaringFromBytes(objects[j]->ptr,sdslen(objects[j]->ptr));
+        }
+
+        if (op == BITOP_NOT) {
+            res = roaringFlip(r,(uint64_t)maxlen*8);
+        } else if (res == NULL) {
+            res = owned ? r : roaringDup(r);
+            owned = 0;
+        } else {
+            roaring *tmp = roaringOp(rop,res,r);
+            roaringFree(res);
+            res = tmp;
+        }
+        if (owned) roaringFree(r);
+    }
+    res->bytes = maxlen;
+    return res;
+}
+
 /* SETBIT key offset bitvalue */
 void setbitCommand(client *c) {
     robj *o;
@@ -545,18 +610,39 @@ void setbitCommand(client *c) {
         return;
     }
 
-    if ((o = lookupStringForBitCommand(c,bitoffset)) == NULL) return;
+    /* Compressed bitmaps are created instead of strings for new keys when
+     * compressed-bitmaps is enabled. Existing strings are never converted. */
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if ((o != NULL && o->type == OBJ_BITMAP) ||
+        (o == NULL && server.compressed_bitmaps))
+    {
+        roaring *r;
 
-    /* Get current values */
-    byte = bitoffset >> 3;
-    byteval = ((uint8_t*)o->ptr)[byte];
-    bit = 7 - (bitoffset & 0x7);
-    bitval = byteval & (1 << bit);
+        if (bitoffset >= ROARING_MAX_BITS) {
+            addReplyError(c,"bit offset is not an integer or out of range");
+            return;
+        }
+        if (o == NULL) {
+            o = createBitmapObject();
+            dbAdd(c->db,c->argv[1],o);
+        }
+        r = o->ptr;
+        bitval = on ? !roaringAdd(r,bitoffset) : roaringRemove(r,bitoffset);
+        if (r->bytes <= (bitoffset >> 3)) r->bytes = (bitoffset >> 3)+1;
+    } else {
+        if ((o = lookupStringForBitCommand(c,bitoffset)) == NULL) return;
 
-    /* Update byte with new bit value and return original value */
-    byteval &= ~(1 << bit);
-    byteval |= ((on & 0x1) << bit);
-    ((uint8_t*)o->ptr)[byte] = byteval;
+        /* Get current values */
+        byte = bitoffset >> 3;
+        byteval = ((uint8_t*)o->ptr)[byte];
+        bit = 7 - (bitoffset & 0x7);
+        bitval = byteval & (1 << bit);
+
+        /* Update byte with new bit value and return original value */
+        byteval &= ~(1 << bit);
+        byteval |= ((on & 0x1) << bit);
+        ((uint8_t*)o->ptr)[byte] = byteval;
+    }
     signalModifiedKey(c,c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
     server.dirty++;
@@ -574,8 +660,12 @@ void getbitCommand(client *c) {
     if (getBitOffsetFromArgument(c,c->argv[2],&bitoffset,0,0) != C_OK)
         return;
 
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
-        checkType(c,o,OBJ_STRING)) return;
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL) return;
+    if (o->type == OBJ_BITMAP) {
+        addReply(c, roaringContains(o->ptr,bitoffset) ? shared.cone : shared.czero);
+        return;
+    }
+    if (checkType(c,o,OBJ_STRING)) return;
 
     byte = bitoffset >> 3;
     bit = 7 - (bitoffset & 0x7);
@@ -601,6 +691,8 @@ void bitopCommand(client *c) {
                                        and max len. */
     unsigned long minlen = 0;    /* Min len among the input keys. */
     unsigned char *res = NULL; /* Resulting string. */
+    roaring *resbitmap = NULL; /* Resulting compressed bitmap. */
+    int compressed = 0; /* True if at least a source is a compressed bitmap. */
 
     /* Parse the operation name. */
     if ((opname[0] == 'a' || opname[0] == 'A') && !strcasecmp(opname,"and"))
@@ -637,6 +729,17 @@ void bitopCommand(client *c) {
             minlen = 0;
             continue;
         }
+        /* Compressed bitmaps are handled by bitopRoaring() later. */
+        if (o->type == OBJ_BITMAP) {
+            incrRefCount(o);
+            objects[j] = o;
+            src[j] = NULL;
+            len[j] = ((roaring*)o->ptr)->bytes;
+            if (len[j] > maxlen) maxlen = len[j];
+            if (j == 0 || len[j] < minlen) minlen = len[j];
+            compressed = 1;
+            continue;
+        }
         /* Return an error if one of the keys is not a string. */
         if (checkType(c,o,OBJ_STRING)) {
             unsigned long i;
@@ -657,7 +760,9 @@ void bitopCommand(client *c) {
     }
 
     /* Compute the bit operation, if at least one string is not empty. */
-    if (maxlen) {
+    if (maxlen && compressed) {
+        resbitmap = bitopRoaring(op,objects,numkeys,maxlen);
+    } else if (maxlen) {
         res = (unsigned char*) sdsnewlen(NULL,maxlen);
         unsigned char output, byte;
         unsigned long i;
@@ -767,7 +872,11 @@ void bitopCommand(client *c) {
 
     /* Store the computed value into the target key */
     if (maxlen) {
-        o = createObject(OBJ_STRING,res);
+        if (resbitmap) {
+            o = createBitmapObjectFromRoaring(resbitmap);
+        } else {
+            o = createObject(OBJ_STRING,res);
+        }
         setKey(c,c->db,targetkey,o);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->db->id);
         decrRefCount(o);
@@ -788,9 +897,15 @@ void bitcountCommand(client *c) {
     char llbuf[LONG_STR_SIZE];
 
     /* Lookup, check for type, and return 0 for non existing keys. */
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
-        checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL) return;
+    if (o->type == OBJ_BITMAP) {
+        /* Compressed bitmaps behave like strings of their logical length. */
+        p = NULL;
+        strlen = ((roaring*)o->ptr)->bytes;
+    } else {
+        if (checkType(c,o,OBJ_STRING)) return;
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->argc == 4) {
@@ -822,6 +937,9 @@ void bitcountCommand(client *c) {
      * zero can be returned is: start > end. */
     if (start > end) {
         addReply(c,shared.czero);
+    } else if (p == NULL) {
+        addReplyLongLong(c,roaringRangeCard(o->ptr,(uint64_t)start*8,
+                                            (uint64_t)end*8+7));
     } else {
         long bytes = end-start+1;
 
@@ -853,8 +971,13 @@ void bitposCommand(client *c) {
         addReplyLongLong(c, bit ? -1 : 0);
         return;
     }
-    if (checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->type == OBJ_BITMAP) {
+        p = NULL;
+        strlen = ((roaring*)o->ptr)->bytes;
+    } else {
+        if (checkType(c,o,OBJ_STRING)) return;
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->argc == 4 || c->argc == 5) {
@@ -889,7 +1012,21 @@ void bitposCommand(client *c) {
         addReplyLongLong(c, -1);
     } else {
         long bytes = end-start+1;
-        long long pos = redisBitpos(p+start,bytes,bit);
+        long long pos;
+
+        if (p) {
+            pos = redisBitpos(p+start,bytes,bit);
+        } else {
+            /* Return the position relative to 'start', with the same
+             * semantics of redisBitpos(): when looking for a clear bit in
+             * a range of all ones, the first bit after the range is
+             * returned. */
+            uint64_t from = (uint64_t)start*8, to = (uint64_t)end*8+7;
+            pos = bit ? roaringNextSet(o->ptr,from,to) :
+                        roaringNextClear(o->ptr,from,to);
+            if (pos != -1) pos -= from;
+            else if (bit == 0) pos = (long long)bytes<<3;
+        }
 
         /* If we are looking for clear bits, and the user specified an exact
          * range with start-end, we can't consider the right of the range as
@@ -907,6 +1044,59 @@ void bitposCommand(client *c) {
     }
 }
 
+/* BITOPCARD AND|OR key [key ...]
+ *
+ * Return the number of bits set in the result of BITOP AND or BITOP OR among
+ * the specified keys, without computing or storing the resulting bitmap when
+ * possible: the last step only counts the bits of the intersection. */
+void bitopcardCommand(client *c) {
+    char *opname = c->argv[1]->ptr;
+    int op, j, looked, numkeys = c->argc-2;
+    roaring **bitmaps;
+    int *owned;
+    uint64_t card = 0;
+
+    if (!strcasecmp(opname,"and"))
+        op = ROARING_OP_AND;
+    else if (!strcasecmp(opname,"or"))
+        op = ROARING_OP_OR;
+    else {
+        addReplyErrorObject(c,shared.syntaxerr);
+        return;
+    }
+
+    bitmaps = zmalloc(sizeof(roaring*) * numkeys);
+    owned = zmalloc(sizeof(int) * numkeys);
+    for (looked = 0; looked < numkeys; looked++) {
+        bitmaps[looked] =
+            lookupRoaringForBitCommand(c,c->argv[looked+2],owned+looked);
+        if (bitmaps[looked] == NULL) goto cleanup;
+    }
+
+    if (numkeys == 1) {
+        card = bitmaps[0]->card;
+    } else {
+        /* Combine all the bitmaps but the last, then just count the bits of
+         * the final operation. */
+        roaring *acc = bitmaps[0];
+        for (j = 1; j < numkeys-1; j++) {
+            roaring *tmp = roaringOp(op,acc,bitmaps[j]);
+            if (acc != bitmaps[0]) roaringFree(acc);
+            acc = tmp;
+        }
+        card = (op == ROARING_OP_AND) ? roaringAndCard(acc,bitmaps[j]) :
+                                        roaringOrCard(acc,bitmaps[j]);
+        if (acc != bitmaps[0]) roaringFree(acc);
+    }
+    addReplyLongLong(c,card);
+
+cleanup:
+    for (j = 0; j < looked; j++)
+        if (owned[j]) roaringFree(bitmaps[j]);
+    zfree(bitmaps);
+    zfree(owned);
+}
+
 /* BITFIELD key subcommmand-1 arg ... subcommand-2 arg ... subcommand-N ...
  *
  * Supported subcommands:
@@ -1015,7 +1205,9 @@ void bitfieldGeneric(client *c, int flags) {
         /* Lookup for read is ok if key doesn't exit, but errors
          * if it's not a string. */
         o = lookupKeyRead(c->db,c->argv[1]);
-        if (o != NULL && checkType(c,o,OBJ_STRING)) {
+        if (o != NULL && o->type != OBJ_BITMAP &&
+            checkType(c,o,OBJ_STRING))
+        {
             zfree(ops);
             return;
         }
@@ -1120,7 +1312,7 @@ void bitfieldGeneric(client *c, int flags) {
             unsigned char *src = NULL;
             char llbuf[LONG_STR_SIZE];
 
-            if (o != NULL)
+            if (o != NULL && o->type != OBJ_BITMAP)
                 src = getObjectReadOnlyString(o,&strlen,llbuf);
 
             /* For GET we use a trick: before executing the operation
@@ -1130,6 +1322,13 @@ void bitfieldGeneric(client *c, int flags) {
             memset(buf,0,9);
             int i;
             uint64_t byte = thisop->offset >> 3;
+            if (o != NULL && o->type == OBJ_BITMAP) {
+                /* Compressed bitmaps: convert just the bytes we need. */
+                strlen = ((roaring*)o->ptr)->bytes;
+                if (byte < (uint64_t)strlen)
+                    roaringToBytes(o->ptr,buf,byte,
+                        strlen-byte < 9 ? strlen-byte : 9);
+            }
             for (i = 0; i < 9; i++) {
                 if (src == NULL || i+byte >= (uint64_t)strlen) break;
                 buf[i] = src[i+byte];
@@ -102,6 +102,9 @@ void blockClient(client *c, int btype) {
         c->paused_list_node = listLast(server.paused_clients);
         /* Mark this client to execute its command */
         c->flags |= CLIENT_PENDING_COMMAND;
+    } else if (btype == BLOCKED_STALENESS) {
+        listAddNodeTail(server.clients_waiting_staleness, c);
+        c->flags |= CLIENT_PENDING_COMMAND;
     }
 }
 
@@ -142,7 +145,9 @@ void processUnblockedClients(void) {
                 continue;
             }
             /* Then process client if it has more data in it's buffer. */
-            if (c->querybuf && sdslen(c->querybuf) > 0) {
+            if ((c->querybuf && sdslen(c->querybuf) > 0) ||
+                replicaApplyHasPending(c))
+            {
                 processInputBuffer(c);
             }
         }
@@ -189,6 +194,8 @@ void unblockClient(client *c) {
     } else if (c->btype == BLOCKED_PAUSE) {
         listDelNode(server.paused_clients,c->paused_list_node);
         c->paused_list_node = NULL;
+    } else if (c->btype == BLOCKED_STALENESS) {
+        unblockClientWaitingStaleness(c);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
@@ -196,8 +203,13 @@ void unblockClient(client *c) {
     /* Reset the client for a new query since, for blocking commands
      * we do not do it immediately after the command returns (when the
      * client got blocked) in order to be still able to access the argument
-     * vector from module callbacks and updateStatsOnUnblock. */
-    if (c->btype != BLOCKED_PAUSE) {
+     * vector from module callbacks and updateStatsOnUnblock.
+     *
+     * Reads blocked by CLIENT STALENESS are instead executed from scratch
+     * like paused commands, unless they timed out. */
+    if (c->btype != BLOCKED_PAUSE &&
+        !(c->btype == BLOCKED_STALENESS && c->flags & CLIENT_PENDING_COMMAND))
+    {
         freeClientOriginalArgv(c);
         resetClient(c);
     }
@@ -224,6 +236,10 @@ void replyToBlockedClientTimedOut(client *c) {
         addReplyLongLong(c,replicationCountAcksByOffset(c->bpop.reploffset));
     } else if (c->btype == BLOCKED_MODULE) {
         moduleBlockedClientTimedOut(c);
+    } else if (c->btype == BLOCKED_STALENESS) {
+        /* The read is not executed: just reply with the error. */
+        c->flags &= ~CLIENT_PENDING_COMMAND;
+        addReplyErrorObject(c,shared.staleerr);
     } else {
         serverPanic("Unknown btype in replyToBlockedClientTimedOut().");
     }
@@ -249,7 +265,7 @@ void disconnectAllBlockedClients(void) {
              * command processing will start from scratch, and the command will
              * be either executed or rejected. (unlike LIST blocked clients for
              * which the command is already in progress in a way. */
-            if (c->btype == BLOCKED_PAUSE)
+            if (c->btype == BLOCKED_PAUSE || c->btype == BLOCKED_STALENESS)
                 continue;
 
             addReplyError(c,
@@ -307,6 +323,7 @@ void serveClientsBlockedOnListKey(robj *o, readyList *rl) {
                     listTypePush(o,value,wherefrom);
                 }
                 updateStatsOnUnblock(receiver, 0, elapsedUs(replyTimer));
+                aofGroupCommitWaitWrites(receiver);
                 unblockClient(receiver);
                 afterCommand(receiver);
                 server.current_client = old_client;
@@ -359,6 +376,7 @@ void serveClientsBlockedOnSortedSetKey(robj *o, readyList *rl) {
             elapsedStart(&replyTimer);
             genericZpopCommand(receiver,&rl->key,1,where,1,NULL);
             updateStatsOnUnblock(receiver, 0, elapsedUs(replyTimer));
+            aofGroupCommitWaitWrites(receiver);
             unblockClient(receiver);
             afterCommand(receiver);
             server.current_client = old_client;
@@ -475,6 +493,7 @@ void serveClientsBlockedOnStreamKey(robj *o, readyList *rl) {
                                      receiver->bpop.xread_count,
                                      0, group, consumer, noack, &pi);
                 updateStatsOnUnblock(receiver, 0, elapsedUs(replyTimer));
+                aofGroupCommitWaitWrites(receiver);
 
                 /* Note that after we unblock the client, 'gt'
                  * and other receiver->bpop stuff are no longer
@@ -533,6 +552,7 @@ void serveClientsBlockedOnKeyByModule(readyList *rl) {
             elapsedStart(&replyTimer);
             if (!moduleTryServeClientBlockedOnKey(receiver, rl->key)) continue;
             updateStatsOnUnblock(receiver, 0, elapsedUs(replyTimer));
+            aofGroupCommitWaitWrites(receiver);
 
             moduleUnblockClient(receiver);
             afterCommand(receiver);
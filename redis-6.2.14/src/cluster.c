@@ -5059,8 +5059,9 @@ void createDumpPayload(rio *payload, robj *o, robj *key) {
      */
 
     /* RDB version */
-    buf[0] = RDB_VERSION & 0xff;
-    buf[1] = (RDB_VERSION >> 8) & 0xff;
+    int rdbver = o->type == OBJ_BITMAP ? RDB_VERSION_BITMAP : RDB_VERSION;
+    buf[0] = rdbver & 0xff;
+    buf[1] = (rdbver >> 8) & 0xff;
     payload->io.buffer.ptr = sdscatlen(payload->io.buffer.ptr,buf,2);
 
     /* CRC64 */
@@ -5085,7 +5086,7 @@ int verifyDumpPayload(unsigned char *p, size_t len) {
 
     /* Verify RDB version */
     rdbver = (footer[1] << 8) | footer[0];
-    if (rdbver > RDB_VERSION) return C_ERR;
+    if (!rdbIsVersionSupported(rdbver)) return C_ERR;
 
     if (server.skip_checksum_validation)
         return C_OK;
@@ -124,6 +124,11 @@
 #define rdb_fsync_range(fd,off,size) fsync(fd)
 #endif
 
+/* Define HAVE_POSIX_FADVISE if posix_fadvise() is available. */
+#if defined(__linux__) || defined(__FreeBSD__)
+#define HAVE_POSIX_FADVISE
+#endif
+
 /* Check if we can use setproctitle().
  * BSD systems have support for it, we provide an implementation for
  * Linux and osx. */
@@ -262,6 +267,19 @@ int pthread_setname_np(const char *name);
 #endif
 #endif
 
+/* Check if we can compile AVX2 code paths. They are only used after checking
+ * at runtime that the CPU actually supports AVX2, so the rest of the binary
+ * does not depend on it. */
+#if defined(__x86_64__) && ((defined(__GNUC__) && __GNUC__ >= 5) || \
+    (defined(__clang__) && __clang_major__ >= 4))
+#if defined(__has_attribute)
+#if __has_attribute(target)
+#define HAVE_AVX2
+#define ATTRIBUTE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+#endif
+
 /* Check if we can use setcpuaffinity(). */
 #if (defined __linux || defined __NetBSD__ || defined __FreeBSD__ || defined __DragonFly__)
 #define USE_SETCPUAFFINITY
@@ -71,10 +71,20 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
         if (!hasActiveChildProcess() && !(flags & LOOKUP_NOTOUCH)){
             if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
                 updateLFU(val);
+            } else if (server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU) {
+                val->lru = (val->lru & TINYLFU_ADMITTED) |
+                           (LRU_CLOCK() & TINYLFU_CLOCK_MAX);
             } else {
                 val->lru = LRU_CLOCK();
             }
         }
+        /* The sketch is not shared with the child, so it is updated
+         * even when there is one. */
+        if ((server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU) &&
+            !(flags & LOOKUP_NOTOUCH))
+        {
+            tinylfuRecordAccess(key->ptr);
+        }
         return val;
     } else {
         return NULL;
@@ -197,6 +207,9 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
     serverAssertWithInfo(NULL,key,retval == DICT_OK);
     signalKeyAsReady(db, key, val->type);
     if (server.cluster_enabled) slotToKeyAdd(key->ptr);
+    slotDigestTouchKey(key);
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU)
+        tinylfuRecordAccess(key->ptr);
 }
 
 /* This is a special version of dbAdd() that is used only when loading
@@ -230,16 +243,22 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     robj *old = dictGetVal(de);
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         val->lru = old->lru;
+    } else if (server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU) {
+        val->lru = (old->lru & TINYLFU_ADMITTED) |
+                   (val->lru & TINYLFU_CLOCK_MAX);
     }
     /* Although the key is not really deleted from the database, we regard 
     overwrite as two steps of unlink+add, so we still need to call the unlink 
     callback of the module. */
     moduleNotifyKeyUnlink(key,old);
     dictSetVal(db->dict, de, val);
+    slotDigestTouchKey(key);
 
     if (server.lazyfree_lazy_server_del) {
         freeObjAsync(key,old);
         dictSetVal(db->dict, &auxentry, NULL);
+    } else if (freeObjIncrementally(key,old)) {
+        dictSetVal(db->dict, &auxentry, NULL);
     }
 
     dictFreeVal(db->dict, &auxentry);
@@ -311,18 +330,39 @@ robj *dbRandomKey(redisDb *db) {
     }
 }
 
+/* Remove a key and its expire, if any, from the DB like dbSyncDelete(),
+ * but instead of releasing the value, return it to the caller, that is in
+ * charge of freeing it. NULL is returned if the key does not exist. */
+robj *dbUnlinkValue(redisDb *db, robj *key) {
+    dbDeleteExpire(db,key->ptr);
+    dictEntry *de = dictUnlink(db->dict,key->ptr);
+    if (de == NULL) return NULL;
+
+    robj *val = dictGetVal(de);
+    /* Tells the module that the key has been unlinked from the database. */
+    moduleNotifyKeyUnlink(key,val);
+    dictSetVal(db->dict,de,NULL);
+    dictFreeUnlinkedEntry(db->dict,de);
+    if (server.cluster_enabled) slotToKeyDel(key->ptr);
+    slotDigestTouchKey(key);
+    return val;
+}
+
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    dbDeleteExpire(db,key->ptr);
     dictEntry *de = dictUnlink(db->dict,key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
         /* Tells the module that the key has been unlinked from the database. */
         moduleNotifyKeyUnlink(key,val);
+        /* Huge values may be released incrementally, in beforeSleep(). */
+        if (freeObjIncrementally(key,val)) dictSetVal(db->dict,de,NULL);
         dictFreeUnlinkedEntry(db->dict,de);
         if (server.cluster_enabled) slotToKeyDel(key->ptr);
+        slotDigestTouchKey(key);
         return 1;
     } else {
         return 0;
@@ -346,6 +386,9 @@ int dbDelete(redisDb *db, robj *key) {
  *    other users.
  * 2) The object encoding is not "RAW".
  *
+ * Compressed bitmaps are also accepted, and always replaced by a string
+ * holding the same bits.
+ *
  * If the object is found in one of the above conditions (or both) by the
  * function, an unshared / not-encoded copy of the string object is stored
  * at 'key' in the specified 'db'. Otherwise the object 'o' itself is
@@ -364,8 +407,12 @@ int dbDelete(redisDb *db, robj *key) {
  * using an sdscat() call to append some data, or anything else.
  */
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
-    serverAssert(o->type == OBJ_STRING);
-    if (o->refcount != 1 || o->encoding != OBJ_ENCODING_RAW) {
+    serverAssert(o->type == OBJ_STRING || o->type == OBJ_BITMAP);
+    if (o->type == OBJ_BITMAP) {
+        /* Compressed bitmaps are modified as the string of their bits. */
+        o = createStringObjectFromBitmap(o);
+        dbOverwrite(db,key,o);
+    } else if (o->refcount != 1 || o->encoding != OBJ_ENCODING_RAW) {
         robj *decoded = getDecodedObject(o);
         o = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
         decrRefCount(decoded);
@@ -401,6 +448,7 @@ long long emptyDbStructure(redisDb *dbarray, int dbnum, int async,
             dictEmpty(dbarray[j].dict,callback);
             dictEmpty(dbarray[j].expires,callback);
         }
+        expireIndexReset(&dbarray[j],async);
         /* Because all keys of database are removed, reset average ttl. */
         dbarray[j].avg_ttl = 0;
         dbarray[j].expires_cursor = 0;
@@ -473,6 +521,8 @@ dbBackup *backupDb(void) {
         backup->dbarray[i] = server.db[i];
         server.db[i].dict = dictCreate(&dbDictType,NULL);
         server.db[i].expires = dictCreate(&dbExpiresDictType,NULL);
+        if (server.db[i].expires_index) server.db[i].expires_index = raxNew();
+        server.db[i].expires_index_bytes = 0;
     }
 
     /* Backup cluster slots to keys map if enable cluster. */
@@ -502,6 +552,7 @@ void discardDbBackup(dbBackup *buckup, int flags, void(callback)(void*)) {
     for (int i=0; i<server.dbnum; i++) {
         dictRelease(buckup->dbarray[i].dict);
         dictRelease(buckup->dbarray[i].expires);
+        expireIndexRelease(&buckup->dbarray[i],0);
     }
 
     /* Release slots to keys map backup if enable cluster. */
@@ -527,8 +578,10 @@ void restoreDbBackup(dbBackup *buckup) {
         serverAssert(dictSize(server.db[i].expires) == 0);
         dictRelease(server.db[i].dict);
         dictRelease(server.db[i].expires);
+        expireIndexRelease(&server.db[i],0);
         server.db[i] = buckup->dbarray[i];
     }
+    slotDigestTouchAll();
 
     /* Restore slots to keys map backup if enable cluster. */
     if (server.cluster_enabled) {
@@ -578,6 +631,9 @@ long long dbTotalServerKeyCount() {
 void signalModifiedKey(client *c, redisDb *db, robj *key) {
     touchWatchedKey(db,key);
     trackingInvalidateKey(c,key,1);
+    pfcountCacheInvalidateKey(key);
+    memoryTopKeysUpdate(db,key);
+    slotDigestTouchKey(key);
 }
 
 void signalFlushedDb(int dbid, int async) {
@@ -592,6 +648,9 @@ void signalFlushedDb(int dbid, int async) {
     for (int j = startdb; j <= enddb; j++) {
         touchAllWatchedKeysInDb(&server.db[j], NULL);
     }
+    pfcountCacheFlush();
+    memoryTopKeysFlush(dbid);
+    slotDigestTouchAll();
 
     trackingInvalidateKeysOnFlush(async);
 }
@@ -1051,6 +1110,7 @@ char* getObjectTypeName(robj *o) {
         case OBJ_ZSET: type = "zset"; break;
         case OBJ_HASH: type = "hash"; break;
         case OBJ_STREAM: type = "stream"; break;
+        case OBJ_BITMAP: type = "bitmap"; break;
         case OBJ_MODULE: {
             moduleValue *mv = o->ptr;
             type = mv->type->name;
@@ -1277,6 +1337,9 @@ void copyCommand(client *c) {
         case OBJ_ZSET: newobj = zsetDup(o); break;
         case OBJ_HASH: newobj = hashTypeDup(o); break;
         case OBJ_STREAM: newobj = streamDup(o); break;
+        case OBJ_BITMAP:
+            newobj = createBitmapObjectFromRoaring(roaringDup(o->ptr));
+            break;
         case OBJ_MODULE:
             newobj = moduleTypeDupOrReply(c, key, newkey, o);
             if (!newobj) return;
@@ -1338,11 +1401,15 @@ int dbSwapDatabases(int id1, int id2) {
     db1->expires = db2->expires;
     db1->avg_ttl = db2->avg_ttl;
     db1->expires_cursor = db2->expires_cursor;
+    db1->expires_index = db2->expires_index;
+    db1->expires_index_bytes = db2->expires_index_bytes;
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
     db2->avg_ttl = aux.avg_ttl;
     db2->expires_cursor = aux.expires_cursor;
+    db2->expires_index = aux.expires_index;
+    db2->expires_index_bytes = aux.expires_index_bytes;
 
     /* Now we need to handle clients blocked on lists: as an effect
      * of swapping the two DBs, a client that was waiting for list
@@ -1360,6 +1427,8 @@ int dbSwapDatabases(int id1, int id2) {
     touchAllWatchedKeysInDb(db1, db2);
     scanDatabaseForReadyLists(db2);
     touchAllWatchedKeysInDb(db2, db1);
+    memoryTopKeysSwapDb(id1,id2);
+    slotDigestTouchAll();
     return C_OK;
 }
 
@@ -1402,7 +1471,19 @@ int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
     serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    return dbDeleteExpire(db,key->ptr);
+}
+
+/* Remove the expire of 'key' from the expires dict and, if enabled, from the
+ * deadline index. Returns 1 if the key had an expire, otherwise 0. */
+int dbDeleteExpire(redisDb *db, sds key) {
+    if (dictSize(db->expires) == 0) return 0;
+    if (db->expires_index) {
+        dictEntry *de = dictFind(db->expires,key);
+        if (de == NULL) return 0;
+        expireIndexDel(db,dictGetKey(de),dictGetSignedIntegerVal(de));
+    }
+    return dictDelete(db->expires,key) == DICT_OK;
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
@@ -1410,13 +1491,18 @@ int removeExpire(redisDb *db, robj *key) {
  * to NULL. The 'when' parameter is the absolute unix time in milliseconds
  * after which the key will no longer be considered valid. */
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dictEntry *kde, *de, *existing;
 
     /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictAddOrFind(db->expires,dictGetKey(kde));
+    de = dictAddRaw(db->expires,dictGetKey(kde),&existing);
+    if (existing) {
+        de = existing;
+        expireIndexDel(db,dictGetKey(de),dictGetSignedIntegerVal(de));
+    }
     dictSetSignedIntegerVal(de,when);
+    expireIndexAdd(db,dictGetKey(de),when);
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
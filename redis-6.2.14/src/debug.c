@@ -257,6 +257,11 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
             mt->digest(&md,mv->value);
             xorDigest(digest,md.x,sizeof(md.x));
         }
+    } else if (o->type == OBJ_BITMAP) {
+        size_t len;
+        unsigned char *buf = roaringSerialize(o->ptr,&len);
+        mixDigest(digest,buf,len);
+        zfree(buf);
     } else {
         serverPanic("Unknown object type");
     }
@@ -552,9 +557,9 @@ NULL
         if (server.aof_state != AOF_OFF) flushAppendOnlyFile(1);
         emptyDb(-1,EMPTYDB_NO_FLAGS,NULL);
         protectClient(c);
-        int ret = loadAppendOnlyFile(server.aof_filename);
+        int ret = loadAppendOnlyFiles(server.aof_manifest);
         unprotectClient(c);
-        if (ret != C_OK) {
+        if (ret != AOF_OK && ret != AOF_TRUNCATED && ret != AOF_EMPTY) {
             addReplyErrorObject(c,shared.err);
             return;
         }
@@ -980,6 +985,9 @@ void serverLogObjectDebugInfo(const robj *o) {
             serverLog(LL_WARNING,"Skiplist level: %d", (int) ((const zset*)o->ptr)->zsl->level);
     } else if (o->type == OBJ_STREAM) {
         serverLog(LL_WARNING,"Stream size: %d", (int) streamLength(o));
+    } else if (o->type == OBJ_BITMAP) {
+        serverLog(LL_WARNING,"Bitmap bits set: %llu",
+            (unsigned long long) roaringCard(o->ptr));
     }
 #endif
 }
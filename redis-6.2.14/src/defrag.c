@@ -47,6 +47,7 @@ int je_get_defrag_hint(void* ptr);
 /* forward declarations*/
 void defragDictBucketCallback(void *privdata, dictEntry **bucketref);
 dictEntry* replaceSatelliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sds newkey, uint64_t hash, long *defragged);
+int defragSizeIsTarget(size_t size);
 
 /* Defrag helper for generic allocations.
  *
@@ -56,6 +57,22 @@ dictEntry* replaceSatelliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, s
 void* activeDefragAlloc(void *ptr) {
     size_t size;
     void *newptr;
+    /* Objects allocated from slabs are moved by the slab allocator, from
+     * the sparse pages to the dense ones. */
+    if (zslab_owns(ptr)) {
+        newptr = zslab_defrag(ptr);
+        if (!newptr) server.stat_active_defrag_misses++;
+        return newptr;
+    }
+    /* Huge page regions have pages of their own, and are not moved. */
+    if (zhuge_owns(ptr)) return NULL;
+    /* Don't even ask jemalloc about allocations of size classes that are
+     * not fragmented enough to be worth the effort, see defragUpdateMap(). */
+    size = zmalloc_size(ptr);
+    if (!defragSizeIsTarget(size)) {
+        server.stat_active_defrag_skipped++;
+        return NULL;
+    }
     if(!je_get_defrag_hint(ptr)) {
         server.stat_active_defrag_misses++;
         return NULL;
@@ -63,7 +80,6 @@ void* activeDefragAlloc(void *ptr) {
     /* move this allocation to a new allocation.
      * make sure not to use the thread cache. so that we don't get back the same
      * pointers we try to free */
-    size = zmalloc_size(ptr);
     newptr = zmalloc_no_tcache(size);
     memcpy(newptr, ptr, size);
     zfree_no_tcache(ptr);
@@ -795,6 +811,24 @@ long defragStream(redisDb *db, dictEntry *kde) {
     return defragged;
 }
 
+/* Defrag a compressed bitmap key: the roaring struct, the containers
+ * array and every container data. Returns the number of pointers defragged. */
+long defragBitmap(robj *ob) {
+    long defragged = 0;
+    roaring *r = ob->ptr, *newr;
+    void *newptr;
+
+    if ((newr = activeDefragAlloc(r)))
+        defragged++, ob->ptr = r = newr;
+    if (r->c && (newptr = activeDefragAlloc(r->c)))
+        defragged++, r->c = newptr;
+    for (uint32_t j = 0; j < r->count; j++) {
+        if ((newptr = activeDefragAlloc(r->c[j].data)))
+            defragged++, r->c[j].data = newptr;
+    }
+    return defragged;
+}
+
 /* Defrag a module key. This is either done immediately or scheduled
  * for later. Returns then number of pointers defragged.
  */
@@ -879,6 +913,8 @@ long defragKey(redisDb *db, dictEntry *de) {
         }
     } else if (ob->type == OBJ_STREAM) {
         defragged += defragStream(db, de);
+    } else if (ob->type == OBJ_BITMAP) {
+        defragged += defragBitmap(ob);
     } else if (ob->type == OBJ_MODULE) {
         defragged += defragModule(db, de);
     } else {
@@ -887,8 +923,53 @@ long defragKey(redisDb *db, dictEntry *de) {
     return defragged;
 }
 
+/* Return 1 if the allocation may live in a size class targeted by the
+ * current defrag cycle. Slab allocations are always candidates, the slab
+ * allocator tracks its own sparse pages, while huge page regions are never
+ * moved. */
+static int defragAllocIsTarget(void *ptr) {
+    if (zslab_owns(ptr)) return 1;
+    if (zhuge_owns(ptr)) return 0;
+    return defragSizeIsTarget(zmalloc_size(ptr));
+}
+
+/* Return 0 if we can tell, without touching the allocator, that none of the
+ * allocations of the key would be moved by defragKey(), so that keys living
+ * entirely in size classes with little fragmentation are skipped. Only
+ * strings and the compact encodings are checked, the other types are made
+ * of many allocations that activeDefragAlloc() filters one by one anyway. */
+int defragKeyIsTarget(redisDb *db, dictEntry *de) {
+    sds keysds = dictGetKey(de);
+    robj *ob = dictGetVal(de);
+
+    if (defragAllocIsTarget(sdsAllocPtr(keysds))) return 1;
+    if (dictSize(db->expires) && defragSizeIsTarget(sizeof(dictEntry)))
+        return 1;
+    if (ob->refcount == 1 && defragAllocIsTarget(ob)) return 1;
+    switch(ob->type) {
+    case OBJ_STRING:
+        return ob->encoding == OBJ_ENCODING_RAW &&
+               defragAllocIsTarget(sdsAllocPtr(ob->ptr));
+    case OBJ_LIST:
+    case OBJ_ZSET:
+    case OBJ_HASH:
+        if (ob->encoding != OBJ_ENCODING_ZIPLIST) return 1;
+        return defragAllocIsTarget(ob->ptr);
+    case OBJ_SET:
+        if (ob->encoding != OBJ_ENCODING_INTSET) return 1;
+        return defragAllocIsTarget(ob->ptr);
+    default:
+        return 1;
+    }
+}
+
 /* Defrag scan callback for the main db dictionary. */
 void defragScanCallback(void *privdata, const dictEntry *de) {
+    if (!defragKeyIsTarget((redisDb*)privdata, (dictEntry*)de)) {
+        server.stat_active_defrag_skipped++;
+        server.stat_active_defrag_scanned++;
+        return;
+    }
     long defragged = defragKey((redisDb*)privdata, (dictEntry*)de);
     server.stat_active_defrag_hits += defragged;
     if(defragged)
@@ -902,6 +983,10 @@ void defragScanCallback(void *privdata, const dictEntry *de) {
  * used in order to defrag the dictEntry allocations. */
 void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
     UNUSED(privdata); /* NOTE: this function is also used by both activeDefragCycle and scanLaterHash, etc. don't use privdata */
+    /* All the entries of the bucket share the same size class. Slab entries
+     * are the exception, but these are checked by activeDefragAlloc(). */
+    if (!server.slab_allocator && !defragSizeIsTarget(sizeof(dictEntry)))
+        return;
     while(*bucketref) {
         dictEntry *de = *bucketref, *newde;
         if ((newde = activeDefragAlloc(de))) {
@@ -932,6 +1017,77 @@ float getAllocatorFragmentation(size_t *out_frag_bytes) {
     return frag_pct;
 }
 
+/* The fragmentation map: the small size classes of the allocator sorted
+ * by size, flagging the ones holding most of the fragmentation. Only the
+ * allocations of the flagged classes are moved by the defragger, since in
+ * practice a handful of classes are responsible for most of the wasted
+ * memory, and checking all the other pointers with the allocator is what
+ * makes a full keyspace scan expensive. */
+#define DEFRAG_MAP_MAX_BINS 128
+#define DEFRAG_MAP_COVERAGE 90 /* % of the fragmented bytes to target. */
+static struct {
+    int nbins;      /* Bins in the map, 0 means every size is a target. */
+    int targets;    /* Bins flagged as targets. */
+    size_t size[DEFRAG_MAP_MAX_BINS];
+    unsigned char target[DEFRAG_MAP_MAX_BINS];
+} defrag_map;
+
+/* Rebuild the fragmentation map from the allocator bin stats. Must be
+ * called after the stats are refreshed, see getAllocatorFragmentation(). */
+void defragUpdateMap(void) {
+    zmallocBinStats bins[DEFRAG_MAP_MAX_BINS];
+    size_t frag[DEFRAG_MAP_MAX_BINS], total = 0, covered = 0;
+    int nbins = zmalloc_get_bin_stats(bins, DEFRAG_MAP_MAX_BINS);
+
+    for (int j = 0; j < nbins; j++) {
+        size_t regs = bins[j].curslabs * bins[j].nregs;
+        frag[j] = regs > bins[j].curregs ?
+                  (regs - bins[j].curregs) * bins[j].size : 0;
+        total += frag[j];
+        defrag_map.size[j] = bins[j].size;
+        defrag_map.target[j] = 0;
+    }
+    defrag_map.nbins = nbins;
+    defrag_map.targets = 0;
+
+    /* Flag the most fragmented bins until we cover enough of the total.
+     * There are only a few tens of bins, so a selection is fine. */
+    while (covered * 100 < total * DEFRAG_MAP_COVERAGE) {
+        int best = -1;
+        for (int j = 0; j < nbins; j++) {
+            if (defrag_map.target[j] || !frag[j]) continue;
+            if (best == -1 || frag[j] > frag[best]) best = j;
+        }
+        if (best == -1) break;
+        defrag_map.target[best] = 1;
+        defrag_map.targets++;
+        covered += frag[best];
+    }
+    serverLog(LL_DEBUG,"Defrag map: %d/%d bins targeted, %zu/%zu frag bytes",
+        defrag_map.targets, nbins, covered, total);
+}
+
+/* Return 1 if allocations of 'size' bytes belong to a size class targeted
+ * by the fragmentation map. Sizes above the largest small class are not in
+ * the map, and are left to je_get_defrag_hint() to judge. */
+int defragSizeIsTarget(size_t size) {
+    int lo = 0, hi = defrag_map.nbins - 1;
+
+    if (!defrag_map.nbins || size > defrag_map.size[hi]) return 1;
+    /* Find the smallest class that fits 'size'. */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (defrag_map.size[mid] < size) lo = mid + 1;
+        else hi = mid;
+    }
+    return defrag_map.target[lo];
+}
+
+/* Number of size classes targeted by the current (or last) defrag cycle. */
+int activeDefragTargetBins(void) {
+    return defrag_map.targets;
+}
+
 /* We may need to defrag other globals, one small allocation can hold a full allocator run.
  * so although small, it is still important to defrag these */
 long defragOtherGlobals() {
@@ -1052,6 +1208,10 @@ void computeDefragCycles() {
             return;
     }
 
+    /* Refresh the size classes to target, the stats were just updated by
+     * getAllocatorFragmentation(). */
+    defragUpdateMap();
+
     /* Calculate the adaptive aggressiveness of the defrag */
     int cpu_pct = INTERPOLATE(frag_pct,
             server.active_defrag_threshold_lower,
@@ -1206,6 +1366,10 @@ void *activeDefragAlloc(void *ptr) {
     return NULL;
 }
 
+int activeDefragTargetBins(void) {
+    return 0;
+}
+
 robj *activeDefragStringOb(robj *ob, long *defragged) {
     UNUSED(ob);
     UNUSED(defragged);
@@ -123,6 +123,7 @@ int _dictInit(dict *d, dictType *type,
     d->privdata = privDataPtr;
     d->rehashidx = -1;
     d->pauserehash = 0;
+    d->tracked_size = 0;
     return DICT_OK;
 }
 
@@ -165,12 +166,12 @@ int _dictExpand(dict *d, unsigned long size, int* malloc_failed)
     n.size = realsize;
     n.sizemask = realsize-1;
     if (malloc_failed) {
-        n.table = ztrycalloc(realsize*sizeof(dictEntry*));
+        n.table = ztrycalloc_huge(realsize*sizeof(dictEntry*));
         *malloc_failed = n.table == NULL;
         if (*malloc_failed)
             return DICT_ERR;
     } else
-        n.table = zcalloc(realsize*sizeof(dictEntry*));
+        n.table = zcalloc_huge(realsize*sizeof(dictEntry*));
 
     n.used = 0;
 
@@ -342,7 +343,7 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
+    entry = zslab_malloc(ZSLAB_DICT_ENTRY,sizeof(*entry));
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
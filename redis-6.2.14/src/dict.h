@@ -83,6 +83,8 @@ typedef struct dict {
     dictht ht[2];
     long rehashidx; /* rehashing not in progress if rehashidx == -1 */
     int16_t pauserehash; /* If >0 rehashing is paused (<0 indicates coding error) */
+    size_t tracked_size; /* Memory used by the elements, maintained by the
+                            owner of the dict, see objectSizeTrackEnd(). */
 } dict;
 
 /* If safe is set to 1 this is a safe iterator, that means, you can call
@@ -61,6 +61,48 @@ struct evictionPoolEntry {
 
 static struct evictionPoolEntry *EvictionPoolLRU;
 
+/* When maxmemory-eviction-candidates is not zero the small pool above is
+ * not used: candidates are instead kept in a much larger set that persists
+ * across evictions and is refreshed incrementally with the keys sampled at
+ * every eviction. Instead of keeping the set sorted, candidates are stored
+ * in EVCAND_BUCKETS buckets by approximated score (see evictionScoreBucket()),
+ * so that both inserting a sampled key and taking the best candidate are
+ * O(1) operations, regardless of the number of candidates.
+ *
+ * Entries are linked by index in a double linked list per bucket, and free
+ * entries are linked in a single linked list using the 'next' field. A bitmap
+ * of non empty buckets is used to find the best and the worst bucket.
+ *
+ * Since every eviction consumes a candidate, while the set is less than half
+ * full up to EVCAND_FILL_ROUNDS rounds of sampling are performed instead of
+ * one, and at every eviction a few entries are rescored, in a round robin
+ * fashion, so that the bucket of candidates that stay in the set for a long
+ * time does not get too stale. Every round samples at most EVCAND_SAMPLE_DBS
+ * non empty DBs, resuming from the DB after the last one sampled, so the cost
+ * of an eviction does not grow with the number of DBs. */
+#define EVCAND_BUCKETS 256
+#define EVCAND_FILL_ROUNDS 4
+#define EVCAND_SAMPLE_DBS 4 /* Max DBs sampled per round, in rotation. */
+typedef struct evictionCandidate {
+    sds key;                    /* Key name, allocated once and reused. */
+    int dbid;                   /* Key DB number. */
+    int bucket;                 /* Score bucket, -1 if the entry is free. */
+    int prev, next;             /* Bucket list (or free list) links. */
+} evictionCandidate;
+
+static struct {
+    evictionCandidate *entries;
+    int size;                   /* Number of allocated entries. */
+    int used;                   /* Number of entries in some bucket. */
+    int free;                   /* First free entry, -1 if none. */
+    int policy;                 /* Policy the scores were computed with. */
+    int cursor;                 /* Next entry to rescore. */
+    int dbcursor;               /* Next DB to sample. */
+    size_t memory;              /* Memory used by entries and key names. */
+    int head[EVCAND_BUCKETS];   /* First entry of every bucket, or -1. */
+    uint64_t nonempty[EVCAND_BUCKETS/64]; /* Bitmap of non empty buckets. */
+} EvictionCandidates;
+
 /* ----------------------------------------------------------------------------
  * Implementation of eviction, aging and LRU
  * --------------------------------------------------------------------------*/
@@ -90,10 +132,18 @@ unsigned int LRU_CLOCK(void) {
  * requested, using an approximated LRU algorithm. */
 unsigned long long estimateObjectIdleTime(robj *o) {
     unsigned long long lruclock = LRU_CLOCK();
-    if (lruclock >= o->lru) {
-        return (lruclock - o->lru) * LRU_CLOCK_RESOLUTION;
+    unsigned long long lru = o->lru, lruclock_max = LRU_CLOCK_MAX;
+
+    /* With TinyLFU the most significant bit tracks the segment. */
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU) {
+        lruclock &= TINYLFU_CLOCK_MAX;
+        lru &= TINYLFU_CLOCK_MAX;
+        lruclock_max = TINYLFU_CLOCK_MAX;
+    }
+    if (lruclock >= lru) {
+        return (lruclock - lru) * LRU_CLOCK_RESOLUTION;
     } else {
-        return (lruclock + (LRU_CLOCK_MAX - o->lru)) *
+        return (lruclock + (lruclock_max - lru)) *
                     LRU_CLOCK_RESOLUTION;
     }
 }
@@ -133,6 +183,68 @@ void evictionPoolAlloc(void) {
     EvictionPoolLRU = ep;
 }
 
+/* Return the eviction score of the key at the dict entry 'de' of 'sampledict',
+ * according to the current policy. This is called idle time in the eviction
+ * pool just because the code initially handled LRU, but is in fact just a
+ * score where an higher score means better candidate. */
+static unsigned long long tinylfuEvictionScore(sds key, robj *o);
+
+/* With maxmemory-eviction-size-aware the LRU and LFU scores are multiplied
+ * by a weight growing with the logarithm of the memory used by the value,
+ * so that, for similar idle times or frequencies, the eviction of the
+ * larger keys is preferred, freeing more memory per evicted key. The
+ * weight is 1 up to EVICTION_SIZE_BASE bytes, then grows by one every time
+ * the size doubles. The size is tracked, see objectGetMemory(). */
+#define EVICTION_SIZE_BASE 64
+static unsigned long long evictionSizeWeight(robj *o) {
+    size_t size = objectGetMemory(o);
+    unsigned long long weight = 1;
+
+    while (size > EVICTION_SIZE_BASE) {
+        weight++;
+        size >>= 1;
+    }
+    return weight;
+}
+
+static unsigned long long evictionScore(dictEntry *de, dict *sampledict, dict *keydict) {
+    robj *o = NULL;
+
+    /* If the dictionary we are sampling from is not the main
+     * dictionary (but the expires one) we need to lookup the key
+     * again in the key dictionary to obtain the value object. */
+    if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
+        if (sampledict != keydict) de = dictFind(keydict, dictGetKey(de));
+        o = dictGetVal(de);
+    }
+
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU) {
+        return tinylfuEvictionScore(dictGetKey(de),o);
+    } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
+        unsigned long long idle = estimateObjectIdleTime(o);
+        if (server.maxmemory_eviction_size_aware)
+            idle *= evictionSizeWeight(o);
+        return idle;
+    } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+        /* When we use an LRU policy, we sort the keys by idle time
+         * so that we expire keys starting from greater idle time.
+         * However when the policy is an LFU one, we have a frequency
+         * estimation, and we want to evict keys with lower frequency
+         * first. So inside the pool we put objects using the inverted
+         * frequency subtracting the actual frequency to the maximum
+         * frequency of 255. */
+        unsigned long long score = 255-LFUDecrAndReturn(o);
+        if (server.maxmemory_eviction_size_aware)
+            score *= evictionSizeWeight(o);
+        return score;
+    } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
+        /* In this case the sooner the expire the better. */
+        return ULLONG_MAX - (long)dictGetVal(de);
+    } else {
+        serverPanic("Unknown eviction policy in evictionScore()");
+    }
+}
+
 /* This is an helper function for performEvictions(), it is used in order
  * to populate the evictionPool with a few entries every time we want to
  * expire a key. Keys with idle time bigger than one of the current
@@ -150,40 +262,11 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
-        robj *o;
         dictEntry *de;
 
         de = samples[j];
         key = dictGetKey(de);
-
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
-            o = dictGetVal(de);
-        }
-
-        /* Calculate the idle time according to the policy. This is called
-         * idle just because the code initially handled LRU, but is in fact
-         * just a score where an higher score means better candidate. */
-        if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
-            idle = estimateObjectIdleTime(o);
-        } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
-            /* When we use an LRU policy, we sort the keys by idle time
-             * so that we expire keys starting from greater idle time.
-             * However when the policy is an LFU one, we have a frequency
-             * estimation, and we want to evict keys with lower frequency
-             * first. So inside the pool we put objects using the inverted
-             * frequency subtracting the actual frequency to the maximum
-             * frequency of 255. */
-            idle = 255-LFUDecrAndReturn(o);
-        } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
-            /* In this case the sooner the expire the better. */
-            idle = ULLONG_MAX - (long)dictGetVal(de);
-        } else {
-            serverPanic("Unknown eviction policy in evictionPoolPopulate()");
-        }
+        idle = evictionScore(de,sampledict,keydict);
 
         /* Insert the element inside the pool.
          * First, find the first empty bucket or the first populated
@@ -239,6 +322,256 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
     }
 }
 
+/* Map a value to a bucket in a logarithmic scale, with 8 buckets for every
+ * power of two, so that the relative error is bounded to 12.5%. */
+static int evictionLogBucket(unsigned long long v) {
+    if (v < 8) return v;
+    int msb = 63 - __builtin_clzll(v);
+    int bucket = msb*8 + (int)((v >> (msb-3)) & 7);
+    return bucket < EVCAND_BUCKETS ? bucket : EVCAND_BUCKETS-1;
+}
+
+/* Map the score returned by evictionScore() to the bucket of the eviction
+ * candidates set. Higher buckets hold better candidates. The LFU inverted
+ * counter is already in the 0-255 range (unless weighted by the key size),
+ * LRU idle times (in milliseconds) are mapped in a logarithmic scale, and for
+ * volatile-ttl the logarithm of the time to live is inverted, so that keys
+ * expiring sooner are better. */
+static int evictionScoreBucket(unsigned long long score) {
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+        if (server.maxmemory_eviction_size_aware)
+            return evictionLogBucket(score);
+        return (int)score;
+    } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
+        long long ttl = (long long)(ULLONG_MAX - score) - server.mstime;
+        return EVCAND_BUCKETS-1 - evictionLogBucket(ttl > 0 ? ttl : 0);
+    } else {
+        return evictionLogBucket(score);
+    }
+}
+
+/* Release the eviction candidates set. It is allocated again on demand by
+ * evictionCandidatesBestKey() with the configured size. */
+void evictionCandidatesRelease(void) {
+    for (int j = 0; j < EvictionCandidates.size; j++)
+        sdsfree(EvictionCandidates.entries[j].key);
+    zfree(EvictionCandidates.entries);
+    EvictionCandidates.entries = NULL;
+    EvictionCandidates.size = 0;
+    EvictionCandidates.used = 0;
+    EvictionCandidates.memory = 0;
+}
+
+/* Return the memory used by the eviction candidates set, for INFO. This
+ * memory is counted as used memory for maxmemory, like the dataset: it is
+ * bounded by maxmemory-eviction-candidates, and released when there are no
+ * keys left to evict. */
+size_t evictionCandidatesMemory(void) {
+    return EvictionCandidates.memory;
+}
+
+/* Allocate an empty eviction candidates set of 'size' entries. */
+static void evictionCandidatesCreate(int size) {
+    evictionCandidatesRelease();
+    EvictionCandidates.entries = zmalloc(sizeof(evictionCandidate)*size);
+    EvictionCandidates.memory = zmalloc_size(EvictionCandidates.entries);
+    for (int j = 0; j < size; j++) {
+        EvictionCandidates.entries[j].key = NULL;
+        EvictionCandidates.entries[j].bucket = -1;
+        EvictionCandidates.entries[j].next = (j == size-1) ? -1 : j+1;
+    }
+    EvictionCandidates.size = size;
+    EvictionCandidates.free = 0;
+    EvictionCandidates.cursor = 0;
+    EvictionCandidates.dbcursor = 0;
+    EvictionCandidates.policy = server.maxmemory_policy;
+    for (int j = 0; j < EVCAND_BUCKETS; j++) EvictionCandidates.head[j] = -1;
+    memset(EvictionCandidates.nonempty,0,sizeof(EvictionCandidates.nonempty));
+}
+
+/* Return the highest (if 'highest' is true) or lowest non empty bucket,
+ * or -1 if there are no candidates. */
+static int evictionCandidatesEdgeBucket(int highest) {
+    int words = EVCAND_BUCKETS/64;
+    for (int i = 0; i < words; i++) {
+        int w = highest ? words-1-i : i;
+        uint64_t bits = EvictionCandidates.nonempty[w];
+        if (bits == 0) continue;
+        return w*64 + (highest ? 63-__builtin_clzll(bits) : __builtin_ctzll(bits));
+    }
+    return -1;
+}
+
+/* Link the entry 'idx' at the head of the list of 'bucket'. */
+static void evictionCandidatesLink(int idx, int bucket) {
+    evictionCandidate *ec = EvictionCandidates.entries+idx;
+    int head = EvictionCandidates.head[bucket];
+
+    ec->bucket = bucket;
+    ec->prev = -1;
+    ec->next = head;
+    if (head != -1) EvictionCandidates.entries[head].prev = idx;
+    EvictionCandidates.head[bucket] = idx;
+    EvictionCandidates.nonempty[bucket/64] |= 1ULL<<(bucket%64);
+    EvictionCandidates.used++;
+}
+
+/* Unlink the entry 'idx' from the list of its bucket. */
+static void evictionCandidatesUnlink(int idx) {
+    evictionCandidate *ec = EvictionCandidates.entries+idx;
+    int bucket = ec->bucket;
+
+    if (ec->prev != -1)
+        EvictionCandidates.entries[ec->prev].next = ec->next;
+    else
+        EvictionCandidates.head[bucket] = ec->next;
+    if (ec->next != -1) EvictionCandidates.entries[ec->next].prev = ec->prev;
+    if (EvictionCandidates.head[bucket] == -1)
+        EvictionCandidates.nonempty[bucket/64] &= ~(1ULL<<(bucket%64));
+    ec->bucket = -1;
+    EvictionCandidates.used--;
+}
+
+/* Unlink the entry 'idx' and put it in the free list. The key name is
+ * retained so that its allocation can be reused. */
+static void evictionCandidatesFree(int idx) {
+    evictionCandidatesUnlink(idx);
+    EvictionCandidates.entries[idx].next = EvictionCandidates.free;
+    EvictionCandidates.free = idx;
+}
+
+/* Add a sampled key to the candidates. When the set is full the key
+ * replaces one of the candidates in the worst bucket, but only if it
+ * belongs to a better bucket. Note that the same key may be added multiple
+ * times: duplicates are handled as ghosts once the key is evicted. */
+static void evictionCandidatesAdd(int dbid, sds key, int bucket) {
+    if (EvictionCandidates.free == -1) {
+        int worst = evictionCandidatesEdgeBucket(0);
+        if (bucket <= worst) return;
+        evictionCandidatesFree(EvictionCandidates.head[worst]);
+    }
+
+    int idx = EvictionCandidates.free;
+    evictionCandidate *ec = EvictionCandidates.entries+idx;
+    EvictionCandidates.free = ec->next;
+    if (ec->key) {
+        EvictionCandidates.memory -= sdsAllocSize(ec->key);
+        ec->key = sdscpylen(ec->key,key,sdslen(key));
+    } else {
+        ec->key = sdsnewlen(key,sdslen(key));
+    }
+    EvictionCandidates.memory += sdsAllocSize(ec->key);
+    ec->dbid = dbid;
+    evictionCandidatesLink(idx,bucket);
+}
+
+/* Sample keys from 'sampledict' and add them to the candidates set. */
+static void evictionCandidatesPopulate(int dbid, dict *sampledict, dict *keydict) {
+    int j, count;
+    dictEntry *samples[server.maxmemory_samples];
+
+    count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    for (j = 0; j < count; j++) {
+        unsigned long long score = evictionScore(samples[j],sampledict,keydict);
+        evictionCandidatesAdd(dbid,dictGetKey(samples[j]),
+                              evictionScoreBucket(score));
+    }
+}
+
+/* Rescore the entry 'idx' according to the key current state, moving it to
+ * its current bucket, or discarding it if the key no longer exists. Return
+ * the key dict entry, or NULL if the entry was discarded. */
+static dictEntry *evictionCandidatesRescore(int idx) {
+    evictionCandidate *ec = EvictionCandidates.entries+idx;
+    redisDb *db = server.db+ec->dbid;
+    dict *d = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+              db->dict : db->expires;
+    dictEntry *de = dictFind(d,ec->key);
+
+    /* Ghost: the key was deleted (or evicted) after being sampled. */
+    if (de == NULL) {
+        evictionCandidatesFree(idx);
+        return NULL;
+    }
+
+    int bucket = evictionScoreBucket(evictionScore(de,d,db->dict));
+    if (bucket != ec->bucket) {
+        evictionCandidatesUnlink(idx);
+        evictionCandidatesLink(idx,bucket);
+    }
+    return de;
+}
+
+/* Return the best key to evict according to the eviction candidates set,
+ * setting '*bestdbid' to its DB, or NULL if there are no keys to evict.
+ *
+ * Every call refreshes the set sampling maxmemory-samples keys from up to
+ * EVCAND_SAMPLE_DBS non empty DBs, rotating among the DBs across calls, and
+ * rescoring maxmemory-samples entries.
+ * Candidates are then taken from the best bucket, and validated against the
+ * keyspace: keys that no longer exist are discarded, and keys that were
+ * accessed after being sampled are moved to the bucket of their current
+ * score. */
+static sds evictionCandidatesBestKey(int *bestdbid) {
+    int allkeys = server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS;
+    int j, rounds = 0;
+
+    /* Scores computed with a different policy are meaningless. */
+    if (EvictionCandidates.size != server.maxmemory_eviction_candidates ||
+        EvictionCandidates.policy != server.maxmemory_policy)
+    {
+        evictionCandidatesCreate(server.maxmemory_eviction_candidates);
+    }
+
+    for (j = 0; j < server.maxmemory_samples && EvictionCandidates.used; j++) {
+        int idx = EvictionCandidates.cursor;
+        EvictionCandidates.cursor = (idx+1) % EvictionCandidates.size;
+        if (EvictionCandidates.entries[idx].bucket != -1)
+            evictionCandidatesRescore(idx);
+    }
+
+    while (1) {
+        int sampled;
+
+        do {
+            sampled = 0;
+            for (int i = 0; i < server.dbnum; i++) {
+                int dbid = (EvictionCandidates.dbcursor+i) % server.dbnum;
+                redisDb *db = server.db+dbid;
+                dict *d = allkeys ? db->dict : db->expires;
+                if (dictSize(d) == 0) continue;
+                evictionCandidatesPopulate(dbid,d,db->dict);
+                if (++sampled == EVCAND_SAMPLE_DBS) {
+                    EvictionCandidates.dbcursor = (dbid+1) % server.dbnum;
+                    break;
+                }
+            }
+        } while (sampled && ++rounds < EVCAND_FILL_ROUNDS &&
+                 EvictionCandidates.used < EvictionCandidates.size/2);
+        if (!sampled) {
+            /* No keys to evict: the cached key names are useless. */
+            evictionCandidatesRelease();
+            return NULL;
+        }
+
+        int bucket;
+        while ((bucket = evictionCandidatesEdgeBucket(1)) != -1) {
+            int idx = EvictionCandidates.head[bucket];
+            dictEntry *de = evictionCandidatesRescore(idx);
+
+            /* Evict the key only if it is still in the best bucket: the
+             * score can get worse if the key was accessed (or its TTL was
+             * extended) after it was sampled. */
+            if (de == NULL || EvictionCandidates.entries[idx].bucket < bucket)
+                continue;
+
+            evictionCandidatesFree(idx);
+            *bestdbid = EvictionCandidates.entries[idx].dbid;
+            return dictGetKey(de);
+        }
+    }
+}
+
 /* ----------------------------------------------------------------------------
  * LFU (Least Frequently Used) implementation.
 
@@ -324,26 +657,420 @@ unsigned long LFUDecrAndReturn(robj *o) {
     return counter;
 }
 
+/* ----------------------------------------------------------------------------
+ * W-TinyLFU implementation.
+ *
+ * The LFU policies above rank keys by the LOG_C counter of the object, that
+ * is only updated while the key exists: a key is always admitted when it is
+ * written, and a scan of keys that are accessed just once can evict the
+ * keys that are really hot, since freshly created keys and hot keys that
+ * were not accessed in the last few minutes look the same.
+ *
+ * The *-tinylfu policies implement instead a sampled version of W-TinyLFU:
+ *
+ * 1. The access frequency of every key, including keys that are no longer
+ *    in memory, is estimated by a count-min sketch of 4 rows of 4 bits
+ *    counters (saturated at 15). All the counters are halved every time
+ *    the number of recorded accesses reaches 10 times the sketch width, so
+ *    that the frequency reflects the recent history. Since the sketch can
+ *    be large, the halving is performed incrementally by tinylfuCron(), a
+ *    fixed number of counters per call.
+ *
+ * 2. The first access of a key only sets its bits in a "doorkeeper" Bloom
+ *    filter, that is cleared at every halving, and only the following ones
+ *    update the sketch, so that the many keys accessed just once do not
+ *    pollute the sketch counters.
+ *
+ * 3. The keyspace is split into a small window, where new keys enter, and
+ *    a main segment. The segment is tracked reusing the most significant
+ *    bit of the 24 bits LRU field of the object, while the other 23 bits
+ *    store the LRU clock as usually (wrapping after 97 days instead of 194).
+ *
+ * When a key must be evicted, keys are sampled like for the other policies.
+ * If the window is larger than maxmemory-tinylfu-window percent of the
+ * keyspace (estimated by the moving average of the sampled keys in the
+ * window), the least frequently used sampled window key is the candidate
+ * to enter the main segment: it is admitted only if its frequency is
+ * greater than the one of the least frequently used main key, that is
+ * evicted in its place, otherwise the candidate is evicted. The other
+ * sampled window keys enter the main segment if they are not less
+ * frequently used than the main key. If the window is small enough, the
+ * least frequently used main key is evicted. Window keys never enter the
+ * main segment without winning this frequency comparison.
+ * --------------------------------------------------------------------------*/
+
+#define TINYLFU_DEPTH 4
+#define TINYLFU_MIN_WIDTH 1024
+#define TINYLFU_MAX_WIDTH (1<<26)
+#define TINYLFU_COUNTER_MAX 15
+#define TINYLFU_SAMPLE_FACTOR 10    /* Halve every SAMPLE_FACTOR*width accesses. */
+#define TINYLFU_PROMOTE_MAX 64      /* Max window keys promoted at once. */
+#define TINYLFU_SAMPLE_TRIES 4      /* Max samplings to find a window key. */
+#define TINYLFU_AGE_STEP (1<<17)    /* Counters columns halved per cron call. */
+#define TINYLFU_IDLE_MAX ((1ULL<<40)-1) /* Idle time bits of the pool score. */
+
+typedef struct tinylfuSample {
+    sds key;
+    robj *val;
+    int dbid;
+    unsigned long freq;         /* Estimated frequency when sampled. */
+    unsigned long long idle;    /* Idle time when sampled. */
+} tinylfuSample;
+
+static struct {
+    uint8_t *sketch;            /* TINYLFU_DEPTH rows of 'width' counters. */
+    uint8_t *doorkeeper;        /* Bloom filter of 'width'*8 bits. */
+    unsigned long width;        /* Power of two, 0 if not allocated. */
+    unsigned long long accesses;/* Accesses recorded since the last halving. */
+    double window_ratio;        /* Moving average of sampled window keys. */
+    int aging;                  /* True if a halving is in progress. */
+    unsigned long age_cursor;   /* Next column to halve. */
+} TinyLFU;
+
+/* Release the sketch. It is allocated again on demand when a TinyLFU policy
+ * is selected. */
+void tinylfuRelease(void) {
+    zfree(TinyLFU.sketch);
+    zfree(TinyLFU.doorkeeper);
+    TinyLFU.sketch = NULL;
+    TinyLFU.doorkeeper = NULL;
+    TinyLFU.width = 0;
+    TinyLFU.accesses = 0;
+    TinyLFU.window_ratio = 1;
+    TinyLFU.aging = 0;
+    TinyLFU.age_cursor = 0;
+}
+
+/* Return the memory used by the sketch. Since the sketch is sized according
+ * to the number of keys, it is counted for eviction like the dict tables. */
+size_t tinylfuMemory(void) {
+    if (TinyLFU.width == 0) return 0;
+    return zmalloc_size(TinyLFU.sketch)+zmalloc_size(TinyLFU.doorkeeper);
+}
+
+/* Halve up to 'count' columns of counters, clearing the same bytes of the
+ * doorkeeper, continuing the halving in progress. */
+static void tinylfuAgeStep(unsigned long count) {
+    unsigned long end;
+
+    if (!TinyLFU.aging) return;
+    end = TinyLFU.age_cursor + count;
+    if (end > TinyLFU.width || end < count) end = TinyLFU.width;
+    for (int r = 0; r < TINYLFU_DEPTH; r++) {
+        uint8_t *row = TinyLFU.sketch + r*TinyLFU.width;
+        for (unsigned long j = TinyLFU.age_cursor; j < end; j++) row[j] >>= 1;
+    }
+    memset(TinyLFU.doorkeeper+TinyLFU.age_cursor,0,end-TinyLFU.age_cursor);
+    TinyLFU.age_cursor = end;
+    if (end == TinyLFU.width) TinyLFU.aging = 0;
+}
+
+/* Called by serverCron() to perform the halving of the counters in small
+ * steps, so that the latency does not depend on the sketch size. */
+void tinylfuCron(void) {
+    tinylfuAgeStep(TINYLFU_AGE_STEP);
+}
+
+/* Size the sketch according to the number of keys in the dataset, with
+ * a counter per key in every row. Since the counters of a key are selected
+ * masking its hash with the width, the history is preserved: when the
+ * sketch grows every new counter starts from the one the key used before,
+ * and when it shrinks the counters that collapse into one are summed,
+ * so that the estimate is still never lower than the true frequency. */
+static void tinylfuResize(void) {
+    unsigned long long keys = 0;
+    unsigned long width = TINYLFU_MIN_WIDTH, oldwidth = TinyLFU.width;
+    uint8_t *sketch, *doorkeeper;
+
+    for (int j = 0; j < server.dbnum; j++) keys += dictSize(server.db[j].dict);
+    while (width < keys && width < TINYLFU_MAX_WIDTH) width *= 2;
+    if (width == oldwidth) return;
+
+    sketch = zcalloc(TINYLFU_DEPTH*width);
+    doorkeeper = zcalloc(width);
+    if (oldwidth) {
+        /* Resizing already touches every counter: complete the halving
+         * in progress, if any, so that all the counters are consistent. */
+        tinylfuAgeStep(oldwidth);
+        for (int r = 0; r < TINYLFU_DEPTH; r++) {
+            uint8_t *src = TinyLFU.sketch + r*oldwidth;
+            uint8_t *dst = sketch + r*width;
+            if (width > oldwidth) {
+                for (unsigned long j = 0; j < width; j++)
+                    dst[j] = src[j & (oldwidth-1)];
+            } else {
+                for (unsigned long j = 0; j < oldwidth; j++) {
+                    unsigned int c = dst[j & (width-1)] + src[j];
+                    dst[j & (width-1)] = c > TINYLFU_COUNTER_MAX ?
+                                         TINYLFU_COUNTER_MAX : c;
+                }
+            }
+        }
+        if (width > oldwidth) {
+            for (unsigned long j = 0; j < width; j++)
+                doorkeeper[j] = TinyLFU.doorkeeper[j & (oldwidth-1)];
+        } else {
+            for (unsigned long j = 0; j < oldwidth; j++)
+                doorkeeper[j & (width-1)] |= TinyLFU.doorkeeper[j];
+        }
+        zfree(TinyLFU.sketch);
+        zfree(TinyLFU.doorkeeper);
+    }
+    TinyLFU.sketch = sketch;
+    TinyLFU.doorkeeper = doorkeeper;
+    TinyLFU.width = width;
+}
+
+/* Compute the TINYLFU_DEPTH counters indexes of the key, and the two bits
+ * of the doorkeeper, using double hashing. The second bit is taken from a
+ * remix of the whole hash, so that both bits span any doorkeeper size. */
+static void tinylfuHash(sds key, unsigned long *idx, unsigned long *bits) {
+    uint64_t h = dictGenHashFunction(key,sdslen(key));
+    uint64_t h1 = h, h2 = (h >> 32) | 1;
+    uint64_t h3 = ((h << 32) | (h >> 32)) * 0x9e3779b97f4a7c15ULL;
+    unsigned long mask = TinyLFU.width-1;
+
+    for (int j = 0; j < TINYLFU_DEPTH; j++)
+        idx[j] = j*TinyLFU.width + ((h1 + j*h2) & mask);
+    h3 ^= h3 >> 29;
+    bits[0] = (h1 >> 7) & (TinyLFU.width*8-1);
+    bits[1] = h3 & (TinyLFU.width*8-1);
+}
+
+static int tinylfuDoorkeeperGet(unsigned long bit) {
+    return (TinyLFU.doorkeeper[bit/8] >> (bit%8)) & 1;
+}
+
+/* Record an access to the key. Called when an existing key is accessed or
+ * a new key is added to the dataset. */
+void tinylfuRecordAccess(sds key) {
+    unsigned long idx[TINYLFU_DEPTH], bits[2];
+
+    if (TinyLFU.width == 0 || (TinyLFU.accesses & 4095) == 0) tinylfuResize();
+    tinylfuHash(key,idx,bits);
+
+    if (!tinylfuDoorkeeperGet(bits[0]) || !tinylfuDoorkeeperGet(bits[1])) {
+        TinyLFU.doorkeeper[bits[0]/8] |= 1<<(bits[0]%8);
+        TinyLFU.doorkeeper[bits[1]/8] |= 1<<(bits[1]%8);
+    } else {
+        /* Conservative update: only the counters that are equal to the
+         * estimated frequency are incremented. */
+        uint8_t min = TINYLFU_COUNTER_MAX;
+        for (int j = 0; j < TINYLFU_DEPTH; j++)
+            if (TinyLFU.sketch[idx[j]] < min) min = TinyLFU.sketch[idx[j]];
+        if (min < TINYLFU_COUNTER_MAX) {
+            for (int j = 0; j < TINYLFU_DEPTH; j++)
+                if (TinyLFU.sketch[idx[j]] == min) TinyLFU.sketch[idx[j]]++;
+        }
+    }
+    if (++TinyLFU.accesses >= TinyLFU.width*TINYLFU_SAMPLE_FACTOR &&
+        !TinyLFU.aging)
+    {
+        /* Start a halving, performed incrementally by tinylfuCron(). */
+        TinyLFU.aging = 1;
+        TinyLFU.age_cursor = 0;
+        TinyLFU.accesses /= 2;
+    }
+}
+
+/* Return the estimated access frequency of the key, from 0 to 16. */
+unsigned long tinylfuFrequency(sds key) {
+    unsigned long idx[TINYLFU_DEPTH], bits[2];
+    uint8_t min = TINYLFU_COUNTER_MAX;
+
+    if (TinyLFU.width == 0) return 0;
+    tinylfuHash(key,idx,bits);
+    for (int j = 0; j < TINYLFU_DEPTH; j++)
+        if (TinyLFU.sketch[idx[j]] < min) min = TinyLFU.sketch[idx[j]];
+    return min + (tinylfuDoorkeeperGet(bits[0]) && tinylfuDoorkeeperGet(bits[1]));
+}
+
+/* Score of a key for the eviction pool with TinyLFU policies: only keys of
+ * the main segment are candidates, the least frequently used first, then
+ * the least recently used. Window keys get the worst possible score. */
+static unsigned long long tinylfuEvictionScore(sds key, robj *o) {
+    unsigned long long idle;
+
+    if (!(o->lru & TINYLFU_ADMITTED)) return 0;
+    idle = estimateObjectIdleTime(o);
+    if (idle > TINYLFU_IDLE_MAX) idle = TINYLFU_IDLE_MAX;
+    return ((unsigned long long)(TINYLFU_COUNTER_MAX+1-tinylfuFrequency(key)) << 40) | idle;
+}
+
+/* Return the index of the window candidate among the sampled window keys:
+ * the least frequently used one, or the least recently used one among the
+ * keys with the same frequency. Its frequency is stored in '*freq'. */
+static int tinylfuWindowCandidate(tinylfuSample *samples, int count,
+                                  unsigned long *freq)
+{
+    int candidate = 0;
+
+    *freq = samples[0].freq;
+    for (int j = 1; j < count; j++) {
+        if (samples[j].freq < *freq ||
+            (samples[j].freq == *freq &&
+             samples[j].idle > samples[candidate].idle))
+        {
+            candidate = j;
+            *freq = samples[j].freq;
+        }
+    }
+    return candidate;
+}
+
+/* Admit into the main segment the sampled window keys, other than
+ * 'skip', with a frequency of at least 'minfreq'. */
+static void tinylfuAdmit(tinylfuSample *samples, int count, int skip,
+                         unsigned long minfreq)
+{
+    for (int j = 0; j < count; j++) {
+        if (j == skip || samples[j].freq < minfreq) continue;
+        samples[j].val->lru |= TINYLFU_ADMITTED;
+        server.stat_tinylfu_admitted++;
+    }
+}
+
+/* Return the best key to evict according to the W-TinyLFU policy, setting
+ * '*bestdbid' to its DB, or NULL if there are no keys to evict.
+ *
+ * The window candidate is selected among the sampled window keys by
+ * tinylfuWindowCandidate(), while the main segment victim is taken from the
+ * eviction pool, populated as usually with the score of
+ * tinylfuEvictionScore(), so that the victim is the least frequently used
+ * of many more keys. */
+static sds tinylfuBestKey(int *bestdbid) {
+    struct evictionPoolEntry *pool = EvictionPoolLRU;
+    int allkeys = server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS;
+    unsigned long long total_keys = 0;
+    unsigned long mfreq, wfreq;
+    int sampled = 0, window = 0, wcount = 0, tries = 0, candidate, k;
+    dictEntry *mde = NULL;
+    tinylfuSample wsamples[TINYLFU_PROMOTE_MAX];
+
+    /* If the window is too big but no window key was sampled, sample again
+     * a few times: evicting a main key would let the window grow more. */
+    do {
+        total_keys = 0;
+        for (int i = 0; i < server.dbnum; i++) {
+            redisDb *db = server.db+i;
+            dict *d = allkeys ? db->dict : db->expires;
+            dictEntry *samples[server.maxmemory_samples];
+            int count;
+
+            if (dictSize(d) == 0) continue;
+            total_keys += dictSize(d);
+            evictionPoolPopulate(i,d,db->dict,pool);
+            count = dictGetSomeKeys(d,samples,server.maxmemory_samples);
+            for (int j = 0; j < count; j++) {
+                sds key = dictGetKey(samples[j]);
+                robj *o = allkeys ? dictGetVal(samples[j]) :
+                                    dictGetVal(dictFind(db->dict,key));
+
+                sampled++;
+                if (o->lru & TINYLFU_ADMITTED) continue;
+                window++;
+                if (wcount < TINYLFU_PROMOTE_MAX) {
+                    wsamples[wcount].key = key;
+                    wsamples[wcount].val = o;
+                    wsamples[wcount].dbid = i;
+                    wsamples[wcount].freq = tinylfuFrequency(key);
+                    wsamples[wcount].idle = estimateObjectIdleTime(o);
+                    wcount++;
+                }
+            }
+        }
+    } while (total_keys && wcount == 0 && ++tries < TINYLFU_SAMPLE_TRIES &&
+             TinyLFU.window_ratio*100 > server.maxmemory_tinylfu_window);
+    if (total_keys == 0 || sampled == 0) return NULL;
+
+    TinyLFU.window_ratio = TinyLFU.window_ratio*0.9 +
+                           (double)window/sampled*0.1;
+
+    /* Find the best main segment victim in the pool, discarding the keys
+     * that no longer exist and the window keys. The entry is removed from
+     * the pool only if the key is really evicted. */
+    for (k = EVPOOL_SIZE-1; k >= 0; k--) {
+        if (pool[k].key == NULL) continue;
+        if (pool[k].idle != 0) {
+            redisDb *db = server.db+pool[k].dbid;
+            mde = dictFind(allkeys ? db->dict : db->expires,pool[k].key);
+            if (mde) {
+                robj *o = allkeys ? dictGetVal(mde) :
+                          dictGetVal(dictFind(db->dict,pool[k].key));
+                if (o->lru & TINYLFU_ADMITTED) break;
+                mde = NULL;
+            }
+        }
+        if (pool[k].key != pool[k].cached) sdsfree(pool[k].key);
+        pool[k].key = NULL;
+        pool[k].idle = 0;
+    }
+
+    if (wcount && mde == NULL) {
+        /* No key of the main segment was found: this happens when the
+         * policy was just selected, or if the main segment is very small.
+         * The window candidate is evicted, and the other sampled window
+         * keys that are more frequently used enter the main segment. */
+        candidate = tinylfuWindowCandidate(wsamples,wcount,&wfreq);
+        tinylfuAdmit(wsamples,wcount,candidate,wfreq+1);
+        server.stat_tinylfu_rejected++;
+        *bestdbid = wsamples[candidate].dbid;
+        return wsamples[candidate].key;
+    }
+    if (mde == NULL) return NULL;
+    mfreq = tinylfuFrequency(dictGetKey(mde));
+
+    if (wcount && TinyLFU.window_ratio*100 > server.maxmemory_tinylfu_window) {
+        /* The window is too big, so the main segment is not full: the
+         * window candidate is admitted only if it is more frequently used
+         * than the main victim, that is evicted in its place. The other
+         * sampled window keys that are not less frequently used than the
+         * main victim enter the main segment as well, so that the window
+         * shrinks to its size even after a burst of new keys. */
+        candidate = tinylfuWindowCandidate(wsamples,wcount,&wfreq);
+        if (wfreq <= mfreq) {
+            tinylfuAdmit(wsamples,wcount,candidate,mfreq);
+            server.stat_tinylfu_rejected++;
+            *bestdbid = wsamples[candidate].dbid;
+            return wsamples[candidate].key;
+        }
+        tinylfuAdmit(wsamples,wcount,-1,mfreq);
+    }
+
+    /* Evict the main segment victim. */
+    *bestdbid = pool[k].dbid;
+    if (pool[k].key != pool[k].cached) sdsfree(pool[k].key);
+    pool[k].key = NULL;
+    pool[k].idle = 0;
+    return dictGetKey(mde);
+}
+
 /* We don't want to count AOF buffers and slaves output buffers as
  * used memory: the eviction should use mostly data size. This function
- * returns the sum of AOF and slaves buffer. */
+ * returns the sum of AOF and slaves buffer, plus the memory that the
+ * pending lazy free jobs are going to release. */
 size_t freeMemoryGetNotCountedMemory(void) {
     size_t overhead = 0;
-    int slaves = listLength(server.slaves);
 
-    if (slaves) {
-        listIter li;
-        listNode *ln;
-
-        listRewind(server.slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = listNodeValue(ln);
-            overhead += getClientOutputBufferMemoryUsage(slave);
+    /* Since all replicas and the replication backlog share the replication
+     * buffer, only the part exceeding the backlog size is the separate
+     * consumption of the replicas. The backlog itself is counted: it grows
+     * up to its size and then remains constant. */
+    if ((long long)server.repl_buffer_mem > server.repl_backlog_size) {
+        /* The backlog also uses the memory of the list nodes and block
+         * headers, we only know their approximate number. */
+        size_t extra_approx_size =
+            (server.repl_backlog_size/PROTO_REPLY_CHUNK_BYTES + 1) *
+            (sizeof(replBufBlock)+sizeof(listNode));
+        size_t counted_mem = server.repl_backlog_size + extra_approx_size;
+        if (server.repl_buffer_mem > counted_mem) {
+            overhead += (server.repl_buffer_mem - counted_mem);
         }
     }
     if (server.aof_state != AOF_OFF) {
-        overhead += sdsalloc(server.aof_buf)+aofRewriteBufferSize();
+        overhead += sdsalloc(server.aof_buf);
     }
+    overhead += lazyfreeGetPendingMemory();
     return overhead;
 }
 
@@ -544,12 +1271,19 @@ int performEvictions(void) {
         dict *dict;
         dictEntry *de;
 
-        if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
+        if (server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU) {
+            bestkey = tinylfuBestKey(&bestdbid);
+        }
+
+        else if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
             server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
         {
             struct evictionPoolEntry *pool = EvictionPoolLRU;
 
-            while (bestkey == NULL) {
+            if (server.maxmemory_eviction_candidates)
+                bestkey = evictionCandidatesBestKey(&bestdbid);
+
+            while (bestkey == NULL && !server.maxmemory_eviction_candidates) {
                 unsigned long total_keys = 0, keys;
 
                 /* We don't want to make local-db choices when expiring keys,
@@ -31,6 +31,185 @@
  */
 
 #include "server.h"
+#include "endianconv.h"
+
+/*-----------------------------------------------------------------------------
+ * Deadline index of the keys with an expire.
+ *
+ * When active-expire-index is enabled, every database also tracks the keys
+ * with an expire set in a radix tree ordered by deadline: the elements are
+ * the expire time, as a 64 bit big endian integer, followed by the key name,
+ * so that the tree can be walked from the first element to find exactly the
+ * keys that are due, instead of sampling db->expires at random. The index is
+ * updated by setExpire() and dbDeleteExpire(), which are the only places
+ * where keys are added to or removed from db->expires.
+ *----------------------------------------------------------------------------*/
+
+#define EXPIRE_INDEX_STATIC_KEY 128 /* Stack buffer for index elements. */
+#define EXPIRE_INDEX_BATCH 64 /* Due keys collected per index walk. */
+
+/* Populate 'buf' with the index element of 'key' expiring at 'when', and
+ * return it. If 'buf' is too small a new buffer is allocated and returned:
+ * the caller should free it if it is not the one passed. */
+static unsigned char *expireIndexElement(unsigned char *buf, size_t bufsize,
+                                         sds key, long long when, size_t *len)
+{
+    size_t keylen = sdslen(key);
+    uint64_t deadline = when < 0 ? 0 : (uint64_t)when;
+
+    *len = sizeof(deadline)+keylen;
+    if (*len > bufsize) buf = zmalloc(*len);
+    deadline = htonu64(deadline);
+    memcpy(buf,&deadline,sizeof(deadline));
+    memcpy(buf+sizeof(deadline),key,keylen);
+    return buf;
+}
+
+/* Add 'key' with the deadline 'when' to the index of the db, if any. */
+void expireIndexAdd(redisDb *db, sds key, long long when) {
+    unsigned char buf[EXPIRE_INDEX_STATIC_KEY], *ele;
+    size_t len;
+
+    if (db->expires_index == NULL) return;
+    ele = expireIndexElement(buf,sizeof(buf),key,when,&len);
+    if (raxTryInsert(db->expires_index,ele,len,NULL,NULL))
+        db->expires_index_bytes += len;
+    if (ele != buf) zfree(ele);
+}
+
+/* Remove 'key' with the deadline 'when' from the index of the db, if any. */
+void expireIndexDel(redisDb *db, sds key, long long when) {
+    unsigned char buf[EXPIRE_INDEX_STATIC_KEY], *ele;
+    size_t len;
+
+    if (db->expires_index == NULL) return;
+    ele = expireIndexElement(buf,sizeof(buf),key,when,&len);
+    if (raxRemove(db->expires_index,ele,len,NULL))
+        db->expires_index_bytes -= len;
+    if (ele != buf) zfree(ele);
+}
+
+/* Create the index of the db, populating it from db->expires. This is
+ * O(N) in the number of keys with an expire, it only happens when
+ * active-expire-index is turned on at runtime. */
+void expireIndexBuild(redisDb *db) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (db->expires_index) return;
+    db->expires_index = raxNew();
+    db->expires_index_bytes = 0;
+    di = dictGetIterator(db->expires);
+    while ((de = dictNext(di)) != NULL)
+        expireIndexAdd(db,dictGetKey(de),dictGetSignedIntegerVal(de));
+    dictReleaseIterator(di);
+}
+
+/* Release the index of the db, if any, in a background thread if 'async'
+ * is true. */
+void expireIndexRelease(redisDb *db, int async) {
+    if (db->expires_index == NULL) return;
+    if (async)
+        freeExpireIndexAsync(db->expires_index);
+    else
+        raxFree(db->expires_index);
+    db->expires_index = NULL;
+    db->expires_index_bytes = 0;
+}
+
+/* Called when all the keys of the db were removed: replace the index, if
+ * any, with an empty one. */
+void expireIndexReset(redisDb *db, int async) {
+    if (db->expires_index == NULL) return;
+    expireIndexRelease(db,async);
+    db->expires_index = raxNew();
+}
+
+/* Return an estimate of the memory used by the index of the db: the
+ * element bytes are an upper bound since the rax shares the common
+ * prefixes, plus the node headers with their child and value pointers. */
+size_t expireIndexMemory(redisDb *db) {
+    if (db->expires_index == NULL) return 0;
+    return db->expires_index_bytes +
+           db->expires_index->numnodes*(sizeof(raxNode)+sizeof(void*)*2);
+}
+
+/*-----------------------------------------------------------------------------
+ * Batched expiry.
+ *
+ * When active-expire-batch-size is greater than zero, the active expire
+ * cycle does not delete and propagate the expired keys one by one: keys are
+ * unlinked from the keyspace as they are found (so they are logically gone
+ * and their events are fired right away), and every batch of keys is then
+ * propagated to AOF and replicas with a single UNLINK command, while the
+ * values are released by the lazyfree thread with a single job. This way
+ * a mass expire event does not turn into as many DEL commands in the
+ * replication stream and as many synchronous frees in the main thread.
+ *
+ * Batching is skipped when modules subscribed to expired events, since
+ * they may write to the keyspace from the notification callback, and such
+ * writes must be propagated after the expire of the key.
+ *----------------------------------------------------------------------------*/
+
+static struct {
+    int size;       /* Keys per batch, 0 when batching is off. */
+    redisDb *db;    /* DB of the keys in the batch. */
+    int numkeys;
+    int numvals;
+    robj *keys[ACTIVE_EXPIRE_BATCH_MAX];
+    robj *vals[ACTIVE_EXPIRE_BATCH_MAX];
+} expireBatch;
+
+/* Propagate the keys in the batch, and release them and their values. */
+static void expireBatchFlush(void) {
+    if (expireBatch.numkeys == 0) return;
+
+    robj **argv = zmalloc(sizeof(robj*)*(expireBatch.numkeys+1));
+    argv[0] = shared.unlink;
+    memcpy(argv+1,expireBatch.keys,sizeof(robj*)*expireBatch.numkeys);
+
+    /* Like propagateExpire(), propagate no matter what. */
+    int prev_replication_allowed = server.replication_allowed;
+    server.replication_allowed = 1;
+    propagate(server.delCommand,expireBatch.db->id,argv,expireBatch.numkeys+1,
+              PROPAGATE_AOF|PROPAGATE_REPL);
+    server.replication_allowed = prev_replication_allowed;
+    zfree(argv);
+
+    freeObjectsAsync(expireBatch.vals,expireBatch.numvals);
+    for (int j = 0; j < expireBatch.numkeys; j++)
+        decrRefCount(expireBatch.keys[j]);
+    expireBatch.numkeys = 0;
+    expireBatch.numvals = 0;
+}
+
+/* Expire 'keyobj' as deleteExpiredKeyAndPropagate() does, but defer the
+ * propagation and the release of the value to expireBatchFlush(). */
+static void expireBatchAdd(redisDb *db, robj *keyobj) {
+    mstime_t expire_latency;
+
+    if (expireBatch.db != db) expireBatchFlush();
+    expireBatch.db = db;
+
+    latencyStartMonitor(expire_latency);
+    robj *val = dbUnlinkValue(db,keyobj);
+    latencyEndMonitor(expire_latency);
+    latencyAddSampleIfNeeded("expire-del",expire_latency);
+    notifyKeyspaceEvent(NOTIFY_EXPIRED,"expired",keyobj,db->id);
+    signalModifiedKey(NULL, db, keyobj);
+    server.stat_expiredkeys++;
+
+    incrRefCount(keyobj);
+    expireBatch.keys[expireBatch.numkeys++] = keyobj;
+    if (val) {
+        /* Shared values can only be released by the main thread. */
+        if (val->refcount == 1)
+            expireBatch.vals[expireBatch.numvals++] = val;
+        else
+            decrRefCount(val);
+    }
+    if (expireBatch.numkeys >= expireBatch.size) expireBatchFlush();
+}
 
 /*-----------------------------------------------------------------------------
  * Incremental collection of expired keys.
@@ -56,7 +235,10 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
     if (now > t) {
         sds key = dictGetKey(de);
         robj *keyobj = createStringObject(key,sdslen(key));
-        deleteExpiredKeyAndPropagate(db,keyobj);
+        if (expireBatch.size)
+            expireBatchAdd(db,keyobj);
+        else
+            deleteExpiredKeyAndPropagate(db,keyobj);
         decrRefCount(keyobj);
         return 1;
     } else {
@@ -110,6 +292,44 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
 #define ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE 10 /* % of stale keys after which
                                                    we do extra efforts. */
 
+/* Expire the keys that are due in the db walking its deadline index, in
+ * batches of EXPIRE_INDEX_BATCH keys. Returns 1 if the cycle stopped because
+ * of the time limit, with more keys due, otherwise 0. */
+static int activeExpireIndexCycle(redisDb *db, long long start, long long timelimit) {
+    robj *keys[EXPIRE_INDEX_BATCH];
+    long long now = mstime();
+    int iteration = 0;
+
+    while (1) {
+        raxIterator ri;
+        int count = 0, j;
+
+        /* Keys are deleted while we expire them, so collect a batch first
+         * and walk the tree again from the start for the next batch. */
+        raxStart(&ri,db->expires_index);
+        raxSeek(&ri,"^",NULL,0);
+        while (count < EXPIRE_INDEX_BATCH && raxNext(&ri)) {
+            uint64_t deadline;
+            memcpy(&deadline,ri.key,sizeof(deadline));
+            deadline = ntohu64(deadline);
+            if ((long long)deadline >= now) break;
+            keys[count++] = createStringObject((char*)ri.key+sizeof(deadline),
+                                               ri.key_len-sizeof(deadline));
+        }
+        raxStop(&ri);
+
+        for (j = 0; j < count; j++) {
+            dictEntry *de = dictFind(db->expires,keys[j]->ptr);
+            serverAssertWithInfo(NULL,keys[j],de != NULL);
+            activeExpireCycleTryExpire(db,de,now);
+            decrRefCount(keys[j]);
+        }
+        if (count < EXPIRE_INDEX_BATCH) return 0;
+
+        if ((++iteration & 0x3) == 0 && ustime()-start > timelimit) return 1;
+    }
+}
+
 void activeExpireCycle(int type) {
     /* Adjust the running parameters according to the configured expire
      * effort. The default effort is 1, and the maximum configurable effort
@@ -176,6 +396,10 @@ void activeExpireCycle(int type) {
     if (type == ACTIVE_EXPIRE_CYCLE_FAST)
         timelimit = config_cycle_fast_duration; /* in microseconds. */
 
+    expireBatch.size = server.active_expire_batch_size;
+    if (expireBatch.size && moduleHasKeyspaceSubscribers(NOTIFY_EXPIRED))
+        expireBatch.size = 0;
+
     /* Accumulate some global stats as we expire keys, to have some idea
      * about the number of keys that are already logically expired, but still
      * existing inside the database. */
@@ -193,6 +417,19 @@ void activeExpireCycle(int type) {
          * distribute the time evenly across DBs. */
         current_db++;
 
+        /* With the deadline index we know exactly which keys are due, so
+         * there is nothing to sample: expire them all, then only do a
+         * single sampling round below to keep the average TTL updated. */
+        int sample_once = 0;
+        if (db->expires_index) {
+            if (activeExpireIndexCycle(db,start,timelimit)) {
+                timelimit_exit = 1;
+                server.stat_expired_time_cap_reached_count++;
+                break;
+            }
+            sample_once = 1;
+        }
+
         /* Continue to expire if at the end of the cycle there are still
          * a big percentage of keys to expire, compared to the number of keys
          * we scanned. The percentage, stored in config_cycle_acceptable_stale
@@ -298,10 +535,13 @@ void activeExpireCycle(int type) {
             /* We don't repeat the cycle for the current database if there are
              * an acceptable amount of stale keys (logically expired but yet
              * not reclaimed). */
-        } while (sampled == 0 ||
-                 (expired*100/sampled) > config_cycle_acceptable_stale);
+        } while (!sample_once && (sampled == 0 ||
+                 (expired*100/sampled) > config_cycle_acceptable_stale));
     }
 
+    expireBatchFlush();
+    expireBatch.size = 0;
+
     elapsed = ustime()-start;
     server.stat_expire_cycle_time_used += elapsed;
     latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
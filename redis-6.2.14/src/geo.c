@@ -209,62 +209,107 @@ void addReplyDoubleDistance(client *c, double d) {
     addReplyBulkCBuffer(c, dbuf, dlen);
 }
 
-/* Helper function for geoGetPointsInRange(): given a sorted set score
- * representing a point, and a GeoShape, appends this entry as a geoPoint
- * into the specified geoArray only if the point is within the search area.
+/* Points read from the sorted set are not tested against the search shape
+ * one by one: they are collected in batches of GEO_BATCH_SIZE entries, the
+ * whole batch is decoded and filtered by geohashGetDistanceIfInShapeBatch(),
+ * and only the points that are part of the result get their member copied.
+ * The same batch can be tested against multiple shapes (see GEOMSEARCH). */
+#define GEO_BATCH_SIZE 64
+
+typedef struct geoBatch {
+    int count;
+    double score[GEO_BATCH_SIZE];
+    double lon[GEO_BATCH_SIZE];
+    double lat[GEO_BATCH_SIZE];
+    double dist[GEO_BATCH_SIZE];
+    unsigned char inside[GEO_BATCH_SIZE];
+    unsigned char *eptr[GEO_BATCH_SIZE]; /* Ziplist encoding. */
+    sds ele[GEO_BATCH_SIZE];             /* Skiplist encoding. */
+} geoBatch;
+
+/* Return a new sds string with the member of the i-th entry of the batch. */
+static sds geoBatchMember(geoBatch *b, int i) {
+    if (b->ele[i]) return sdsdup(b->ele[i]);
+
+    unsigned char *vstr = NULL;
+    unsigned int vlen = 0;
+    long long vlong = 0;
+    /* We know the element exists. ziplistGet should always succeed */
+    ziplistGet(b->eptr[i], &vstr, &vlen, &vlong);
+    return (vstr == NULL) ? sdsfromlonglong(vlong) : sdsnewlen(vstr,vlen);
+}
+
+/* Test the points in the batch against every shape, appending the ones
+ * that are within shapes[j] as geoPoint entries into gas[j], up to 'limit'
+ * entries per array if limit is not zero. The batch is emptied.
  *
- * returns C_OK if the point is included, or REIDS_ERR if it is outside. */
-int geoAppendIfWithinShape(geoArray *ga, GeoShape *shape, double score, sds member) {
-    double distance = 0, xy[2];
-
-    if (!decodeGeohash(score,xy)) return C_ERR; /* Can't decode. */
-    /* Note that geohashGetDistanceIfInRadiusWGS84() takes arguments in
-     * reverse order: longitude first, latitude later. */
-    if (shape->type == CIRCULAR_TYPE) {
-        if (!geohashGetDistanceIfInRadiusWGS84(shape->xy[0], shape->xy[1], xy[0], xy[1],
-                                               shape->t.radius*shape->conversion, &distance)) return C_ERR;
-    } else if (shape->type == RECTANGLE_TYPE) {
-        if (!geohashGetDistanceIfInRectangle(shape->t.r.width * shape->conversion,
-                                             shape->t.r.height * shape->conversion,
-                                             shape->xy[0], shape->xy[1], xy[0], xy[1], &distance))
-            return C_ERR;
+ * Returns 1 if every array reached the limit, so that the caller can stop
+ * scanning the sorted set, otherwise 0 is returned. */
+static int geoBatchFlush(geoBatch *b, GeoShape **shapes, geoArray **gas,
+                         int numshapes, unsigned long limit)
+{
+    int i, j, valid = 0, full = 1;
+
+    for (i = 0; i < b->count; i++) {
+        double xy[2];
+        if (!decodeGeohash(b->score[i],xy)) continue; /* Can't decode. */
+        b->score[valid] = b->score[i];
+        b->eptr[valid] = b->eptr[i];
+        b->ele[valid] = b->ele[i];
+        b->lon[valid] = xy[0];
+        b->lat[valid] = xy[1];
+        valid++;
     }
 
-    /* Append the new element. */
-    geoPoint *gp = geoArrayAppend(ga);
-    gp->longitude = xy[0];
-    gp->latitude = xy[1];
-    gp->dist = distance;
-    gp->member = member;
-    gp->score = score;
-    return C_OK;
+    for (j = 0; j < numshapes; j++) {
+        geoArray *ga = gas[j];
+        if (limit && ga->used >= limit) continue;
+        if (geohashGetDistanceIfInShapeBatch(shapes[j], valid, b->lon, b->lat,
+                                             b->dist, b->inside))
+        {
+            for (i = 0; i < valid; i++) {
+                if (!b->inside[i]) continue;
+                geoPoint *gp = geoArrayAppend(ga);
+                gp->longitude = b->lon[i];
+                gp->latitude = b->lat[i];
+                gp->dist = b->dist[i];
+                gp->member = geoBatchMember(b,i);
+                gp->score = b->score[i];
+                if (limit && ga->used >= limit) break;
+            }
+        }
+        if (!limit || ga->used < limit) full = 0;
+    }
+    b->count = 0;
+    return full;
 }
 
 /* Query a Redis sorted set to extract all the elements between 'min' and
- * 'max', appending them into the array of geoPoint structures 'gparray'.
- * The command returns the number of elements added to the array.
- *
- * Elements which are farest than 'radius' from the specified 'x' and 'y'
- * coordinates are not included.
+ * 'max', appending the ones within shapes[j] into the array of geoPoint
+ * structures gas[j]. The command returns the number of elements added
+ * to the arrays.
  *
  * The ability of this function to append to an existing set of points is
  * important for good performances because querying by radius is performed
  * using multiple queries to the sorted set, that we later need to sort
  * via qsort. Similarly we need to be able to reject points outside the search
  * radius area ASAP in order to allocate and process more points than needed. */
-int geoGetPointsInRange(robj *zobj, double min, double max, GeoShape *shape, geoArray *ga, unsigned long limit) {
+int geoGetPointsInRange(robj *zobj, double min, double max, GeoShape **shapes,
+                        geoArray **gas, int numshapes, unsigned long limit)
+{
     /* minex 0 = include min in range; maxex 1 = exclude max in range */
     /* That's: min <= val < max */
     zrangespec range = { .min = min, .max = max, .minex = 0, .maxex = 1 };
-    size_t origincount = ga->used;
-    sds member;
+    size_t origincount = 0, addedcount = 0;
+    geoBatch batch;
+    int full = 0, j;
+
+    batch.count = 0;
+    for (j = 0; j < numshapes; j++) origincount += gas[j]->used;
 
     if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
-        unsigned char *vstr = NULL;
-        unsigned int vlen = 0;
-        long long vlong = 0;
         double score = 0;
 
         if ((eptr = zzlFirstInRange(zl, &range)) == NULL) {
@@ -280,13 +325,12 @@ int geoGetPointsInRange(robj *zobj, double min, double max, GeoShape *shape, geo
             if (!zslValueLteMax(score, &range))
                 break;
 
-            /* We know the element exists. ziplistGet should always succeed */
-            ziplistGet(eptr, &vstr, &vlen, &vlong);
-            member = (vstr == NULL) ? sdsfromlonglong(vlong) :
-                                      sdsnewlen(vstr,vlen);
-            if (geoAppendIfWithinShape(ga,shape,score,member)
-                == C_ERR) sdsfree(member);
-            if (ga->used && limit && ga->used >= limit) break;
+            batch.score[batch.count] = score;
+            batch.eptr[batch.count] = eptr;
+            batch.ele[batch.count] = NULL;
+            if (++batch.count == GEO_BATCH_SIZE &&
+                (full = geoBatchFlush(&batch,shapes,gas,numshapes,limit)))
+                break;
             zzlNext(zl, &eptr, &sptr);
         }
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -300,19 +344,23 @@ int geoGetPointsInRange(robj *zobj, double min, double max, GeoShape *shape, geo
         }
 
         while (ln) {
-            sds ele = ln->ele;
             /* Abort when the node is no longer in range. */
             if (!zslValueLteMax(ln->score, &range))
                 break;
 
-            ele = sdsdup(ele);
-            if (geoAppendIfWithinShape(ga,shape,ln->score,ele)
-                == C_ERR) sdsfree(ele);
-            if (ga->used && limit && ga->used >= limit) break;
+            batch.score[batch.count] = ln->score;
+            batch.eptr[batch.count] = NULL;
+            batch.ele[batch.count] = ln->ele;
+            if (++batch.count == GEO_BATCH_SIZE &&
+                (full = geoBatchFlush(&batch,shapes,gas,numshapes,limit)))
+                break;
             ln = ln->level[0].forward;
         }
     }
-    return ga->used - origincount;
+    if (!full && batch.count) geoBatchFlush(&batch,shapes,gas,numshapes,limit);
+
+    for (j = 0; j < numshapes; j++) addedcount += gas[j]->used;
+    return addedcount - origincount;
 }
 
 /* Compute the sorted set scores min (inclusive), max (exclusive) we should
@@ -344,73 +392,86 @@ void scoresOfGeoHashBox(GeoHashBits hash, GeoHashFix52Bits *min, GeoHashFix52Bit
     *max = geohashAlign52Bits(hash);
 }
 
-/* Obtain all members between the min/max of this geohash bounding box.
- * Populate a geoArray of GeoPoints by calling geoGetPointsInRange().
- * Return the number of points added to the array. */
-int membersOfGeoHashBox(robj *zobj, GeoHashBits hash, geoArray *ga, GeoShape *shape, unsigned long limit) {
-    GeoHashFix52Bits min, max;
+/* A [min, max) range of sorted set scores to scan. */
+typedef struct geoScoreRange {
+    GeoHashFix52Bits min;
+    GeoHashFix52Bits max;
+} geoScoreRange;
 
-    scoresOfGeoHashBox(hash,&min,&max);
-    return geoGetPointsInRange(zobj, min, max, shape, ga, limit);
+static int geoScoreRangeCompare(const void *a, const void *b) {
+    const geoScoreRange *ra = a, *rb = b;
+    if (ra->min < rb->min) return -1;
+    return ra->min > rb->min;
 }
 
-/* Search all eight neighbors + self geohash box */
-int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, GeoShape *shape, geoArray *ga, unsigned long limit) {
-    GeoHashBits neighbors[9];
-    unsigned int i, count = 0, last_processed = 0;
-    int debugmsg = 0;
-
-    neighbors[0] = n.hash;
-    neighbors[1] = n.neighbors.north;
-    neighbors[2] = n.neighbors.south;
-    neighbors[3] = n.neighbors.east;
-    neighbors[4] = n.neighbors.west;
-    neighbors[5] = n.neighbors.north_east;
-    neighbors[6] = n.neighbors.north_west;
-    neighbors[7] = n.neighbors.south_east;
-    neighbors[8] = n.neighbors.south_west;
-
-    /* For each neighbor (*and* our own hashbox), get all the matching
-     * members and add them to the potential result list. */
-    for (i = 0; i < sizeof(neighbors) / sizeof(*neighbors); i++) {
-        if (HASHISZERO(neighbors[i])) {
-            if (debugmsg) D("neighbors[%d] is zero",i);
-            continue;
-        }
+/* Append to 'ranges' the score ranges of the cells covering the shape (see
+ * geohashCoverShapeWGS84()), and return the number of ranges added, at most
+ * GEO_COVER_MAX_CELLS. Small sorted sets are ziplist encoded and are cheap to
+ * scan, so we only refine the covering for skiplist encoded ones, where
+ * every false positive costs a node visit and a distance computation. */
+static int geoCoveringRanges(robj *zobj, GeoShape *shape, const GeoHashRadius *n,
+                             geoScoreRange *ranges)
+{
+    GeoHashBits cells[GEO_COVER_MAX_CELLS];
+    int levels = zobj->encoding == OBJ_ENCODING_SKIPLIST ? GEO_COVER_MAX_LEVELS : 0;
+    int count = geohashCoverShapeWGS84(shape, n, levels, cells);
+
+    for (int i = 0; i < count; i++)
+        scoresOfGeoHashBox(cells[i], &ranges[i].min, &ranges[i].max);
+    return count;
+}
 
-        /* Debugging info. */
-        if (debugmsg) {
-            GeoHashRange long_range, lat_range;
-            geohashGetCoordRange(&long_range,&lat_range);
-            GeoHashArea myarea = {{0}};
-            geohashDecode(long_range, lat_range, neighbors[i], &myarea);
-
-            /* Dump center square. */
-            D("neighbors[%d]:\n",i);
-            D("area.longitude.min: %f\n", myarea.longitude.min);
-            D("area.longitude.max: %f\n", myarea.longitude.max);
-            D("area.latitude.min: %f\n", myarea.latitude.min);
-            D("area.latitude.max: %f\n", myarea.latitude.max);
-            D("\n");
+/* Coalesce the consecutive ranges that overlap or are contiguous: sibling
+ * cells of the covering are often adjacent in the score space, and every
+ * range we save is a sorted set lookup. Returns the new count.
+ *
+ * The covering lists the cells of the center box first, then the ones of
+ * the neighbors, each group in ascending order. Without 'sort' this order
+ * is retained, so that unsorted replies still start from the points near
+ * the center as they always did. With 'sort' the ranges are sorted first,
+ * which is needed to merge the overlapping coverings of multiple shapes. */
+static int geoMergeScoreRanges(geoScoreRange *ranges, int count, int sort) {
+    int i, j = 0;
+
+    if (count == 0) return 0;
+    if (sort) qsort(ranges, count, sizeof(geoScoreRange), geoScoreRangeCompare);
+    for (i = 1; i < count; i++) {
+        if (ranges[i].min >= ranges[j].min && ranges[i].min <= ranges[j].max) {
+            if (ranges[i].max > ranges[j].max) ranges[j].max = ranges[i].max;
+        } else {
+            ranges[++j] = ranges[i];
         }
+    }
+    return j + 1;
+}
 
-        /* When a huge Radius (in the 5000 km range or more) is used,
-         * adjacent neighbors can be the same, leading to duplicated
-         * elements. Skip every range which is the same as the one
-         * processed previously. */
-        if (last_processed &&
-            neighbors[i].bits == neighbors[last_processed].bits &&
-            neighbors[i].step == neighbors[last_processed].step)
-        {
-            if (debugmsg)
-                D("Skipping processing of %d, same as previous\n",i);
-            continue;
-        }
-        if (ga->used && limit && ga->used >= limit) break;
-        count += membersOfGeoHashBox(zobj, neighbors[i], ga, shape, limit);
-        last_processed = i;
+/* Scan the merged score ranges testing every point against all the shapes,
+ * see geoGetPointsInRange(). Returns the number of points added. */
+static int membersOfScoreRanges(robj *zobj, geoScoreRange *ranges, int count,
+                                GeoShape **shapes, geoArray **gas, int numshapes,
+                                unsigned long limit)
+{
+    int added = 0;
+
+    for (int i = 0; i < count; i++) {
+        int j;
+        for (j = 0; j < numshapes; j++)
+            if (!limit || gas[j]->used < limit) break;
+        if (j == numshapes) break; /* Every array reached the limit. */
+        added += geoGetPointsInRange(zobj, ranges[i].min, ranges[i].max,
+                                     shapes, gas, numshapes, limit);
     }
-    return count;
+    return added;
+}
+
+/* Search all eight neighbors + self geohash box, as refined by the cell
+ * covering of the shape. */
+int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, GeoShape *shape, geoArray *ga, unsigned long limit) {
+    geoScoreRange ranges[GEO_COVER_MAX_CELLS];
+    int count = geoCoveringRanges(zobj, shape, &n, ranges);
+
+    count = geoMergeScoreRanges(ranges, count, 0);
+    return membersOfScoreRanges(zobj, ranges, count, &shape, &ga, 1, limit);
 }
 
 /* Sort comparators for qsort() */
@@ -499,6 +560,88 @@ void geoaddCommand(client *c) {
 #define SORT_ASC 1
 #define SORT_DESC 2
 
+/* Sort the search results as requested, and return the number of items to
+ * return to the user. When only the first 'count' items are needed, just
+ * that part of the array is sorted. */
+static long geoSortResults(geoArray *ga, int sort, long long count) {
+    long result_length = ga->used;
+    long returned_items = (count == 0 || result_length < count) ?
+                          result_length : count;
+
+    /* Process [optional] requested sorting */
+    if (sort != SORT_NONE) {
+        int (*sort_gp_callback)(const void *a, const void *b) = NULL;
+        if (sort == SORT_ASC) {
+            sort_gp_callback = sort_gp_asc;
+        } else if (sort == SORT_DESC) {
+            sort_gp_callback = sort_gp_desc;
+        }
+
+        if (returned_items == result_length) {
+            qsort(ga->array, result_length, sizeof(geoPoint), sort_gp_callback);
+        } else {
+            pqsort(ga->array, result_length, sizeof(geoPoint), sort_gp_callback,
+                0, (returned_items - 1));
+        }
+    }
+    return returned_items;
+}
+
+/* Reply with the first 'returned_items' points of the array, converting the
+ * distances to the unit of the query. The members are moved into the reply,
+ * and the array entries are left with a NULL member. */
+static void geoReplyResults(client *c, geoArray *ga, long returned_items,
+                            double conversion, int withdist, int withhash,
+                            int withcoords)
+{
+    long option_length = 0;
+
+    /* Our options are self-contained nested multibulk replies, so we
+     * only need to track how many of those nested replies we return. */
+    if (withdist)
+        option_length++;
+
+    if (withcoords)
+        option_length++;
+
+    if (withhash)
+        option_length++;
+
+    /* The array len we send is exactly result_length. The result is
+     * either all strings of just zset members  *or* a nested multi-bulk
+     * reply containing the zset member string _and_ all the additional
+     * options the user enabled for this request. */
+    addReplyArrayLen(c, returned_items);
+
+    /* Finally send results back to the caller */
+    int i;
+    for (i = 0; i < returned_items; i++) {
+        geoPoint *gp = ga->array+i;
+        gp->dist /= conversion; /* Fix according to unit. */
+
+        /* If we have options in option_length, return each sub-result
+         * as a nested multi-bulk.  Add 1 to account for result value
+         * itself. */
+        if (option_length)
+            addReplyArrayLen(c, option_length + 1);
+
+        addReplyBulkSds(c,gp->member);
+        gp->member = NULL;
+
+        if (withdist)
+            addReplyDoubleDistance(c, gp->dist);
+
+        if (withhash)
+            addReplyLongLong(c, gp->score);
+
+        if (withcoords) {
+            addReplyArrayLen(c, 2);
+            addReplyHumanLongDouble(c, gp->longitude);
+            addReplyHumanLongDouble(c, gp->latitude);
+        }
+    }
+}
+
 #define RADIUS_COORDS (1<<0)    /* Search around coordinates. */
 #define RADIUS_MEMBER (1<<1)    /* Search around member. */
 #define RADIUS_NOSTORE (1<<2)   /* Do not accept STORE/STOREDIST option. */
@@ -724,75 +867,12 @@ void georadiusGeneric(client *c, int srcKeyIndex, int flags) {
         return;
     }
 
-    long result_length = ga->used;
-    long returned_items = (count == 0 || result_length < count) ?
-                          result_length : count;
-    long option_length = 0;
-
-    /* Process [optional] requested sorting */
-    if (sort != SORT_NONE) {
-        int (*sort_gp_callback)(const void *a, const void *b) = NULL;
-        if (sort == SORT_ASC) {
-            sort_gp_callback = sort_gp_asc;
-        } else if (sort == SORT_DESC) {
-            sort_gp_callback = sort_gp_desc;
-        }
-
-        if (returned_items == result_length) {
-            qsort(ga->array, result_length, sizeof(geoPoint), sort_gp_callback);
-        } else {
-            pqsort(ga->array, result_length, sizeof(geoPoint), sort_gp_callback,
-                0, (returned_items - 1));
-        }
-    }
+    long returned_items = geoSortResults(ga, sort, count);
 
     if (storekey == NULL) {
         /* No target key, return results to user. */
-
-        /* Our options are self-contained nested multibulk replies, so we
-         * only need to track how many of those nested replies we return. */
-        if (withdist)
-            option_length++;
-
-        if (withcoords)
-            option_length++;
-
-        if (withhash)
-            option_length++;
-
-        /* The array len we send is exactly result_length. The result is
-         * either all strings of just zset members  *or* a nested multi-bulk
-         * reply containing the zset member string _and_ all the additional
-         * options the user enabled for this request. */
-        addReplyArrayLen(c, returned_items);
-
-        /* Finally send results back to the caller */
-        int i;
-        for (i = 0; i < returned_items; i++) {
-            geoPoint *gp = ga->array+i;
-            gp->dist /= shape.conversion; /* Fix according to unit. */
-
-            /* If we have options in option_length, return each sub-result
-             * as a nested multi-bulk.  Add 1 to account for result value
-             * itself. */
-            if (option_length)
-                addReplyArrayLen(c, option_length + 1);
-
-            addReplyBulkSds(c,gp->member);
-            gp->member = NULL;
-
-            if (withdist)
-                addReplyDoubleDistance(c, gp->dist);
-
-            if (withhash)
-                addReplyLongLong(c, gp->score);
-
-            if (withcoords) {
-                addReplyArrayLen(c, 2);
-                addReplyHumanLongDouble(c, gp->longitude);
-                addReplyHumanLongDouble(c, gp->latitude);
-            }
-        }
+        geoReplyResults(c, ga, returned_items, shape.conversion,
+                        withdist, withhash, withcoords);
     } else {
         /* Target key, create a sorted set with the results. */
         robj *zobj;
@@ -864,6 +944,131 @@ void geosearchstoreCommand(client *c) {
     georadiusGeneric(c, 2, GEOSEARCH|GEOSEARCHSTORE);
 }
 
+/* GEOMSEARCH key CENTERS numcenters long lat [long lat ...]
+ *                [BYRADIUS radius unit] [BYBOX width height unit]
+ *                [WITHCOORD] [WITHDIST] [WITHHASH] [COUNT count [ANY]] [ASC|DESC]
+ *
+ * Run the same GEOSEARCH for multiple centers at once, replying with an
+ * array of numcenters GEOSEARCH replies. The covering ranges of all the
+ * centers are merged before scanning the sorted set, so when the centers
+ * are close to each other (the common case of matching many requests in
+ * the same area) every point is read once and tested against all the
+ * shapes, instead of once per query. */
+void geomsearchCommand(client *c) {
+    int withdist = 0, withhash = 0, withcoords = 0;
+    int byradius = 0, bybox = 0, sort = SORT_NONE, any = 0;
+    long long count = 0, numcenters = 0;
+    int centers_idx = 0, i, j;
+    GeoShape shape = {0};
+
+    for (i = 2; i < c->argc; i++) {
+        char *arg = c->argv[i]->ptr;
+        int remaining = c->argc - i - 1;
+        if (!strcasecmp(arg, "withdist")) {
+            withdist = 1;
+        } else if (!strcasecmp(arg, "withhash")) {
+            withhash = 1;
+        } else if (!strcasecmp(arg, "withcoord")) {
+            withcoords = 1;
+        } else if (!strcasecmp(arg, "any")) {
+            any = 1;
+        } else if (!strcasecmp(arg, "asc")) {
+            sort = SORT_ASC;
+        } else if (!strcasecmp(arg, "desc")) {
+            sort = SORT_DESC;
+        } else if (!strcasecmp(arg, "count") && remaining >= 1) {
+            if (getLongLongFromObjectOrReply(c, c->argv[i+1], &count, NULL) != C_OK)
+                return;
+            if (count <= 0) {
+                addReplyError(c,"COUNT must be > 0");
+                return;
+            }
+            i++;
+        } else if (!strcasecmp(arg, "centers") && remaining >= 1 && !centers_idx) {
+            if (getLongLongFromObjectOrReply(c, c->argv[i+1], &numcenters, NULL) != C_OK)
+                return;
+            if (numcenters <= 0 || numcenters > (remaining-1)/2) {
+                addReplyError(c,"numcenters should be greater than 0 and match the number of long lat pairs");
+                return;
+            }
+            for (j = 0; j < numcenters; j++) {
+                double xy[2];
+                if (extractLongLatOrReply(c, c->argv+i+2+j*2, xy) == C_ERR) return;
+            }
+            centers_idx = i + 2;
+            i += 1 + numcenters*2;
+        } else if (!strcasecmp(arg, "byradius") && remaining >= 2 && !bybox) {
+            if (extractDistanceOrReply(c, c->argv+i+1, &shape.conversion, &shape.t.radius) != C_OK)
+                return;
+            shape.type = CIRCULAR_TYPE;
+            byradius = 1;
+            i += 2;
+        } else if (!strcasecmp(arg, "bybox") && remaining >= 3 && !byradius) {
+            if (extractBoxOrReply(c, c->argv+i+1, &shape.conversion, &shape.t.r.width,
+                    &shape.t.r.height) != C_OK) return;
+            shape.type = RECTANGLE_TYPE;
+            bybox = 1;
+            i += 3;
+        } else {
+            addReplyErrorObject(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    if (!centers_idx) {
+        addReplyError(c,"the CENTERS argument is required for GEOMSEARCH");
+        return;
+    }
+    if (!(byradius || bybox)) {
+        addReplyError(c,"exactly one of BYRADIUS and BYBOX can be specified for GEOMSEARCH");
+        return;
+    }
+    if (any && !count) {
+        addReplyError(c,"the ANY argument requires COUNT argument");
+        return;
+    }
+
+    robj *zobj = lookupKeyRead(c->db, c->argv[1]);
+    if (checkType(c, zobj, OBJ_ZSET)) return;
+    addReplyArrayLen(c, numcenters);
+    if (zobj == NULL) {
+        for (j = 0; j < numcenters; j++) addReply(c,shared.emptyarray);
+        return;
+    }
+    if (count != 0 && sort == SORT_NONE && !any) sort = SORT_ASC;
+
+    GeoShape *shapes = zmalloc(sizeof(GeoShape)*numcenters);
+    GeoShape **shapeptrs = zmalloc(sizeof(GeoShape*)*numcenters);
+    geoArray **gas = zmalloc(sizeof(geoArray*)*numcenters);
+    geoScoreRange *ranges = zmalloc(sizeof(geoScoreRange)*GEO_COVER_MAX_CELLS*numcenters);
+    int numranges = 0;
+
+    for (j = 0; j < numcenters; j++) {
+        shapes[j] = shape;
+        /* Already validated while parsing the arguments. */
+        getDoubleFromObject(c->argv[centers_idx+j*2], &shapes[j].xy[0]);
+        getDoubleFromObject(c->argv[centers_idx+j*2+1], &shapes[j].xy[1]);
+        GeoHashRadius n = geohashCalculateAreasByShapeWGS84(&shapes[j]);
+        numranges += geoCoveringRanges(zobj, &shapes[j], &n, ranges+numranges);
+        shapeptrs[j] = &shapes[j];
+        gas[j] = geoArrayCreate();
+    }
+    numranges = geoMergeScoreRanges(ranges, numranges, 1);
+    membersOfScoreRanges(zobj, ranges, numranges, shapeptrs, gas, numcenters,
+                         any ? count : 0);
+
+    for (j = 0; j < numcenters; j++) {
+        long returned_items = geoSortResults(gas[j], sort, count);
+        geoReplyResults(c, gas[j], returned_items, shape.conversion,
+                        withdist, withhash, withcoords);
+        geoArrayFree(gas[j]);
+    }
+    zfree(ranges);
+    zfree(gas);
+    zfree(shapeptrs);
+    zfree(shapes);
+}
+
 /* GEOHASH key ele1 ele2 ... eleN
  *
  * Returns an array with an 11 characters geohash representation of the
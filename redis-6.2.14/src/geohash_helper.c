@@ -38,6 +38,7 @@
 #include "geohash_helper.h"
 #include "debugmacro.h"
 #include <math.h>
+#include <string.h>
 
 #define D_R (M_PI / 180.0)
 #define R_MAJOR 6378137.0
@@ -210,6 +211,127 @@ GeoHashRadius geohashCalculateAreasByShapeWGS84(GeoShape *shape) {
     return radius;
 }
 
+/* Return the distance in meters the covering code can safely treat as the
+ * radius of the shape: the circle radius, or the half diagonal of a box. */
+static double geohashShapeExtent(GeoShape *shape) {
+    double extent = shape->type == CIRCULAR_TYPE ? shape->t.radius :
+            sqrt((shape->t.r.width/2)*(shape->t.r.width/2) + (shape->t.r.height/2)*(shape->t.r.height/2));
+    return extent * shape->conversion;
+}
+
+/* Return 1 if the geohash cell 'hash' may contain points of 'shape', 0 if it
+ * is certainly outside. The test is conservative: the bounding box is padded
+ * by 1% and, for circles, the distance to the cell center is compared against
+ * an upper bound of the cell half diagonal. When the circle certainly covers
+ * the whole cell *inside is set to 1, so that the cell is not split further.
+ * shape->bounds must be already populated. */
+static int geohashCellIntersectsShape(GeoShape *shape, GeoHashBits hash, int *inside) {
+    GeoHashRange long_range, lat_range;
+    GeoHashArea area;
+    const double *b = shape->bounds;
+    double lat_pad = (b[3]-b[1])*0.01 + 1e-6;
+    double lon_pad = (b[2]-b[0])*0.01 + 1e-6;
+
+    *inside = 0;
+    geohashGetCoordRange(&long_range,&lat_range);
+    geohashDecode(long_range,lat_range,hash,&area);
+    if (area.latitude.max < b[1]-lat_pad || area.latitude.min > b[3]+lat_pad ||
+        area.longitude.max < b[0]-lon_pad || area.longitude.min > b[2]+lon_pad)
+        return 0;
+
+    if (shape->type == CIRCULAR_TYPE) {
+        double radius = shape->t.radius * shape->conversion;
+        double clon = (area.longitude.min + area.longitude.max) / 2;
+        double clat = (area.latitude.min + area.latitude.max) / 2;
+        /* Any point of the cell can be reached from its center moving along
+         * the parallel of the center, then along a meridian, so this path
+         * length bounds the great circle distance from above. */
+        double half = EARTH_RADIUS_IN_METERS *
+                      (deg_rad(area.latitude.max - area.latitude.min) / 2 +
+                       deg_rad(area.longitude.max - area.longitude.min) / 2 * cos(deg_rad(clat)));
+        double dist = geohashGetDistance(shape->xy[0],shape->xy[1],clon,clat);
+        half = half * 1.01 + 1;
+        if (dist - half > radius) return 0;
+        if (dist + half <= radius) *inside = 1;
+    }
+    return 1;
+}
+
+/* Compute the set of geohash cells to scan for a search of 'shape', starting
+ * from the center box and the 8 neighbors in 'n' as returned by
+ * geohashCalculateAreasByShapeWGS84(). Boxes that don't intersect the shape
+ * are dropped, and the remaining ones are split into their 4 children up to
+ * 'levels' times (max GEO_COVER_MAX_LEVELS), again dropping the children
+ * that fall outside the shape. This cuts the area scanned for a circle from
+ * up to 9 boxes as large as the radius to a ring of much smaller cells,
+ * that is, much less false positives to filter.
+ *
+ * Refinement only happens for shapes up to GEO_COVER_MAX_EXTENT meters
+ * whose bounding box does not cross the poles or the antimeridian. In the
+ * other cases the 9 boxes are returned unchanged (duplicates removed).
+ *
+ * The cells are grouped by box, center box first, and the children of a
+ * box are emitted in ascending geohash order, so the cells of each group
+ * are sorted. 'cells' must have room for GEO_COVER_MAX_CELLS entries.
+ * The number of cells populated is returned. */
+int geohashCoverShapeWGS84(GeoShape *shape, const GeoHashRadius *n, int levels,
+                           GeoHashBits *cells) {
+    const GeoHashBits boxes[9] = {
+        n->hash, n->neighbors.north, n->neighbors.south, n->neighbors.east,
+        n->neighbors.west, n->neighbors.north_east, n->neighbors.north_west,
+        n->neighbors.south_east, n->neighbors.south_west
+    };
+    const double *b = shape->bounds;
+    int inside[GEO_COVER_MAX_CELLS];
+    int count = 0, refine;
+
+    if (levels > GEO_COVER_MAX_LEVELS) levels = GEO_COVER_MAX_LEVELS;
+    refine = levels > 0 && geohashShapeExtent(shape) <= GEO_COVER_MAX_EXTENT &&
+             b[0] >= GEO_LONG_MIN && b[2] <= GEO_LONG_MAX &&
+             b[1] > GEO_LAT_MIN && b[3] < GEO_LAT_MAX;
+
+    for (int i = 0; i < 9; i++) {
+        int j, in = 0;
+
+        if (HASHISZERO(boxes[i])) continue;
+        /* With huge shapes adjacent neighbors can be the same box. */
+        for (j = 0; j < count; j++)
+            if (cells[j].bits == boxes[i].bits && cells[j].step == boxes[i].step)
+                break;
+        if (j != count) continue;
+        if (refine && !geohashCellIntersectsShape(shape,boxes[i],&in)) continue;
+        inside[count] = in;
+        cells[count++] = boxes[i];
+    }
+    if (!refine) return count;
+
+    while (levels--) {
+        GeoHashBits next[GEO_COVER_MAX_CELLS];
+        int nextin[GEO_COVER_MAX_CELLS];
+        int nextcount = 0;
+
+        for (int i = 0; i < count; i++) {
+            if (inside[i] || cells[i].step >= GEO_STEP_MAX) {
+                nextin[nextcount] = inside[i];
+                next[nextcount++] = cells[i];
+                continue;
+            }
+            for (uint64_t k = 0; k < 4; k++) {
+                GeoHashBits child = { .bits = (cells[i].bits << 2) | k,
+                                      .step = cells[i].step + 1 };
+                int in;
+                if (!geohashCellIntersectsShape(shape,child,&in)) continue;
+                nextin[nextcount] = in;
+                next[nextcount++] = child;
+            }
+        }
+        memcpy(cells,next,sizeof(GeoHashBits)*nextcount);
+        memcpy(inside,nextin,sizeof(int)*nextcount);
+        count = nextcount;
+    }
+    return count;
+}
+
 GeoHashFix52Bits geohashAlign52Bits(const GeoHashBits hash) {
     uint64_t bits = hash.bits;
     bits <<= (52 - hash.step * 2);
@@ -261,3 +383,69 @@ int geohashGetDistanceIfInRectangle(double width_m, double height_m, double x1,
     *distance = geohashGetDistance(x1, y1, x2, y2);
     return 1;
 }
+
+/* Test 'count' points, whose coordinates are in the 'lon' and 'lat' arrays,
+ * against the search shape. For every point inside[i] is set to 1 or 0, and
+ * for the points inside dist[i] is set to the distance from the center in
+ * meters. The number of points inside is returned.
+ *
+ * The results are exactly the ones of geohashGetDistanceIfInRadiusWGS84() and
+ * geohashGetDistanceIfInRectangle(), but the work is organized to reject
+ * the points outside the shape as cheaply as possible: a first pass over the
+ * whole batch drops the points too far in latitude (no trigonometry at all,
+ * the distance is at least R * |delta latitude|), and for circles the
+ * haversine term is compared with the one of the radius before paying for
+ * asin() and sqrt(). The cosine of the center latitude is computed once
+ * per batch instead of once per point. */
+int geohashGetDistanceIfInShapeBatch(GeoShape *shape, int count, const double *lon,
+                                     const double *lat, double *dist,
+                                     unsigned char *inside) {
+    double lat1r = deg_rad(shape->xy[1]);
+    double lon1r = deg_rad(shape->xy[0]);
+    double half_height = shape->type == CIRCULAR_TYPE ?
+                         shape->t.radius * shape->conversion :
+                         shape->t.r.height * shape->conversion / 2;
+    double band = half_height / EARTH_RADIUS_IN_METERS * (1 + 1e-9);
+    int i, found = 0;
+
+    for (i = 0; i < count; i++)
+        inside[i] = fabs(deg_rad(lat[i]) - lat1r) <= band;
+
+    if (shape->type == RECTANGLE_TYPE) {
+        double width = shape->t.r.width * shape->conversion;
+        double height = shape->t.r.height * shape->conversion;
+        for (i = 0; i < count; i++) {
+            if (!inside[i]) continue;
+            inside[i] = geohashGetDistanceIfInRectangle(width, height,
+                            shape->xy[0], shape->xy[1], lon[i], lat[i], dist+i);
+            found += inside[i];
+        }
+        return found;
+    }
+
+    double radius = shape->t.radius * shape->conversion;
+    double cos_lat1 = cos(lat1r);
+    double angle = radius / EARTH_RADIUS_IN_METERS / 2;
+    double max_hav = 2; /* No prefilter for radii over half the globe. */
+    if (angle < M_PI/2) {
+        double s = sin(angle);
+        max_hav = s * s * (1 + 1e-9) + 1e-18;
+    }
+    for (i = 0; i < count; i++) {
+        if (!inside[i]) continue;
+        /* Same expression of geohashGetDistance(), so that the distances
+         * and the points on the border match the non batched code. */
+        double lat2r = deg_rad(lat[i]);
+        double u = sin((lat2r - lat1r) / 2);
+        double v = sin((deg_rad(lon[i]) - lon1r) / 2);
+        double a = u * u + cos_lat1 * cos(lat2r) * v * v;
+        if (a > max_hav) {
+            inside[i] = 0;
+            continue;
+        }
+        dist[i] = 2.0 * EARTH_RADIUS_IN_METERS * asin(sqrt(a));
+        inside[i] = dist[i] <= radius;
+        found += inside[i];
+    }
+    return found;
+}
@@ -47,10 +47,20 @@ typedef struct {
     GeoHashNeighbors neighbors;
 } GeoHashRadius;
 
+/* Cell covering of a search shape: the 9 boxes of GeoHashRadius, each one
+ * split up to GEO_COVER_MAX_LEVELS times into its 4 children. */
+#define GEO_COVER_MAX_LEVELS 2
+#define GEO_COVER_MAX_CELLS (9*4*4)
+/* Shapes larger than this (radius, or half diagonal for boxes) are not
+ * refined: the bounding box approximation gets too loose for them. */
+#define GEO_COVER_MAX_EXTENT 100000.0
+
 int GeoHashBitsComparator(const GeoHashBits *a, const GeoHashBits *b);
 uint8_t geohashEstimateStepsByRadius(double range_meters, double lat);
 int geohashBoundingBox(GeoShape *shape, double *bounds);
 GeoHashRadius geohashCalculateAreasByShapeWGS84(GeoShape *shape);
+int geohashCoverShapeWGS84(GeoShape *shape, const GeoHashRadius *n, int levels,
+                           GeoHashBits *cells);
 GeoHashFix52Bits geohashAlign52Bits(const GeoHashBits hash);
 double geohashGetDistance(double lon1d, double lat1d,
                           double lon2d, double lat2d);
@@ -62,5 +72,8 @@ int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double *distance);
 int geohashGetDistanceIfInRectangle(double width_m, double height_m, double x1, double y1,
                                     double x2, double y2, double *distance);
+int geohashGetDistanceIfInShapeBatch(GeoShape *shape, int count, const double *lon,
+                                     const double *lat, double *dist,
+                                     unsigned char *inside);
 
 #endif /* GEOHASH_HELPER_HPP_ */
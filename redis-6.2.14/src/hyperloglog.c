@@ -34,6 +34,10 @@
 #include <stdint.h>
 #include <math.h>
 
+#ifdef HAVE_AVX2
+#include <immintrin.h>
+#endif
+
 /* The Redis HyperLogLog implementation is based on the following ideas:
  *
  * * The use of a 64 bit hash function as proposed in [1], in order to estimate
@@ -515,10 +519,147 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
     return hllDenseSet(registers,index,count);
 }
 
+/* ====================== Dense registers vector kernels ===================== */
+
+/* With 6 bits per register, every group of 3 bytes of the dense
+ * representation holds exactly 4 registers, so the registers can be
+ * unpacked in fixed size groups instead of computing the byte offset and
+ * shift of every single register like HLL_DENSE_GET_REGISTER() does.
+ *
+ * When the CPU supports AVX2 (checked at runtime, see HLL_USE_AVX2) the
+ * kernels below unpack 32 registers per iteration. The generic versions
+ * are used otherwise, and can be forced with PFDEBUG SIMD OFF in order to
+ * test that both code paths produce the same results. */
+static int hll_simd_enabled = 1;
+
+#ifdef HAVE_AVX2
+#define HLL_USE_AVX2 (hll_simd_enabled && __builtin_cpu_supports("avx2"))
+#else
+#define HLL_USE_AVX2 0
+#endif
+
+/* Merge 'count' registers of the dense representation pointed by 'r'
+ * into the uint8_t array 'max' computing max[i] = MAX(max[i],r[i]).
+ * 'count' must be a multiple of 4. */
+static void hllMergeDenseGeneric(uint8_t *max, const uint8_t *r, int count) {
+    uint8_t val;
+    int j;
+
+    for (j = 0; j < count/4; j++) {
+        val = r[0] & 63;
+        if (val > max[0]) max[0] = val;
+        val = (r[0] >> 6 | r[1] << 2) & 63;
+        if (val > max[1]) max[1] = val;
+        val = (r[1] >> 4 | r[2] << 4) & 63;
+        if (val > max[2]) max[2] = val;
+        val = (r[2] >> 2) & 63;
+        if (val > max[3]) max[3] = val;
+        r += 3;
+        max += 4;
+    }
+}
+
+#ifdef HAVE_AVX2
+/* AVX2 version of hllMergeDenseGeneric() for the whole set of registers.
+ *
+ * Each iteration loads 32 bytes starting 4 bytes *before* the current
+ * group of 24 bytes (32 registers), so that the low 128 bit lane holds the
+ * first 12 bytes at offset 4 and the high lane the next 12 bytes at offset
+ * 0: a byte shuffle can then move every 3 bytes group into its own 32 bit
+ * word, where the 4 registers are isolated with shifts and masks. Reading
+ * before the registers is safe since they always follow the HLL header.
+ * The last group would read past the end of the registers, so it is
+ * handled by the generic code. */
+ATTRIBUTE_TARGET_AVX2
+static void hllMergeDenseAVX2(uint8_t *max, const uint8_t *r) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i mask0 = _mm256_set1_epi32(0x0000003f);
+    const __m256i mask1 = _mm256_set1_epi32(0x00003f00);
+    const __m256i mask2 = _mm256_set1_epi32(0x003f0000);
+    const __m256i mask3 = _mm256_set1_epi32(0x3f000000);
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS/32-1; j++) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(r-4));
+        x = _mm256_shuffle_epi8(x,shuffle);
+        __m256i r0 = _mm256_and_si256(x,mask0);
+        __m256i r1 = _mm256_and_si256(_mm256_slli_epi32(x,2),mask1);
+        __m256i r2 = _mm256_and_si256(_mm256_slli_epi32(x,4),mask2);
+        __m256i r3 = _mm256_and_si256(_mm256_slli_epi32(x,6),mask3);
+        __m256i regs = _mm256_or_si256(_mm256_or_si256(r0,r1),
+                                       _mm256_or_si256(r2,r3));
+        __m256i cur = _mm256_loadu_si256((const __m256i*)max);
+        _mm256_storeu_si256((__m256i*)max,_mm256_max_epu8(cur,regs));
+        r += 24;
+        max += 32;
+    }
+    hllMergeDenseGeneric(max,r,32);
+}
+#endif
+
+/* Merge the dense registers 'registers' into the uint8_t array 'max' of
+ * HLL_REGISTERS elements, computing max[i] = MAX(max[i],registers[i]).
+ * 'registers' must point inside an HLL string, after the header. */
+void hllMergeDense(uint8_t *max, uint8_t *registers) {
+    if (HLL_REGISTERS == 16384 && HLL_BITS == 6) {
+#ifdef HAVE_AVX2
+        if (HLL_USE_AVX2) {
+            hllMergeDenseAVX2(max,registers);
+            return;
+        }
+#endif
+        hllMergeDenseGeneric(max,registers,HLL_REGISTERS);
+    } else {
+        uint8_t val;
+        int i;
+
+        for (i = 0; i < HLL_REGISTERS; i++) {
+            HLL_DENSE_GET_REGISTER(val,registers,i);
+            if (val > max[i]) max[i] = val;
+        }
+    }
+}
+
+/* Pack the uint8_t array 'max' of HLL_REGISTERS elements into the dense
+ * registers 'registers', overwriting their old value. This is the inverse
+ * of hllMergeDense() against zeroed registers. */
+void hllDenseCompress(uint8_t *registers, uint8_t *max) {
+    int j;
+
+    if (HLL_REGISTERS == 16384 && HLL_BITS == 6) {
+        for (j = 0; j < HLL_REGISTERS/4; j++) {
+            registers[0] = max[0] | max[1] << 6;
+            registers[1] = max[1] >> 2 | max[2] << 4;
+            registers[2] = max[2] >> 4 | max[3] << 2;
+            registers += 3;
+            max += 4;
+        }
+    } else {
+        for (j = 0; j < HLL_REGISTERS; j++)
+            HLL_DENSE_SET_REGISTER(registers,j,max[j]);
+    }
+}
+
+void hllRawRegHisto(uint8_t *registers, int* reghisto);
+
 /* Compute the register histogram in the dense representation. */
 void hllDenseRegHisto(uint8_t *registers, int* reghisto) {
     int j;
 
+#ifdef HAVE_AVX2
+    /* Unpacking the registers with AVX2 and computing the histogram of
+     * the uint8_t registers is faster than the unrolled loop below. */
+    if (HLL_REGISTERS == 16384 && HLL_BITS == 6 && HLL_USE_AVX2) {
+        uint8_t raw[HLL_REGISTERS];
+        memset(raw,0,sizeof(raw));
+        hllMergeDenseAVX2(raw,registers);
+        hllRawRegHisto(raw,reghisto);
+        return;
+    }
+#endif
+
     /* Redis default is to use 16384 registers 6 bits each. The code works
      * with other values by modifying the defines, but for our target value
      * we take a faster path with unrolled loops. */
@@ -941,28 +1082,36 @@ void hllSparseRegHisto(uint8_t *sparse, int sparselen, int *invalid, int* reghis
  * computation, which is representation-specific, while all the rest is common. */
 
 /* Implements the register histogram calculation for uint8_t data type
- * which is only used internally as speedup for PFCOUNT with multiple keys. */
+ * which is only used internally as speedup for PFCOUNT with multiple keys.
+ *
+ * Most registers of an HLL share a few values, so incrementing a single
+ * histogram would serialize on the same counters: we update four partial
+ * histograms instead and sum them at the end. */
 void hllRawRegHisto(uint8_t *registers, int* reghisto) {
     uint64_t *word = (uint64_t*) registers;
     uint8_t *bytes;
+    int histo[4][64];
     int j;
 
+    memset(histo,0,sizeof(histo));
     for (j = 0; j < HLL_REGISTERS/8; j++) {
         if (*word == 0) {
-            reghisto[0] += 8;
+            histo[0][0] += 8;
         } else {
             bytes = (uint8_t*) word;
-            reghisto[bytes[0]]++;
-            reghisto[bytes[1]]++;
-            reghisto[bytes[2]]++;
-            reghisto[bytes[3]]++;
-            reghisto[bytes[4]]++;
-            reghisto[bytes[5]]++;
-            reghisto[bytes[6]]++;
-            reghisto[bytes[7]]++;
+            histo[0][bytes[0]]++;
+            histo[1][bytes[1]]++;
+            histo[2][bytes[2]]++;
+            histo[3][bytes[3]]++;
+            histo[0][bytes[4]]++;
+            histo[1][bytes[5]]++;
+            histo[2][bytes[6]]++;
+            histo[3][bytes[7]]++;
         }
         word++;
     }
+    for (j = 0; j < 64; j++)
+        reghisto[j] += histo[0][j] + histo[1][j] + histo[2][j] + histo[3][j];
 }
 
 /* Helper function sigma as defined in
@@ -1070,12 +1219,7 @@ int hllMerge(uint8_t *max, robj *hll) {
     int i;
 
     if (hdr->encoding == HLL_DENSE) {
-        uint8_t val;
-
-        for (i = 0; i < HLL_REGISTERS; i++) {
-            HLL_DENSE_GET_REGISTER(val,hdr->registers,i);
-            if (val > max[i]) max[i] = val;
-        }
+        hllMergeDense(max,hdr->registers);
     } else {
         uint8_t *p = hll->ptr, *end = p + sdslen(hll->ptr);
         long runlen, regval;
@@ -1107,6 +1251,177 @@ int hllMerge(uint8_t *max, robj *hll) {
     return C_OK;
 }
 
+/* ======================== Multi-key PFCOUNT cache ========================= */
+
+/* PFCOUNT with multiple keys can't use the cardinality cached in the HLL
+ * header, and has to merge all the HLLs every time. Since it is common to
+ * call it again and again with the same set of keys (for instance the last
+ * N days of daily HLLs), we remember the result for the last key sets used.
+ *
+ * Entries are identified by the DB id and the list of key names. An entry
+ * is dropped as soon as one of its keys is modified, via
+ * pfcountCacheInvalidateKey() called by signalModifiedKey(). Keys may also
+ * go away without being signaled (expired keys), so every entry also
+ * remembers the value objects of its keys, and it is only used if the
+ * keys still resolve to the very same objects. The number of entries is
+ * capped by the pfcount-cache-max-entries config. */
+typedef struct pfcountCacheEntry {
+    sds id;             /* DB id + key names, see pfcountCacheId(). */
+    int numkeys;
+    sds *keys;          /* Key names, used to unlink from the keys index. */
+    robj **vals;        /* Value of the keys when the entry was created. */
+    uint64_t card;      /* Cardinality of the union. */
+} pfcountCacheEntry;
+
+/* id -> pfcountCacheEntry. The id is owned by the entry. */
+static dictType pfcountCacheDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    NULL,                       /* val destructor */
+    NULL                        /* allow to expand */
+};
+
+/* Key name -> list of entries referencing the key. */
+static dictType pfcountCacheKeysDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL,                       /* val destructor */
+    NULL                        /* allow to expand */
+};
+
+static dict *PfcountCache = NULL;
+static dict *PfcountCacheKeys = NULL;
+
+/* Return the id of the key set specified by the PFCOUNT arguments. Key
+ * names are length prefixed so that different key sets never collide. */
+static sds pfcountCacheId(client *c) {
+    sds id = sdsfromlonglong(c->db->id);
+    int j;
+
+    for (j = 1; j < c->argc; j++) {
+        sds key = c->argv[j]->ptr;
+        uint32_t len = sdslen(key);
+        id = sdscatlen(id,&len,sizeof(len));
+        id = sdscatlen(id,key,sdslen(key));
+    }
+    return id;
+}
+
+/* Remove the entry from the cache and the keys index, and free it. */
+static void pfcountCacheRemove(pfcountCacheEntry *e) {
+    int j;
+
+    for (j = 0; j < e->numkeys; j++) {
+        dictEntry *de = dictFind(PfcountCacheKeys,e->keys[j]);
+        if (de) {
+            list *l = dictGetVal(de);
+            listNode *ln = listSearchKey(l,e);
+            if (ln) listDelNode(l,ln);
+            if (listLength(l) == 0) {
+                listRelease(l);
+                dictDelete(PfcountCacheKeys,e->keys[j]);
+            }
+        }
+        sdsfree(e->keys[j]);
+    }
+    dictDelete(PfcountCache,e->id);
+    sdsfree(e->id);
+    zfree(e->keys);
+    zfree(e->vals);
+    zfree(e);
+}
+
+/* Drop all the cached entries. */
+void pfcountCacheFlush(void) {
+    while (PfcountCache && dictSize(PfcountCache)) {
+        dictEntry *de = dictGetRandomKey(PfcountCache);
+        pfcountCacheRemove(dictGetVal(de));
+    }
+}
+
+/* Drop the cached entries involving 'key', in any DB. Called every time
+ * a key is modified, so it must be cheap when there is nothing cached. */
+void pfcountCacheInvalidateKey(robj *key) {
+    dictEntry *de;
+
+    if (PfcountCacheKeys == NULL || dictSize(PfcountCacheKeys) == 0) return;
+    while ((de = dictFind(PfcountCacheKeys,key->ptr)) != NULL) {
+        list *l = dictGetVal(de);
+        pfcountCacheRemove(listNodeValue(listFirst(l)));
+    }
+}
+
+/* Lookup the cached cardinality for the key set 'id', where 'vals' are
+ * the current values of the keys. Return 1 and set '*card' on hit,
+ * otherwise 0 is returned. */
+static int pfcountCacheLookup(sds id, robj **vals, int numkeys,
+                              uint64_t *card)
+{
+    pfcountCacheEntry *e;
+
+    if (PfcountCache == NULL) return 0;
+    if (server.pfcount_cache_max_entries == 0) {
+        pfcountCacheFlush();
+        return 0;
+    }
+    if ((e = dictFetchValue(PfcountCache,id)) == NULL) return 0;
+    if (memcmp(e->vals,vals,sizeof(robj*)*numkeys) != 0) {
+        pfcountCacheRemove(e);
+        return 0;
+    }
+    *card = e->card;
+    return 1;
+}
+
+/* Remember the cardinality 'card' for the key set 'id', taking ownership
+ * of 'id'. */
+static void pfcountCacheAdd(client *c, sds id, robj **vals, uint64_t card) {
+    pfcountCacheEntry *e;
+    int j;
+
+    if (server.pfcount_cache_max_entries == 0) {
+        sdsfree(id);
+        return;
+    }
+    if (PfcountCache == NULL) {
+        PfcountCache = dictCreate(&pfcountCacheDictType,NULL);
+        PfcountCacheKeys = dictCreate(&pfcountCacheKeysDictType,NULL);
+    }
+    while (dictSize(PfcountCache) >= server.pfcount_cache_max_entries) {
+        dictEntry *de = dictGetRandomKey(PfcountCache);
+        pfcountCacheRemove(dictGetVal(de));
+    }
+
+    e = zmalloc(sizeof(*e));
+    e->id = id;
+    e->numkeys = c->argc-1;
+    e->keys = zmalloc(sizeof(sds)*e->numkeys);
+    e->vals = zmalloc(sizeof(robj*)*e->numkeys);
+    memcpy(e->vals,vals,sizeof(robj*)*e->numkeys);
+    e->card = card;
+    for (j = 0; j < e->numkeys; j++) {
+        sds key = c->argv[j+1]->ptr;
+        dictEntry *de = dictFind(PfcountCacheKeys,key);
+        list *l;
+
+        if (de) {
+            l = dictGetVal(de);
+        } else {
+            l = listCreate();
+            dictAdd(PfcountCacheKeys,sdsdup(key),l);
+        }
+        listAddNodeTail(l,e);
+        e->keys[j] = sdsdup(key);
+    }
+    dictAdd(PfcountCache,id,e);
+}
+
 /* ========================== HyperLogLog commands ========================== */
 
 /* Create an HLL object. We always create the HLL using sparse encoding.
@@ -1228,29 +1543,51 @@ void pfcountCommand(client *c) {
      * the cardinality of the merge of the N HLLs specified. */
     if (c->argc > 2) {
         uint8_t max[HLL_HDR_SIZE+HLL_REGISTERS], *registers;
-        int j;
+        robj *static_vals[16], **vals = static_vals;
+        int j, numkeys = c->argc-1;
+        sds id;
+
+        /* Lookup all the keys first: if the same values were already
+         * merged by a previous call, the cached result is still valid. */
+        if (numkeys > 16) vals = zmalloc(sizeof(robj*)*numkeys);
+        for (j = 0; j < numkeys; j++)
+            vals[j] = lookupKeyRead(c->db,c->argv[j+1]);
+        id = pfcountCacheId(c);
+        if (pfcountCacheLookup(id,vals,numkeys,&card)) {
+            sdsfree(id);
+            addReplyLongLong(c,card);
+            goto cleanup;
+        }
 
         /* Compute an HLL with M[i] = MAX(M[i]_j). */
         memset(max,0,sizeof(max));
         hdr = (struct hllhdr*) max;
         hdr->encoding = HLL_RAW; /* Special internal-only encoding. */
         registers = max + HLL_HDR_SIZE;
-        for (j = 1; j < c->argc; j++) {
+        for (j = 0; j < numkeys; j++) {
             /* Check type and size. */
-            robj *o = lookupKeyRead(c->db,c->argv[j]);
+            robj *o = vals[j];
             if (o == NULL) continue; /* Assume empty HLL for non existing var.*/
-            if (isHLLObjectOrReply(c,o) != C_OK) return;
+            if (isHLLObjectOrReply(c,o) != C_OK) {
+                sdsfree(id);
+                goto cleanup;
+            }
 
             /* Merge with this HLL with our 'max' HLL by setting max[i]
              * to MAX(max[i],hll[i]). */
             if (hllMerge(registers,o) == C_ERR) {
+                sdsfree(id);
                 addReplyError(c,invalid_hll_err);
-                return;
+                goto cleanup;
             }
         }
 
         /* Compute cardinality of the resulting set. */
-        addReplyLongLong(c,hllCount(hdr,NULL));
+        card = hllCount(hdr,NULL);
+        pfcountCacheAdd(c,id,vals,card);
+        addReplyLongLong(c,card);
+cleanup:
+        if (vals != static_vals) zfree(vals);
         return;
     }
 
@@ -1359,13 +1696,20 @@ void pfmergeCommand(client *c) {
     }
 
     /* Write the resulting HLL to the destination HLL registers and
-     * invalidate the cached value. */
-    for (j = 0; j < HLL_REGISTERS; j++) {
-        if (max[j] == 0) continue;
-        hdr = o->ptr;
-        switch(hdr->encoding) {
-        case HLL_DENSE: hllDenseSet(hdr->registers,j,max[j]); break;
-        case HLL_SPARSE: hllSparseSet(o,j,max[j]); break;
+     * invalidate the cached value. The destination was merged as well, so
+     * 'max' is never smaller than its registers and the dense registers can
+     * be overwritten at once. */
+    hdr = o->ptr;
+    if (hdr->encoding == HLL_DENSE) {
+        hllDenseCompress(hdr->registers,max);
+    } else {
+        for (j = 0; j < HLL_REGISTERS; j++) {
+            if (max[j] == 0) continue;
+            hdr = o->ptr;
+            switch(hdr->encoding) {
+            case HLL_DENSE: hllDenseSet(hdr->registers,j,max[j]); break;
+            case HLL_SPARSE: hllSparseSet(o,j,max[j]); break;
+            }
         }
     }
     hdr = o->ptr; /* o->ptr may be different now, as a side effect of
@@ -1496,6 +1840,22 @@ void pfdebugCommand(client *c) {
     robj *o;
     int j;
 
+    /* PFDEBUG SIMD (ON|OFF) */
+    if (!strcasecmp(cmd,"simd")) {
+        if (c->argc != 3) goto arityerr;
+
+        if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            hll_simd_enabled = 1;
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            hll_simd_enabled = 0;
+        } else {
+            addReplyError(c,"Argument must be ON or OFF");
+            return;
+        }
+        addReplyStatus(c,HLL_USE_AVX2 ? "enabled" : "disabled");
+        return;
+    }
+
     o = lookupKeyWrite(c->db,c->argv[2]);
     if (o == NULL) {
         addReplyError(c,"The specified key does not exist");
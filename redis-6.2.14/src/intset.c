@@ -36,11 +36,17 @@
 #include "endianconv.h"
 #include "redisassert.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* Note that these encodings are ordered, so:
  * INTSET_ENC_INT16 < INTSET_ENC_INT32 < INTSET_ENC_INT64. */
 #define INTSET_ENC_INT16 (sizeof(int16_t))
 #define INTSET_ENC_INT32 (sizeof(int32_t))
 #define INTSET_ENC_INT64 (sizeof(int64_t))
+/* Not a width: large intsets use the packed layout described below. */
+#define INTSET_ENC_PACKED 1
 
 /* Return the required encoding for the provided value. */
 static uint8_t _intsetValueEncoding(int64_t v) {
@@ -110,6 +116,429 @@ static intset *intsetResize(intset *is, uint32_t len) {
     return is;
 }
 
+/* ============================ Packed encoding ============================= */
+
+/* Large intsets switch to a different in-memory layout, signaled by the
+ * INTSET_ENC_PACKED encoding. With the classic layout adding or removing a
+ * value moves on average half of the set, and a single value out of the
+ * int16/int32 range upgrades every element of the set.
+ *
+ * The packed layout splits the sorted values into fixed size blocks. Every
+ * block stores its values as unsigned offsets from the block base (frame of
+ * reference), using the smallest width among 1, 2, 4 or 8 bytes that can
+ * represent all the offsets of the block, so a large value only widens its
+ * own block. Adding or removing a value only moves the offsets of a single
+ * block, and the offsets of a block are searched with a few SIMD compares.
+ *
+ * The blocks are stored one after the other in the same allocation of the
+ * classic intset, after the number of blocks:
+ *
+ * <encoding><length><numblocks><pad><block 0><block 1>...<block N-1>
+ *
+ * Every block holds at least one value. The base of a block is not greater
+ * than its first value, and is greater than all the values of the previous
+ * block, so the block holding a value is the last one with base <= value.
+ *
+ * Intsets are converted to the packed layout when they reach
+ * INTSET_PACK_THRESHOLD elements, and back to the classic one when they get
+ * smaller than half of that. The packed layout is only used in memory:
+ * intsetUnpack() returns the classic representation, which is what RDB
+ * files contain. */
+#define INTSET_PACK_THRESHOLD 1024
+#define INTSET_BLOCK_BYTES 256
+#define INTSET_PACKED_HDR 8 /* Number of blocks + padding. */
+
+typedef struct intsetBlock {
+    int64_t base;       /* Offsets are relative to this value. */
+    uint32_t rank;      /* Number of values stored in the previous blocks. */
+    uint16_t count;     /* Number of values stored in this block. */
+    uint8_t width;      /* Bytes used by every offset: 1, 2, 4 or 8. */
+    uint8_t unused;
+    uint8_t data[INTSET_BLOCK_BYTES];
+} intsetBlock;
+
+static int _intsetIsPacked(const intset *is) {
+    return intrev32ifbe(is->encoding) == INTSET_ENC_PACKED;
+}
+
+static uint32_t _intsetNumBlocks(const intset *is) {
+    return *(uint32_t*)is->contents;
+}
+
+static void _intsetSetNumBlocks(intset *is, uint32_t numblocks) {
+    *(uint32_t*)is->contents = numblocks;
+}
+
+static intsetBlock *_intsetBlocks(const intset *is) {
+    return (intsetBlock*)(is->contents+INTSET_PACKED_HDR);
+}
+
+/* Resize the packed intset to hold 'numblocks' blocks. */
+static intset *_intsetPackedResize(intset *is, uint32_t numblocks) {
+    is = zrealloc(is,sizeof(intset)+INTSET_PACKED_HDR+
+                     (size_t)numblocks*sizeof(intsetBlock));
+    _intsetSetNumBlocks(is,numblocks);
+    return is;
+}
+
+/* Return the smallest block width able to represent the offset. */
+static uint8_t _blockWidth(uint64_t offset) {
+    if (offset <= UINT8_MAX) return 1;
+    if (offset <= UINT16_MAX) return 2;
+    if (offset <= UINT32_MAX) return 4;
+    return 8;
+}
+
+static uint64_t _blockGetOffset(const intsetBlock *b, int i) {
+    switch(b->width) {
+    case 1: return b->data[i];
+    case 2: return ((uint16_t*)b->data)[i];
+    case 4: return ((uint32_t*)b->data)[i];
+    default: return ((uint64_t*)b->data)[i];
+    }
+}
+
+static void _blockSetOffset(intsetBlock *b, int i, uint64_t offset) {
+    switch(b->width) {
+    case 1: b->data[i] = offset; break;
+    case 2: ((uint16_t*)b->data)[i] = offset; break;
+    case 4: ((uint32_t*)b->data)[i] = offset; break;
+    default: ((uint64_t*)b->data)[i] = offset; break;
+    }
+}
+
+static int64_t _blockGet(const intsetBlock *b, int i) {
+    return (int64_t)((uint64_t)b->base+_blockGetOffset(b,i));
+}
+
+/* Return true if the 'count' sorted values fit in a single block. */
+static int _blockFits(const int64_t *vals, int count) {
+    uint64_t span = (uint64_t)vals[count-1]-(uint64_t)vals[0];
+    return count <= INTSET_BLOCK_BYTES/_blockWidth(span);
+}
+
+/* Store the 'count' sorted values in the block, that must fit. */
+static void _blockEncode(intsetBlock *b, const int64_t *vals, int count) {
+    b->base = vals[0];
+    b->width = _blockWidth((uint64_t)vals[count-1]-(uint64_t)vals[0]);
+    b->count = count;
+    b->unused = 0;
+    for (int i = 0; i < count; i++)
+        _blockSetOffset(b,i,(uint64_t)vals[i]-(uint64_t)b->base);
+}
+
+/* Load the values of the block in 'vals', returning how many they are. */
+static int _blockDecode(const intsetBlock *b, int64_t *vals) {
+    for (int i = 0; i < b->count; i++) vals[i] = _blockGet(b,i);
+    return b->count;
+}
+
+/* Return the number of offsets of the block smaller than 'offset', that is
+ * the position of 'offset' in the block if present, or the position where
+ * it should be inserted otherwise. */
+static int _blockRank(const intsetBlock *b, uint64_t offset) {
+    int count = b->count;
+
+    /* The offsets wider than the block are greater than any offset of it. */
+    if (b->width < 8 && offset >> (b->width*8)) return count;
+
+#if defined(__SSE2__)
+    if (b->width < 8) {
+        /* SSE2 only has signed compares, so both the offsets and the key
+         * are biased flipping the most significant bit of every lane. */
+        int lanes = 16/b->width, rank = 0;
+        __m128i bias, key, lt;
+
+        if (b->width == 1) {
+            bias = _mm_set1_epi8((char)0x80);
+            key = _mm_set1_epi8((char)(offset^0x80));
+        } else if (b->width == 2) {
+            bias = _mm_set1_epi16((short)0x8000);
+            key = _mm_set1_epi16((short)(offset^0x8000));
+        } else {
+            bias = _mm_set1_epi32((int)0x80000000);
+            key = _mm_set1_epi32((int)(offset^0x80000000));
+        }
+        for (int i = 0; i < count; i += lanes) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(b->data+i*b->width));
+            x = _mm_xor_si128(x,bias);
+            if (b->width == 1) lt = _mm_cmplt_epi8(x,key);
+            else if (b->width == 2) lt = _mm_cmplt_epi16(x,key);
+            else lt = _mm_cmplt_epi32(x,key);
+            unsigned int mask = _mm_movemask_epi8(lt);
+            /* Ignore the lanes past the end of the block. */
+            if (count-i < lanes) mask &= (1U<<((count-i)*b->width))-1;
+            int smaller = __builtin_popcount(mask)/b->width;
+            rank += smaller;
+            /* Offsets are sorted: stop at the first greater offset. */
+            if (smaller < lanes) break;
+        }
+        return rank;
+    }
+#endif
+
+    int min = 0, max = count;
+    while (min < max) {
+        int mid = (min+max) >> 1;
+        if (_blockGetOffset(b,mid) < offset) min = mid+1;
+        else max = mid;
+    }
+    return min;
+}
+
+/* Return the index of the block that holds (or should hold) 'value'. */
+static uint32_t _intsetFindBlock(const intset *is, int64_t value) {
+    intsetBlock *blocks = _intsetBlocks(is);
+    uint32_t min = 0, max = _intsetNumBlocks(is)-1;
+
+    while (min < max) {
+        uint32_t mid = (min+max+1) >> 1;
+        if (blocks[mid].base <= value) min = mid;
+        else max = mid-1;
+    }
+    return min;
+}
+
+/* Return the index of the block that holds the value at position 'pos'. */
+static uint32_t _intsetFindBlockByPos(const intset *is, uint32_t pos) {
+    intsetBlock *blocks = _intsetBlocks(is);
+    uint32_t min = 0, max = _intsetNumBlocks(is)-1;
+
+    while (min < max) {
+        uint32_t mid = (min+max+1) >> 1;
+        if (blocks[mid].rank <= pos) min = mid;
+        else max = mid-1;
+    }
+    return min;
+}
+
+/* Recompute the rank of the blocks starting from block 'from'. */
+static void _intsetUpdateRanks(intset *is, uint32_t from) {
+    intsetBlock *blocks = _intsetBlocks(is);
+    uint32_t numblocks = _intsetNumBlocks(is);
+    uint32_t rank = from ? blocks[from-1].rank+blocks[from-1].count : 0;
+
+    for (uint32_t j = from; j < numblocks; j++) {
+        blocks[j].rank = rank;
+        rank += blocks[j].count;
+    }
+}
+
+/* Search the packed intset, see intsetSearch(). */
+static uint8_t _intsetPackedSearch(const intset *is, int64_t value,
+                                   uint32_t *pos)
+{
+    intsetBlock *b = _intsetBlocks(is)+_intsetFindBlock(is,value);
+    int rank;
+
+    if (value < b->base) {
+        /* Only possible for the first block. */
+        if (pos) *pos = 0;
+        return 0;
+    }
+    uint64_t offset = (uint64_t)value-(uint64_t)b->base;
+    rank = _blockRank(b,offset);
+    if (pos) *pos = b->rank+rank;
+    return rank < b->count && _blockGetOffset(b,rank) == offset;
+}
+
+/* Return the value at pos of the packed intset. */
+static int64_t _intsetPackedGet(const intset *is, uint32_t pos) {
+    intsetBlock *b = _intsetBlocks(is)+_intsetFindBlockByPos(is,pos);
+    return _blockGet(b,pos-b->rank);
+}
+
+/* Replace 'numold' blocks starting at block 'idx' with blocks holding the
+ * 'count' sorted values 'vals'. As many blocks as needed are used. */
+static intset *_intsetPackedReplace(intset *is, uint32_t idx, uint32_t numold,
+                                    const int64_t *vals, int count,
+                                    int append)
+{
+    int sizes[INTSET_BLOCK_BYTES/8+2], numnew = 0, start = 0;
+    uint32_t numblocks = _intsetNumBlocks(is);
+    intsetBlock *blocks;
+
+    /* Use a single block if possible. Otherwise try to split the values in
+     * two halves, leaving room for more values in both the blocks. When
+     * appending to the last block we instead leave it full and start a new
+     * block, so that sets populated in order use full blocks. When both
+     * fail (values of very different magnitude) fill blocks greedily. */
+    if (_blockFits(vals,count)) {
+        sizes[numnew++] = count;
+    } else if (append && _blockFits(vals,count-1)) {
+        sizes[numnew++] = count-1;
+        sizes[numnew++] = 1;
+    } else if (_blockFits(vals,count/2) &&
+               _blockFits(vals+count/2,count-count/2))
+    {
+        sizes[numnew++] = count/2;
+        sizes[numnew++] = count-count/2;
+    } else {
+        while (start < count) {
+            int len = 1;
+            while (start+len < count && _blockFits(vals+start,len+1)) len++;
+            sizes[numnew++] = len;
+            start += len;
+        }
+    }
+
+    /* Make room for the new blocks, or release the unused ones. */
+    if ((uint32_t)numnew > numold)
+        is = _intsetPackedResize(is,numblocks+numnew-numold);
+    blocks = _intsetBlocks(is);
+    memmove(blocks+idx+numnew,blocks+idx+numold,
+            (numblocks-idx-numold)*sizeof(intsetBlock));
+    if ((uint32_t)numnew < numold)
+        is = _intsetPackedResize(is,numblocks+numnew-numold);
+    blocks = _intsetBlocks(is);
+
+    start = 0;
+    for (int j = 0; j < numnew; j++) {
+        _blockEncode(blocks+idx+j,vals+start,sizes[j]);
+        start += sizes[j];
+    }
+    _intsetUpdateRanks(is,idx);
+    return is;
+}
+
+/* Add the value to the packed intset. */
+static intset *_intsetPackedAdd(intset *is, int64_t value, uint8_t *success) {
+    uint32_t idx = _intsetFindBlock(is,value);
+    intsetBlock *b = _intsetBlocks(is)+idx;
+    int64_t vals[INTSET_BLOCK_BYTES+1];
+    int rank = 0, count;
+
+    if (value >= b->base) {
+        uint64_t offset = (uint64_t)value-(uint64_t)b->base;
+        rank = _blockRank(b,offset);
+        if (rank < b->count && _blockGetOffset(b,rank) == offset) {
+            if (success) *success = 0;
+            return is;
+        }
+
+        /* Fast path: the offset fits the block width and there is room. */
+        if (_blockWidth(offset) <= b->width &&
+            b->count < INTSET_BLOCK_BYTES/b->width)
+        {
+            memmove(b->data+(rank+1)*b->width,b->data+rank*b->width,
+                    (b->count-rank)*b->width);
+            _blockSetOffset(b,rank,offset);
+            b->count++;
+            _intsetUpdateRanks(is,idx+1);
+            is->length = intrev32ifbe(intrev32ifbe(is->length)+1);
+            return is;
+        }
+    }
+
+    /* Slow path: the block needs a different base or width, or must be
+     * split. Re-encode its values with the new one. */
+    count = _blockDecode(b,vals);
+    memmove(vals+rank+1,vals+rank,(count-rank)*sizeof(int64_t));
+    vals[rank] = value;
+    count++;
+    is = _intsetPackedReplace(is,idx,1,vals,count,
+                 idx == _intsetNumBlocks(is)-1 && rank == count-1);
+    is->length = intrev32ifbe(intrev32ifbe(is->length)+1);
+    return is;
+}
+
+/* Remove the value from the packed intset. */
+static intset *_intsetPackedRemove(intset *is, int64_t value, int *success) {
+    uint32_t idx = _intsetFindBlock(is,value);
+    intsetBlock *b = _intsetBlocks(is)+idx;
+    uint32_t numblocks = _intsetNumBlocks(is);
+    int rank;
+
+    if (value < b->base) return is;
+    uint64_t offset = (uint64_t)value-(uint64_t)b->base;
+    rank = _blockRank(b,offset);
+    if (rank == b->count || _blockGetOffset(b,rank) != offset) return is;
+
+    if (success) *success = 1;
+    memmove(b->data+rank*b->width,b->data+(rank+1)*b->width,
+            (b->count-rank-1)*b->width);
+    b->count--;
+    is->length = intrev32ifbe(intrev32ifbe(is->length)-1);
+
+    if (b->count == 0) {
+        /* Drop the empty block. */
+        intsetBlock *blocks = _intsetBlocks(is);
+        memmove(blocks+idx,blocks+idx+1,
+                (numblocks-idx-1)*sizeof(intsetBlock));
+        is = _intsetPackedResize(is,numblocks-1);
+        _intsetUpdateRanks(is,idx);
+    } else {
+        /* Merge blocks getting almost empty with a neighbor, if the
+         * values of both blocks fit in a single block. */
+        uint32_t first = idx+1 < numblocks ? idx : idx-1;
+        intsetBlock *blocks = _intsetBlocks(is);
+
+        if (b->count < INTSET_BLOCK_BYTES/b->width/4 && numblocks > 1 &&
+            blocks[first].count+blocks[first+1].count <= INTSET_BLOCK_BYTES)
+        {
+            int64_t vals[INTSET_BLOCK_BYTES];
+            int count = _blockDecode(blocks+first,vals);
+
+            count += _blockDecode(blocks+first+1,vals+count);
+            if (_blockFits(vals,count))
+                return _intsetPackedReplace(is,first,2,vals,count,0);
+        }
+        _intsetUpdateRanks(is,idx+1);
+    }
+    return is;
+}
+
+/* Convert a classic intset to the packed layout. */
+static intset *_intsetPack(intset *is) {
+    uint32_t len = intrev32ifbe(is->length), numblocks = 0, pos = 0;
+    int64_t vals[INTSET_BLOCK_BYTES];
+    intset *packed = zmalloc(sizeof(intset)+INTSET_PACKED_HDR);
+
+    packed->encoding = intrev32ifbe(INTSET_ENC_PACKED);
+    packed->length = intrev32ifbe(len);
+    _intsetSetNumBlocks(packed,0);
+
+    /* Fill the blocks with as many values as possible. */
+    while (pos < len) {
+        int count = 0;
+        vals[count++] = _intsetGet(is,pos++);
+        while (pos < len && count < INTSET_BLOCK_BYTES) {
+            vals[count] = _intsetGet(is,pos);
+            if (!_blockFits(vals,count+1)) break;
+            count++;
+            pos++;
+        }
+        packed = _intsetPackedResize(packed,numblocks+1);
+        _blockEncode(_intsetBlocks(packed)+numblocks,vals,count);
+        numblocks++;
+    }
+    _intsetUpdateRanks(packed,0);
+    zfree(is);
+    return packed;
+}
+
+/* Convert a packed intset to the classic layout. */
+static intset *_intsetUnpack(const intset *is) {
+    uint32_t len = intrev32ifbe(is->length), pos = 0;
+    intsetBlock *blocks = _intsetBlocks(is);
+    uint32_t numblocks = _intsetNumBlocks(is);
+    intset *flat = intsetNew();
+    uint8_t enc;
+
+    if (len == 0) return flat;
+    enc = _intsetValueEncoding(_intsetPackedGet(is,0));
+    if (_intsetValueEncoding(_intsetPackedGet(is,len-1)) > enc)
+        enc = _intsetValueEncoding(_intsetPackedGet(is,len-1));
+    flat->encoding = intrev32ifbe(enc);
+    flat = intsetResize(flat,len);
+    for (uint32_t j = 0; j < numblocks; j++) {
+        for (int i = 0; i < blocks[j].count; i++)
+            _intsetSet(flat,pos++,_blockGet(blocks+j,i));
+    }
+    flat->length = intrev32ifbe(len);
+    return flat;
+}
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position
@@ -118,6 +547,8 @@ static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
     int min = 0, max = intrev32ifbe(is->length)-1, mid = -1;
     int64_t cur = -1;
 
+    if (_intsetIsPacked(is)) return _intsetPackedSearch(is,value,pos);
+
     /* The value can never be found when the set is empty */
     if (intrev32ifbe(is->length) == 0) {
         if (pos) *pos = 0;
@@ -208,6 +639,14 @@ intset *intsetAdd(intset *is, int64_t value, uint8_t *success) {
     uint32_t pos;
     if (success) *success = 1;
 
+    /* Switch to the packed layout when the set gets large. */
+    if (!_intsetIsPacked(is) &&
+        intrev32ifbe(is->length) >= INTSET_PACK_THRESHOLD)
+    {
+        is = _intsetPack(is);
+    }
+    if (_intsetIsPacked(is)) return _intsetPackedAdd(is,value,success);
+
     /* Upgrade encoding if necessary. If we need to upgrade, we know that
      * this value should be either appended (if > 0) or prepended (if < 0),
      * because it lies outside the range of existing values. */
@@ -238,6 +677,16 @@ intset *intsetRemove(intset *is, int64_t value, int *success) {
     uint32_t pos;
     if (success) *success = 0;
 
+    if (_intsetIsPacked(is)) {
+        is = _intsetPackedRemove(is,value,success);
+        if (intrev32ifbe(is->length) < INTSET_PACK_THRESHOLD/2) {
+            intset *flat = _intsetUnpack(is);
+            zfree(is);
+            is = flat;
+        }
+        return is;
+    }
+
     if (valenc <= intrev32ifbe(is->encoding) && intsetSearch(is,value,&pos)) {
         uint32_t len = intrev32ifbe(is->length);
 
@@ -255,13 +704,51 @@ intset *intsetRemove(intset *is, int64_t value, int *success) {
 /* Determine whether a value belongs to this set */
 uint8_t intsetFind(intset *is, int64_t value) {
     uint8_t valenc = _intsetValueEncoding(value);
+    if (_intsetIsPacked(is)) return _intsetPackedSearch(is,value,NULL);
     return valenc <= intrev32ifbe(is->encoding) && intsetSearch(is,value,NULL);
 }
 
+/* Like intsetFind(), but for callers looking up values in ascending order,
+ * like when intersecting sets: "pos" is the position where the previous
+ * lookup stopped (0 for the first one), and it is updated with the position
+ * of the value, or of the first greater value if not found. Instead of
+ * bisecting the whole set the search gallops forward from "pos", so that
+ * looking up the M values of a smaller set costs O(M*log(N/M)). */
+uint8_t intsetFindFrom(intset *is, int64_t value, uint32_t *pos) {
+    uint32_t len = intrev32ifbe(is->length), min = *pos, max, step = 1;
+
+    if (_intsetIsPacked(is)) return _intsetPackedSearch(is,value,pos);
+    if (_intsetValueEncoding(value) > intrev32ifbe(is->encoding)) {
+        /* Out of the range of the set, greater or smaller than all. */
+        if (value > 0) *pos = len;
+        return 0;
+    }
+    if (min >= len) return 0;
+
+    /* Gallop to find a range [min,max) where the value should be. */
+    max = min;
+    while (max < len && _intsetGet(is,max) < value) {
+        min = max+1;
+        max += step;
+        step <<= 1;
+    }
+    if (max > len) max = len;
+
+    /* Bisect the range looking for the first value >= "value". */
+    while (min < max) {
+        uint32_t mid = (min+max) >> 1;
+        if (_intsetGet(is,mid) < value) min = mid+1;
+        else max = mid;
+    }
+    *pos = min;
+    return min < len && _intsetGet(is,min) == value;
+}
+
 /* Return random member */
 int64_t intsetRandom(intset *is) {
     uint32_t len = intrev32ifbe(is->length);
     assert(len); /* avoid division by zero on corrupt intset payload. */
+    if (_intsetIsPacked(is)) return _intsetPackedGet(is,rand()%len);
     return _intsetGet(is,rand()%len);
 }
 
@@ -269,7 +756,10 @@ int64_t intsetRandom(intset *is) {
  * out of range the function returns 0, when in range it returns 1. */
 uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value) {
     if (pos < intrev32ifbe(is->length)) {
-        *value = _intsetGet(is,pos);
+        if (_intsetIsPacked(is))
+            *value = _intsetPackedGet(is,pos);
+        else
+            *value = _intsetGet(is,pos);
         return 1;
     }
     return 0;
@@ -282,9 +772,40 @@ uint32_t intsetLen(const intset *is) {
 
 /* Return intset blob size in bytes. */
 size_t intsetBlobLen(intset *is) {
+    if (_intsetIsPacked(is))
+        return sizeof(intset)+INTSET_PACKED_HDR+
+               (size_t)_intsetNumBlocks(is)*sizeof(intsetBlock);
     return sizeof(intset)+(size_t)intrev32ifbe(is->length)*intrev32ifbe(is->encoding);
 }
 
+/* Return true if the intset uses the packed layout. */
+int intsetIsPacked(const intset *is) {
+    return _intsetIsPacked(is);
+}
+
+/* Convert the intset to the packed layout if it is large enough to use it,
+ * returning the new pointer. This is done automatically by intsetAdd(), it
+ * is only needed for intsets created in other ways, like loaded from RDB. */
+intset *intsetPack(intset *is) {
+    if (!_intsetIsPacked(is) &&
+        intrev32ifbe(is->length) >= INTSET_PACK_THRESHOLD)
+    {
+        is = _intsetPack(is);
+    }
+    return is;
+}
+
+/* Return a new intset with the same values using the classic layout, that
+ * is the one used to serialize intsets. */
+intset *intsetUnpack(const intset *is) {
+    if (_intsetIsPacked(is)) return _intsetUnpack(is);
+
+    size_t size = intsetBlobLen((intset*)is);
+    intset *flat = zmalloc(size);
+    memcpy(flat,is,size);
+    return flat;
+}
+
 /* Validate the integrity of the data structure.
  * when `deep` is 0, only the integrity of the header is validated.
  * when `deep` is 1, we make sure there are no duplicate or out of order records. */
@@ -376,6 +897,28 @@ static intset *createSet(int bits, int size) {
 }
 
 static void checkConsistency(intset *is) {
+    if (_intsetIsPacked(is)) {
+        intsetBlock *blocks = _intsetBlocks(is);
+        uint32_t rank = 0;
+        int64_t prev = 0;
+
+        for (uint32_t j = 0; j < _intsetNumBlocks(is); j++) {
+            intsetBlock *b = blocks+j;
+            assert(b->count > 0 && b->count <= INTSET_BLOCK_BYTES/b->width);
+            assert(b->rank == rank);
+            assert(j == 0 || b->base > prev);
+            for (int i = 0; i < b->count; i++) {
+                int64_t cur = _blockGet(b,i);
+                assert(cur >= b->base);
+                assert((j == 0 && i == 0) || cur > prev);
+                prev = cur;
+            }
+            rank += b->count;
+        }
+        assert(rank == intrev32ifbe(is->length));
+        return;
+    }
+
     for (uint32_t i = 0; i < (intrev32ifbe(is->length)-1); i++) {
         uint32_t encoding = intrev32ifbe(is->encoding);
 
@@ -542,6 +1085,111 @@ int intsetTest(int argc, char **argv, int accurate) {
         zfree(is);
     }
 
+    printf("Packed layout matches the classic one: "); {
+        intset *flat;
+        int64_t v1, v2;
+        is = intsetNew();
+        for (i = 0; i < INTSET_PACK_THRESHOLD-1; i++)
+            is = intsetAdd(is,i*3,NULL);
+        assert(!intsetIsPacked(is));
+        is = intsetAdd(is,-1,NULL);
+        is = intsetAdd(is,-2,NULL);
+        assert(intsetIsPacked(is));
+        checkConsistency(is);
+        /* Values of very different magnitude, forcing wider blocks and
+         * greedy splits. */
+        for (i = 0; i < 5000; i++) {
+            int64_t v = rand();
+            if (i % 7 == 0) v *= 1000000007LL;
+            if (i % 11 == 0) v = -v;
+            if (i % 101 == 0) v = (i % 2) ? INT64_MAX-i : INT64_MIN+i;
+            is = intsetAdd(is,v,NULL);
+        }
+        checkConsistency(is);
+        flat = intsetUnpack(is);
+        assert(!intsetIsPacked(flat));
+        checkConsistency(flat);
+        assert(intsetLen(flat) == intsetLen(is));
+        for (uint32_t j = 0; j < intsetLen(is); j++) {
+            assert(intsetGet(is,j,&v1) && intsetGet(flat,j,&v2));
+            assert(v1 == v2);
+            assert(intsetFind(is,v1));
+            if (v1 != INT64_MAX) assert(intsetFind(is,v1+1) == intsetFind(flat,v1+1));
+        }
+        assert(!intsetGet(is,intsetLen(is),&v1));
+        zfree(flat);
+        ok();
+        zfree(is);
+    }
+
+    printf("Packed layout add+delete: "); {
+        uint8_t present[0x10000] = {0};
+        int v, success2;
+        uint32_t count = 0;
+        is = intsetNew();
+        for (i = 0; i < 0x3ffff; i++) {
+            v = rand() % 0x10000;
+            if (rand() % 3) {
+                is = intsetAdd(is,v,&success);
+                assert(success == !present[v]);
+                if (success) count++;
+                present[v] = 1;
+            } else {
+                is = intsetRemove(is,v,&success2);
+                assert(success2 == present[v]);
+                if (success2) count--;
+                present[v] = 0;
+            }
+            assert(intsetLen(is) == count);
+        }
+        assert(intsetIsPacked(is));
+        checkConsistency(is);
+        for (v = 0; v < 0x10000; v++) assert(intsetFind(is,v) == present[v]);
+        /* Removing most values converts it back to the classic layout. */
+        for (v = 0; v < 0x10000 && intsetLen(is) > 10; v++)
+            is = intsetRemove(is,v,NULL);
+        assert(!intsetIsPacked(is));
+        checkConsistency(is);
+        ok();
+        zfree(is);
+    }
+
+    printf("Galloping search: "); {
+        intset *small = createSet(16,50), *packed = createSet(20,20000);
+        intset *sets[2] = {createSet(20,800), packed};
+        for (int s = 0; s < 2; s++) {
+            uint32_t pos = 0, j;
+            int64_t v;
+            is = sets[s];
+            for (j = 0; intsetGet(small,j,&v); j++) {
+                uint32_t expected;
+                uint8_t found = intsetSearch(is,v,&expected);
+                assert(intsetFindFrom(is,v,&pos) == found);
+                assert(pos == expected);
+            }
+            assert(intsetFindFrom(is,INT64_MAX,&pos) == 0);
+            assert(pos == intsetLen(is));
+            zfree(is);
+        }
+        zfree(small);
+        ok();
+    }
+
+    printf("Stress packed lookups: "); {
+        long num = 100000, size = 100000;
+        int i, bits = 30;
+        long long start;
+        is = createSet(bits,size);
+        assert(intsetIsPacked(is));
+        checkConsistency(is);
+
+        start = usec();
+        for (i = 0; i < num; i++) intsetSearch(is,rand() % ((1<<bits)-1),NULL);
+        printf("%ld lookups, %u element set, %zu bytes, %lldusec\n",
+               num,intsetLen(is),intsetBlobLen(is),usec()-start);
+        zfree(is);
+    }
+
     return 0;
 }
 #endif
@@ -45,7 +45,11 @@ uint8_t intsetFind(intset *is, int64_t value);
 int64_t intsetRandom(intset *is);
 uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value);
 uint32_t intsetLen(const intset *is);
+uint8_t intsetFindFrom(intset *is, int64_t value, uint32_t *pos);
 size_t intsetBlobLen(intset *is);
+int intsetIsPacked(const intset *is);
+intset *intsetPack(intset *is);
+intset *intsetUnpack(const intset *is);
 int intsetValidateIntegrity(const unsigned char *is, size_t size, int deep);
 
 #ifdef REDIS_TEST
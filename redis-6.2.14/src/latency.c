@@ -61,9 +61,10 @@ dictType latencyTimeSeriesDictType = {
 
 #ifdef __linux__
 #include <sys/prctl.h>
-/* Returns 1 if Transparent Huge Pages support is enabled in the kernel.
- * Otherwise (or if we are unable to check) 0 is returned. */
-int THPIsEnabled(void) {
+/* Returns 1 if the Transparent Huge Pages mode of the kernel is 'mode'
+ * ("[always]", "[madvise]" or "[never]"). Otherwise (or if we are unable
+ * to check) 0 is returned. */
+static int THPModeIs(const char *mode) {
     char buf[1024];
 
     FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled","r");
@@ -73,7 +74,19 @@ int THPIsEnabled(void) {
         return 0;
     }
     fclose(fp);
-    return (strstr(buf,"[always]") != NULL) ? 1 : 0;
+    return (strstr(buf,mode) != NULL) ? 1 : 0;
+}
+
+/* Returns 1 if Transparent Huge Pages support is enabled in the kernel.
+ * Otherwise (or if we are unable to check) 0 is returned. */
+int THPIsEnabled(void) {
+    return THPModeIs("[always]");
+}
+
+/* Returns 1 if Transparent Huge Pages are only used for the memory regions
+ * flagged with madvise(), like the huge page regions of zmalloc. */
+int THPIsMadviseEnabled(void) {
+    return THPModeIs("[madvise]");
 }
 
 /* since linux-3.5, kernel supports to set the state of the "THP disable" flag
@@ -398,7 +411,7 @@ sds createLatencyReport(void) {
     dictReleaseIterator(di);
 
     /* Add non event based advices. */
-    if (THPGetAnonHugePagesSize() > 0) {
+    if (THPGetAnonHugePagesSize() > 0 && !server.hugepage_regions) {
         advise_disable_thp = 1;
         advices++;
     }
@@ -64,6 +64,7 @@ struct latencyStats {
 void latencyMonitorInit(void);
 void latencyAddSample(const char *event, mstime_t latency);
 int THPIsEnabled(void);
+int THPIsMadviseEnabled(void);
 int THPDisable(void);
 
 /* Latency monitoring macros. */
@@ -5,28 +5,141 @@
 
 static redisAtomic size_t lazyfree_objects = 0;
 static redisAtomic size_t lazyfreed_objects = 0;
+/* Estimated memory that the pending jobs are going to release. */
+static redisAtomic size_t lazyfree_memory = 0;
+
+/* Huge hash tables are released by multiple lazyfree jobs, each one freeing
+ * LAZYFREE_CHUNK_BUCKETS buckets, so that the lazyfree workers can release
+ * them in parallel, and the jobs queued after a huge object or database are
+ * not delayed until it is completely released. */
+#define LAZYFREE_CHUNK_BUCKETS 16384
+
+typedef struct lazyfreeChunked {
+    robj *obj;              /* Object owning d[0], or NULL for a database. */
+    dict *d[2];             /* The object dict, or the DB keys and expires. */
+    pthread_mutex_t mutex;
+    unsigned long chunks;   /* Chunks not yet released, protected by mutex. */
+    unsigned long total;    /* Chunks the dicts were split into. */
+    size_t memory;          /* Estimated memory of the whole object / DB. */
+} lazyfreeChunked;
 
 /* Release objects from the lazyfree thread. It's just decrRefCount()
  * updating the count of objects to release. */
 void lazyfreeFreeObject(void *args[]) {
     robj *o = (robj *) args[0];
+    size_t memory = (size_t) args[1];
     decrRefCount(o);
+    atomicDecr(lazyfree_memory,memory);
     atomicDecr(lazyfree_objects,1);
     atomicIncr(lazyfreed_objects,1);
 }
 
-/* Release a database from the lazyfree thread. The 'db' pointer is the
- * database which was substituted with a fresh one in the main thread
- * when the database was logically deleted. */
-void lazyfreeFreeDatabase(void *args[]) {
-    dict *ht1 = (dict *) args[0];
-    dict *ht2 = (dict *) args[1];
+/* Release an array of objects from the lazyfree thread, see
+ * freeObjectsAsync(). */
+void lazyfreeFreeObjects(void *args[]) {
+    robj **objs = args[0];
+    size_t count = (size_t) args[1];
+    size_t memory = (size_t) args[2];
+    for (size_t j = 0; j < count; j++) decrRefCount(objs[j]);
+    zfree(objs);
+    atomicDecr(lazyfree_memory,memory);
+    atomicDecr(lazyfree_objects,count);
+    atomicIncr(lazyfreed_objects,count);
+}
+
+/* Release the entries stored in 'count' buckets of the hash table 'ht'
+ * of 'd', starting from the bucket 'start'. 'obj' is the object owning
+ * 'd', or NULL for a database. Returns the number of released entries. */
+static size_t lazyfreeFreeBuckets(robj *obj, dict *d, dictht *ht,
+                                  unsigned long start, unsigned long count)
+{
+    unsigned long end = start+count;
+    int zset = obj && obj->type == OBJ_ZSET;
+    size_t freed = 0;
+
+    if (end > ht->size) end = ht->size;
+    for (unsigned long j = start; j < end; j++) {
+        dictEntry *he = ht->table[j];
+        while (he) {
+            dictEntry *next = he->next;
+            if (zset) {
+                /* The value is the score of the skiplist node, that owns
+                 * the element used as key: release the whole node. */
+                zskiplistNode *node = (zskiplistNode*)
+                    ((char*)dictGetVal(he) - offsetof(zskiplistNode,score));
+                sdsfree(node->ele);
+                zfree(node);
+            } else {
+                dictFreeKey(d,he);
+                dictFreeVal(d,he);
+            }
+            zfree(he);
+            freed++;
+            he = next;
+        }
+    }
+    return freed;
+}
+
+/* Release what remains of an object or database once all the entries of
+ * its dicts were released with lazyfreeFreeBuckets(): the hash tables and
+ * the containers. 'd1' may be NULL. */
+static void lazyfreeFreeContainers(robj *obj, dict *d0, dict *d1) {
+    dict *dicts[2] = {d0,d1};
+    for (int j = 0; j < 2; j++) {
+        dict *d = dicts[j];
+        if (d == NULL) continue;
+        zfree(d->ht[0].table);
+        zfree(d->ht[1].table);
+        zfree(d);
+    }
+    if (obj) {
+        if (obj->type == OBJ_ZSET) {
+            zset *zs = obj->ptr;
+            zfree(zs->zsl->header);
+            zfree(zs->zsl);
+            zfree(zs);
+        }
+        zfree(obj);
+    }
+}
+
+/* Release a chunk of a huge object or database from a lazyfree worker,
+ * see lazyfreeScheduleChunked(). The last chunk released also frees the
+ * containers. */
+void lazyfreeFreeChunk(void *args[]) {
+    lazyfreeChunked *c = args[0];
+    unsigned long table = (unsigned long) args[1];
+    unsigned long start = (unsigned long) args[2];
+    dict *d = c->d[table>>1];
+    size_t freed = lazyfreeFreeBuckets(c->obj,d,&d->ht[table&1],start,
+                                       LAZYFREE_CHUNK_BUCKETS);
+    size_t chunk_memory = c->memory/c->total;
+    int is_object = c->obj != NULL, last;
+
+    /* For a database we count the keys, for an object the object itself. */
+    if (!is_object && (table>>1) == 0) {
+        atomicDecr(lazyfree_objects,freed);
+        atomicIncr(lazyfreed_objects,freed);
+    }
+
+    /* Once the chunk is accounted as released 'c' may be freed by another
+     * worker at any time, unless this is the last chunk. */
+    pthread_mutex_lock(&c->mutex);
+    last = --c->chunks == 0;
+    pthread_mutex_unlock(&c->mutex);
 
-    size_t numkeys = dictSize(ht1);
-    dictRelease(ht1);
-    dictRelease(ht2);
-    atomicDecr(lazyfree_objects,numkeys);
-    atomicIncr(lazyfreed_objects,numkeys);
+    if (last) {
+        if (is_object) {
+            atomicDecr(lazyfree_objects,1);
+            atomicIncr(lazyfreed_objects,1);
+        }
+        chunk_memory = c->memory - chunk_memory*(c->total-1);
+        lazyfreeFreeContainers(c->obj,c->d[0],c->d[1]);
+        pthread_mutex_destroy(&c->mutex);
+        zfree(c);
+    }
+    atomicDecr(lazyfree_memory,chunk_memory);
 }
 
 /* Release the skiplist mapping Redis Cluster keys to slots in the
@@ -39,6 +152,16 @@ void lazyfreeFreeSlotsMap(void *args[]) {
     atomicIncr(lazyfreed_objects,len);
 }
 
+/* Release the deadline index of the keys with an expire in the lazyfree
+ * thread. */
+void lazyfreeFreeExpireIndex(void *args[]) {
+    rax *rt = args[0];
+    size_t len = rt->numele;
+    raxFree(rt);
+    atomicDecr(lazyfree_objects,len);
+    atomicIncr(lazyfreed_objects,len);
+}
+
 /* Release the key tracking table. */
 void lazyFreeTrackingTable(void *args[]) {
     rax *rt = args[0];
@@ -56,6 +179,19 @@ void lazyFreeLuaScripts(void *args[]) {
     atomicIncr(lazyfreed_objects,len);
 }
 
+/* Release the replication buffer blocks and their index, once the
+ * replication backlog is freed. */
+void lazyFreeReplicationBacklogRefMem(void *args[]) {
+    list *blocks = args[0];
+    rax *index = args[1];
+    long long len = listLength(blocks);
+    len += raxSize(index);
+    listRelease(blocks);
+    raxFree(index);
+    atomicDecr(lazyfree_objects,len);
+    atomicIncr(lazyfreed_objects,len);
+}
+
 /* Return the number of currently pending objects to free. */
 size_t lazyfreeGetPendingObjectsCount(void) {
     size_t aux;
@@ -70,6 +206,111 @@ size_t lazyfreeGetFreedObjectsCount(void) {
     return aux;
 }
 
+/* Return the estimated memory that the pending lazyfree jobs are going to
+ * release: eviction does not count it as used, otherwise it would evict
+ * more keys while the memory of the deleted ones is being reclaimed. */
+size_t lazyfreeGetPendingMemory(void) {
+    size_t aux;
+    atomicGet(lazyfree_memory,aux);
+    return aux;
+}
+
+/* Split the hash tables of 'd0' and 'd1' (that may be NULL) into chunks of
+ * LAZYFREE_CHUNK_BUCKETS buckets, and create a lazyfree job for every chunk.
+ * 'obj' is the object owning 'd0', or NULL if the dicts are the keys and
+ * the expires of a database. The pending objects count must already be
+ * incremented by the caller. */
+static void lazyfreeScheduleChunked(robj *obj, dict *d0, dict *d1,
+                                    size_t memory)
+{
+    lazyfreeChunked *c = zmalloc(sizeof(*c));
+    c->obj = obj;
+    c->d[0] = d0;
+    c->d[1] = d1;
+    c->memory = memory;
+    c->total = 0;
+    for (int j = 0; j < 4; j++) {
+        dict *d = c->d[j>>1];
+        if (d) c->total += (d->ht[j&1].size+LAZYFREE_CHUNK_BUCKETS-1) /
+                           LAZYFREE_CHUNK_BUCKETS;
+    }
+
+    /* Nothing to do in background for an empty database. */
+    if (c->total == 0) {
+        serverAssert(obj == NULL);
+        dictRelease(d0);
+        dictRelease(d1);
+        zfree(c);
+        return;
+    }
+
+    pthread_mutex_init(&c->mutex,NULL);
+    c->chunks = c->total;
+    atomicIncr(lazyfree_memory,memory);
+    for (int j = 0; j < 4; j++) {
+        dict *d = c->d[j>>1];
+        if (d == NULL) continue;
+        for (unsigned long start = 0; start < d->ht[j&1].size;
+             start += LAZYFREE_CHUNK_BUCKETS)
+        {
+            bioCreateLazyFreeJob(lazyfreeFreeChunk,3,c,
+                (void*)(unsigned long)j,(void*)start);
+        }
+    }
+}
+
+/* Return the dict of a hash table based set, hash or sorted set, or NULL
+ * for the other objects. */
+static dict *lazyfreeObjectDict(robj *obj) {
+    if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
+        return obj->ptr;
+    } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
+        return obj->ptr;
+    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST){
+        return ((zset*)obj->ptr)->dict;
+    }
+    return NULL;
+}
+
+/* Return the dict a huge object can be released in chunks from, or NULL
+ * if the object must be released by a single job. */
+static dict *lazyfreeChunkableDict(robj *obj) {
+    dict *d = lazyfreeObjectDict(obj);
+    if (d && dictSlots(d) > LAZYFREE_CHUNK_BUCKETS) return d;
+    return NULL;
+}
+
+/* Release a not shared object in background, in chunks if it is huge. */
+static void lazyfreeScheduleObject(robj *obj) {
+    size_t memory = objectComputeSize(obj,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+    dict *d = lazyfreeChunkableDict(obj);
+
+    atomicIncr(lazyfree_objects,1);
+    if (d) {
+        lazyfreeScheduleChunked(obj,d,NULL,memory);
+    } else {
+        atomicIncr(lazyfree_memory,memory);
+        bioCreateLazyFreeJob(lazyfreeFreeObject,2,obj,(void*)memory);
+    }
+}
+
+/* Estimate the memory used by a database sampling a few of its keys. */
+static size_t lazyfreeEstimateDbMemory(dict *keys, dict *expires) {
+    size_t sampled = 0, samples = 0;
+
+    while (samples < OBJ_COMPUTE_SIZE_DEF_SAMPLES && dictSize(keys)) {
+        dictEntry *de = dictGetFairRandomKey(keys);
+        sampled += sizeof(dictEntry) + sdsZmallocSize(dictGetKey(de)) +
+                   objectComputeSize(dictGetVal(de),
+                                     OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+        samples++;
+    }
+    size_t memory = samples ? sampled/samples*dictSize(keys) : 0;
+    memory += sizeof(dictEntry)*dictSize(expires);
+    memory += sizeof(dictEntry*)*(dictSlots(keys)+dictSlots(expires));
+    return memory;
+}
+
 /* Return the amount of work needed in order to free an object.
  * The return value is not always the actual number of allocations the
  * object is composed of, but a number proportional to it.
@@ -122,6 +363,9 @@ size_t lazyfreeGetFreeEffort(robj *key, robj *obj) {
             raxStop(&ri);
         }
         return effort;
+    } else if (obj->type == OBJ_BITMAP) {
+        roaring *r = obj->ptr;
+        return r->count; /* Every container is an allocation. */
     } else if (obj->type == OBJ_MODULE) {
         moduleValue *mv = obj->ptr;
         moduleType *mt = mv->type;
@@ -146,7 +390,7 @@ size_t lazyfreeGetFreeEffort(robj *key, robj *obj) {
 int dbAsyncDelete(redisDb *db, robj *key) {
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    dbDeleteExpire(db,key->ptr);
 
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
@@ -169,8 +413,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
          * through and reach the dictFreeUnlinkedEntry() call, that will be
          * equivalent to just calling decrRefCount(). */
         if (free_effort > LAZYFREE_THRESHOLD && val->refcount == 1) {
-            atomicIncr(lazyfree_objects,1);
-            bioCreateLazyFreeJob(lazyfreeFreeObject,1, val);
+            lazyfreeScheduleObject(val);
             dictSetVal(db->dict,de,NULL);
         }
     }
@@ -180,6 +423,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
     if (de) {
         dictFreeUnlinkedEntry(db->dict,de);
         if (server.cluster_enabled) slotToKeyDel(key->ptr);
+        slotDigestTouchKey(key);
         return 1;
     } else {
         return 0;
@@ -190,22 +434,39 @@ int dbAsyncDelete(redisDb *db, robj *key) {
 void freeObjAsync(robj *key, robj *obj) {
     size_t free_effort = lazyfreeGetFreeEffort(key,obj);
     if (free_effort > LAZYFREE_THRESHOLD && obj->refcount == 1) {
-        atomicIncr(lazyfree_objects,1);
-        bioCreateLazyFreeJob(lazyfreeFreeObject,1,obj);
+        lazyfreeScheduleObject(obj);
     } else {
         decrRefCount(obj);
     }
 }
 
+/* Release 'count' objects with a single lazyfree job, regardless of their
+ * free effort: this amortizes the job overhead when many values are
+ * released at once, like when a batch of keys expires. The objects must
+ * not be shared. The array is copied, so the caller can reuse it. */
+void freeObjectsAsync(robj **objs, size_t count) {
+    if (count == 0) return;
+    robj **copy = zmalloc(sizeof(robj*)*count);
+    size_t memory = sizeof(robj*)*count;
+    memcpy(copy,objs,sizeof(robj*)*count);
+    for (size_t j = 0; j < count; j++)
+        memory += objectComputeSize(objs[j],OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+    atomicIncr(lazyfree_objects,count);
+    atomicIncr(lazyfree_memory,memory);
+    bioCreateLazyFreeJob(lazyfreeFreeObjects,3,copy,(void*)count,
+                         (void*)memory);
+}
+
 /* Empty a Redis DB asynchronously. What the function does actually is to
  * create a new empty set of hash tables and scheduling the old ones for
- * lazy freeing. */
+ * lazy freeing, in chunks, so that multiple workers can release them. */
 void emptyDbAsync(redisDb *db) {
     dict *oldht1 = db->dict, *oldht2 = db->expires;
+    size_t memory = lazyfreeEstimateDbMemory(oldht1,oldht2);
     db->dict = dictCreate(&dbDictType,NULL);
     db->expires = dictCreate(&dbExpiresDictType,NULL);
     atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateLazyFreeJob(lazyfreeFreeDatabase,2,oldht1,oldht2);
+    lazyfreeScheduleChunked(NULL,oldht1,oldht2,memory);
 }
 
 /* Release the radix tree mapping Redis Cluster keys to slots asynchronously. */
@@ -214,12 +475,32 @@ void freeSlotsToKeysMapAsync(rax *rt) {
     bioCreateLazyFreeJob(lazyfreeFreeSlotsMap,1,rt);
 }
 
+/* Release the deadline index of a database asynchronously. */
+void freeExpireIndexAsync(rax *rt) {
+    atomicIncr(lazyfree_objects,rt->numele);
+    bioCreateLazyFreeJob(lazyfreeFreeExpireIndex,1,rt);
+}
+
 /* Free an object, if the object is huge enough, free it in async way. */
 void freeTrackingRadixTreeAsync(rax *tracking) {
     atomicIncr(lazyfree_objects,tracking->numele);
     bioCreateLazyFreeJob(lazyFreeTrackingTable,1,tracking);
 }
 
+/* Free the replication buffer blocks referenced by the replication backlog,
+ * if they are a lot, free them in async way. */
+void freeReplicationBacklogRefMemAsync(list *blocks, rax *index) {
+    if (listLength(blocks) > LAZYFREE_THRESHOLD ||
+        raxSize(index) > LAZYFREE_THRESHOLD)
+    {
+        atomicIncr(lazyfree_objects,listLength(blocks)+raxSize(index));
+        bioCreateLazyFreeJob(lazyFreeReplicationBacklogRefMem,2,blocks,index);
+    } else {
+        listRelease(blocks);
+        raxFree(index);
+    }
+}
+
 /* Free lua_scripts dict, if the dict is huge enough, free it in async way. */
 void freeLuaScriptsAsync(dict *lua_scripts) {
     if (dictSize(lua_scripts) > LAZYFREE_THRESHOLD) {
@@ -229,3 +510,155 @@ void freeLuaScriptsAsync(dict *lua_scripts) {
         dictRelease(lua_scripts);
     }
 }
+
+/* ---------------------------------------------------------------------------
+ * Incremental free
+ *
+ * When 'lazyfree-incremental-budget' is set, huge values deleted
+ * synchronously (DEL without lazyfree, overwritten values, and so forth)
+ * are not released on the spot: the key is unlinked immediately, and the
+ * value is released a few elements at a time by incrementalFreeCycle(),
+ * that is called in beforeSleep() and never runs for more than the budget,
+ * so that deleting a huge value does not block the server.
+ * ------------------------------------------------------------------------- */
+
+#define INCREMENTAL_FREE_STEP 64 /* Buckets / nodes released per step. */
+
+typedef struct incrementalFree {
+    robj *obj;
+    int table;              /* Hash table being released (dict objects). */
+    unsigned long cursor;   /* Next bucket to release (dict objects). */
+    size_t items;           /* Entries or nodes not yet released. */
+    size_t memory;          /* Estimated memory not yet released. */
+} incrementalFree;
+
+static list *incremental_frees = NULL;
+
+/* Release up to INCREMENTAL_FREE_STEP buckets or nodes of the object,
+ * returning the number of released entries or nodes. The object itself is
+ * released, and 'f->obj' set to NULL, once it is empty. */
+static size_t incrementalFreeStep(incrementalFree *f) {
+    robj *obj = f->obj;
+    dict *d = lazyfreeObjectDict(obj);
+    size_t freed = 0;
+
+    if (d) {
+        while (f->table < 2 && f->cursor >= d->ht[f->table].size) {
+            f->table++;
+            f->cursor = 0;
+        }
+        if (f->table == 2) {
+            lazyfreeFreeContainers(obj,d,NULL);
+            f->obj = NULL;
+            return 0;
+        }
+        freed = lazyfreeFreeBuckets(obj,d,&d->ht[f->table],f->cursor,
+                                    INCREMENTAL_FREE_STEP);
+        f->cursor += INCREMENTAL_FREE_STEP;
+    } else if (obj->type == OBJ_LIST) {
+        quicklist *ql = obj->ptr;
+        quicklistNode *node;
+        while (freed < INCREMENTAL_FREE_STEP && (node = ql->head)) {
+            ql->head = node->next;
+            ql->count -= node->count;
+            ql->len--;
+            zfree(node->zl);
+            zfree(node);
+            freed++;
+        }
+        if (ql->head == NULL) {
+            ql->tail = NULL;
+            decrRefCount(obj);
+            f->obj = NULL;
+        }
+    } else if (obj->type == OBJ_STREAM) {
+        /* Remove the listpacks from the head of the stream radix tree, the
+         * consumer groups are released together with the empty stream. */
+        stream *s = obj->ptr;
+        raxIterator ri;
+        raxStart(&ri,s->rax);
+        while (freed < INCREMENTAL_FREE_STEP) {
+            raxSeek(&ri,"^",NULL,0);
+            if (!raxNext(&ri)) break;
+            lpFree(ri.data);
+            raxRemove(s->rax,ri.key,ri.key_len,NULL);
+            freed++;
+        }
+        raxStop(&ri);
+        if (raxSize(s->rax) == 0) {
+            decrRefCount(obj);
+            f->obj = NULL;
+        }
+    }
+    return freed;
+}
+
+/* If incremental freeing is enabled and the object is huge, unshared, and
+ * of a type that can be released incrementally, queue it for release by
+ * incrementalFreeCycle() and return 1. Otherwise 0 is returned and the
+ * caller should release the object as usually. */
+int freeObjIncrementally(robj *key, robj *obj) {
+    if (!server.lazyfree_incremental_budget || obj->refcount != 1) return 0;
+
+    size_t items;
+    dict *d = lazyfreeObjectDict(obj);
+    if (d) {
+        items = dictSize(d);
+    } else if (obj->type == OBJ_LIST &&
+               obj->encoding == OBJ_ENCODING_QUICKLIST) {
+        items = ((quicklist*)obj->ptr)->len;
+    } else if (obj->type == OBJ_STREAM) {
+        items = raxSize(((stream*)obj->ptr)->rax);
+    } else {
+        return 0;
+    }
+    if (lazyfreeGetFreeEffort(key,obj) <= LAZYFREE_THRESHOLD) return 0;
+
+    incrementalFree *f = zmalloc(sizeof(*f));
+    f->obj = obj;
+    f->table = 0;
+    f->cursor = 0;
+    f->items = items;
+    f->memory = objectComputeSize(obj,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+    if (incremental_frees == NULL) incremental_frees = listCreate();
+    listAddNodeTail(incremental_frees,f);
+    atomicIncr(lazyfree_objects,1);
+    atomicIncr(lazyfree_memory,f->memory);
+    return 1;
+}
+
+/* Release the objects queued by freeObjIncrementally(), oldest first,
+ * running for at most 'lazyfree-incremental-budget' microseconds. */
+void incrementalFreeCycle(void) {
+    if (incremental_frees == NULL || listLength(incremental_frees) == 0)
+        return;
+
+    long long start = ustime();
+    while (listLength(incremental_frees)) {
+        listNode *ln = listFirst(incremental_frees);
+        incrementalFree *f = listNodeValue(ln);
+
+        size_t freed = incrementalFreeStep(f);
+        if (f->obj == NULL) {
+            atomicDecr(lazyfree_memory,f->memory);
+            atomicDecr(lazyfree_objects,1);
+            atomicIncr(lazyfreed_objects,1);
+            zfree(f);
+            listDelNode(incremental_frees,ln);
+        } else if (freed) {
+            /* Account the released memory proportionally to the number
+             * of entries released. */
+            if (freed > f->items) freed = f->items;
+            size_t memory = f->items ? f->memory/f->items*freed : 0;
+            atomicDecr(lazyfree_memory,memory);
+            f->memory -= memory;
+            f->items -= freed;
+        }
+        if (ustime()-start >= server.lazyfree_incremental_budget) break;
+    }
+}
+
+/* Return the number of objects waiting to be released incrementally. */
+size_t incrementalFreePendingObjects(void) {
+    return incremental_frees ? listLength(incremental_frees) : 0;
+}
@@ -171,13 +171,20 @@ client *createClient(connection *conn) {
     c->replstate = REPL_STATE_NONE;
     c->repl_put_online_on_ack = 0;
     c->reploff = 0;
+    c->repl_applying_off = 0;
     c->read_reploff = 0;
     c->repl_ack_off = 0;
     c->repl_ack_time = 0;
     c->repl_last_partial_write = 0;
+    c->repldb_budget = 0;
+    c->ref_repl_buf_node = NULL;
+    c->ref_block_pos = 0;
+    c->ref_disk_seg_node = NULL;
+    c->repl_disk_off = 0;
     c->slave_listening_port = 0;
     c->slave_addr = NULL;
     c->slave_capa = SLAVE_CAPA_NONE;
+    c->slot_digests = NULL;
     c->reply = listCreate();
     c->deferred_reply_errors = NULL;
     c->reply_bytes = 0;
@@ -194,6 +201,10 @@ client *createClient(connection *conn) {
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
     c->woff = 0;
+    c->read_min_offset = 0;
+    c->read_max_lag = -1;
+    c->read_bound_timeout = 0;
+    c->aof_fsync_offset = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
     c->pubsub_patterns = listCreate();
@@ -281,6 +292,10 @@ int prepareClientToWrite(client *c) {
     if ((c->flags & CLIENT_MASTER) &&
         !(c->flags & CLIENT_MASTER_FORCE_REPLY)) return C_ERR;
 
+    /* Replicas don't receive replies either: they are only sent the
+     * replication stream, from the shared replication buffer. */
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) return C_ERR;
+
     if (!c->conn) return C_ERR; /* Fake client for AOF loading. */
 
     /* Schedule the client to write the output buffers to the socket, unless
@@ -492,7 +507,7 @@ void afterErrorReply(client *c, const char *s, size_t len) {
                              "to its %s: '%.*s' after processing the command "
                              "'%s'", from, to, (int)len, s, cmdname);
         if (ctype == CLIENT_TYPE_MASTER && server.repl_backlog &&
-            server.repl_backlog_histlen > 0)
+            server.repl_backlog->histlen > 0)
         {
             showLatestBacklog();
         }
@@ -1028,16 +1043,16 @@ void AddReplyFromClient(client *dst, client *src) {
     closeClientOnOutputBufferLimitReached(dst, 1);
 }
 
-/* Copy 'src' client output buffers into 'dst' client output buffers.
- * The function takes care of freeing the old output buffers of the
- * destination client. */
-void copyClientOutputBuffer(client *dst, client *src) {
-    listRelease(dst->reply);
-    dst->sentlen = 0;
-    dst->reply = listDup(src->reply);
-    memcpy(dst->buf,src->buf,src->bufpos);
-    dst->bufpos = src->bufpos;
-    dst->reply_bytes = src->reply_bytes;
+/* Make the replica 'dst' reference the same position of the shared
+ * replication buffer of the replica 'src', so that it will be sent the
+ * same replication stream. */
+void copyReplicaOutputBuffer(client *dst, client *src) {
+    serverAssert(src->bufpos == 0 && listLength(src->reply) == 0);
+
+    if (src->ref_repl_buf_node == NULL) return;
+    dst->ref_repl_buf_node = src->ref_repl_buf_node;
+    dst->ref_block_pos = src->ref_block_pos;
+    ((replBufBlock *)listNodeValue(dst->ref_repl_buf_node))->refcount++;
 }
 
 /* Append the listed errors to the server error statistics. the input
@@ -1055,6 +1070,21 @@ void deferredAfterErrorReply(client *c, list *errors) {
 /* Return true if the specified client has pending reply buffers to write to
  * the socket. */
 int clientHasPendingReplies(client *c) {
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+        /* Replicas use the shared replication buffer instead of a
+         * private output buffer. */
+        if (c->repl_disk_off) return 1;
+        if (c->ref_repl_buf_node == NULL) return 0;
+
+        /* If the last replication buffer block content is totally sent,
+         * we have nothing to send. */
+        listNode *ln = listLast(server.repl_buffer_blocks);
+        replBufBlock *tail = listNodeValue(ln);
+        if (ln == c->ref_repl_buf_node &&
+            c->ref_block_pos == tail->used) return 0;
+
+        return 1;
+    }
     return c->bufpos || listLength(c->reply);
 }
 
@@ -1379,8 +1409,8 @@ void unlinkClient(client *c) {
             int i;
             for (i=0; i < server.rdb_pipe_numconns; i++) {
                 if (server.rdb_pipe_conns[i] == c->conn) {
-                    rdbPipeWriteHandlerConnRemoved(c->conn);
                     server.rdb_pipe_conns[i] = NULL;
+                    rdbPipeWriteHandlerConnRemoved(c->conn);
                     break;
                 }
             }
@@ -1397,6 +1427,14 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_PENDING_WRITE;
     }
 
+    /* Remove from the list of clients waiting for the AOF fsync. */
+    if (c->flags & CLIENT_PENDING_AOF_FSYNC) {
+        ln = listSearchKey(server.clients_waiting_aof_fsync,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.clients_waiting_aof_fsync,ln);
+        c->flags &= ~CLIENT_PENDING_AOF_FSYNC;
+    }
+
     /* Remove from the list of pending reads if needed. */
     if (c->flags & CLIENT_PENDING_READ) {
         ln = listSearchKey(server.clients_pending_read,c);
@@ -1489,6 +1527,7 @@ void freeClient(client *c) {
 
     /* Free data structures. */
     listRelease(c->reply);
+    freeReplicaReferencedReplBuffer(c);
     freeClientArgv(c);
     freeClientOriginalArgv(c);
     if (c->deferred_reply_errors)
@@ -1556,6 +1595,7 @@ void freeClient(client *c) {
     sdsfree(c->peerid);
     sdsfree(c->sockname);
     sdsfree(c->slave_addr);
+    sdsfree(c->slot_digests);
     zfree(c);
 }
 
@@ -1629,7 +1669,38 @@ int writeToClient(client *c, int handler_installed) {
     clientReplyBlock *o;
 
     while(clientHasPendingReplies(c)) {
-        if (c->bufpos > 0) {
+        if (getClientType(c) == CLIENT_TYPE_SLAVE && c->repl_disk_off) {
+            /* Replicas that partially resynchronized from the disk backlog
+             * read it from disk first. Nothing accumulates in memory
+             * meanwhile, so let's serve the other clients as well. */
+            nwritten = writeToReplicaFromDiskBacklog(c);
+            if (nwritten <= 0) break;
+            totwritten += nwritten;
+            if (totwritten > NET_MAX_WRITES_PER_EVENT) break;
+        } else if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+            /* Replicas are sent the shared replication buffer, starting
+             * from the block they reference. */
+            replBufBlock *rb = listNodeValue(c->ref_repl_buf_node);
+            serverAssert(rb->used >= c->ref_block_pos);
+            if (rb->used > c->ref_block_pos) {
+                nwritten = connWrite(c->conn, rb->buf + c->ref_block_pos,
+                                     rb->used - c->ref_block_pos);
+                if (nwritten <= 0) break;
+                c->ref_block_pos += nwritten;
+                totwritten += nwritten;
+            }
+
+            /* If we fully sent the block, reference the next one, so that
+             * the backlog can release the blocks no replica needs anymore. */
+            listNode *next = listNextNode(c->ref_repl_buf_node);
+            if (next && c->ref_block_pos == rb->used) {
+                rb->refcount--;
+                ((replBufBlock *)listNodeValue(next))->refcount++;
+                c->ref_repl_buf_node = next;
+                c->ref_block_pos = 0;
+                incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+            }
+        } else if (c->bufpos > 0) {
             nwritten = connWrite(c->conn,c->buf+c->sentlen,c->bufpos-c->sentlen);
             if (nwritten <= 0) break;
             c->sentlen += nwritten;
@@ -1720,6 +1791,13 @@ int writeToClient(client *c, int handler_installed) {
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(connection *conn) {
     client *c = connGetPrivateData(conn);
+
+    /* New replies may have been appended that must wait for the AOF
+     * fsync: the handler is installed again once it completes. */
+    if (aofGroupCommitHoldClient(c)) {
+        connSetWriteHandler(c->conn, NULL);
+        return;
+    }
     writeToClient(c,1);
 }
 
@@ -1745,6 +1823,9 @@ int handleClientsWithPendingWrites(void) {
         /* Don't write to clients that are going to be closed anyway. */
         if (c->flags & CLIENT_CLOSE_ASAP) continue;
 
+        /* Don't reply before the AOF fsync covering the client writes. */
+        if (aofGroupCommitHoldClient(c)) continue;
+
         /* Try to write buffers to the client socket. */
         if (writeToClient(c,0) == C_ERR) continue;
 
@@ -2127,7 +2208,10 @@ void commandProcessed(client *c) {
     long long prev_offset = c->reploff;
     if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
         /* Update the applied replication offset of our master. */
-        c->reploff = c->read_reploff - sdslen(c->querybuf) + c->qb_pos;
+        if (server.repl_apply_thread)
+            c->reploff = c->repl_applying_off;
+        else
+            c->reploff = c->read_reploff - sdslen(c->querybuf) + c->qb_pos;
     }
 
     /* If the client is a master we need to compute the difference
@@ -2195,6 +2279,17 @@ int processPendingCommandsAndResetClient(client *c) {
  * or because a client was blocked and later reactivated, so there could be
  * pending query buffer, already representing a full command, to process. */
 void processInputBuffer(client *c) {
+    /* The replication stream is parsed by the replica apply thread. */
+    if (c->flags & CLIENT_MASTER && server.repl_apply_thread) {
+        replicaApplyParsedCommands(c);
+        return;
+    }
+
+    /* Time the parsing and the execution of the replication stream. */
+    monotime timer = 0;
+    long long apply_usec = 0;
+    if (c->flags & CLIENT_MASTER) elapsedStart(&timer);
+
     /* Keep processing while there is something in the input buffer */
     while(c->qb_pos < sdslen(c->querybuf)) {
         /* Immediately abort if the client is in the middle of something. */
@@ -2259,15 +2354,24 @@ void processInputBuffer(client *c) {
             }
 
             /* We are finally ready to execute the command. */
+            monotime apply_timer = 0;
+            int timed = c->flags & CLIENT_MASTER;
+            if (timed) elapsedStart(&apply_timer);
             if (processCommandAndResetClient(c) == C_ERR) {
                 /* If the client is no longer valid, we avoid exiting this
                  * loop and trimming the client buffer later. So we return
                  * ASAP in that case. */
                 return;
             }
+            if (timed) apply_usec += elapsedUs(apply_timer);
         }
     }
 
+    if (c->flags & CLIENT_MASTER) {
+        server.stat_repl_parse_usec += elapsedUs(timer) - apply_usec;
+        server.stat_repl_apply_usec += apply_usec;
+    }
+
     /* Trim to pos */
     if (c->qb_pos) {
         sdsrange(c->querybuf,c->qb_pos,-1);
@@ -2343,6 +2447,12 @@ void readQueryFromClient(connection *conn) {
         return;
     }
 
+    /* The replica apply thread parses the replication stream. */
+    if (c->flags & CLIENT_MASTER && server.repl_apply_thread) {
+        replicaApplyFeed(c);
+        return;
+    }
+
     /* There is more data in the client input buffer, continue parsing it
      * in case to check if there is a full command to execute. */
      processInputBuffer(c);
@@ -2581,6 +2691,10 @@ void resetCommand(client *c) {
         c->name = NULL;
     }
 
+    c->read_min_offset = 0;
+    c->read_max_lag = -1;
+    c->read_bound_timeout = 0;
+
     /* Selectively clear state flags not covered above */
     c->flags &= ~(CLIENT_ASKING|CLIENT_READONLY|CLIENT_PUBSUB|
             CLIENT_REPLY_OFF|CLIENT_REPLY_SKIP_NEXT);
@@ -2630,6 +2744,9 @@ void clientCommand(client *c) {
 "    Control the replies sent to the current connection.",
 "SETNAME <name>",
 "    Assign the name <name> to the current connection.",
+"STALENESS (OFF|[MAXLAG <ms>] [MINOFFSET <offset>] [TIMEOUT <ms>])",
+"    Bound the staleness of the reads served by a replica. Reads beyond the",
+"    bound wait up to TIMEOUT milliseconds for the replica to catch up.",
 "UNBLOCK <clientid> [TIMEOUT|ERROR]",
 "    Unblock the specified blocked client.",
 "TRACKING (ON|OFF) [REDIRECT <id>] [BCAST] [PREFIX <prefix> [...]]",
@@ -2821,10 +2938,13 @@ NULL
             != C_OK) return;
         struct client *target = lookupClientByID(id);
         if (target && target->flags & CLIENT_BLOCKED && moduleBlockedClientMayTimeout(target)) {
-            if (unblock_error)
+            if (unblock_error) {
+                /* A read blocked by CLIENT STALENESS is not executed. */
+                if (target->btype == BLOCKED_STALENESS)
+                    target->flags &= ~CLIENT_PENDING_COMMAND;
                 addReplyError(target,
                     "-UNBLOCKED client unblocked via CLIENT UNBLOCK");
-            else
+            } else
                 replyToBlockedClientTimedOut(target);
             unblockClient(target);
             addReply(c,shared.cone);
@@ -2841,6 +2961,51 @@ NULL
             addReplyBulk(c,c->name);
         else
             addReplyNull(c);
+    } else if (!strcasecmp(c->argv[1]->ptr,"staleness") && c->argc >= 3) {
+        /* CLIENT STALENESS OFF
+         * CLIENT STALENESS [MAXLAG <ms>] [MINOFFSET <offset>] [TIMEOUT <ms>] */
+        long long minoff = 0, maxlag = -1, timeout = 0;
+
+        if (c->argc == 3 && !strcasecmp(c->argv[2]->ptr,"off")) {
+            c->read_min_offset = 0;
+            c->read_max_lag = -1;
+            c->read_bound_timeout = 0;
+            addReply(c,shared.ok);
+            return;
+        }
+        for (int j = 2; j < c->argc; j += 2) {
+            long long *val;
+
+            if (j+1 == c->argc) {
+                addReplyErrorObject(c,shared.syntaxerr);
+                return;
+            }
+            if (!strcasecmp(c->argv[j]->ptr,"maxlag")) {
+                val = &maxlag;
+            } else if (!strcasecmp(c->argv[j]->ptr,"minoffset")) {
+                val = &minoff;
+            } else if (!strcasecmp(c->argv[j]->ptr,"timeout")) {
+                val = &timeout;
+            } else {
+                addReplyErrorObject(c,shared.syntaxerr);
+                return;
+            }
+            if (getLongLongFromObjectOrReply(c,c->argv[j+1],val,NULL) != C_OK)
+                return;
+            if (*val < 0) {
+                addReplyErrorFormat(c,"%s can't be negative",
+                    (char*)c->argv[j]->ptr);
+                return;
+            }
+        }
+        if (maxlag == -1 && minoff == 0) {
+            addReplyError(c,"CLIENT STALENESS needs MAXLAG or MINOFFSET");
+            return;
+        }
+        c->read_min_offset = minoff;
+        c->read_max_lag = maxlag;
+        c->read_bound_timeout = timeout;
+        addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"unpause") && c->argc == 2) {
         /* CLIENT UNPAUSE */
         unpauseClients();
@@ -3289,6 +3454,21 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
  * the caller wishes. The main usage of this function currently is
  * enforcing the client output length limits. */
 unsigned long getClientOutputBufferMemoryUsage(client *c) {
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+        /* The output buffer of a replica is the part of the shared
+         * replication buffer it still has to send: the blocks are
+         * contiguous in the list, so their ids tell how many they are. */
+        size_t repl_buf_size = 0;
+        size_t repl_node_num = 0;
+        size_t repl_node_size = sizeof(listNode) + sizeof(replBufBlock);
+        if (c->ref_repl_buf_node) {
+            replBufBlock *last = listNodeValue(listLast(server.repl_buffer_blocks));
+            replBufBlock *cur = listNodeValue(c->ref_repl_buf_node);
+            repl_buf_size = last->repl_offset + last->size - cur->repl_offset;
+            repl_node_num = last->id - cur->id + 1;
+        }
+        return repl_buf_size + (repl_node_size*repl_node_num);
+    }
     unsigned long list_item_size = sizeof(listNode) + sizeof(clientReplyBlock);
     return c->reply_bytes + (list_item_size*listLength(c->reply));
 }
@@ -3389,7 +3569,10 @@ int checkClientOutputBufferLimits(client *c) {
 int closeClientOnOutputBufferLimitReached(client *c, int async) {
     if (!c->conn) return 0; /* It is unsafe to free fake clients. */
     serverAssert(c->reply_bytes < SIZE_MAX-(1024*64));
-    if (c->reply_bytes == 0 || c->flags & CLIENT_CLOSE_ASAP) return 0;
+    /* Note that c->reply_bytes is irrelevant for replica clients: they
+     * reference the shared replication buffer. */
+    if ((c->reply_bytes == 0 && getClientType(c) != CLIENT_TYPE_SLAVE) ||
+        c->flags & CLIENT_CLOSE_ASAP) return 0;
     if (checkClientOutputBufferLimits(c)) {
         sds client = catClientInfoString(sdsempty(),c);
 
@@ -3745,12 +3928,21 @@ int handleClientsWithPendingWritesUsingThreads(void) {
         c->flags &= ~CLIENT_PENDING_WRITE;
 
         /* Remove clients from the list of pending writes since
-         * they are going to be closed ASAP. */
-        if (c->flags & CLIENT_CLOSE_ASAP) {
+         * they are going to be closed ASAP, or since they wait for
+         * the AOF fsync. */
+        if (c->flags & CLIENT_CLOSE_ASAP || aofGroupCommitHoldClient(c)) {
             listDelNode(server.clients_pending_write, ln);
             continue;
         }
 
+        /* The replicas and the replication backlog share the replication
+         * buffer, that is not thread safe: the main thread always serves
+         * the replicas. */
+        if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+            listAddNodeTail(io_threads_list[0],c);
+            continue;
+        }
+
         int target_id = item_id % server.io_threads_num;
         listAddNodeTail(io_threads_list[target_id],c);
         item_id++;
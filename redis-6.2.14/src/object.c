@@ -39,7 +39,7 @@
 /* ===================== Creation and parsing of objects ==================== */
 
 robj *createObject(int type, void *ptr) {
-    robj *o = zmalloc(sizeof(*o));
+    robj *o = zslab_malloc(ZSLAB_ROBJ,sizeof(*o));
     o->type = type;
     o->encoding = OBJ_ENCODING_RAW;
     o->ptr = ptr;
@@ -49,6 +49,8 @@ robj *createObject(int type, void *ptr) {
      * alternatively the LFU counter. */
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
+    } else if (server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU) {
+        o->lru = LRU_CLOCK() & TINYLFU_CLOCK_MAX; /* In the window. */
     } else {
         o->lru = LRU_CLOCK();
     }
@@ -91,6 +93,8 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     o->refcount = 1;
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
+    } else if (server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU) {
+        o->lru = LRU_CLOCK() & TINYLFU_CLOCK_MAX; /* In the window. */
     } else {
         o->lru = LRU_CLOCK();
     }
@@ -286,6 +290,39 @@ robj *createStreamObject(void) {
     return o;
 }
 
+/* Number of compressed bitmaps alive, see rdbSaveRio(). They may be freed
+ * by the lazyfree threads. */
+static redisAtomic long long bitmap_objects = 0;
+
+robj *createBitmapObjectFromRoaring(roaring *r) {
+    robj *o = createObject(OBJ_BITMAP,r);
+    o->encoding = OBJ_ENCODING_ROARING;
+    atomicIncr(bitmap_objects,1);
+    return o;
+}
+
+robj *createBitmapObject(void) {
+    return createBitmapObjectFromRoaring(roaringNew());
+}
+
+/* Return true if there may be compressed bitmaps in the dataset. */
+int bitmapObjectsExist(void) {
+    long long count;
+    atomicGet(bitmap_objects,count);
+    return count != 0;
+}
+
+/* Create a string object holding the bits of the compressed bitmap 'o',
+ * like the one SETBIT creates when compressed-bitmaps is disabled. Used by
+ * the string commands, that see compressed bitmaps as such strings. */
+robj *createStringObjectFromBitmap(robj *o) {
+    roaring *r = o->ptr;
+    sds s = sdsnewlen(SDS_NOINIT,r->bytes);
+
+    roaringToBytes(r,(unsigned char*)s,0,r->bytes);
+    return createObject(OBJ_STRING,s);
+}
+
 robj *createModuleObject(moduleType *mt, void *value) {
     moduleValue *mv = zmalloc(sizeof(*mv));
     mv->type = mt;
@@ -361,6 +398,11 @@ void freeStreamObject(robj *o) {
     freeStream(o->ptr);
 }
 
+void freeBitmapObject(robj *o) {
+    roaringFree(o->ptr);
+    atomicDecr(bitmap_objects,1);
+}
+
 void incrRefCount(robj *o) {
     if (o->refcount < OBJ_FIRST_SPECIAL_REFCOUNT) {
         o->refcount++;
@@ -383,6 +425,7 @@ void decrRefCount(robj *o) {
         case OBJ_HASH: freeHashObject(o); break;
         case OBJ_MODULE: freeModuleObject(o); break;
         case OBJ_STREAM: freeStreamObject(o); break;
+        case OBJ_BITMAP: freeBitmapObject(o); break;
         default: serverPanic("Unknown object type"); break;
         }
         zfree(o);
@@ -603,8 +646,10 @@ int equalStringObjects(robj *a, robj *b) {
 }
 
 size_t stringObjectLen(robj *o) {
-    serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
-    if (sdsEncodedObject(o)) {
+    serverAssertWithInfo(NULL,o,o->type == OBJ_STRING || o->type == OBJ_BITMAP);
+    if (o->type == OBJ_BITMAP) {
+        return ((roaring*)o->ptr)->bytes;
+    } else if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);
     } else {
         return sdigits10((long)o->ptr);
@@ -770,6 +815,7 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
     case OBJ_ENCODING_EMBSTR: return "embstr";
     case OBJ_ENCODING_STREAM: return "stream";
+    case OBJ_ENCODING_ROARING: return "roaring";
     default: return "unknown";
     }
 }
@@ -800,11 +846,46 @@ size_t streamRadixTreeMemoryUsage(rax *rax) {
     return size;
 }
 
+/* Consumer groups also have a non trivial memory overhead if there
+ * are many consumers and many groups, let's count at least the
+ * overhead of the pending entries in the groups and consumers
+ * PELs. */
+static size_t streamConsumerGroupsSize(stream *s) {
+    size_t asize = 0;
+    raxIterator ri;
+
+    if (s->cgroups == NULL) return 0;
+    raxStart(&ri,s->cgroups);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        streamCG *cg = ri.data;
+        asize += sizeof(*cg);
+        asize += streamRadixTreeMemoryUsage(cg->pel);
+        asize += sizeof(streamNACK)*raxSize(cg->pel);
+
+        /* For each consumer we also need to add the basic data
+         * structures and the PEL memory usage. */
+        raxIterator cri;
+        raxStart(&cri,cg->consumers);
+        raxSeek(&cri,"^",NULL,0);
+        while(raxNext(&cri)) {
+            streamConsumer *consumer = cri.data;
+            asize += sizeof(*consumer);
+            asize += sdslen(consumer->name);
+            asize += streamRadixTreeMemoryUsage(consumer->pel);
+            /* Don't count NACKs again, they are shared with the
+             * consumer group PEL. */
+        }
+        raxStop(&cri);
+    }
+    raxStop(&ri);
+    return asize;
+}
+
 /* Returns the size in bytes consumed by the key's value in RAM.
  * Note that the returned value is just an approximation, especially in the
  * case of aggregated data types where only "sample_size" elements
  * are checked and averaged to estimate the total size. */
-#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
 size_t objectComputeSize(robj *o, size_t sample_size) {
     sds ele, ele2;
     dict *d;
@@ -867,7 +948,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                     zmalloc_size(zsl->header);
             while(znode != NULL && samples < sample_size) {
                 elesize += sdsZmallocSize(znode->ele);
-                elesize += sizeof(struct dictEntry) + zmalloc_size(znode);
+                elesize += sizeof(struct dictEntry) + zslab_malloc_size(znode);
                 samples++;
                 znode = znode->level[0].forward;
             }
@@ -927,36 +1008,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         }
         raxStop(&ri);
 
-        /* Consumer groups also have a non trivial memory overhead if there
-         * are many consumers and many groups, let's count at least the
-         * overhead of the pending entries in the groups and consumers
-         * PELs. */
-        if (s->cgroups) {
-            raxStart(&ri,s->cgroups);
-            raxSeek(&ri,"^",NULL,0);
-            while(raxNext(&ri)) {
-                streamCG *cg = ri.data;
-                asize += sizeof(*cg);
-                asize += streamRadixTreeMemoryUsage(cg->pel);
-                asize += sizeof(streamNACK)*raxSize(cg->pel);
-
-                /* For each consumer we also need to add the basic data
-                 * structures and the PEL memory usage. */
-                raxIterator cri;
-                raxStart(&cri,cg->consumers);
-                raxSeek(&cri,"^",NULL,0);
-                while(raxNext(&cri)) {
-                    streamConsumer *consumer = cri.data;
-                    asize += sizeof(*consumer);
-                    asize += sdslen(consumer->name);
-                    asize += streamRadixTreeMemoryUsage(consumer->pel);
-                    /* Don't count NACKs again, they are shared with the
-                     * consumer group PEL. */
-                }
-                raxStop(&cri);
-            }
-            raxStop(&ri);
-        }
+        asize += streamConsumerGroupsSize(s);
     } else if (o->type == OBJ_MODULE) {
         moduleValue *mv = o->ptr;
         moduleType *mt = mv->type;
@@ -965,6 +1017,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else {
             asize = 0;
         }
+    } else if (o->type == OBJ_BITMAP) {
+        asize = sizeof(*o)+roaringAllocSize(o->ptr);
     } else {
         serverPanic("Unknown object type");
     }
@@ -1009,16 +1063,29 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
 
     mem_total += server.initial_memory_usage;
 
-    mem = 0;
-    if (server.repl_backlog)
-        mem += zmalloc_size(server.repl_backlog);
-    mh->repl_backlog = mem;
-    mem_total += mem;
+    /* The replication buffer is shared by the backlog and the replicas:
+     * the part exceeding the backlog size is accounted to the replicas. */
+    if (listLength(server.slaves) &&
+        (long long)server.repl_buffer_mem > server.repl_backlog_size)
+    {
+        mh->clients_slaves = server.repl_buffer_mem - server.repl_backlog_size;
+        mh->repl_backlog = server.repl_backlog_size;
+    } else {
+        mh->clients_slaves = 0;
+        mh->repl_backlog = server.repl_buffer_mem;
+    }
+    if (server.repl_backlog) {
+        /* The approximate memory of rax tree for indexed blocks. */
+        mh->repl_backlog +=
+            server.repl_backlog->blocks_index->numnodes * sizeof(raxNode) +
+            raxSize(server.repl_backlog->blocks_index) * sizeof(void*);
+    }
+    mem_total += mh->repl_backlog;
 
     /* Computing the memory used by the clients would be O(N) if done
      * here online. We use our values computed incrementally by
      * clientsCronTrackClientsMemUsage(). */
-    mh->clients_slaves = server.stat_clients_type_memory[CLIENT_TYPE_SLAVE];
+    mh->clients_slaves += server.stat_clients_type_memory[CLIENT_TYPE_SLAVE];
     mh->clients_normal = server.stat_clients_type_memory[CLIENT_TYPE_MASTER]+
                          server.stat_clients_type_memory[CLIENT_TYPE_PUBSUB]+
                          server.stat_clients_type_memory[CLIENT_TYPE_NORMAL];
@@ -1028,7 +1095,6 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mem = 0;
     if (server.aof_state != AOF_OFF) {
         mem += sdsZmallocSize(server.aof_buf);
-        mem += aofRewriteBufferSize();
     }
     mh->aof_buffer = mem;
     mem_total+=mem;
@@ -1048,6 +1114,10 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
         long long keyscount = dictSize(db->dict);
+
+        mem = expireIndexMemory(db);
+        mh->expire_index += mem;
+        mem_total+=mem;
         if (keyscount==0) continue;
 
         mh->total_keys += keyscount;
@@ -1232,12 +1302,318 @@ int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
          * some time. */
         if (lru_abs < 0)
             lru_abs = (lru_clock+(LRU_CLOCK_MAX/2)) % LRU_CLOCK_MAX;
-        val->lru = lru_abs;
+        if (server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU) {
+            val->lru = (val->lru & TINYLFU_ADMITTED) |
+                       (lru_abs & TINYLFU_CLOCK_MAX);
+        } else {
+            val->lru = lru_abs;
+        }
         return 1;
     }
     return 0;
 }
 
+/* ======================= Tracked object sizes ============================
+ *
+ * The size of the aggregate values encoded as hash tables, skiplists,
+ * quicklists and streams is maintained incrementally, so that it can be
+ * queried in constant time, without the sampling of objectComputeSize().
+ *
+ * Every encoding has a 'tracked_size' field holding the memory used by the
+ * elements of the value: the parts of the value that objectComputeSize()
+ * computes without sampling (the object headers, the hash table buckets,
+ * the consumer groups of streams) are computed on demand instead.
+ *
+ * The mutation paths of the types bracket their changes to the value with
+ * objectSizeTrackStart() and objectSizeTrackEnd(): the memory allocated
+ * and released by the thread in between is attributed to the value.
+ * Allocations made before the bracket and handed over to the value, or
+ * made in the bracket but handed to the caller, are reported with
+ * objectSizeTrackAdd(). Brackets can be nested: the memory attributed by
+ * an inner bracket is not attributed again by the outer one.
+ *
+ * Values created without brackets (RESTORE, the *STORE commands, encoding
+ * conversions, ...) have a zero tracked size, and are lazily estimated by
+ * objectGetMemory() with a sampled objectComputeSize(), after which their
+ * size is maintained incrementally. RDB loading measures the values it
+ * creates instead. */
+
+/* Memory attributed to the tracked values by the brackets of this thread,
+ * so that enclosing brackets don't count it twice. */
+static __thread long long size_tracked_memory = 0;
+
+/* Return a pointer to the tracked size field of the value, or NULL if the
+ * size of its encoding is not tracked, since computing it is cheap. */
+static size_t *objectTrackedSizeRef(robj *o) {
+    switch(o->encoding) {
+    case OBJ_ENCODING_HT:
+        return (o->type == OBJ_SET || o->type == OBJ_HASH) ?
+               &((dict*)o->ptr)->tracked_size : NULL;
+    case OBJ_ENCODING_SKIPLIST: return &((zset*)o->ptr)->dict->tracked_size;
+    case OBJ_ENCODING_QUICKLIST: return &((quicklist*)o->ptr)->tracked_size;
+    case OBJ_ENCODING_STREAM: return &((stream*)o->ptr)->tracked_size;
+    default: return NULL;
+    }
+}
+
+/* The part of the size of the value that is not tracked, see above. */
+static size_t objectUntrackedSize(robj *o) {
+    size_t size = sizeof(*o);
+    dict *d;
+
+    switch(o->encoding) {
+    case OBJ_ENCODING_HT:
+        d = o->ptr;
+        size += sizeof(dict)+(sizeof(struct dictEntry*)*dictSlots(d));
+        break;
+    case OBJ_ENCODING_SKIPLIST:
+        d = ((zset*)o->ptr)->dict;
+        size += sizeof(zset)+sizeof(zskiplist)+sizeof(dict)+
+                (sizeof(struct dictEntry*)*dictSlots(d))+
+                zmalloc_size(((zset*)o->ptr)->zsl->header);
+        break;
+    case OBJ_ENCODING_QUICKLIST: size += sizeof(quicklist); break;
+    case OBJ_ENCODING_STREAM:
+        size += sizeof(stream)+streamConsumerGroupsSize(o->ptr);
+        break;
+    }
+    return size;
+}
+
+/* A tracked size of zero for a value having elements means the size was
+ * never computed. */
+static int objectTrackedSizeIsStale(robj *o, size_t *ref) {
+    if (*ref) return 0;
+    switch(o->encoding) {
+    case OBJ_ENCODING_HT: return dictSize((dict*)o->ptr) != 0;
+    case OBJ_ENCODING_SKIPLIST: return dictSize(((zset*)o->ptr)->dict) != 0;
+    case OBJ_ENCODING_QUICKLIST: return ((quicklist*)o->ptr)->len != 0;
+    case OBJ_ENCODING_STREAM: return raxSize(((stream*)o->ptr)->rax) != 0;
+    default: return 0;
+    }
+}
+
+/* Set the tracked size of the value given its total size 'total', as
+ * measured while creating it, or estimated. */
+void objectSetTrackedSize(robj *o, long long total) {
+    size_t *ref = objectTrackedSizeRef(o);
+    if (ref == NULL) return;
+
+    long long untracked = objectUntrackedSize(o);
+    *ref = total > untracked ? total-untracked : 0;
+}
+
+static void sizeTrackStart(objectSizeTracker *t, robj *o, size_t *ref,
+                           size_t untracked, int stale)
+{
+    t->o = o;
+    t->ref = ref;
+    t->encoding = o ? o->encoding : OBJ_ENCODING_STREAM;
+    t->untracked = untracked;
+    t->stale = stale;
+    t->mem = zmalloc_thread_used_memory();
+    t->attributed = size_tracked_memory;
+}
+
+/* Start attributing to the value 'o' the memory allocated by this thread. */
+void objectSizeTrackStart(objectSizeTracker *t, robj *o) {
+    size_t *ref = objectTrackedSizeRef(o);
+    if (ref == NULL) {
+        sizeTrackStart(t,o,NULL,0,0);
+    } else {
+        sizeTrackStart(t,o,ref,objectUntrackedSize(o),
+                       objectTrackedSizeIsStale(o,ref));
+    }
+}
+
+/* Like objectSizeTrackStart(), for the code working on the stream itself
+ * rather than on its object. Only the stream entries are tracked: the size
+ * of the consumer groups is part of objectUntrackedSize(). */
+void streamSizeTrackStart(objectSizeTracker *t, stream *s) {
+    sizeTrackStart(t,NULL,&s->tracked_size,sizeof(*s),
+                   s->tracked_size == 0 && raxSize(s->rax) != 0);
+}
+
+/* Attribute to the value 'bytes' allocated out of the bracket, or when
+ * negative, allocated in the bracket but not owned by the value. */
+void objectSizeTrackAdd(objectSizeTracker *t, long long bytes) {
+    t->mem -= bytes;
+}
+
+/* Stop the bracket, updating the tracked size of the value. */
+void objectSizeTrackEnd(objectSizeTracker *t) {
+    long long delta = (zmalloc_thread_used_memory()-t->mem) -
+                      (size_tracked_memory-t->attributed);
+    size_tracked_memory += delta;
+
+    /* The value was converted to another encoding: the new one, created out
+     * of any bracket, is measured lazily. The same for stale sizes. */
+    if (t->ref == NULL || t->stale) return;
+    if (t->o && (t->o->encoding != t->encoding ||
+                 objectTrackedSizeRef(t->o) != t->ref)) return;
+
+    if (t->o) delta -= (long long)objectUntrackedSize(t->o)-t->untracked;
+    if (delta < 0 && (size_t)-delta > *t->ref) *t->ref = 0;
+    else *t->ref += delta;
+}
+
+/* Return the memory used by the value in constant time for the tracked
+ * encodings, estimating the tracked size with the default samples if never
+ * computed before: this is called by eviction and on every write, so the
+ * value is never traversed. For the other encodings this is
+ * objectComputeSize() with the default samples. */
+size_t objectGetMemory(robj *o) {
+    size_t *ref = objectTrackedSizeRef(o);
+    if (ref == NULL) return objectComputeSize(o,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+    if (objectTrackedSizeIsStale(o,ref)) {
+        size_t estimate = objectComputeSize(o,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+        objectSetTrackedSize(o,estimate);
+    }
+    return objectUntrackedSize(o)+*ref;
+}
+
+/* Memory used by the key at the main dictionary entry 'de', like reported
+ * by MEMORY USAGE. */
+static size_t keyGetMemory(dictEntry *de) {
+    return objectGetMemory(dictGetVal(de))+sdsZmallocSize(dictGetKey(de))+
+           sizeof(dictEntry);
+}
+
+/* ============================= Heavy keys =================================
+ *
+ * The 'memory-top-keys' largest keys of the dataset, updated every time a
+ * key is modified by memoryTopKeysUpdate(), called by signalModifiedKey(),
+ * so that MEMORY TOP-KEYS can report them without scanning the keyspace.
+ *
+ * This is approximated: a key is only considered when it is modified, and
+ * a key that left the set when another key grew is not reconsidered until
+ * it is modified again. Keys deleted without signalModifiedKey() are
+ * dropped by MEMORY TOP-KEYS. */
+
+typedef struct heavyKey {
+    int dbid;
+    sds key;
+    size_t size;        /* Memory usage at the last update. */
+} heavyKey;
+
+static heavyKey *heavy_keys = NULL;
+static int heavy_keys_count = 0;
+static int heavy_keys_size = 0;     /* Allocated entries. */
+
+static int heavyKeyFind(int dbid, sds key) {
+    size_t keylen = sdslen(key);
+    for (int j = 0; j < heavy_keys_count; j++) {
+        heavyKey *hk = heavy_keys+j;
+        if (hk->dbid == dbid && sdslen(hk->key) == keylen &&
+            memcmp(hk->key,key,keylen) == 0) return j;
+    }
+    return -1;
+}
+
+static void heavyKeyRemove(int j) {
+    sdsfree(heavy_keys[j].key);
+    heavy_keys[j] = heavy_keys[--heavy_keys_count];
+}
+
+static int heavyKeyCompare(const void *a, const void *b) {
+    const heavyKey *ha = a, *hb = b;
+    if (ha->size == hb->size) return 0;
+    return ha->size < hb->size ? 1 : -1;
+}
+
+/* Resize the heavy keys set to 'memory-top-keys' keys, keeping the largest
+ * ones when shrinking. Called on demand after the config changes. */
+static void heavyKeysResize(void) {
+    if (heavy_keys_size == server.memory_top_keys) return;
+    if (heavy_keys_count > server.memory_top_keys) {
+        qsort(heavy_keys,heavy_keys_count,sizeof(heavyKey),heavyKeyCompare);
+        while (heavy_keys_count > server.memory_top_keys)
+            heavyKeyRemove(heavy_keys_count-1);
+    }
+    heavy_keys_size = server.memory_top_keys;
+    if (heavy_keys_size == 0) {
+        zfree(heavy_keys);
+        heavy_keys = NULL;
+    } else {
+        heavy_keys = zrealloc(heavy_keys,sizeof(heavyKey)*heavy_keys_size);
+    }
+}
+
+/* Update the size of 'key', that was just modified, in the heavy keys. */
+void memoryTopKeysUpdate(redisDb *db, robj *key) {
+    heavyKeysResize();
+    if (server.memory_top_keys == 0) return;
+
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    int j = heavyKeyFind(db->id,key->ptr);
+    if (de == NULL) {
+        if (j != -1) heavyKeyRemove(j);
+        return;
+    }
+
+    size_t size = keyGetMemory(de);
+    if (j != -1) {
+        heavy_keys[j].size = size;
+        return;
+    }
+    if (heavy_keys_count < server.memory_top_keys) {
+        j = heavy_keys_count++;
+    } else {
+        /* Replace the smallest key, if smaller than this one. */
+        int min = 0;
+        for (j = 1; j < heavy_keys_count; j++)
+            if (heavy_keys[j].size < heavy_keys[min].size) min = j;
+        if (heavy_keys[min].size >= size) return;
+        j = min;
+        sdsfree(heavy_keys[j].key);
+    }
+    heavy_keys[j].dbid = db->id;
+    heavy_keys[j].key = sdsdup(key->ptr);
+    heavy_keys[j].size = size;
+}
+
+/* Forget the heavy keys of the DB 'dbid', or of all the DBs if -1. */
+void memoryTopKeysFlush(int dbid) {
+    for (int j = heavy_keys_count-1; j >= 0; j--)
+        if (dbid == -1 || heavy_keys[j].dbid == dbid) heavyKeyRemove(j);
+}
+
+/* Called by SWAPDB, the keys of the two DBs move with them. */
+void memoryTopKeysSwapDb(int id1, int id2) {
+    for (int j = 0; j < heavy_keys_count; j++) {
+        if (heavy_keys[j].dbid == id1) heavy_keys[j].dbid = id2;
+        else if (heavy_keys[j].dbid == id2) heavy_keys[j].dbid = id1;
+    }
+}
+
+/* MEMORY TOP-KEYS [<count>] */
+static void memoryTopKeysCommand(client *c) {
+    long count = server.memory_top_keys;
+
+    if (c->argc == 3 &&
+        getRangeLongFromObjectOrReply(c,c->argv[2],0,LONG_MAX,&count,NULL)
+        != C_OK) return;
+
+    /* Refresh the sizes, dropping the keys that don't exist anymore. */
+    heavyKeysResize();
+    for (int j = heavy_keys_count-1; j >= 0; j--) {
+        dictEntry *de = dictFind(server.db[heavy_keys[j].dbid].dict,
+                                 heavy_keys[j].key);
+        if (de == NULL) heavyKeyRemove(j);
+        else heavy_keys[j].size = keyGetMemory(de);
+    }
+    qsort(heavy_keys,heavy_keys_count,sizeof(heavyKey),heavyKeyCompare);
+
+    if (count > heavy_keys_count) count = heavy_keys_count;
+    addReplyArrayLen(c,count);
+    for (int j = 0; j < count; j++) {
+        addReplyArrayLen(c,3);
+        addReplyLongLong(c,heavy_keys[j].dbid);
+        addReplyBulkCBuffer(c,heavy_keys[j].key,sdslen(heavy_keys[j].key));
+        addReplyLongLong(c,heavy_keys[j].size);
+    }
+}
+
 /* ======================= The OBJECT and MEMORY commands =================== */
 
 /* This is a helper function for the OBJECT command. We need to lookup keys
@@ -1293,6 +1669,11 @@ NULL
     } else if (!strcasecmp(c->argv[1]->ptr,"freq") && c->argc == 3) {
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.null[c->resp]))
                 == NULL) return;
+        if (server.maxmemory_policy & MAXMEMORY_FLAG_TINYLFU) {
+            /* The estimated frequency of the key in the sketch. */
+            addReplyLongLong(c,tinylfuFrequency(c->argv[2]->ptr));
+            return;
+        }
         if (!(server.maxmemory_policy & MAXMEMORY_FLAG_LFU)) {
             addReplyError(c,"An LFU maxmemory policy is not selected, access frequency not tracked. Please note that when switching between policies at runtime LRU and LFU data will take some time to adjust.");
             return;
@@ -1322,15 +1703,19 @@ void memoryCommand(client *c) {
 "    Attempt to purge dirty pages for reclamation by the allocator.",
 "STATS",
 "    Return information about the memory usage of the server.",
+"TOP-KEYS [<count>]",
+"    Return the <count> largest keys (default: all the tracked ones), as",
+"    [db, key, bytes] arrays, see the memory-top-keys config.",
 "USAGE <key> [SAMPLES <count>]",
-"    Return memory in bytes used by <key> and its value. Nested values are",
-"    sampled up to <count> times (default: 5).",
+"    Return memory in bytes used by <key> and its value. Without SAMPLES the",
+"    tracked size of the value is returned in constant time. Otherwise nested",
+"    values are sampled up to <count> times (0 for all the values).",
 NULL
         };
         addReplyHelp(c, help);
     } else if (!strcasecmp(c->argv[1]->ptr,"usage") && c->argc >= 3) {
         dictEntry *de;
-        long long samples = OBJ_COMPUTE_SIZE_DEF_SAMPLES;
+        long long samples = 0;
         for (int j = 3; j < c->argc; j++) {
             if (!strcasecmp(c->argv[j]->ptr,"samples") &&
                 j+1 < c->argc)
@@ -1352,14 +1737,21 @@ NULL
             addReplyNull(c);
             return;
         }
-        size_t usage = objectComputeSize(dictGetVal(de),samples);
-        usage += sdsZmallocSize(dictGetKey(de));
-        usage += sizeof(dictEntry);
+        size_t usage;
+        if (samples == 0) {
+            usage = keyGetMemory(de);
+        } else {
+            usage = objectComputeSize(dictGetVal(de),samples);
+            usage += sdsZmallocSize(dictGetKey(de));
+            usage += sizeof(dictEntry);
+        }
         addReplyLongLong(c,usage);
+    } else if (!strcasecmp(c->argv[1]->ptr,"top-keys") && c->argc <= 3) {
+        memoryTopKeysCommand(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
 
-        addReplyMapLen(c,25+mh->num_dbs);
+        addReplyMapLen(c,26+mh->num_dbs);
 
         addReplyBulkCString(c,"peak.allocated");
         addReplyLongLong(c,mh->peak_allocated);
@@ -1385,6 +1777,9 @@ NULL
         addReplyBulkCString(c,"lua.caches");
         addReplyLongLong(c,mh->lua_caches);
 
+        addReplyBulkCString(c,"expire.index");
+        addReplyLongLong(c,mh->expire_index);
+
         for (size_t j = 0; j < mh->num_dbs; j++) {
             char dbname[32];
             snprintf(dbname,sizeof(dbname),"db.%zd",mh->db[j].dbid);
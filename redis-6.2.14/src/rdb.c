@@ -28,6 +28,7 @@
  */
 
 #include "server.h"
+#include "cluster.h"
 #include "lzf.h"    /* LZF compression library */
 #include "zipmap.h"
 #include "endianconv.h"
@@ -695,6 +696,8 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
             serverPanic("Unknown hash encoding");
     case OBJ_STREAM:
         return rdbSaveType(rdb,RDB_TYPE_STREAM_LISTPACKS);
+    case OBJ_BITMAP:
+        return rdbSaveType(rdb,RDB_TYPE_BITMAP_ROARING);
     case OBJ_MODULE:
         return rdbSaveType(rdb,RDB_TYPE_MODULE_2);
     default:
@@ -863,9 +866,15 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             }
             dictReleaseIterator(di);
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
-            size_t l = intsetBlobLen((intset*)o->ptr);
+            intset *is = o->ptr;
 
-            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            /* The packed layout is only used in memory. */
+            if (intsetIsPacked(is)) is = intsetUnpack(is);
+            size_t l = intsetBlobLen(is);
+
+            n = rdbSaveRawString(rdb,(unsigned char*)is,l);
+            if (is != o->ptr) zfree(is);
+            if (n == -1) return -1;
             nwritten += n;
         } else {
             serverPanic("Unknown set encoding");
@@ -1063,6 +1072,13 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             zfree(io.ctx);
         }
         return io.error ? -1 : (ssize_t)io.bytes;
+    } else if (o->type == OBJ_BITMAP) {
+        /* Save the roaring bitmap serialized as a single string. */
+        size_t len;
+        unsigned char *buf = roaringSerialize(o->ptr,&len);
+        nwritten = rdbSaveRawString(rdb,buf,len);
+        zfree(buf);
+        if (nwritten == -1) return -1;
     } else {
         serverPanic("Unknown object type");
     }
@@ -1214,6 +1230,21 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
     return io.bytes;
 }
 
+/* Return the number of keys of 'd' in the hash slots set in 'slots'. */
+static uint64_t rdbCountSlotsKeys(dict *d, unsigned char *slots) {
+    dictIterator *di = dictGetIterator(d);
+    dictEntry *de;
+    uint64_t count = 0;
+
+    while((de = dictNext(di)) != NULL) {
+        sds keystr = dictGetKey(de);
+        if (slotBitmapTest(slots,keyHashSlot(keystr,sdslen(keystr))))
+            count++;
+    }
+    dictReleaseIterator(di);
+    return count;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -1227,23 +1258,49 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
     dictEntry *de;
     char magic[10];
     uint64_t cksum;
-    size_t processed = 0;
     int j;
     long key_count = 0;
     long long info_updated_time = 0;
     char *pname = (rdbflags & RDBFLAGS_AOF_PREAMBLE) ? "AOF rewrite" :  "RDB";
+    unsigned char diff_slots[CLUSTER_SLOTS/8];
+    int diff = rsi && rsi->slot_digests;
+
+    /* For a diff resync only the slots that differ from the replica are
+     * saved, and their list is sent first, so that the replica can drop
+     * its own keys in those slots before loading ours. */
+    if (diff) {
+        int count = slotDigestDiff(rsi->slot_digests,diff_slots);
+        serverAssert(count != -1);
+        serverLog(LL_NOTICE,"Diff resync: %d of %d slots differ from the "
+                            "replica", count, CLUSTER_SLOTS);
+    }
 
     if (server.rdb_checksum)
         rdb->update_cksum = rioGenericUpdateChecksum;
-    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    /* Only the files holding compressed bitmaps need their version. */
+    snprintf(magic,sizeof(magic),"REDIS%04d",
+             bitmapObjectsExist() ? RDB_VERSION_BITMAP : RDB_VERSION);
     if (rdbWriteRaw(rdb,magic,9) == -1) goto werr;
     if (rdbSaveInfoAuxFields(rdb,rdbflags,rsi) == -1) goto werr;
+    if (diff && rdbSaveAuxField(rdb,"diff-slots",10,diff_slots,
+                                sizeof(diff_slots)) == -1) goto werr;
     if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_BEFORE_RDB) == -1) goto werr;
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
         dict *d = db->dict;
         if (dictSize(d) == 0) continue;
+
+        /* A diff only holds the keys of the slots that differ. */
+        uint64_t db_size, expires_size;
+        if (diff) {
+            db_size = rdbCountSlotsKeys(db->dict,diff_slots);
+            if (db_size == 0) continue;
+            expires_size = rdbCountSlotsKeys(db->expires,diff_slots);
+        } else {
+            db_size = dictSize(db->dict);
+            expires_size = dictSize(db->expires);
+        }
         di = dictGetSafeIterator(d);
 
         /* Write the SELECT DB opcode */
@@ -1251,9 +1308,6 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         if (rdbSaveLen(rdb,j) == -1) goto werr;
 
         /* Write the RESIZE DB opcode. */
-        uint64_t db_size, expires_size;
-        db_size = dictSize(db->dict);
-        expires_size = dictSize(db->expires);
         if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
@@ -1264,20 +1318,13 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
             robj key, *o = dictGetVal(de);
             long long expire;
 
+            if (diff && !slotBitmapTest(diff_slots,
+                                        keyHashSlot(keystr,sdslen(keystr))))
+                continue;
             initStaticStringObject(key,keystr);
             expire = getExpire(db,&key);
             if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
 
-            /* When this RDB is produced as part of an AOF rewrite, move
-             * accumulated diff from parent to child while rewriting in
-             * order to have a smaller final write. */
-            if (rdbflags & RDBFLAGS_AOF_PREAMBLE &&
-                rdb->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES)
-            {
-                processed = rdb->processed_bytes;
-                aofReadDiffFromParent();
-            }
-
             /* Update child info every 1 second (approximately).
              * in order to avoid calling mstime() on each iteration, we will
              * check the diff every 1024 keys */
@@ -1968,6 +2015,8 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                 o->encoding = OBJ_ENCODING_INTSET;
                 if (intsetLen(o->ptr) > server.set_max_intset_entries)
                     setTypeConvert(o,OBJ_ENCODING_HT);
+                else
+                    o->ptr = intsetPack(o->ptr);
                 break;
             case RDB_TYPE_ZSET_ZIPLIST:
                 if (deep_integrity_validation) server.stat_dump_payload_sanitizations++;
@@ -2257,6 +2306,20 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int *error) {
                 raxStop(&ri_cg_pel);
             }
         }
+    } else if (rdbtype == RDB_TYPE_BITMAP_ROARING) {
+        size_t encoded_len;
+        unsigned char *encoded =
+            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
+        if (encoded == NULL) return NULL;
+        /* The payload is always validated: this is cheap compared to the
+         * cost of loading it. */
+        roaring *r = roaringDeserialize(encoded,encoded_len);
+        zfree(encoded);
+        if (r == NULL) {
+            rdbReportCorruptRDB("Roaring bitmap integrity check failed.");
+            return NULL;
+        }
+        o = createBitmapObjectFromRoaring(r);
     } else if (rdbtype == RDB_TYPE_MODULE || rdbtype == RDB_TYPE_MODULE_2) {
         uint64_t moduleid = rdbLoadLen(rdb,NULL);
         if (rioGetReadError(rdb)) {
@@ -2441,7 +2504,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         return C_ERR;
     }
     rdbver = atoi(buf+5);
-    if (rdbver < 1 || rdbver > RDB_VERSION) {
+    if (!rdbIsVersionSupported(rdbver)) {
         serverLog(LL_WARNING,"Can't handle RDB format version %d",rdbver);
         errno = EINVAL;
         return C_ERR;
@@ -2451,6 +2514,12 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
     long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
     long long lru_clock = LRU_CLOCK();
 
+    /* A diff resync only touches the slots listed by its "diff-slots" AUX
+     * field, which comes before any key. Any other load may change every
+     * slot. */
+    int diff_slots_pending = (rdbflags & RDBFLAGS_DIFF_RESYNC) != 0;
+    if (!diff_slots_pending) slotDigestTouchAll();
+
     while(1) {
         sds key;
         robj *val;
@@ -2458,6 +2527,17 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         /* Read type. */
         if ((type = rdbLoadType(rdb)) == -1) goto eoferr;
 
+        /* Never merge the keys of a diff resync into a replica that did
+         * not drop its keys in the same slots first. */
+        if (diff_slots_pending && type != RDB_OPCODE_AUX &&
+            type != RDB_OPCODE_MODULE_AUX)
+        {
+            serverLog(LL_WARNING,"The diff resync RDB has no diff-slots "
+                                 "AUX field");
+            errno = EINVAL;
+            return C_ERR;
+        }
+
         /* Handle special types. */
         if (type == RDB_OPCODE_EXPIRETIME) {
             /* EXPIRETIME: load an expire associated with the next key
@@ -2565,6 +2645,18 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
                 if (haspreamble) serverLog(LL_NOTICE,"RDB has an AOF tail");
             } else if (!strcasecmp(auxkey->ptr,"redis-bits")) {
                 /* Just ignored. */
+            } else if (!strcasecmp(auxkey->ptr,"diff-slots")) {
+                /* Drop our keys in the slots that differ from the master,
+                 * the RDB has the master version of them. Ignored unless
+                 * we asked for a diff resync. */
+                if (diff_slots_pending &&
+                    sdslen(auxval->ptr) == CLUSTER_SLOTS/8)
+                {
+                    long long removed = slotDigestPurge(auxval->ptr);
+                    serverLog(LL_NOTICE,"Diff resync: %lld keys removed "
+                                        "from the slots that differ",removed);
+                    diff_slots_pending = 0;
+                }
             } else {
                 /* We ignore fields we don't understand, as by AUX field
                  * contract. */
@@ -2634,8 +2726,11 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         /* Read key */
         if ((key = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL)
             goto eoferr;
-        /* Read value */
+        /* Read value, measuring its size on the way so that it is known
+         * without traversing it later, see objectSetTrackedSize(). */
+        long long mem = zmalloc_thread_used_memory();
         val = rdbLoadObject(type,rdb,key,&error);
+        if (val) objectSetTrackedSize(val,zmalloc_thread_used_memory()-mem);
 
         /* Check if the key already expired. This function is used when loading
          * an RDB file from disk, either at startup, or when an RDB was
@@ -2822,10 +2917,11 @@ static void backgroundSaveDoneHandlerSocket(int exitcode, int bysignal) {
     zfree(server.rdb_pipe_conns);
     server.rdb_pipe_conns = NULL;
     server.rdb_pipe_numconns = 0;
-    server.rdb_pipe_numconns_writing = 0;
     zfree(server.rdb_pipe_buff);
     server.rdb_pipe_buff = NULL;
-    server.rdb_pipe_bufflen = 0;
+    server.rdb_pipe_read_off = 0;
+    server.rdb_pipe_eof = 0;
+    server.rdb_pipe_stalled_since = 0;
 }
 
 /* When a background RDB saving/transfer terminates, call the right handler. */
@@ -2901,13 +2997,19 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
      * the RDB to, which are i WAIT_BGSAVE_START state. */
     server.rdb_pipe_conns = zmalloc(sizeof(connection *)*listLength(server.slaves));
     server.rdb_pipe_numconns = 0;
-    server.rdb_pipe_numconns_writing = 0;
+    server.rdb_pipe_buff_size = server.repl_diskless_sync_buffer_size;
+    server.rdb_pipe_read_off = 0;
+    server.rdb_pipe_eof = 0;
+    server.rdb_pipe_stalled_since = 0;
     listRewind(server.slaves,&li);
     while((ln = listNext(&li))) {
         client *slave = ln->value;
         if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) {
             server.rdb_pipe_conns[server.rdb_pipe_numconns++] = slave->conn;
             replicationSetupSlaveForFullResync(slave,getPsyncInitialOffset());
+            /* 'repldboff' is the offset of the RDB stream sent so far. */
+            slave->repldboff = 0;
+            slave->repldb_budget = 0;
         }
     }
 
@@ -2965,7 +3067,6 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
             zfree(server.rdb_pipe_conns);
             server.rdb_pipe_conns = NULL;
             server.rdb_pipe_numconns = 0;
-            server.rdb_pipe_numconns_writing = 0;
         } else {
             serverLog(LL_NOTICE,"Background RDB transfer started by pid %ld",
                 (long) childpid);
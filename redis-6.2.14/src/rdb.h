@@ -40,6 +40,14 @@
  * backward compatible this number gets incremented. */
 #define RDB_VERSION 9
 
+/* The version of the RDB files and DUMP payloads holding compressed bitmaps,
+ * the others keep RDB_VERSION so that older instances can load them. It is
+ * far from the versions used by Redis 7 and later, so that no other version
+ * of Redis loads them. */
+#define RDB_VERSION_BITMAP 64
+#define rdbIsVersionSupported(v) (((v) >= 1 && (v) <= RDB_VERSION) || \
+                                  (v) == RDB_VERSION_BITMAP)
+
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
  * the first byte to interpreter the length:
@@ -91,10 +99,15 @@
 #define RDB_TYPE_HASH_ZIPLIST  13
 #define RDB_TYPE_LIST_QUICKLIST 14
 #define RDB_TYPE_STREAM_LISTPACKS 15
+/* Compressed bitmaps (RDB_VERSION_BITMAP). The id is far from the ones following
+ * RDB_TYPE_STREAM_LISTPACKS, that Redis 7 assigned to other encodings, so
+ * that an RDB with compressed bitmaps can't be misread by it. */
+#define RDB_TYPE_BITMAP_ROARING 64
 /* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
 
 /* Test if a type is an object type. */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 15))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 15) || \
+                            t == RDB_TYPE_BITMAP_ROARING)
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
 #define RDB_OPCODE_MODULE_AUX 247   /* Module auxiliary data. */
@@ -126,6 +139,7 @@
 #define RDBFLAGS_AOF_PREAMBLE (1<<0)    /* Load/save the RDB as AOF preamble. */
 #define RDBFLAGS_REPLICATION (1<<1)     /* Load/save for SYNC. */
 #define RDBFLAGS_ALLOW_DUP (1<<2)       /* Allow duplicated keys when loading.*/
+#define RDBFLAGS_DIFF_RESYNC (1<<3)     /* Merge a diff resync of the master. */
 
 /* When rdbLoadObject() returns NULL, the err flag is
  * set to hold the type of error that occurred */
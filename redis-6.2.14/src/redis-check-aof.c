@@ -143,12 +143,188 @@ off_t process(FILE *fp) {
     return pos;
 }
 
+/* Check the records of a binary AOF, see catAppendOnlyBinaryCommand() in
+ * aof.c. Returns the offset of the end of the last valid record, or, when
+ * 'to_timestamp' is not -1, of the last record up to that time. As for the
+ * RESP format, a MULTI/EXEC block is kept or discarded as a whole: if the
+ * timestamp falls inside a transaction, the file is truncated before its
+ * MULTI. */
+off_t processBinary(FILE *fp, off_t size, long long to_timestamp) {
+    unsigned char hdr[AOF_BINARY_HDR_LEN], trailer[8];
+    uint64_t bodylen, timestamp, crc, expected, arglen;
+    uint32_t argc;
+    unsigned char *body;
+    off_t pos = ftello(fp);
+    long long posline = line;
+    int multi = 0;
+
+    while(1) {
+        if (!multi) {
+            pos = ftello(fp);
+            posline = line;
+        }
+        epos = ftello(fp);
+        size_t nread = fread(hdr,1,sizeof(hdr),fp);
+        if (nread == 0 && feof(fp)) break;
+        if (nread != sizeof(hdr)) {
+            ERROR("Expected to read %d bytes of record header, got %zu bytes",
+                AOF_BINARY_HDR_LEN,nread);
+            break;
+        }
+        memcpy(&bodylen,hdr,8);
+        memrev64ifbe(&bodylen);
+        memcpy(&timestamp,hdr+8,8);
+        memrev64ifbe(&timestamp);
+        if (to_timestamp != -1 && (long long)timestamp > to_timestamp) {
+            /* Drop the records of the transaction already read, if any. */
+            line = posline;
+            multi = 0;
+            break;
+        }
+        if (bodylen < sizeof(argc) || bodylen+8 > (uint64_t)(size-epos)) {
+            ERROR("Record of %llu bytes doesn't fit the file",
+                (unsigned long long)bodylen);
+            break;
+        }
+
+        body = zmalloc(bodylen);
+        if (fread(body,bodylen,1,fp) != 1 || fread(trailer,8,1,fp) != 1) {
+            ERROR("Expected to read %llu bytes of record",
+                (unsigned long long)bodylen+8);
+            zfree(body);
+            break;
+        }
+        crc = crc64(crc64(0,hdr,sizeof(hdr)),body,bodylen);
+        memcpy(&expected,trailer,8);
+        memrev64ifbe(&expected);
+        if (crc != expected) {
+            ERROR("Checksum mismatch, expected %016llx, got %016llx",
+                (unsigned long long)expected,(unsigned long long)crc);
+            zfree(body);
+            break;
+        }
+
+        /* Arguments. Only the name of the command is needed. */
+        memcpy(&argc,body,sizeof(argc));
+        memrev32ifbe(&argc);
+        memcpy(&arglen,body+sizeof(argc),sizeof(arglen));
+        memrev64ifbe(&arglen);
+        if (argc < 1 || bodylen < sizeof(argc)+sizeof(arglen) ||
+            arglen > bodylen-sizeof(argc)-sizeof(arglen))
+        {
+            ERROR("Bad command in record");
+            zfree(body);
+            break;
+        }
+        char *name = (char*)body+sizeof(argc)+sizeof(arglen);
+        if (arglen == 5 && !strncasecmp(name,"multi",5)) {
+            if (multi++) {
+                ERROR("Unexpected MULTI");
+                zfree(body);
+                break;
+            }
+        } else if (arglen == 4 && !strncasecmp(name,"exec",4)) {
+            if (--multi) {
+                ERROR("Unexpected EXEC");
+                zfree(body);
+                break;
+            }
+        }
+        zfree(body);
+        line++;
+    }
+
+    if (feof(fp) && multi && strlen(error) == 0) {
+        ERROR("Reached EOF before reading EXEC for MULTI");
+    }
+    if (strlen(error) > 0) {
+        printf("%s\n", error);
+    }
+    return pos;
+}
+
+/* Return the path of the manifest that may list the INCR file at 'filepath':
+ * INCR files are named <appendfilename>.<seq>.incr.aof and live in the same
+ * directory of <appendfilename>.manifest. NULL is returned if the name is
+ * not the one of an INCR file. */
+static sds getManifestPathOfIncr(const char *filepath) {
+    const char *suffix = ".incr.aof";
+    size_t suffixlen = strlen(suffix);
+    sds path = sdsnew(filepath);
+    char *dot;
+
+    if (sdslen(path) <= suffixlen ||
+        strcmp(path+sdslen(path)-suffixlen,suffix) != 0) goto notincr;
+    sdsrange(path,0,sdslen(path)-suffixlen-1);
+    dot = strrchr(path,'.');
+    if (dot == NULL || dot[1] == '\0' ||
+        strspn(dot+1,"0123456789") != strlen(dot+1)) goto notincr;
+    sdsrange(path,0,dot-path-1);
+    return sdscat(path,".manifest");
+
+notincr:
+    sdsfree(path);
+    return NULL;
+}
+
+/* Truncating an INCR file to a timestamp is only meaningful if it is the
+ * last INCR file of the AOF, otherwise the following ones, listed in the
+ * manifest, would still be loaded. Exit with an error if this is not the
+ * case. */
+static void checkTruncateIsLastIncr(const char *filepath) {
+    sds am_filepath = getManifestPathOfIncr(filepath);
+    sds last = NULL;
+    char buf[1024];
+    FILE *fp;
+
+    if (am_filepath == NULL) return;
+    if ((fp = fopen(am_filepath,"r")) == NULL) {
+        sdsfree(am_filepath);
+        return;
+    }
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        int argc;
+        sds *argv = sdssplitargs(buf,&argc);
+        sds name = NULL;
+        int incr = 0;
+
+        if (buf[0] == '#' || argv == NULL) {
+            if (argv) sdsfreesplitres(argv,argc);
+            continue;
+        }
+        for (int j = 0; j+1 < argc; j += 2) {
+            if (!strcasecmp(argv[j],"file")) name = argv[j+1];
+            else if (!strcasecmp(argv[j],"type")) incr = argv[j+1][0] == 'i';
+        }
+        if (incr && name) {
+            sdsfree(last);
+            last = sdsdup(name);
+        }
+        sdsfreesplitres(argv,argc);
+    }
+    fclose(fp);
+
+    const char *filename = strrchr(filepath,'/');
+    filename = filename ? filename+1 : filepath;
+    if (last && strcmp(last,filename) != 0) {
+        printf("%s is not the last INCR file listed in %s (%s is): the "
+               "following INCR files would still be loaded.\n"
+               "Only the last INCR file can be truncated to a timestamp, "
+               "remove the following ones from the manifest first.\n",
+               filename, am_filepath, last);
+        exit(1);
+    }
+    sdsfree(last);
+    sdsfree(am_filepath);
+}
+
 int redis_check_aof_main(int argc, char **argv) {
     char *filename;
-    int fix = 0;
+    int fix = 0, binary = 0;
+    long long to_timestamp = -1;
 
     if (argc < 2) {
-        printf("Usage: %s [--fix] <file.aof>\n", argv[0]);
+        printf("Usage: %s [--fix|--truncate-to-timestamp <ms>] <file.aof>\n", argv[0]);
         exit(1);
     } else if (argc == 2) {
         filename = argv[1];
@@ -159,6 +335,15 @@ int redis_check_aof_main(int argc, char **argv) {
         }
         filename = argv[2];
         fix = 1;
+    } else if (argc == 4) {
+        if (strcmp(argv[1],"--truncate-to-timestamp") != 0 ||
+            string2ll(argv[2],strlen(argv[2]),&to_timestamp) == 0 ||
+            to_timestamp < 0)
+        {
+            printf("Invalid arguments: %s %s\n", argv[1], argv[2]);
+            exit(1);
+        }
+        filename = argv[3];
     } else {
         printf("Invalid arguments\n");
         exit(1);
@@ -182,9 +367,22 @@ int redis_check_aof_main(int argc, char **argv) {
         exit(1);
     }
 
+    /* Binary AOF files start with their own signature. */
+    if (size >= AOF_BINARY_MAGIC_LEN) {
+        char sig[AOF_BINARY_MAGIC_LEN];
+        binary = fread(sig,sizeof(sig),1,fp) == 1 &&
+                 memcmp(sig,AOF_BINARY_MAGIC,sizeof(sig)) == 0;
+        if (!binary) rewind(fp);
+    }
+    if (to_timestamp != -1 && !binary) {
+        printf("Only binary AOF files can be truncated to a timestamp\n");
+        exit(1);
+    }
+    if (to_timestamp != -1) checkTruncateIsLastIncr(filename);
+
     /* This AOF file may have an RDB preamble. Check this to start, and if this
      * is the case, start processing the RDB part. */
-    if (size >= 8) {    /* There must be at least room for the RDB header. */
+    if (!binary && size >= 8) { /* There must be at least room for the RDB header. */
         char sig[5];
         int has_preamble = fread(sig,sizeof(sig),1,fp) == 1 &&
                             memcmp(sig,"REDIS",sizeof(sig)) == 0;
@@ -201,12 +399,25 @@ int redis_check_aof_main(int argc, char **argv) {
         }
     }
 
-    off_t pos = process(fp);
+    off_t pos = binary ? processBinary(fp,size,to_timestamp) : process(fp);
     off_t diff = size-pos;
-    printf("AOF analyzed: size=%lld, ok_up_to=%lld, ok_up_to_line=%lld, diff=%lld\n",
-        (long long) size, (long long) pos, line, (long long) diff);
+    if (binary) {
+        printf("AOF analyzed: size=%lld, ok_up_to=%lld, ok_up_to_record=%lld, diff=%lld\n",
+            (long long) size, (long long) pos, line-1, (long long) diff);
+    } else {
+        printf("AOF analyzed: size=%lld, ok_up_to=%lld, ok_up_to_line=%lld, diff=%lld\n",
+            (long long) size, (long long) pos, line, (long long) diff);
+    }
     if (diff > 0) {
-        if (fix) {
+        if (to_timestamp != -1 && strlen(error) == 0) {
+            if (ftruncate(fileno(fp), pos) == -1) {
+                printf("Failed to truncate AOF\n");
+                exit(1);
+            } else {
+                printf("Successfully truncated AOF to timestamp %lld\n",
+                    to_timestamp);
+            }
+        } else if (fix) {
             char buf[2];
             printf("This will shrink the AOF from %lld bytes, with %lld bytes, to %lld bytes\n",(long long)size,(long long)diff,(long long)pos);
             printf("Continue? [y/N]: ");
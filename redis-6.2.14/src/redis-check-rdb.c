@@ -90,7 +90,8 @@ char *rdb_type_string[] = {
     "zset-ziplist",
     "hash-ziplist",
     "quicklist",
-    "stream"
+    "stream",
+    [RDB_TYPE_BITMAP_ROARING] = "bitmap-roaring"
 };
 
 /* Show a few stats collected into 'rdbstate' */
@@ -123,7 +124,8 @@ void rdbCheckError(const char *fmt, ...) {
         printf("[additional info] Reading type %d (%s)\n",
             rdbstate.key_type,
             ((unsigned)rdbstate.key_type <
-             sizeof(rdb_type_string)/sizeof(char*)) ?
+             sizeof(rdb_type_string)/sizeof(char*) &&
+             rdb_type_string[rdbstate.key_type]) ?
                 rdb_type_string[rdbstate.key_type] : "unknown");
     rdbShowGenericInfo();
 }
@@ -203,7 +205,7 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
         goto err;
     }
     rdbver = atoi(buf+5);
-    if (rdbver < 1 || rdbver > RDB_VERSION) {
+    if (!rdbIsVersionSupported(rdbver)) {
         rdbCheckError("Can't handle RDB format version %d",rdbver);
         goto err;
     }
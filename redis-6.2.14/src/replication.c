@@ -42,8 +42,11 @@
 void replicationDiscardCachedMaster(void);
 void replicationResurrectCachedMaster(connection *conn);
 void replicationSendAck(void);
+void replicationRequestAckFromSlaves(void);
 void putSlaveOnline(client *slave);
 int cancelReplicationHandshake(int reconnect);
+static void dropReplicationBacklogDiskSegment(void);
+void rdbPipeWriteHandler(struct connection *conn);
 
 /* We take a global flag to remember if this instance generated an RDB
  * because of replication, so that we can remove the RDB file in case
@@ -100,7 +103,7 @@ int bg_unlink(const char *filename) {
             errno = old_errno;
             return -1;
         }
-        bioCreateCloseJob(fd);
+        bioCreateCloseJob(fd, 0);
         return 0; /* Success. */
     }
 }
@@ -109,81 +112,599 @@ int bg_unlink(const char *filename) {
 
 void createReplicationBacklog(void) {
     serverAssert(server.repl_backlog == NULL);
-    server.repl_backlog = zmalloc(server.repl_backlog_size);
-    server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
+    server.repl_backlog = zmalloc(sizeof(replBacklog));
+    server.repl_backlog->ref_repl_buf_node = NULL;
+    server.repl_backlog->unindexed_count = 0;
+    server.repl_backlog->blocks_index = raxNew();
+    server.repl_backlog->histlen = 0;
+    server.repl_backlog->disk_segments = listCreate();
+    server.repl_backlog->disk_histlen = 0;
+    server.repl_backlog->disk_offset = 0;
+    server.repl_backlog->disk_pending = listCreate();
+    server.repl_backlog->disk_pending_index = raxNew();
 
     /* We don't have any data inside our buffer, but virtually the first
      * byte we have is the next byte that will be generated for the
      * replication stream. */
-    server.repl_backlog_off = server.master_repl_offset+1;
+    server.repl_backlog->offset = server.master_repl_offset+1;
 }
 
 /* This function is called when the user modifies the replication backlog
- * size at runtime. It is up to the function to both update the
- * server.repl_backlog_size and to resize the buffer and setup it so that
- * it contains the same data as the previous one (possibly less data, but
- * the most recent bytes, or the same data and more free space in case the
- * buffer is enlarged). */
+ * size at runtime. The backlog is just the head of the shared replication
+ * buffer, so there is nothing to reallocate: when the backlog is enlarged
+ * it will retain more blocks as new data arrives, when it is shrunk the
+ * oldest blocks are released incrementally. */
 void resizeReplicationBacklog(long long newsize) {
     if (newsize < CONFIG_REPL_BACKLOG_MIN_SIZE)
         newsize = CONFIG_REPL_BACKLOG_MIN_SIZE;
     if (server.repl_backlog_size == newsize) return;
 
     server.repl_backlog_size = newsize;
-    if (server.repl_backlog != NULL) {
-        /* What we actually do is to flush the old buffer and realloc a new
-         * empty one. It will refill with new data incrementally.
-         * The reason is that copying a few gigabytes adds latency and even
-         * worse often we need to alloc additional space before freeing the
-         * old buffer. */
-        zfree(server.repl_backlog);
-        server.repl_backlog = zmalloc(server.repl_backlog_size);
-        server.repl_backlog_histlen = 0;
-        server.repl_backlog_idx = 0;
-        /* Next byte we have is... the next since the buffer is empty. */
-        server.repl_backlog_off = server.master_repl_offset+1;
+    if (server.repl_backlog != NULL)
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+}
+
+/* A block trimmed from the in memory backlog, that the BIO_REPL_BACKLOG
+ * thread is appending to a segment of the disk backlog. The main thread
+ * keeps the block in disk_pending until the write is done. */
+typedef struct replBacklogDiskWrite {
+    replBufBlock *block;
+    long long seg_id;       /* Segment the block is written to. */
+    int fd;                 /* Segment file. */
+    long long pos;          /* Position of the block in the segment. */
+    long long seq;          /* Write sequence number. */
+} replBacklogDiskWrite;
+
+static long long disk_write_seq = 0;  /* Last write submitted. */
+static long long disk_drop_seq = 0;   /* Last write when the disk backlog
+                                         was released after an error. */
+static redisAtomic long long disk_write_done_seq = 0; /* Last write done. */
+static redisAtomic long long disk_write_err_seq = 0;  /* Last failed write. */
+static redisAtomic int disk_write_errno = 0;
+
+static void dropReplicationBacklogDiskSegment(void);
+
+/* BIO_REPL_BACKLOG job writing a block to the disk backlog. */
+static void writeReplicationBacklogDiskJob(void *args[]) {
+    replBacklogDiskWrite *w = args[0];
+    long long seq = w->seq;
+    size_t written = 0;
+
+    while (written < w->block->used) {
+        ssize_t nwritten = pwrite(w->fd, w->block->buf+written,
+                                  w->block->used-written, w->pos+written);
+        if (nwritten == -1 && errno == EINTR) continue;
+        if (nwritten <= 0) {
+            atomicSet(disk_write_errno, nwritten == -1 ? errno : EIO);
+            atomicSet(disk_write_err_seq, seq);
+            break;
+        }
+        written += nwritten;
+    }
+    /* The main thread may release the write as soon as it sees this. */
+    atomicSetWithSync(disk_write_done_seq, seq);
+}
+
+/* BIO_REPL_BACKLOG job closing a segment, once all its writes are done. */
+static void closeReplicationBacklogDiskJob(void *args[]) {
+    close((int)(long)args[0]);
+}
+
+/* Add a block to the writes in flight of the disk backlog. */
+static void addReplicationBacklogDiskWrite(replBacklogDiskWrite *w) {
+    uint64_t encoded_offset = htonu64(w->block->repl_offset);
+
+    listAddNodeTail(server.repl_backlog->disk_pending, w);
+    raxInsert(server.repl_backlog->disk_pending_index,
+              (unsigned char*)&encoded_offset, sizeof(uint64_t), w, NULL);
+}
+
+/* Release the oldest write in flight of the disk backlog, that is done. */
+static void delReplicationBacklogDiskWrite(void) {
+    listNode *ln = listFirst(server.repl_backlog->disk_pending);
+    replBacklogDiskWrite *w = listNodeValue(ln);
+    uint64_t encoded_offset = htonu64(w->block->repl_offset);
+
+    raxRemove(server.repl_backlog->disk_pending_index,
+              (unsigned char*)&encoded_offset, sizeof(uint64_t), NULL);
+    server.repl_buffer_mem -= w->block->size + sizeof(replBufBlock);
+    zfree(w->block);
+    zfree(w);
+    listDelNode(server.repl_backlog->disk_pending, ln);
+}
+
+/* BIO_REPL_BACKLOG job releasing the writes of a freed backlog. */
+static void freeReplicationBacklogDiskWritesJob(void *args[]) {
+    list *pending = args[0];
+    listIter li;
+    listNode *ln;
+
+    listRewind(pending,&li);
+    while((ln = listNext(&li))) {
+        replBacklogDiskWrite *w = listNodeValue(ln);
+        zfree(w->block);
+        zfree(w);
+    }
+    listRelease(pending);
+}
+
+/* Release the whole disk backlog. The writes still in flight for its
+ * segments may fail, as they are not part of the backlog anymore their
+ * errors are ignored. */
+static void releaseReplicationBacklogDisk(void) {
+    while (listLength(server.repl_backlog->disk_segments))
+        dropReplicationBacklogDiskSegment();
+    disk_drop_seq = disk_write_seq;
+}
+
+/* Release the blocks the bio thread is done writing to the disk backlog,
+ * and release the disk backlog if one of the writes failed: it must
+ * always be contiguous with the in memory one. */
+void reapReplicationBacklogDiskWrites(void) {
+    replBacklog *bl = server.repl_backlog;
+    long long done, err_seq;
+
+    if (bl == NULL) return;
+    atomicGetWithSync(disk_write_done_seq, done);
+    while (listLength(bl->disk_pending)) {
+        replBacklogDiskWrite *w = listNodeValue(listFirst(bl->disk_pending));
+        if (w->seq > done) break;
+        delReplicationBacklogDiskWrite();
+    }
+
+    atomicGet(disk_write_err_seq, err_seq);
+    if (err_seq > disk_drop_seq) {
+        int err;
+        atomicGet(disk_write_errno, err);
+        serverLog(LL_WARNING,"Error writing the disk backlog: %s. "
+            "Releasing the disk backlog.", strerror(err));
+        releaseReplicationBacklogDisk();
     }
 }
 
 void freeReplicationBacklog(void) {
     serverAssert(listLength(server.slaves) == 0);
+    if (server.repl_backlog == NULL) return;
+
+    /* Decrease the start buffer node reference count. */
+    if (server.repl_backlog->ref_repl_buf_node) {
+        replBufBlock *o = listNodeValue(
+            server.repl_backlog->ref_repl_buf_node);
+        serverAssert(o->refcount == 1); /* Last reference. */
+        o->refcount--;
+    }
+
+    /* Replication buffer blocks are completely released when we free the
+     * backlog, since the backlog is released only when there are no replicas
+     * and the backlog keeps the last reference of all blocks. */
+    freeReplicationBacklogRefMemAsync(server.repl_buffer_blocks,
+                                      server.repl_backlog->blocks_index);
+    releaseReplicationBacklogDisk();
+    listRelease(server.repl_backlog->disk_segments);
+    /* The blocks still being written are released by the bio thread,
+     * after the writes. */
+    if (listLength(server.repl_backlog->disk_pending))
+        bioCreateReplBacklogJob(freeReplicationBacklogDiskWritesJob,1,
+                                server.repl_backlog->disk_pending);
+    else
+        listRelease(server.repl_backlog->disk_pending);
+    raxFree(server.repl_backlog->disk_pending_index);
+    server.repl_buffer_blocks = listCreate();
+    listSetFreeMethod(server.repl_buffer_blocks,zfree);
+    server.repl_buffer_mem = 0;
     zfree(server.repl_backlog);
     server.repl_backlog = NULL;
 }
 
-/* Add data to the replication backlog.
+/* Release the oldest segment of the disk backlog. The replicas still
+ * catching up from it are too far behind: they are disconnected, and will
+ * need a full resynchronization. */
+static void dropReplicationBacklogDiskSegment(void) {
+    listNode *first = listFirst(server.repl_backlog->disk_segments);
+    replBacklogSegment *seg = listNodeValue(first);
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+        if (slave->ref_disk_seg_node != first) continue;
+        serverLog(LL_WARNING,
+            "Disconnecting replica %s: the disk backlog it was reading "
+            "was released.", replicationGetSlaveName(slave));
+        slave->ref_disk_seg_node = NULL;
+        slave->repl_disk_off = 0;
+        freeClientAsync(slave);
+    }
+
+    /* Closing the last reference of a big file may block for a while. It
+     * is done by the thread writing the segment, after its writes. */
+    bioCreateReplBacklogJob(closeReplicationBacklogDiskJob,1,
+                            (void*)(long)seg->fd);
+    server.repl_backlog->disk_histlen -= seg->len;
+    server.repl_backlog->disk_offset += seg->len;
+    zfree(seg);
+    listDelNode(server.repl_backlog->disk_segments, first);
+}
+
+/* Release the oldest segments of the disk backlog, until it fits
+ * repl-backlog-disk-size. */
+void trimReplicationBacklogDisk(void) {
+    if (server.repl_backlog == NULL) return;
+    while (listLength(server.repl_backlog->disk_segments) &&
+           server.repl_backlog->disk_histlen > server.repl_backlog_disk_size)
+    {
+        dropReplicationBacklogDiskSegment();
+    }
+}
+
+/* Create a new segment at the tail of the disk backlog. Returns NULL
+ * if the file can't be created. */
+static replBacklogSegment *createReplicationBacklogDiskSegment(void) {
+    static long long segment_id = 0;
+    char tmpfile[256];
+
+    segment_id++;
+    snprintf(tmpfile,sizeof(tmpfile),"temp-backlog-%d.%lld.seg",
+        (int) getpid(), segment_id);
+    int fd = open(tmpfile,O_RDWR|O_CREAT|O_TRUNC,0644);
+    if (fd == -1) return NULL;
+    /* Nobody else needs the file, we only reference it by its fd. */
+    unlink(tmpfile);
+
+    replBacklogSegment *seg = zmalloc(sizeof(*seg));
+    seg->id = segment_id;
+    seg->fd = fd;
+    seg->offset = server.repl_backlog->disk_offset +
+                  server.repl_backlog->disk_histlen;
+    seg->len = 0;
+    listAddNodeTail(server.repl_backlog->disk_segments, seg);
+    return seg;
+}
+
+/* Append a block trimmed from the head of the in memory backlog to the disk
+ * backlog, so that it keeps serving partial resynchronizations. The write
+ * is done by the bio thread, that takes over the block: the backlog
+ * accounts for it right away, and replicas reading it before the write is
+ * done are served from memory. The block stays counted in repl_buffer_mem
+ * until the write is done. On errors the disk backlog is released: it
+ * must always be contiguous with the in memory one. */
+static void spillReplicationBacklogBlock(replBufBlock *o) {
+    replBacklog *bl = server.repl_backlog;
+    long long segsize = server.repl_backlog_disk_size/REPL_BACKLOG_DISK_SEGMENTS;
+    if (segsize < CONFIG_REPL_BACKLOG_MIN_SIZE)
+        segsize = CONFIG_REPL_BACKLOG_MIN_SIZE;
+    if (segsize > REPL_BACKLOG_DISK_SEGMENT_MAX_SIZE)
+        segsize = REPL_BACKLOG_DISK_SEGMENT_MAX_SIZE;
+
+    if (listLength(bl->disk_segments) == 0) bl->disk_offset = o->repl_offset;
+    serverAssert(bl->disk_offset + bl->disk_histlen == o->repl_offset);
+
+    listNode *ln = listLast(bl->disk_segments);
+    replBacklogSegment *seg = ln ? listNodeValue(ln) : NULL;
+    if (seg == NULL || seg->len >= segsize) {
+        seg = createReplicationBacklogDiskSegment();
+        if (seg == NULL) {
+            serverLog(LL_WARNING,"Can't create a disk backlog segment: %s. "
+                "Releasing the disk backlog.", strerror(errno));
+            releaseReplicationBacklogDisk();
+            server.repl_buffer_mem -= o->size + sizeof(replBufBlock);
+            zfree(o);
+            return;
+        }
+    }
+
+    replBacklogDiskWrite *w = zmalloc(sizeof(*w));
+    w->block = o;
+    w->seg_id = seg->id;
+    w->fd = seg->fd;
+    w->pos = seg->len;
+    w->seq = ++disk_write_seq;
+    addReplicationBacklogDiskWrite(w);
+    bioCreateReplBacklogJob(writeReplicationBacklogDiskJob,1,w);
+
+    seg->len += o->used;
+    bl->disk_histlen += o->used;
+    trimReplicationBacklogDisk();
+}
+
+/* Send a replica that is catching up from the disk backlog the next chunk
+ * of the stream, read from the segment it references. Once the replica
+ * reaches the end of the disk backlog, it references the head of the in
+ * memory backlog, like any other replica. Returns the bytes written, or
+ * -1 on errors. */
+ssize_t writeToReplicaFromDiskBacklog(client *c) {
+    char buf[PROTO_IOBUF_LEN];
+    replBacklogSegment *seg = listNodeValue(c->ref_disk_seg_node);
+    long long pos = c->repl_disk_off - seg->offset;
+    long long end = seg->len;
+    char *src = NULL;
+    uint64_t encoded_offset = htonu64(c->repl_disk_off);
+    replBacklogDiskWrite *w;
+    raxIterator ri;
+
+    /* Only read from the file what is already written, the blocks the bio
+     * thread is still writing are sent from memory: look for the block
+     * holding our offset, or else for the next one. */
+    raxStart(&ri,server.repl_backlog->disk_pending_index);
+    raxSeek(&ri,"<=",(unsigned char*)&encoded_offset,sizeof(uint64_t));
+    if (raxNext(&ri)) {
+        w = ri.data;
+        if (w->seg_id == seg->id &&
+            pos < w->pos + (long long)w->block->used)
+        {
+            src = w->block->buf + (pos - w->pos);
+            end = w->pos + w->block->used;
+        }
+    }
+    if (src == NULL) {
+        raxSeek(&ri,">",(unsigned char*)&encoded_offset,sizeof(uint64_t));
+        if (raxNext(&ri)) {
+            w = ri.data;
+            if (w->seg_id == seg->id) end = w->pos;
+        }
+    }
+    raxStop(&ri);
+
+    size_t toread = end - pos;
+    ssize_t buflen;
+    if (src) {
+        buflen = toread;
+    } else {
+        if (toread > sizeof(buf)) toread = sizeof(buf);
+        buflen = pread(seg->fd, buf, toread, pos);
+        if (buflen <= 0) {
+            serverLog(LL_WARNING,"Read error sending the disk backlog to "
+                "replica %s: %s", replicationGetSlaveName(c),
+                (buflen == 0) ? "premature EOF" : strerror(errno));
+            freeClientAsync(c);
+            return -1;
+        }
+        src = buf;
+    }
+    ssize_t nwritten = connWrite(c->conn, src, buflen);
+    if (nwritten <= 0) return nwritten;
+    c->repl_disk_off += nwritten;
+
+    /* Go to the next segment, or to the in memory backlog, that always
+     * starts where the disk backlog ends. */
+    if (c->repl_disk_off == seg->offset + seg->len) {
+        listNode *next = listNextNode(c->ref_disk_seg_node);
+        if (next) {
+            c->ref_disk_seg_node = next;
+        } else {
+            serverAssert(c->repl_disk_off == server.repl_backlog->offset);
+            c->ref_disk_seg_node = NULL;
+            c->repl_disk_off = 0;
+            c->ref_repl_buf_node = server.repl_backlog->ref_repl_buf_node;
+            c->ref_block_pos = 0;
+            ((replBufBlock *)listNodeValue(c->ref_repl_buf_node))->refcount++;
+        }
+    }
+    return nwritten;
+}
+
+/* Return the replication offset of the first byte we have in the backlog,
+ * that is in the disk backlog if there is one. */
+static long long getReplicationBacklogFirstOffset(void) {
+    if (server.repl_backlog->disk_histlen)
+        return server.repl_backlog->disk_offset;
+    return server.repl_backlog->offset;
+}
+
+/* To make search offset from replication buffer blocks quickly
+ * when replicas ask partial resynchronization, we create one index
+ * block every REPL_BACKLOG_INDEX_PER_BLOCKS blocks. */
+static void createReplicationBacklogIndex(listNode *ln) {
+    server.repl_backlog->unindexed_count++;
+    if (server.repl_backlog->unindexed_count >= REPL_BACKLOG_INDEX_PER_BLOCKS) {
+        replBufBlock *o = listNodeValue(ln);
+        uint64_t encoded_offset = htonu64(o->repl_offset);
+        raxInsert(server.repl_backlog->blocks_index,
+                  (unsigned char*)&encoded_offset, sizeof(uint64_t),
+                  ln, NULL);
+        server.repl_backlog->unindexed_count = 0;
+    }
+}
+
+/* Release the replication buffer blocks the backlog does not need anymore.
+ *
+ * The backlog always references the first block of the replication buffer:
+ * when it holds more than repl-backlog-size bytes, and the first block is
+ * not referenced by any replica, the backlog moves its reference to the
+ * next block and the first one is released. At most 'max_blocks' blocks
+ * are released in a single call, to avoid blocking the server for long
+ * when the backlog is shrunk or a replica releases a lot of blocks. */
+void incrementalTrimReplicationBacklog(size_t max_blocks) {
+    serverAssert(server.repl_backlog != NULL);
+    reapReplicationBacklogDiskWrites();
+
+    size_t trimmed_blocks = 0;
+    while (server.repl_backlog->histlen > server.repl_backlog_size &&
+           trimmed_blocks < max_blocks)
+    {
+        /* We never trim backlog to less than one block. */
+        if (listLength(server.repl_buffer_blocks) <= 1) break;
+
+        /* Replicas increment the refcount of the first replication buffer
+         * block they refer to, in that case we don't trim the backlog even
+         * if backlog_histlen exceeds backlog_size. This implicitly makes the
+         * backlog bigger than our setting, but makes the master accept
+         * partial resyncs as much as possible. */
+        listNode *first = listFirst(server.repl_buffer_blocks);
+        serverAssert(first == server.repl_backlog->ref_repl_buf_node);
+        replBufBlock *fo = listNodeValue(first);
+        if (fo->refcount != 1) break;
+
+        /* Don't trim if the backlog would become smaller than its setting
+         * once the first block is released. */
+        if (server.repl_backlog->histlen - (long long)fo->size <=
+            server.repl_backlog_size) break;
+
+        /* Decr refcount and release the first block later. */
+        fo->refcount--;
+        trimmed_blocks++;
+        server.repl_backlog->histlen -= fo->size;
+
+        /* Go to use next replication buffer block node. */
+        listNode *next = listNextNode(first);
+        server.repl_backlog->ref_repl_buf_node = next;
+        serverAssert(server.repl_backlog->ref_repl_buf_node != NULL);
+        /* Incr reference count to keep the new head node. */
+        ((replBufBlock *)listNodeValue(next))->refcount++;
+
+        /* Remove the node in recorded blocks. */
+        uint64_t encoded_offset = htonu64(fo->repl_offset);
+        raxRemove(server.repl_backlog->blocks_index,
+            (unsigned char *) &encoded_offset, sizeof(uint64_t), NULL);
+
+        /* Delete the first node from global replication buffer. Keep the
+         * block in the disk backlog if there is one, that takes over the
+         * block. */
+        serverAssert(fo->refcount == 0 && fo->used == fo->size);
+        server.repl_buffer_mem -= sizeof(listNode);
+        if (server.repl_backlog_disk_size) {
+            spillReplicationBacklogBlock(fo);
+            listNodeValue(first) = NULL;
+        } else {
+            server.repl_buffer_mem -= fo->size + sizeof(replBufBlock);
+        }
+        listDelNode(server.repl_buffer_blocks, first);
+    }
+
+    /* Set the offset of the first byte we have in the backlog. */
+    server.repl_backlog->offset = server.master_repl_offset -
+                                  server.repl_backlog->histlen + 1;
+}
+
+/* Free the replication buffer reference of a replica, if any: the blocks
+ * it was the last user of may now be released by the backlog. */
+void freeReplicaReferencedReplBuffer(client *replica) {
+    if (replica->ref_repl_buf_node != NULL) {
+        /* Decrease the start buffer node reference count. */
+        replBufBlock *o = listNodeValue(replica->ref_repl_buf_node);
+        serverAssert(o->refcount > 0);
+        o->refcount--;
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+    }
+    replica->ref_repl_buf_node = NULL;
+    replica->ref_block_pos = 0;
+    replica->ref_disk_seg_node = NULL;
+    replica->repl_disk_off = 0;
+}
+
+int canFeedReplicaReplBuffer(client *replica) {
+    /* Don't feed replicas that only want the RDB. */
+    if (replica->flags & CLIENT_REPL_RDBONLY) return 0;
+
+    /* Don't feed replicas that are still waiting for BGSAVE to start. */
+    if (replica->replstate == SLAVE_STATE_WAIT_BGSAVE_START) return 0;
+
+    return 1;
+}
+
+/* Append bytes into the global replication buffer list, the replication
+ * backlog and all the replica clients use the replication buffer blocks,
+ * instead of each one keeping a private copy of the replication stream:
+ * a replica only references the block it has to send next.
+ *
  * This function also increments the global replication offset stored at
  * server.master_repl_offset, because there is no case where we want to feed
- * the backlog without incrementing the offset. */
-void feedReplicationBacklog(void *ptr, size_t len) {
-    unsigned char *p = ptr;
+ * the replication stream without incrementing the offset. */
+void feedReplicationBuffer(char *s, size_t len) {
+    static long long repl_block_id = 0;
 
+    if (server.repl_backlog == NULL) return;
     server.master_repl_offset += len;
+    server.repl_backlog->histlen += len;
+
+    size_t start_pos = 0; /* The position of referenced block to start sending. */
+    listNode *start_node = NULL; /* Replica/backlog starts referenced node. */
+    int add_new_block = 0; /* Create new block if current block is total used. */
+    listNode *ln = listLast(server.repl_buffer_blocks);
+    replBufBlock *tail = ln ? listNodeValue(ln) : NULL;
+
+    /* Append to tail string when possible. */
+    if (tail && tail->size > tail->used) {
+        start_node = listLast(server.repl_buffer_blocks);
+        start_pos = tail->used;
+        /* Copy the part we can fit into the tail, and leave the rest for a
+         * new node */
+        size_t avail = tail->size - tail->used;
+        size_t copy = (avail >= len) ? len : avail;
+        memcpy(tail->buf + tail->used, s, copy);
+        tail->used += copy;
+        s += copy;
+        len -= copy;
+    }
+    if (len) {
+        /* Create a new node, make sure it is allocated to at
+         * least PROTO_REPLY_CHUNK_BYTES */
+        size_t usable_size;
+        size_t size = (len < PROTO_REPLY_CHUNK_BYTES) ? PROTO_REPLY_CHUNK_BYTES : len;
+        tail = zmalloc_usable(size + sizeof(replBufBlock), &usable_size);
+        /* Take over the allocation's internal fragmentation */
+        tail->size = usable_size - sizeof(replBufBlock);
+        tail->used = len;
+        tail->refcount = 0;
+        tail->repl_offset = server.master_repl_offset - tail->used + 1;
+        tail->id = repl_block_id++;
+        memcpy(tail->buf, s, len);
+        listAddNodeTail(server.repl_buffer_blocks, tail);
+        /* We also count the list node memory into replication buffer memory. */
+        server.repl_buffer_mem += (usable_size + sizeof(listNode));
+        add_new_block = 1;
+        if (start_node == NULL) {
+            start_node = listLast(server.repl_buffer_blocks);
+            start_pos = 0;
+        }
+    }
 
-    /* This is a circular buffer, so write as much data we can at every
-     * iteration and rewind the "idx" index if we reach the limit. */
-    while(len) {
-        size_t thislen = server.repl_backlog_size - server.repl_backlog_idx;
-        if (thislen > len) thislen = len;
-        memcpy(server.repl_backlog+server.repl_backlog_idx,p,thislen);
-        server.repl_backlog_idx += thislen;
-        if (server.repl_backlog_idx == server.repl_backlog_size)
-            server.repl_backlog_idx = 0;
-        len -= thislen;
-        p += thislen;
-        server.repl_backlog_histlen += thislen;
-    }
-    if (server.repl_backlog_histlen > server.repl_backlog_size)
-        server.repl_backlog_histlen = server.repl_backlog_size;
-    /* Set the offset of the first byte we have in the backlog. */
-    server.repl_backlog_off = server.master_repl_offset -
-                              server.repl_backlog_histlen + 1;
+    /* The replicas that just started to accumulate the replication stream
+     * (waiting for the RDB) start referencing the buffer from here. */
+    listIter li;
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+        if (!canFeedReplicaReplBuffer(slave)) continue;
+
+        /* Update shared replication buffer start position. Replicas
+         * catching up from the disk backlog will reference the buffer
+         * once they reach its head. */
+        if (slave->ref_repl_buf_node == NULL && slave->repl_disk_off == 0) {
+            slave->ref_repl_buf_node = start_node;
+            slave->ref_block_pos = start_pos;
+            /* Only increase the start block reference count. */
+            ((replBufBlock *)listNodeValue(start_node))->refcount++;
+        }
+
+        /* Check output buffer limit only when add new block. */
+        if (add_new_block) closeClientOnOutputBufferLimitReached(slave, 1);
+    }
+
+    /* For replication backlog */
+    if (server.repl_backlog->ref_repl_buf_node == NULL) {
+        server.repl_backlog->ref_repl_buf_node = start_node;
+        /* Only increase the start block reference count. */
+        ((replBufBlock *)listNodeValue(start_node))->refcount++;
+
+        /* Replication buffer must be empty before adding replication stream
+         * into replication backlog. */
+        serverAssert(add_new_block == 1 && start_pos == 0);
+    }
+    if (add_new_block) {
+        createReplicationBacklogIndex(listLast(server.repl_buffer_blocks));
+    }
+    /* Try to trim replication backlog since replication backlog may exceed
+     * our setting when we add replication stream. Note that it is important
+     * to try to trim at least one node since in the common case this is
+     * where one new backlog node is added and one should be removed. */
+    incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
 }
 
-/* Wrapper for feedReplicationBacklog() that takes Redis string objects
+/* Wrapper for feedReplicationBuffer() that takes Redis string objects
  * as input. */
-void feedReplicationBacklogWithObject(robj *o) {
+void feedReplicationBufferWithObject(robj *o) {
     char llstr[LONG_STR_SIZE];
     void *p;
     size_t len;
@@ -195,17 +716,28 @@ void feedReplicationBacklogWithObject(robj *o) {
         len = sdslen(o->ptr);
         p = o->ptr;
     }
-    feedReplicationBacklog(p,len);
+    feedReplicationBuffer(p,len);
 }
 
-int canFeedReplicaReplBuffer(client *replica) {
-    /* Don't feed replicas that only want the RDB. */
-    if (replica->flags & CLIENT_REPL_RDBONLY) return 0;
+/* Similar with 'prepareClientToWrite', note that we must call this function
+ * before feeding the replication stream into the global replication buffer,
+ * since clientHasPendingReplies in prepareClientToWrite will access the
+ * global replication buffer to make judgements. */
+static int prepareReplicasToWrite(void) {
+    listIter li;
+    listNode *ln;
+    int prepared = 0;
 
-    /* Don't feed replicas that are still waiting for BGSAVE to start. */
-    if (replica->replstate == SLAVE_STATE_WAIT_BGSAVE_START) return 0;
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+        if (!canFeedReplicaReplBuffer(slave)) continue;
+        if (slave->flags & CLIENT_CLOSE_ASAP) continue;
+        if (!clientHasPendingReplies(slave)) clientInstallWriteHandler(slave);
+        prepared++;
+    }
 
-    return 1;
+    return prepared;
 }
 
 /* Propagate write commands to slaves, and populate the replication backlog
@@ -214,8 +746,6 @@ int canFeedReplicaReplBuffer(client *replica) {
  * stream. Instead if the instance is a slave and has sub-slaves attached,
  * we use replicationFeedSlavesFromMasterStream() */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
-    listNode *ln;
-    listIter li;
     int j, len;
     char llstr[LONG_STR_SIZE];
 
@@ -233,6 +763,10 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
     /* We can't have slaves attached and no backlog. */
     serverAssert(!(listLength(slaves) != 0 && server.repl_backlog == NULL));
 
+    /* Must install write handler for all replicas first before feeding
+     * replication stream. */
+    prepareReplicasToWrite();
+
     /* Send SELECT command to every slave if needed. */
     if (server.slaveseldb != dictid) {
         robj *selectcmd;
@@ -250,68 +784,39 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
                 dictid_len, llstr));
         }
 
-        /* Add the SELECT command into the backlog. */
-        if (server.repl_backlog) feedReplicationBacklogWithObject(selectcmd);
-
-        /* Send it to slaves. */
-        listRewind(slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = ln->value;
-
-            if (!canFeedReplicaReplBuffer(slave)) continue;
-            addReply(slave,selectcmd);
-        }
+        /* Add the SELECT command into the replication buffer. */
+        feedReplicationBufferWithObject(selectcmd);
 
         if (dictid < 0 || dictid >= PROTO_SHARED_SELECT_CMDS)
             decrRefCount(selectcmd);
     }
     server.slaveseldb = dictid;
 
-    /* Write the command to the replication backlog if any. */
-    if (server.repl_backlog) {
-        char aux[LONG_STR_SIZE+3];
-
-        /* Add the multi bulk reply length. */
-        aux[0] = '*';
-        len = ll2string(aux+1,sizeof(aux)-1,argc);
-        aux[len+1] = '\r';
-        aux[len+2] = '\n';
-        feedReplicationBacklog(aux,len+3);
-
-        for (j = 0; j < argc; j++) {
-            long objlen = stringObjectLen(argv[j]);
-
-            /* We need to feed the buffer with the object as a bulk reply
-             * not just as a plain string, so create the $..CRLF payload len
-             * and add the final CRLF */
-            aux[0] = '$';
-            len = ll2string(aux+1,sizeof(aux)-1,objlen);
-            aux[len+1] = '\r';
-            aux[len+2] = '\n';
-            feedReplicationBacklog(aux,len+3);
-            feedReplicationBacklogWithObject(argv[j]);
-            feedReplicationBacklog(aux+len+1,2);
-        }
-    }
-
-    /* Write the command to every slave. */
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
-
-        if (!canFeedReplicaReplBuffer(slave)) continue;
+    /* Write the command to the replication buffer: the backlog and all the
+     * replicas, including the ones waiting for the initial SYNC (so these
+     * commands are queued until the initial SYNC completes), share it. */
+    char aux[LONG_STR_SIZE+3];
 
-        /* Feed slaves that are waiting for the initial SYNC (so these commands
-         * are queued in the output buffer until the initial SYNC completes),
-         * or are already in sync with the master. */
+    /* Add the multi bulk reply length. */
+    aux[0] = '*';
+    len = ll2string(aux+1,sizeof(aux)-1,argc);
+    aux[len+1] = '\r';
+    aux[len+2] = '\n';
+    feedReplicationBuffer(aux,len+3);
 
-        /* Add the multi bulk length. */
-        addReplyArrayLen(slave,argc);
+    for (j = 0; j < argc; j++) {
+        long objlen = stringObjectLen(argv[j]);
 
-        /* Finally any additional argument that was not stored inside the
-         * static buffer if any (from j to argc). */
-        for (j = 0; j < argc; j++)
-            addReplyBulk(slave,argv[j]);
+        /* We need to feed the buffer with the object as a bulk reply
+         * not just as a plain string, so create the $..CRLF payload len
+         * and add the final CRLF */
+        aux[0] = '$';
+        len = ll2string(aux+1,sizeof(aux)-1,objlen);
+        aux[len+1] = '\r';
+        aux[len+2] = '\n';
+        feedReplicationBuffer(aux,len+3);
+        feedReplicationBufferWithObject(argv[j]);
+        feedReplicationBuffer(aux+len+1,2);
     }
 }
 
@@ -321,26 +826,26 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
  * guess what kind of bug it could be. */
 void showLatestBacklog(void) {
     if (server.repl_backlog == NULL) return;
+    if (listLength(server.repl_buffer_blocks) == 0) return;
 
-    long long dumplen = 256;
-    if (server.repl_backlog_histlen < dumplen)
-        dumplen = server.repl_backlog_histlen;
-
-    /* Identify the first byte to dump. */
-    long long idx =
-      (server.repl_backlog_idx + (server.repl_backlog_size - dumplen)) %
-       server.repl_backlog_size;
+    size_t dumplen = 256;
+    if (server.repl_backlog->histlen < (long long)dumplen)
+        dumplen = server.repl_backlog->histlen;
 
-    /* Scan the circular buffer to collect 'dumplen' bytes. */
+    /* Walk the replication buffer blocks backward to collect the last
+     * 'dumplen' bytes. */
     sds dump = sdsempty();
+    listNode *node = listLast(server.repl_buffer_blocks);
     while(dumplen) {
-        long long thislen =
-            ((server.repl_backlog_size - idx) < dumplen) ?
-            (server.repl_backlog_size - idx) : dumplen;
-
-        dump = sdscatrepr(dump,server.repl_backlog+idx,thislen);
+        if (node == NULL) break;
+        replBufBlock *o = listNodeValue(node);
+        size_t thislen = o->used >= dumplen ? dumplen : o->used;
+        sds head = sdscatrepr(sdsempty(), o->buf+o->used-thislen, thislen);
+        sds tmp = sdscatsds(head, dump);
+        sdsfree(dump);
+        dump = tmp;
         dumplen -= thislen;
-        idx = 0;
+        node = listPrevNode(node);
     }
 
     /* Finally log such bytes: this is vital debugging info to
@@ -353,9 +858,6 @@ void showLatestBacklog(void) {
  * to our sub-slaves. */
 #include <ctype.h>
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen) {
-    listNode *ln;
-    listIter li;
-
     /* Debugging: this is handy to see the stream sent from master
      * to slaves. Disabled with if(0). */
     if (0) {
@@ -366,13 +868,13 @@ void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t bufle
         printf("\n");
     }
 
-    if (server.repl_backlog) feedReplicationBacklog(buf,buflen);
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
-
-        if (!canFeedReplicaReplBuffer(slave)) continue;
-        addReplyProto(slave,buf,buflen);
+    /* There must be replication backlog if having attached slaves. */
+    if (listLength(slaves)) serverAssert(server.repl_backlog != NULL);
+    if (server.repl_backlog) {
+        /* Must install write handler for all replicas first before feeding
+         * replication stream. */
+        prepareReplicasToWrite();
+        feedReplicationBuffer(buf,buflen);
     }
 }
 
@@ -419,11 +921,11 @@ void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv,
 /* Feed the slave 'c' with the replication backlog starting from the
  * specified 'offset' up to the end of the backlog. */
 long long addReplyReplicationBacklog(client *c, long long offset) {
-    long long j, skip, len;
+    long long skip;
 
     serverLog(LL_DEBUG, "[PSYNC] Replica request offset: %lld", offset);
 
-    if (server.repl_backlog_histlen == 0) {
+    if (server.repl_backlog->histlen == 0) {
         serverLog(LL_DEBUG, "[PSYNC] Backlog history len is zero");
         return 0;
     }
@@ -431,41 +933,79 @@ long long addReplyReplicationBacklog(client *c, long long offset) {
     serverLog(LL_DEBUG, "[PSYNC] Backlog size: %lld",
              server.repl_backlog_size);
     serverLog(LL_DEBUG, "[PSYNC] First byte: %lld",
-             server.repl_backlog_off);
+             server.repl_backlog->offset);
     serverLog(LL_DEBUG, "[PSYNC] History len: %lld",
-             server.repl_backlog_histlen);
-    serverLog(LL_DEBUG, "[PSYNC] Current index: %lld",
-             server.repl_backlog_idx);
+             server.repl_backlog->histlen);
+
+    /* Is the offset in the disk backlog? Then the replica is sent the disk
+     * segments first, starting from the one containing the offset. */
+    if (offset < server.repl_backlog->offset) {
+        listIter li;
+        listNode *ln;
+
+        listRewind(server.repl_backlog->disk_segments,&li);
+        while((ln = listNext(&li))) {
+            replBacklogSegment *seg = listNodeValue(ln);
+            if (offset < seg->offset + seg->len) break;
+        }
+        serverAssert(ln != NULL);
+        serverLog(LL_DEBUG, "[PSYNC] Sending from the disk backlog, first "
+            "byte: %lld", server.repl_backlog->disk_offset);
+
+        clientInstallWriteHandler(c);
+        c->ref_disk_seg_node = ln;
+        c->repl_disk_off = offset;
+        return server.master_repl_offset - offset + 1;
+    }
 
     /* Compute the amount of bytes we need to discard. */
-    skip = offset - server.repl_backlog_off;
+    skip = offset - server.repl_backlog->offset;
     serverLog(LL_DEBUG, "[PSYNC] Skipping: %lld", skip);
 
-    /* Point j to the oldest byte, that is actually our
-     * server.repl_backlog_off byte. */
-    j = (server.repl_backlog_idx +
-        (server.repl_backlog_size-server.repl_backlog_histlen)) %
-        server.repl_backlog_size;
-    serverLog(LL_DEBUG, "[PSYNC] Index of first byte: %lld", j);
+    /* Iterate recorded blocks, quickly search the approximate node. */
+    listNode *node = NULL;
+    if (raxSize(server.repl_backlog->blocks_index) > 0) {
+        uint64_t encoded_offset = htonu64(offset);
+        raxIterator ri;
+        raxStart(&ri, server.repl_backlog->blocks_index);
+        raxSeek(&ri, ">", (unsigned char*)&encoded_offset, sizeof(uint64_t));
+        if (raxEOF(&ri)) {
+            /* No found, so search from the last recorded node. */
+            raxSeek(&ri, "$", NULL, 0);
+            raxPrev(&ri);
+            node = (listNode *)ri.data;
+        } else {
+            raxPrev(&ri); /* Skip the sought node. */
+            /* We should search from the prev node since the offset of current
+             * sought node exceeds searching offset. */
+            if (raxPrev(&ri))
+                node = (listNode *)ri.data;
+            else
+                node = server.repl_backlog->ref_repl_buf_node;
+        }
+        raxStop(&ri);
+    } else {
+        /* No recorded blocks, just from the start node to search. */
+        node = server.repl_backlog->ref_repl_buf_node;
+    }
 
-    /* Discard the amount of data to seek to the specified 'offset'. */
-    j = (j + skip) % server.repl_backlog_size;
+    /* Search the exact node. */
+    while (node != NULL) {
+        replBufBlock *o = listNodeValue(node);
+        if (o->repl_offset + (long long)o->used >= offset) break;
+        node = listNextNode(node);
+    }
+    serverAssert(node != NULL);
 
-    /* Feed slave with data. Since it is a circular buffer we have to
-     * split the reply in two parts if we are cross-boundary. */
-    len = server.repl_backlog_histlen - skip;
-    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld", len);
-    while(len) {
-        long long thislen =
-            ((server.repl_backlog_size - j) < len) ?
-            (server.repl_backlog_size - j) : len;
+    /* Install a write handler first, then reference the block containing
+     * the offset: the replica will be served from the shared buffer. */
+    clientInstallWriteHandler(c);
+    replBufBlock *o = listNodeValue(node);
+    o->refcount++;
+    c->ref_repl_buf_node = node;
+    c->ref_block_pos = offset - o->repl_offset;
 
-        serverLog(LL_DEBUG, "[PSYNC] addReply() length: %lld", thislen);
-        addReplySds(c,sdsnewlen(server.repl_backlog + j, thislen));
-        len -= thislen;
-        j = 0;
-    }
-    return server.repl_backlog_histlen - skip;
+    return server.repl_backlog->histlen - skip;
 }
 
 /* Return the offset to provide as reply to the PSYNC command received
@@ -506,7 +1046,8 @@ int replicationSetupSlaveForFullResync(client *slave, long long offset) {
     /* Don't send this reply to slaves that approached us with
      * the old SYNC command. */
     if (!(slave->flags & CLIENT_PRE_PSYNC)) {
-        buflen = snprintf(buf,sizeof(buf),"+FULLRESYNC %s %lld\r\n",
+        buflen = snprintf(buf,sizeof(buf),"+%s %s %lld\r\n",
+                          slave->slot_digests ? "DIFFRESYNC" : "FULLRESYNC",
                           server.replid,offset);
         if (connWrite(slave->conn,buf,buflen) != buflen) {
             freeClientAsync(slave);
@@ -560,8 +1101,8 @@ int masterTryPartialResynchronization(client *c, long long psync_offset) {
 
     /* We still have the data our slave is asking for? */
     if (!server.repl_backlog ||
-        psync_offset < server.repl_backlog_off ||
-        psync_offset > (server.repl_backlog_off + server.repl_backlog_histlen))
+        psync_offset < getReplicationBacklogFirstOffset() ||
+        psync_offset > (server.repl_backlog->offset + server.repl_backlog->histlen))
     {
         serverLog(LL_NOTICE,
             "Unable to partial resync with replica %s for lack of backlog (Replica request was: %lld).", replicationGetSlaveName(c), psync_offset);
@@ -639,10 +1180,22 @@ need_full_resync:
  * Returns C_OK on success or C_ERR otherwise. */
 int startBgsaveForReplication(int mincapa) {
     int retval;
-    int socket_target = server.repl_diskless_sync && (mincapa & SLAVE_CAPA_EOF);
+    client *diff_slave = NULL;
     listIter li;
     listNode *ln;
 
+    /* A replica that sent its slot digests is sent only the slots that
+     * differ, so the RDB always targets its socket. syncCommand() makes sure
+     * it is the only replica waiting for this BGSAVE. */
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START &&
+            slave->slot_digests) diff_slave = slave;
+    }
+    int socket_target = (server.repl_diskless_sync || diff_slave) &&
+                        (mincapa & SLAVE_CAPA_EOF);
+
     serverLog(LL_NOTICE,"Starting BGSAVE for SYNC with target: %s",
         socket_target ? "replicas sockets" : "disk");
 
@@ -651,15 +1204,23 @@ int startBgsaveForReplication(int mincapa) {
     /* Only do rdbSave* when rsiptr is not NULL,
      * otherwise slave will miss repl-stream-db. */
     if (rsiptr) {
-        if (socket_target)
+        if (socket_target) {
+            if (diff_slave) rsi.slot_digests = diff_slave->slot_digests;
             retval = rdbSaveToSlavesSockets(rsiptr);
-        else
+        } else {
             retval = rdbSaveBackground(server.rdb_filename,rsiptr);
+        }
     } else {
         serverLog(LL_WARNING,"BGSAVE for replication: replication information not available, can't generate the RDB file right now. Try later.");
         retval = C_ERR;
     }
 
+    /* The RDB child has its own copy of the digests, if any. */
+    if (diff_slave) {
+        sdsfree(diff_slave->slot_digests);
+        diff_slave->slot_digests = NULL;
+    }
+
     /* If we succeeded to start a BGSAVE with disk target, let's remember
      * this fact, so that we can later delete the file if needed. Note
      * that we don't set the flag to 1 if the feature is disabled, otherwise
@@ -709,6 +1270,30 @@ int startBgsaveForReplication(int mincapa) {
     return retval;
 }
 
+/* Return true if the replica 'c', that can't continue the replication stream
+ * with PSYNC, may be resynchronized with only the slots that differ from its
+ * dataset, according to the slot digests it sends: see slotdigest.c.
+ *
+ * Such an RDB is generated for this replica alone, so the BGSAVE must be
+ * started right now, and no other replica should be waiting for it. */
+static int replicationCanDiffSync(client *c) {
+    int capa = SLAVE_CAPA_EOF|SLAVE_CAPA_SLOTDIFF;
+    listIter li;
+    listNode *ln;
+
+    if (!server.repl_diff_sync || (c->slave_capa & capa) != capa ||
+        (c->flags & CLIENT_REPL_RDBONLY)) return 0;
+    if (hasActiveChildProcess() || server.rdb_pipe_conns) return 0;
+
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+        if (slave != c && slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START)
+            return 0;
+    }
+    return 1;
+}
+
 /* SYNC and PSYNC command implementation. */
 void syncCommand(client *c) {
     /* ignore SYNC if already slave or in monitor mode */
@@ -789,8 +1374,17 @@ void syncCommand(client *c) {
             /* Increment stats for failed PSYNCs, but only if the
              * replid is not "?", as this is used by slaves to force a full
              * resync on purpose when they are not albe to partially
-             * resync. */
-            if (master_replid[0] != '?') server.stat_sync_partial_err++;
+             * resync. The PSYNC sent again after the slot digests is not
+             * counted twice. */
+            if (master_replid[0] != '?' && !c->slot_digests)
+                server.stat_sync_partial_err++;
+
+            /* Ask the replica for its slot digests before falling back to a
+             * full resync: it will send PSYNC again right after them. */
+            if (!c->slot_digests && replicationCanDiffSync(c)) {
+                addReplyProto(c,"+DIGESTS\r\n",10);
+                return;
+            }
         }
     } else {
         /* If a slave uses SYNC, we are dealing with an old implementation
@@ -799,8 +1393,18 @@ void syncCommand(client *c) {
         c->flags |= CLIENT_PRE_PSYNC;
     }
 
-    /* Full resynchronization. */
-    server.stat_sync_full++;
+    /* Full resynchronization, or diff resynchronization if the replica sent
+     * its slot digests and we can still generate an RDB just for it. */
+    if (c->slot_digests &&
+        ((c->flags & CLIENT_PRE_PSYNC) || !replicationCanDiffSync(c)))
+    {
+        sdsfree(c->slot_digests);
+        c->slot_digests = NULL;
+    }
+    if (c->slot_digests)
+        server.stat_sync_diff++;
+    else
+        server.stat_sync_full++;
 
     /* Setup the slave as one waiting for BGSAVE to start. The following code
      * paths will change the state if we handle the slave differently. */
@@ -851,7 +1455,7 @@ void syncCommand(client *c) {
             /* Perfect, the server is already registering differences for
              * another slave. Set the right state, and copy the buffer.
              * We don't copy buffer if clients don't want. */
-            if (!(c->flags & CLIENT_REPL_RDBONLY)) copyClientOutputBuffer(c,slave);
+            if (!(c->flags & CLIENT_REPL_RDBONLY)) copyReplicaOutputBuffer(c,slave);
             replicationSetupSlaveForFullResync(c,slave->psync_initial_offset);
             serverLog(LL_NOTICE,"Waiting for end of BGSAVE for SYNC");
         } else {
@@ -872,7 +1476,7 @@ void syncCommand(client *c) {
     /* CASE 3: There is no BGSAVE is progress. */
     } else {
         if (server.repl_diskless_sync && (c->slave_capa & SLAVE_CAPA_EOF) &&
-            server.repl_diskless_sync_delay)
+            server.repl_diskless_sync_delay && !c->slot_digests)
         {
             /* Diskless replication RDB child is created inside
              * replicationCron() since we want to delay its start a
@@ -957,6 +1561,8 @@ void replconfCommand(client *c) {
                 c->slave_capa |= SLAVE_CAPA_EOF;
             else if (!strcasecmp(c->argv[j+1]->ptr,"psync2"))
                 c->slave_capa |= SLAVE_CAPA_PSYNC2;
+            else if (!strcasecmp(c->argv[j+1]->ptr,"slotdiff"))
+                c->slave_capa |= SLAVE_CAPA_SLOTDIFF;
         } else if (!strcasecmp(c->argv[j]->ptr,"ack")) {
             /* REPLCONF ACK is used by slave to inform the master the amount
              * of replication stream that it processed so far. It is an
@@ -981,12 +1587,41 @@ void replconfCommand(client *c) {
                 checkChildrenDone();
             if (c->repl_put_online_on_ack && c->replstate == SLAVE_STATE_ONLINE)
                 putSlaveOnline(c);
+            /* REPLCONF ACK <offset> GETACK <token> is sent by replicas with
+             * reads waiting for a staleness bound, see
+             * replicationRequestGetack(): send a GETACK with the same token
+             * ASAP, or ask our own master if we are a replica, since we just
+             * proxy its stream. */
+            if (c->argc >= j+4 && !strcasecmp(c->argv[j+2]->ptr,"getack") &&
+                sdsEncodedObject(c->argv[j+3]))
+            {
+                sds token = c->argv[j+3]->ptr;
+                if (server.masterhost)
+                    replicationRequestGetack(token);
+                else if (!strcmp(token,"*"))
+                    replicationRequestAckFromSlaves();
+                else
+                    listAddNodeTail(server.repl_getack_tokens,sdsdup(token));
+            }
             /* Note: this command does not reply anything! */
             return;
         } else if (!strcasecmp(c->argv[j]->ptr,"getack")) {
             /* REPLCONF GETACK is used in order to request an ACK ASAP
              * to the slave. */
-            if (server.masterhost && server.master) replicationSendAck();
+            if (server.masterhost && server.master) {
+                replicationSendAck();
+                /* The master sent this GETACK after getting our request:
+                 * we had all its writes as of the time we asked. */
+                if (server.repl_getack_token &&
+                    sdsEncodedObject(c->argv[j+1]) &&
+                    !strcmp(c->argv[j+1]->ptr,server.repl_getack_token))
+                {
+                    server.repl_fresh_time = server.repl_getack_request_time;
+                    server.repl_getack_request_time = 0;
+                    sdsfree(server.repl_getack_token);
+                    server.repl_getack_token = NULL;
+                }
+            }
             return;
         } else if (!strcasecmp(c->argv[j]->ptr,"rdb-only")) {
            /* REPLCONF RDB-ONLY is used to identify the client only wants
@@ -997,6 +1632,21 @@ void replconfCommand(client *c) {
                 return;
             if (rdb_only == 1) c->flags |= CLIENT_REPL_RDBONLY;
             else c->flags &= ~CLIENT_REPL_RDBONLY;
+        } else if (!strcasecmp(c->argv[j]->ptr,"slot-digests")) {
+            /* REPLCONF SLOT-DIGESTS is sent by replicas asked for their slot
+             * digests with +DIGESTS, just before they send PSYNC again. If
+             * the digests are not valid the replica gets a full resync. */
+            sds digests = c->argv[j+1]->ptr;
+
+            sdsfree(c->slot_digests);
+            c->slot_digests = NULL;
+            if (sdsEncodedObject(c->argv[j+1]) &&
+                slotDigestDumpIsValid(digests))
+                c->slot_digests = sdsdup(digests);
+            else
+                c->slave_capa &= ~SLAVE_CAPA_SLOTDIFF;
+            /* Note: this command does not reply anything! */
+            return;
         } else {
             addReplyErrorFormat(c,"Unrecognized REPLCONF option: %s",
                 (char*)c->argv[j]->ptr);
@@ -1149,47 +1799,197 @@ void sendBulkToSlave(connection *conn) {
     }
 }
 
-/* Remove one write handler from the list of connections waiting to be writable
- * during rdb pipe transfer. */
-void rdbPipeWriteHandlerConnRemoved(struct connection *conn) {
-    if (!connHasWriteHandler(conn))
+/* In diskless replication the data read from the child's rdb pipe is kept
+ * in a ring buffer, and every replica is sent the part it didn't receive yet
+ * at its own pace: 'repldboff' is the offset of the RDB stream sent to the
+ * replica so far. The pipe is read only when there is free space in the ring
+ * buffer, that is, as far as the slowest replica allows. */
+
+/* Return the offset of the RDB stream sent to the slowest replica, or the
+ * offset read from the pipe so far if no replica is left. */
+static long long rdbPipeMinOffset(void) {
+    long long min = server.rdb_pipe_read_off;
+    int i;
+
+    for (i=0; i < server.rdb_pipe_numconns; i++) {
+        connection *conn = server.rdb_pipe_conns[i];
+        if (!conn)
+            continue;
+        client *slave = connGetPrivateData(conn);
+        if (slave->repldboff < min) min = slave->repldboff;
+    }
+    return min;
+}
+
+/* Install again the pipe read handler if the slowest replica made room in
+ * the ring buffer. */
+static void rdbPipeResumeRead(void) {
+    if (server.rdb_pipe_eof || server.rdb_pipe_read == -1) return;
+    if (server.rdb_pipe_read_off - rdbPipeMinOffset() >=
+        (long long)server.rdb_pipe_buff_size) return;
+    if (aeGetFileEvents(server.el,server.rdb_pipe_read) & AE_READABLE) return;
+    if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE, rdbPipeReadHandler,NULL) == AE_ERR) {
+        serverPanic("Unrecoverable error creating server.rdb_pipe_read file event.");
+    }
+}
+
+/* Once the child closed the pipe and every replica was sent all the data,
+ * notify the child that it's safe to exit. When the server detects the child
+ * has exited, it can mark the replicas as online, and start streaming the
+ * replication buffers. */
+static void rdbPipeCheckDone(void) {
+    if (!server.rdb_pipe_eof || server.rdb_child_exit_pipe == -1) return;
+    if (rdbPipeMinOffset() != server.rdb_pipe_read_off) return;
+    close(server.rdb_child_exit_pipe);
+    server.rdb_child_exit_pipe = -1;
+}
+
+/* When the ring buffer is full, the replicas that were not sent its oldest
+ * data yet stop the transfer to all the others. If another replica was sent
+ * everything buffered and is waiting for more for longer than
+ * repl-diskless-sync-slow-timeout, the slow replicas are disconnected so
+ * that they don't throttle the faster ones. */
+static void rdbPipeDropSlowReplicas(void) {
+    long long min = rdbPipeMinOffset();
+    int i, waiting = 0;
+
+    if (server.rdb_pipe_read_off - min >= (long long)server.rdb_pipe_buff_size) {
+        for (i=0; i < server.rdb_pipe_numconns; i++) {
+            connection *conn = server.rdb_pipe_conns[i];
+            if (!conn)
+                continue;
+            client *slave = connGetPrivateData(conn);
+            if (slave->repldboff == server.rdb_pipe_read_off) waiting = 1;
+        }
+    }
+    if (!waiting) {
+        server.rdb_pipe_stalled_since = 0;
         return;
-    connSetWriteHandler(conn, NULL);
-    client *slave = connGetPrivateData(conn);
-    slave->repl_last_partial_write = 0;
-    server.rdb_pipe_numconns_writing--;
-    /* if there are no more writes for now for this conn, or write error: */
-    if (server.rdb_pipe_numconns_writing == 0) {
-        if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE, rdbPipeReadHandler,NULL) == AE_ERR) {
-            serverPanic("Unrecoverable error creating server.rdb_pipe_read file event.");
+    }
+    if (server.rdb_pipe_stalled_since == 0)
+        server.rdb_pipe_stalled_since = server.unixtime;
+    if (!server.repl_diskless_sync_slow_timeout ||
+        server.unixtime - server.rdb_pipe_stalled_since <
+        server.repl_diskless_sync_slow_timeout) return;
+
+    server.rdb_pipe_stalled_since = 0;
+    for (i=0; i < server.rdb_pipe_numconns; i++) {
+        connection *conn = server.rdb_pipe_conns[i];
+        if (!conn)
+            continue;
+        client *slave = connGetPrivateData(conn);
+        if (slave->repldboff != min) continue;
+        serverLog(LL_WARNING,"Diskless rdb transfer, replica %s is %zu bytes "
+            "behind the others, disconnecting it.",
+            replicationGetSlaveName(slave), server.rdb_pipe_buff_size);
+        freeClient(slave);
+    }
+}
+
+/* Send to the replica the data of the ring buffer it was not sent yet, as
+ * much as the connection and the rate limit allow. If the connection can't
+ * accept more data the write handler is installed. Returns C_ERR if the
+ * replica was freed because of a write error. */
+static int rdbPipeWriteToReplica(client *slave) {
+    connection *conn = slave->conn;
+    long long sent = 0;
+    int blocked = 0;
+
+    while (slave->repldboff < server.rdb_pipe_read_off) {
+        size_t start = slave->repldboff % server.rdb_pipe_buff_size;
+        long long len = server.rdb_pipe_read_off - slave->repldboff;
+        int nwritten;
+
+        if (len > (long long)(server.rdb_pipe_buff_size - start))
+            len = server.rdb_pipe_buff_size - start;
+        if (server.repl_diskless_sync_max_rate) {
+            /* Wait for the next period, see rdbPipeCron(). */
+            if (slave->repldb_budget <= 0) break;
+            if (len > slave->repldb_budget) len = slave->repldb_budget;
+        }
+        if ((nwritten = connWrite(conn, server.rdb_pipe_buff + start, len)) == -1) {
+            if (connGetState(conn) != CONN_STATE_CONNECTED) {
+                serverLog(LL_WARNING,"Diskless rdb transfer, write error sending DB to replica: %s",
+                    connGetLastError(conn));
+                freeClient(slave);
+                return C_ERR;
+            }
+            /* An error and still in connected state, is equivalent to EAGAIN */
+            blocked = 1;
+            break;
+        }
+        slave->repldboff += nwritten;
+        slave->repldb_budget -= nwritten;
+        sent += nwritten;
+        atomicIncr(server.stat_net_output_bytes, nwritten);
+        if (nwritten != len) {
+            blocked = 1;
+            break;
         }
     }
+
+    if (blocked) {
+        /* Only refresh the time of the last partial write if we made some
+         * progress, so that a stuck replica times out (see replicationCron). */
+        if (sent || slave->repl_last_partial_write == 0)
+            slave->repl_last_partial_write = server.unixtime;
+        if (!connHasWriteHandler(conn))
+            connSetWriteHandler(conn, rdbPipeWriteHandler);
+    } else {
+        slave->repl_last_partial_write = 0;
+        if (connHasWriteHandler(conn))
+            connSetWriteHandler(conn, NULL);
+    }
+    return C_OK;
+}
+
+/* Remove a connection from the targets of the rdb pipe transfer: the caller
+ * already removed it from 'rdb_pipe_conns'. */
+void rdbPipeWriteHandlerConnRemoved(struct connection *conn) {
+    if (connHasWriteHandler(conn))
+        connSetWriteHandler(conn, NULL);
+    client *slave = connGetPrivateData(conn);
+    slave->repl_last_partial_write = 0;
+    /* The removed replica may have been the slowest, or the last one that
+     * was still receiving data. */
+    rdbPipeResumeRead();
+    rdbPipeCheckDone();
 }
 
 /* Called in diskless master during transfer of data from the rdb pipe, when
  * the replica becomes writable again. */
 void rdbPipeWriteHandler(struct connection *conn) {
-    serverAssert(server.rdb_pipe_bufflen>0);
     client *slave = connGetPrivateData(conn);
-    int nwritten;
-    if ((nwritten = connWrite(conn, server.rdb_pipe_buff + slave->repldboff,
-                              server.rdb_pipe_bufflen - slave->repldboff)) == -1)
-    {
-        if (connGetState(conn) == CONN_STATE_CONNECTED)
-            return; /* equivalent to EAGAIN */
-        serverLog(LL_WARNING,"Write error sending DB to replica: %s",
-            connGetLastError(conn));
-        freeClient(slave);
-        return;
-    } else {
-        slave->repldboff += nwritten;
-        atomicIncr(server.stat_net_output_bytes, nwritten);
-        if (slave->repldboff < server.rdb_pipe_bufflen) {
-            slave->repl_last_partial_write = server.unixtime;
-            return; /* more data to write.. */
+    if (rdbPipeWriteToReplica(slave) == C_ERR) return;
+    rdbPipeDropSlowReplicas();
+    rdbPipeResumeRead();
+    rdbPipeCheckDone();
+}
+
+/* Called by serverCron() during a diskless transfer: every replica can be
+ * sent repl-diskless-sync-max-rate/hz bytes in the next period, and the
+ * replicas that throttle the others for too long are disconnected. */
+void rdbPipeCron(void) {
+    long long budget = server.repl_diskless_sync_max_rate / server.hz;
+    int i;
+
+    if (budget == 0) budget = 1;
+    for (i=0; i < server.rdb_pipe_numconns; i++) {
+        connection *conn = server.rdb_pipe_conns[i];
+        if (!conn)
+            continue;
+        client *slave = connGetPrivateData(conn);
+        slave->repldb_budget = budget;
+        /* Resume the replicas that reached the limit of the last period. */
+        if (!connHasWriteHandler(conn) && server.rdb_pipe_buff &&
+            slave->repldboff < server.rdb_pipe_read_off)
+        {
+            rdbPipeWriteToReplica(slave);
         }
     }
-    rdbPipeWriteHandlerConnRemoved(conn);
+    rdbPipeDropSlowReplicas();
+    rdbPipeResumeRead();
+    rdbPipeCheckDone();
 }
 
 /* Called in diskless master, when there's data to read from the child's rdb pipe */
@@ -1197,14 +1997,29 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
     UNUSED(mask);
     UNUSED(clientData);
     UNUSED(eventLoop);
+    long long size = server.rdb_pipe_buff_size;
     int i;
     if (!server.rdb_pipe_buff)
-        server.rdb_pipe_buff = zmalloc(PROTO_IOBUF_LEN);
-    serverAssert(server.rdb_pipe_numconns_writing==0);
+        server.rdb_pipe_buff = zmalloc(size);
 
     while (1) {
-        server.rdb_pipe_bufflen = read(fd, server.rdb_pipe_buff, PROTO_IOBUF_LEN);
-        if (server.rdb_pipe_bufflen < 0) {
+        long long used = server.rdb_pipe_read_off - rdbPipeMinOffset();
+        if (used == size) {
+            /* The ring buffer is full: stop reading until the slowest
+             * replica makes room, or is dropped for being too slow. */
+            rdbPipeDropSlowReplicas();
+            if (server.rdb_pipe_read_off - rdbPipeMinOffset() == size) {
+                aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
+                break;
+            }
+            continue;
+        }
+
+        size_t start = server.rdb_pipe_read_off % size;
+        size_t len = size - used;
+        if (len > size - start) len = size - start;
+        ssize_t nread = read(fd, server.rdb_pipe_buff + start, len);
+        if (nread < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
                 return;
             serverLog(LL_WARNING,"Diskless rdb transfer, read error sending DB to replicas: %s", strerror(errno));
@@ -1220,10 +2035,11 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
             return;
         }
 
-        if (server.rdb_pipe_bufflen == 0) {
+        if (nread == 0) {
             /* EOF - write end was closed. */
             int stillUp = 0;
             aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
+            server.rdb_pipe_eof = 1;
             for (i=0; i < server.rdb_pipe_numconns; i++)
             {
                 connection *conn = server.rdb_pipe_conns[i];
@@ -1232,55 +2048,29 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
                 stillUp++;
             }
             serverLog(LL_WARNING,"Diskless rdb transfer, done reading from pipe, %d replicas still up.", stillUp);
-            /* Now that the replicas have finished reading, notify the child that it's safe to exit. 
-             * When the server detectes the child has exited, it can mark the replica as online, and
-             * start streaming the replication buffers. */
-            close(server.rdb_child_exit_pipe);
-            server.rdb_child_exit_pipe = -1;
+            /* Now that we read everything, the child can exit as soon as
+             * the replicas were sent what is left in the ring buffer. */
+            rdbPipeCheckDone();
             return;
         }
+        server.rdb_pipe_read_off += nread;
 
         int stillAlive = 0;
         for (i=0; i < server.rdb_pipe_numconns; i++)
         {
-            int nwritten;
             connection *conn = server.rdb_pipe_conns[i];
             if (!conn)
                 continue;
 
             client *slave = connGetPrivateData(conn);
-            if ((nwritten = connWrite(conn, server.rdb_pipe_buff, server.rdb_pipe_bufflen)) == -1) {
-                if (connGetState(conn) != CONN_STATE_CONNECTED) {
-                    serverLog(LL_WARNING,"Diskless rdb transfer, write error sending DB to replica: %s",
-                        connGetLastError(conn));
-                    freeClient(slave);
-                    server.rdb_pipe_conns[i] = NULL;
-                    continue;
-                }
-                /* An error and still in connected state, is equivalent to EAGAIN */
-                slave->repldboff = 0;
-            } else {
-                /* Note: when use diskless replication, 'repldboff' is the offset
-                 * of 'rdb_pipe_buff' sent rather than the offset of entire RDB. */
-                slave->repldboff = nwritten;
-                atomicIncr(server.stat_net_output_bytes, nwritten);
-            }
-            /* If we were unable to write all the data to one of the replicas,
-             * setup write handler (and disable pipe read handler, below) */
-            if (nwritten != server.rdb_pipe_bufflen) {
-                slave->repl_last_partial_write = server.unixtime;
-                server.rdb_pipe_numconns_writing++;
-                connSetWriteHandler(conn, rdbPipeWriteHandler);
-            }
+            if (rdbPipeWriteToReplica(slave) == C_ERR)
+                continue;
             stillAlive++;
         }
 
         if (stillAlive == 0) {
             serverLog(LL_WARNING,"Diskless rdb transfer, last replica dropped, killing fork child.");
             killRDBChild();
-        }
-        /*  Remove the pipe read handler if at least one write handler was set. */
-        if (server.rdb_pipe_numconns_writing || stillAlive == 0) {
             aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
             break;
         }
@@ -1484,6 +2274,7 @@ void replicationCreateMasterClient(connection *conn, int dbid) {
     if (server.master->reploff == -1)
         server.master->flags |= CLIENT_PRE_PSYNC;
     if (dbid != -1) selectDb(server.master,dbid);
+    replicaApplyReset(server.master);
 }
 
 /* This function will try to re-enable the AOF file after the
@@ -1552,6 +2343,8 @@ void readSyncBulkPayload(connection *conn) {
     dbBackup *diskless_load_backup = NULL;
     int empty_db_flags = server.repl_slave_lazy_flush ? EMPTYDB_ASYNC :
                                                         EMPTYDB_NO_FLAGS;
+    int diff = server.repl_transfer_diff;
+    int rdbflags = RDBFLAGS_REPLICATION | (diff ? RDBFLAGS_DIFF_RESYNC : 0);
     off_t left;
 
     /* Static vars used to hold the EOF mark, and the last bytes received
@@ -1716,8 +2509,16 @@ void readSyncBulkPayload(connection *conn) {
      *    read everything from the socket.
      *
      * 2. Or when we are done reading from the socket to the RDB file, in
-     *    such case we want just to read the RDB file in memory. */
-    serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: Flushing old data");
+     *    such case we want just to read the RDB file in memory.
+     *
+     * For a diff resync we keep our data: the slots that differ from the
+     * master are dropped when loading the RDB, that has only those slots. */
+    if (diff) {
+        serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: Keeping the slots "
+                             "that match the master");
+    } else {
+        serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: Flushing old data");
+    }
 
     /* We need to stop any AOF rewriting child before flusing and parsing
      * the RDB, otherwise we'll create a copy-on-write disaster. */
@@ -1726,7 +2527,7 @@ void readSyncBulkPayload(connection *conn) {
     /* When diskless RDB loading is used by replicas, it may be configured
      * in order to save the current DB instead of throwing it away,
      * so that we can restore it in case of failed transfer. */
-    if (use_diskless_load &&
+    if (use_diskless_load && !diff &&
         server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB)
     {
         /* Create a backup of server.db[] and initialize to empty
@@ -1737,7 +2538,7 @@ void readSyncBulkPayload(connection *conn) {
      * (Where disklessLoadMakeBackup left server.db empty) because we
      * want to execute all the auxiliary logic of emptyDb (Namely,
      * fire module events) */
-    emptyDb(-1,empty_db_flags,replicationEmptyDbCallback);
+    if (!diff) emptyDb(-1,empty_db_flags,replicationEmptyDbCallback);
 
     /* Before loading the DB into memory we need to delete the readable
      * handler, otherwise it will get called recursively since
@@ -1756,7 +2557,7 @@ void readSyncBulkPayload(connection *conn) {
         connRecvTimeout(conn, server.repl_timeout*1000);
         startLoading(server.repl_transfer_size, RDBFLAGS_REPLICATION);
 
-        if (rdbLoadRio(&rdb,RDBFLAGS_REPLICATION,&rsi) != C_OK) {
+        if (rdbLoadRio(&rdb,rdbflags,&rsi) != C_OK) {
             /* RDB loading failed. */
             stopLoading(0);
             serverLog(LL_WARNING,
@@ -1766,10 +2567,10 @@ void readSyncBulkPayload(connection *conn) {
             rioFreeConn(&rdb, NULL);
 
             /* Remove the half-loaded data in case we started with
-             * an empty replica. */
+             * an empty replica, or with a half merged diff resync. */
             emptyDb(-1,empty_db_flags,replicationEmptyDbCallback);
 
-            if (server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB) {
+            if (diskless_load_backup) {
                 /* Restore the backed up databases. */
                 disklessLoadRestoreBackup(diskless_load_backup);
             }
@@ -1781,7 +2582,7 @@ void readSyncBulkPayload(connection *conn) {
         }
 
         /* RDB loading succeeded if we reach this point. */
-        if (server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB) {
+        if (diskless_load_backup) {
             /* Delete the backup databases we created before starting to load
              * the new RDB. Now the RDB was loaded with success so the old
              * data is useless. */
@@ -1831,6 +2632,23 @@ void readSyncBulkPayload(connection *conn) {
             return;
         }
 
+        /* A diff resync is not a snapshot of our dataset: load it from the
+         * temp file, that is removed afterwards. */
+        if (diff) {
+            int retval = rdbLoad(server.repl_transfer_tmpfile,&rsi,rdbflags);
+            bg_unlink(server.repl_transfer_tmpfile);
+            if (retval != C_OK) {
+                serverLog(LL_WARNING,
+                    "Failed trying to load the MASTER diff resync "
+                    "from disk");
+                cancelReplicationHandshake(1);
+                /* Don't keep a half merged dataset. */
+                emptyDb(-1,empty_db_flags,replicationEmptyDbCallback);
+                return;
+            }
+            goto loaded;
+        }
+
         /* Rename rdb like renaming rewrite aof asynchronously. */
         int old_rdb_fd = open(server.rdb_filename,O_RDONLY|O_NONBLOCK);
         if (rename(server.repl_transfer_tmpfile,server.rdb_filename) == -1) {
@@ -1843,9 +2661,9 @@ void readSyncBulkPayload(connection *conn) {
             return;
         }
         /* Close old rdb asynchronously. */
-        if (old_rdb_fd != -1) bioCreateCloseJob(old_rdb_fd);
+        if (old_rdb_fd != -1) bioCreateCloseJob(old_rdb_fd, 0);
 
-        if (rdbLoad(server.rdb_filename,&rsi,RDBFLAGS_REPLICATION) != C_OK) {
+        if (rdbLoad(server.rdb_filename,&rsi,rdbflags) != C_OK) {
             serverLog(LL_WARNING,
                 "Failed trying to load the MASTER synchronization "
                 "DB from disk");
@@ -1869,6 +2687,7 @@ void readSyncBulkPayload(connection *conn) {
             bg_unlink(server.rdb_filename);
         }
 
+loaded:
         zfree(server.repl_transfer_tmpfile);
         close(server.repl_transfer_fd);
         server.repl_transfer_fd = -1;
@@ -2046,6 +2865,10 @@ char *sendCommandArgv(connection *conn, int argc, char **argv, size_t *argv_lens
  * PSYNC_WRITE_ERROR: There was an error writing the command to the socket.
  * PSYNC_WAIT_REPLY: Call again the function with read_reply set to 1.
  * PSYNC_TRY_LATER: Master is currently in a transient error condition.
+ * PSYNC_SEND_DIGESTS: A full resync is needed, but the master may just send
+ *                     the slots that differ from ours: it wants our slot
+ *                     digests, then PSYNC again. The read handler is left
+ *                     uninstalled as for the other replies.
  *
  * Notable side effects:
  *
@@ -2062,6 +2885,7 @@ char *sendCommandArgv(connection *conn, int argc, char **argv, size_t *argv_lens
 #define PSYNC_FULLRESYNC 3
 #define PSYNC_NOT_SUPPORTED 4
 #define PSYNC_TRY_LATER 5
+#define PSYNC_SEND_DIGESTS 6
 int slaveTryPartialResynchronization(connection *conn, int read_reply) {
     char *psync_replid;
     char psync_offset[32];
@@ -2075,6 +2899,7 @@ int slaveTryPartialResynchronization(connection *conn, int read_reply) {
          * right value, so that this information will be propagated to the
          * client structure representing the master into server.master. */
         server.master_initial_offset = -1;
+        server.repl_transfer_diff = 0;
 
         if (server.cached_master) {
             psync_replid = server.cached_master->replid;
@@ -2115,11 +2940,20 @@ int slaveTryPartialResynchronization(connection *conn, int read_reply) {
 
     connSetReadHandler(conn, NULL);
 
-    if (!strncmp(reply,"+FULLRESYNC",11)) {
+    if (!strncmp(reply,"+DIGESTS",8)) {
+        sdsfree(reply);
+        return PSYNC_SEND_DIGESTS;
+    }
+
+    if (!strncmp(reply,"+FULLRESYNC",11) ||
+        !strncmp(reply,"+DIFFRESYNC",11))
+    {
         char *replid = NULL, *offset = NULL;
 
         /* FULL RESYNC, parse the reply in order to extract the replid
-         * and the replication offset. */
+         * and the replication offset. A DIFF RESYNC is the same, but the
+         * RDB will only have the slots that differ from our dataset. */
+        server.repl_transfer_diff = reply[1] == 'D';
         replid = strchr(reply,' ');
         if (replid) {
             replid++;
@@ -2138,7 +2972,8 @@ int slaveTryPartialResynchronization(connection *conn, int read_reply) {
             memcpy(server.master_replid, replid, offset-replid-1);
             server.master_replid[CONFIG_RUN_ID_SIZE] = '\0';
             server.master_initial_offset = strtoll(offset,NULL,10);
-            serverLog(LL_NOTICE,"Full resync from master: %s:%lld",
+            serverLog(LL_NOTICE,"%s resync from master: %s:%lld",
+                server.repl_transfer_diff ? "Diff" : "Full",
                 server.master_replid,
                 server.master_initial_offset);
         }
@@ -2338,10 +3173,17 @@ void syncWithMaster(connection *conn) {
          *
          * EOF: supports EOF-style RDB transfer for diskless replication.
          * PSYNC2: supports PSYNC v2, so understands +CONTINUE <new repl ID>.
+         * SLOTDIFF: can send its slot digests and load a diff resync. Not
+         *           worth it when we have no data.
          *
          * The master will ignore capabilities it does not understand. */
-        err = sendCommand(conn,"REPLCONF",
-                "capa","eof","capa","psync2",NULL);
+        if (server.repl_diff_sync && dbTotalServerKeyCount()) {
+            err = sendCommand(conn,"REPLCONF",
+                    "capa","eof","capa","psync2","capa","slotdiff",NULL);
+        } else {
+            err = sendCommand(conn,"REPLCONF",
+                    "capa","eof","capa","psync2",NULL);
+        }
         if (err) goto write_error;
 
         server.repl_state = REPL_STATE_RECEIVE_AUTH_REPLY;
@@ -2436,6 +3278,30 @@ void syncWithMaster(connection *conn) {
     psync_result = slaveTryPartialResynchronization(conn,1);
     if (psync_result == PSYNC_WAIT_REPLY) return; /* Try again later... */
 
+    /* The master wants our slot digests to send us only the slots that
+     * differ: send them, followed by the same PSYNC again, and wait for
+     * the reply in the same state. */
+    if (psync_result == PSYNC_SEND_DIGESTS) {
+        if (!server.repl_diff_sync) {
+            serverLog(LL_WARNING,"Master asked for the slot digests, but "
+                                 "repl-diff-sync is now disabled");
+            goto error;
+        }
+        sds digests = slotDigestDump();
+        char *args[3] = {"REPLCONF","slot-digests",digests};
+        size_t lens[3] = {8,12,sdslen(digests)};
+        err = sendCommandArgv(conn,3,args,lens);
+        sdsfree(digests);
+        if (err) goto write_error;
+        if (slaveTryPartialResynchronization(conn,0) == PSYNC_WRITE_ERROR) {
+            err = sdsnew("Write error sending the PSYNC command.");
+            abortFailover("Write error to failover target");
+            goto write_error;
+        }
+        connSetReadHandler(conn, syncWithMaster);
+        return;
+    }
+
     /* Check the status of the planned failover. We expect PSYNC_CONTINUE,
      * but there is nothing technically wrong with a full resync which
      * could happen in edge cases. */
@@ -2673,6 +3539,9 @@ void replicationUnsetMaster(void) {
 
     /* Clear masterhost first, since the freeClient calls
      * replicationHandleMasterDisconnection which can attempt to re-connect. */
+    /* Apply what was already received from the master. */
+    if (server.master) replicaApplyDrain(server.master);
+
     sdsfree(server.masterhost);
     server.masterhost = NULL;
     if (server.master) freeClient(server.master);
@@ -2879,6 +3748,425 @@ void replicationSendAck(void) {
     }
 }
 
+/* ------------------------- REPLICA APPLY THREAD ---------------------------
+ *
+ * With replica-apply-thread enabled, the replication stream read from the
+ * master is not parsed by the main thread: the buffers read are handed to a
+ * dedicated thread, that parses them into batches of commands, with the
+ * argument objects already created, while the main thread applies the
+ * batches parsed before. So under write bursts the parsing of the stream is
+ * pipelined with the execution of the commands.
+ *
+ * The commands are still applied one after the other by the main thread, in
+ * the order of the stream, so transactions, scripts and the order of the
+ * writes of every key are preserved, and the stream is still propagated to
+ * the sub-replicas and to the backlog as the commands are applied.
+ * -------------------------------------------------------------------------- */
+
+#define REPL_APPLY_BATCH_CMDS 1024 /* Max commands in a batch. */
+#define REPL_APPLY_MAX_PENDING (32*1024*1024) /* Max bytes read from the
+                                                 master and not yet applied:
+                                                 over that we stop reading. */
+
+typedef struct replApplyCmd {
+    int argc;
+    robj **argv;
+    size_t argv_len_sum;
+    long long end_off;      /* Replication offset right after the command. */
+} replApplyCmd;
+
+typedef struct replApplyBatch {
+    int count;              /* Number of commands. */
+    int next;               /* Next command to apply. */
+    int error;              /* A protocol error follows the commands. */
+    long long parse_usec;   /* Time spent parsing the batch. */
+    struct replApplyBatch *next_batch;
+    replApplyCmd cmd[REPL_APPLY_BATCH_CMDS];
+} replApplyBatch;
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* Signaled when there is data to parse. */
+    pthread_cond_t parsed_cond; /* Signaled when the data was parsed. */
+    long long fed, parsed;  /* Buffers handed to the parser, and parsed. */
+    int pipe[2];            /* Awakes the event loop when a batch is ready. */
+    list *input;            /* Buffers read from the master, to parse. */
+    replApplyBatch *head, *tail; /* Parsed batches, to apply. */
+    long long epoch;        /* Incremented when the stream restarts, so that
+                               the parser discards the data of the old one. */
+    long long start_off;    /* Replication offset of the stream start. */
+    /* Accessed only by the main thread. */
+    replApplyBatch *applying; /* Batch being applied. */
+    long long queued_off;   /* Offset of the last byte handed to the parser. */
+    long long applied_off;  /* Offset right after the last command applied. */
+    int reads_paused;       /* Reads stopped, too much data pending. */
+    int draining;           /* Apply even if the master is being closed. */
+} replApply;
+
+static void replApplyBatchFree(replApplyBatch *b) {
+    for (int i = b->next; i < b->count; i++) {
+        for (int j = 0; j < b->cmd[i].argc; j++)
+            decrRefCount(b->cmd[i].argv[j]);
+        zfree(b->cmd[i].argv);
+    }
+    zfree(b);
+}
+
+/* Parse the next command of the stream at 'buf', of 'len' bytes, into
+ * 'cmd'. Returns the bytes the command takes, 0 if the command is not
+ * complete yet, or -1 on protocol errors. Empty commands are parsed with
+ * argc set to zero. */
+static long long replApplyParseCommand(char *buf, size_t len, replApplyCmd *cmd) {
+    char *p = buf, *end = buf+len, *nl;
+    long long ll;
+
+    cmd->argc = 0;
+    cmd->argv = NULL;
+    cmd->argv_len_sum = 0;
+
+    nl = memchr(p,'\n',len);
+    if (nl == NULL) return (len > PROTO_INLINE_MAX_SIZE) ? -1 : 0;
+
+    /* Inline commands, the master only sends newlines this way. */
+    if (*p != '*') {
+        int argc;
+        sds line = sdsnewlen(p,nl-p);
+        sds *argv = sdssplitargs(line,&argc);
+        sdsfree(line);
+        if (argv == NULL) return -1;
+        if (argc) {
+            cmd->argv = zmalloc(sizeof(robj*)*argc);
+            for (int j = 0; j < argc; j++) {
+                cmd->argv[j] = createObject(OBJ_STRING,argv[j]);
+                cmd->argv_len_sum += sdslen(argv[j]);
+            }
+        }
+        zfree(argv);
+        cmd->argc = argc;
+        return nl-buf+1;
+    }
+
+    if (nl == p || nl[-1] != '\r' ||
+        !string2ll(p+1,nl-p-2,&ll) || ll > INT_MAX) return -1;
+    p = nl+1;
+    if (ll <= 0) return p-buf;
+
+    int argc = ll;
+    robj **argv = zmalloc(sizeof(robj*)*argc);
+    int j;
+    for (j = 0; j < argc; j++) {
+        nl = memchr(p,'\n',end-p);
+        if (nl == NULL) {
+            if (end-p > PROTO_INLINE_MAX_SIZE) goto err;
+            goto incomplete;
+        }
+        if (*p != '$' || nl == p || nl[-1] != '\r' ||
+            !string2ll(p+1,nl-p-2,&ll) || ll < 0) goto err;
+        p = nl+1;
+        if (end-p < ll+2) goto incomplete;
+        argv[j] = createStringObject(p,ll);
+        cmd->argv_len_sum += ll;
+        p += ll+2;
+    }
+    cmd->argc = argc;
+    cmd->argv = argv;
+    return p-buf;
+
+incomplete:
+    while (j--) decrRefCount(argv[j]);
+    zfree(argv);
+    return 0;
+err:
+    while (j--) decrRefCount(argv[j]);
+    zfree(argv);
+    return -1;
+}
+
+static void *replApplyThreadMain(void *arg) {
+    UNUSED(arg);
+    sds buf = sdsempty();
+    long long epoch = -1;
+    long long off = 0;  /* Replication offset of the last byte parsed. */
+    int error = 0;
+
+    redis_set_thread_title("repl_apply");
+    while(1) {
+        pthread_mutex_lock(&replApply.lock);
+        while (listLength(replApply.input) == 0)
+            pthread_cond_wait(&replApply.cond,&replApply.lock);
+        if (epoch != replApply.epoch) {
+            /* The stream restarted, discard the data of the old one. */
+            epoch = replApply.epoch;
+            off = replApply.start_off;
+            sdsclear(buf);
+            error = 0;
+        }
+        long long fed = replApply.fed;
+        while (listLength(replApply.input)) {
+            listNode *ln = listFirst(replApply.input);
+            buf = sdscatsds(buf,ln->value);
+            listDelNode(replApply.input,ln);
+        }
+        pthread_mutex_unlock(&replApply.lock);
+
+        /* Parse all the complete commands in batches. */
+        size_t pos = 0;
+        long long skipped = 0;  /* Bytes of empty commands. */
+        while (pos < sdslen(buf) && !error) {
+            monotime timer;
+            elapsedStart(&timer);
+            replApplyBatch *b = zmalloc(sizeof(*b));
+            b->count = 0;
+            b->next = 0;
+            b->error = 0;
+            b->next_batch = NULL;
+            while (b->count < REPL_APPLY_BATCH_CMDS && pos < sdslen(buf)) {
+                replApplyCmd *cmd = b->cmd+b->count;
+                long long n = replApplyParseCommand(buf+pos,sdslen(buf)-pos,cmd);
+                if (n == 0) break;
+                if (n == -1) {
+                    b->error = error = 1;
+                    break;
+                }
+                pos += n;
+                /* Empty commands just advance the offset of the next one. */
+                skipped += n;
+                if (cmd->argc == 0) continue;
+                off += skipped;
+                skipped = 0;
+                cmd->end_off = off;
+                b->count++;
+            }
+            b->parse_usec = elapsedUs(timer);
+            if (b->count == 0 && !b->error) {
+                zfree(b);
+                break;
+            }
+
+            /* Queue the batch, unless the stream restarted meanwhile. */
+            pthread_mutex_lock(&replApply.lock);
+            if (epoch == replApply.epoch) {
+                if (replApply.tail) replApply.tail->next_batch = b;
+                else replApply.head = b;
+                replApply.tail = b;
+                b = NULL;
+            }
+            pthread_mutex_unlock(&replApply.lock);
+            if (b) {
+                replApplyBatchFree(b);
+                break;
+            }
+            if (write(replApply.pipe[1],"A",1) != 1) {
+                /* Nothing to do, the pipe is already full of awake bytes. */
+            }
+        }
+        /* The empty commands not followed by a command are parsed again.
+         * After a protocol error nothing is parsed until the next stream. */
+        pos -= skipped;
+        if (error) sdsclear(buf);
+        else sdsrange(buf,pos,-1);
+
+        pthread_mutex_lock(&replApply.lock);
+        if (epoch == replApply.epoch) replApply.parsed = fed;
+        pthread_cond_broadcast(&replApply.parsed_cond);
+        pthread_mutex_unlock(&replApply.lock);
+    }
+    return NULL;
+}
+
+/* Called by the event loop when the apply thread parsed new batches. */
+static void replApplyPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(mask);
+    UNUSED(privdata);
+
+    char buf[128];
+    while (read(replApply.pipe[0],buf,sizeof(buf)) > 0);
+    if (server.master) replicaApplyParsedCommands(server.master);
+}
+
+/* Start the apply thread, if replica-apply-thread is enabled. */
+void replicaApplyInit(void) {
+    if (!server.repl_apply_thread) return;
+
+    replApply.input = listCreate();
+    listSetFreeMethod(replApply.input,(void (*)(void*))sdsfree);
+    if (pipe(replApply.pipe) == -1) {
+        serverLog(LL_WARNING,
+            "Can't create the pipe for the replica apply thread: %s",
+            strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL,replApply.pipe[0]);
+    anetNonBlock(NULL,replApply.pipe[1]);
+    anetCloexec(replApply.pipe[0]);
+    anetCloexec(replApply.pipe[1]);
+    if (aeCreateFileEvent(server.el,replApply.pipe[0],AE_READABLE,
+        replApplyPipeReadable,NULL) == AE_ERR)
+    {
+        serverPanic("Error registering the readable event for the replica "
+                    "apply thread.");
+    }
+    pthread_mutex_init(&replApply.lock,NULL);
+    pthread_cond_init(&replApply.cond,NULL);
+    pthread_cond_init(&replApply.parsed_cond,NULL);
+    if (pthread_create(&replApply.thread,NULL,replApplyThreadMain,NULL) != 0) {
+        serverLog(LL_WARNING,"Fatal: Can't initialize the replica apply thread.");
+        exit(1);
+    }
+}
+
+/* Discard what was read from the master and not applied yet, since the
+ * stream restarts from the applied offset of 'master': this is called when
+ * the master client is created, cached or resurrected. */
+void replicaApplyReset(client *master) {
+    if (!server.repl_apply_thread) return;
+
+    pthread_mutex_lock(&replApply.lock);
+    listEmpty(replApply.input);
+    replApplyBatch *b = replApply.head;
+    replApply.head = replApply.tail = NULL;
+    replApply.epoch++;
+    replApply.start_off = master->reploff;
+    replApply.parsed = replApply.fed;
+    pthread_mutex_unlock(&replApply.lock);
+
+    while (b) {
+        replApplyBatch *next = b->next_batch;
+        replApplyBatchFree(b);
+        b = next;
+    }
+    if (replApply.applying) {
+        replApplyBatchFree(replApply.applying);
+        replApply.applying = NULL;
+    }
+    replApply.queued_off = master->reploff;
+    replApply.applied_off = master->reploff;
+    replApply.reads_paused = 0;
+    master->repl_applying_off = 0;
+}
+
+/* Hand the query buffer just read from the master to the apply thread. */
+void replicaApplyFeed(client *master) {
+    size_t len = sdslen(master->querybuf);
+
+    pthread_mutex_lock(&replApply.lock);
+    listAddNodeTail(replApply.input,master->querybuf);
+    replApply.fed++;
+    pthread_cond_signal(&replApply.cond);
+    pthread_mutex_unlock(&replApply.lock);
+    master->querybuf = sdsempty();
+    master->qb_pos = 0;
+
+    /* Don't read too far ahead of the commands applied. */
+    replApply.queued_off += len;
+    if (replApply.queued_off-replApply.applied_off > REPL_APPLY_MAX_PENDING) {
+        connSetReadHandler(master->conn,NULL);
+        replApply.reads_paused = 1;
+    }
+}
+
+/* Wait for the apply thread to parse all the data read from 'master', and
+ * apply it. This is used when the master link is lost or the replica is
+ * promoted, so that it has all the writes it received from the master, like
+ * when the stream is applied as soon as it is read. */
+void replicaApplyDrain(client *master) {
+    if (!server.repl_apply_thread || master != server.master) return;
+
+    /* Commands can't be applied from within a transaction, a script, or a
+     * command of the master itself: in this case what was not applied yet
+     * is discarded, like the unprocessed query buffer of the master. */
+    if (server.in_exec || server.in_eval || server.current_client == master)
+        return;
+
+    pthread_mutex_lock(&replApply.lock);
+    while (replApply.parsed != replApply.fed)
+        pthread_cond_wait(&replApply.parsed_cond,&replApply.lock);
+    pthread_mutex_unlock(&replApply.lock);
+    replApply.draining = 1;
+    replicaApplyParsedCommands(master);
+    replApply.draining = 0;
+}
+
+/* Return true if 'master' has parsed commands still to apply. */
+int replicaApplyHasPending(client *master) {
+    if (!server.repl_apply_thread || master != server.master) return 0;
+    if (replApply.applying) return 1;
+    pthread_mutex_lock(&replApply.lock);
+    int pending = replApply.head != NULL;
+    pthread_mutex_unlock(&replApply.lock);
+    return pending;
+}
+
+/* Apply the commands parsed by the apply thread, in place of
+ * processInputBuffer() for the master. Like processInputBuffer() this
+ * stops if the master gets blocked or paused, or while a script is busy,
+ * and processUnblockedClients() will resume it. */
+void replicaApplyParsedCommands(client *c) {
+    monotime timer;
+    elapsedStart(&timer);
+    long long parse_usec = 0;
+
+    while(1) {
+        if (c->flags & (CLIENT_BLOCKED|CLIENT_PENDING_COMMAND)) break;
+        if (server.lua_timedout) break;
+        if (!replApply.draining &&
+            c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP)) break;
+
+        replApplyBatch *b = replApply.applying;
+        if (b == NULL) {
+            pthread_mutex_lock(&replApply.lock);
+            b = replApply.head;
+            if (b) {
+                replApply.head = b->next_batch;
+                if (replApply.head == NULL) replApply.tail = NULL;
+            }
+            pthread_mutex_unlock(&replApply.lock);
+            if (b == NULL) break;
+            replApply.applying = b;
+            parse_usec += b->parse_usec;
+        }
+
+        if (b->next == b->count) {
+            int error = b->error;
+            replApply.applying = NULL;
+            zfree(b);
+            if (error) {
+                serverLog(LL_WARNING,"Protocol error in the replication "
+                    "stream from master, closing the link.");
+                c->flags |= CLIENT_PROTOCOL_ERROR;
+                freeClientAsync(c);
+                break;
+            }
+            continue;
+        }
+
+        /* Move the command to the client arguments, and execute it. */
+        replApplyCmd *cmd = b->cmd+b->next++;
+        zfree(c->argv);
+        c->argc = cmd->argc;
+        c->argv = cmd->argv;
+        c->argv_len_sum = cmd->argv_len_sum;
+        c->repl_applying_off = cmd->end_off;
+        replApply.applied_off = cmd->end_off;
+        c->lastinteraction = server.unixtime;
+        if (processCommandAndResetClient(c) == C_ERR) break;
+    }
+
+    server.stat_repl_parse_usec += parse_usec;
+    server.stat_repl_apply_usec += elapsedUs(timer);
+
+    /* Resume reading once we caught up. */
+    if (replApply.reads_paused && server.master == c &&
+        replApply.queued_off-replApply.applied_off < REPL_APPLY_MAX_PENDING/2)
+    {
+        connSetReadHandler(c->conn,readQueryFromClient);
+        replApply.reads_paused = 0;
+    }
+}
+
 /* ---------------------- MASTER CACHING FOR PSYNC -------------------------- */
 
 /* In order to implement partial synchronization we need to be able to cache
@@ -2903,6 +4191,11 @@ void replicationCacheMaster(client *c) {
     serverAssert(server.master != NULL && server.cached_master == NULL);
     serverLog(LL_NOTICE,"Caching the disconnected master state.");
 
+    /* Apply what was already read, so that the offset we cache is the one
+     * of the last byte received, like when the stream is applied as soon
+     * as it is read. */
+    replicaApplyDrain(c);
+
     /* Unlink the client from the server structures. */
     unlinkClient(c);
 
@@ -2913,6 +4206,7 @@ void replicationCacheMaster(client *c) {
     sdsclear(server.master->querybuf);
     sdsclear(server.master->pending_querybuf);
     server.master->read_reploff = server.master->reploff;
+    replicaApplyReset(c);
     if (c->flags & CLIENT_MULTI) discardTransaction(c);
     listEmpty(c->reply);
     c->sentlen = 0;
@@ -3002,6 +4296,7 @@ void replicationResurrectCachedMaster(connection *conn) {
     server.master->lastinteraction = server.unixtime;
     server.repl_state = REPL_STATE_CONNECTED;
     server.repl_down_since = 0;
+    replicaApplyReset(server.master);
 
     /* Fire the master link modules event. */
     moduleFireServerEvent(REDISMODULE_EVENT_MASTER_LINK_CHANGE,
@@ -3287,6 +4582,114 @@ long long replicationGetSlaveOffset(void) {
     return offset;
 }
 
+/* ------------------------ BOUNDED STALENESS READS -------------------------
+ *
+ * Clients reading from replicas can bound the staleness of the data they
+ * read with CLIENT STALENESS: MINOFFSET is the master replication offset
+ * the replica must have applied (read-your-writes, taking the offset from
+ * the master with ROLE or INFO after a write), MAXLAG the milliseconds the
+ * replica may be behind its master. Reads beyond the bound are blocked with
+ * BLOCKED_STALENESS until the replica catches up, then executed from
+ * scratch, or fail with -STALE after the TIMEOUT of the client.
+ *
+ * Having applied all it read from the link tells nothing to the replica
+ * about the writes of its master still in flight, so freshness is only
+ * derived from markers the master sends: replicas with reads bounded by
+ * MAXLAG ask the master to send a REPLCONF GETACK with a token down the
+ * stream, piggybacking the request on REPLCONF ACK. The master sends it
+ * after getting the request, so once the replica applies that GETACK it
+ * had all the writes of its master as of the time it asked. The network
+ * latency of the request is accounted as staleness.
+ * -------------------------------------------------------------------------- */
+
+/* Return how many milliseconds of writes of its master this replica may be
+ * missing, that is, since it asked the last GETACK it applied. Masters are
+ * never stale. */
+mstime_t replicationGetStaleness(void) {
+    if (server.masterhost == NULL) return 0;
+    return mstime() - server.repl_fresh_time;
+}
+
+/* Return true if the data of this instance is within the staleness bound
+ * the client 'c' set with CLIENT STALENESS, if any. */
+int clientReadBoundSatisfied(client *c) {
+    if (c->read_min_offset == 0 && c->read_max_lag == -1) return 1;
+    if (server.masterhost == NULL) return 1;
+    if (c->read_min_offset &&
+        replicationGetSlaveOffset() < c->read_min_offset) return 0;
+    if (c->read_max_lag != -1 &&
+        replicationGetStaleness() > c->read_max_lag) return 0;
+    return 1;
+}
+
+/* Ask our master to send a REPLCONF GETACK with a token down the
+ * replication stream, so that once we process it we know we are in sync as
+ * of the time we asked. Masters not supporting the request ignore the
+ * arguments after the ACK offset. When 'token' is NULL the request is ours,
+ * and only one is in flight, unless it got no answer in a second, otherwise
+ * it is forwarded for a replica of ours. */
+void replicationRequestGetack(sds token) {
+    client *c = server.master;
+    mstime_t now = mstime();
+
+    if (c == NULL || server.repl_state != REPL_STATE_CONNECTED) return;
+    if (token == NULL) {
+        if (server.repl_getack_request_time &&
+            now - server.repl_getack_request_time < 1000) return;
+        sdsfree(server.repl_getack_token);
+        server.repl_getack_token = sdscatprintf(sdsempty(),"%s-%lld",
+            server.runid, ++server.repl_getack_seq);
+        server.repl_getack_request_time = now;
+        token = server.repl_getack_token;
+    }
+
+    c->flags |= CLIENT_MASTER_FORCE_REPLY;
+    addReplyArrayLen(c,5);
+    addReplyBulkCString(c,"REPLCONF");
+    addReplyBulkCString(c,"ACK");
+    addReplyBulkLongLong(c,c->reploff);
+    addReplyBulkCString(c,"GETACK");
+    addReplyBulkCBuffer(c,token,sdslen(token));
+    c->flags &= ~CLIENT_MASTER_FORCE_REPLY;
+}
+
+/* Block the client 'c', whose current read command is beyond its staleness
+ * bound, until the replica catches up or the bound timeout elapses. */
+void blockClientForStaleness(client *c) {
+    c->bpop.timeout = mstime() + c->read_bound_timeout;
+    blockClient(c,BLOCKED_STALENESS);
+    if (c->read_max_lag != -1) replicationRequestGetack(NULL);
+}
+
+/* This is called by unblockClient() to perform the blocking op type
+ * specific cleanup. Never call it directly, call unblockClient() instead. */
+void unblockClientWaitingStaleness(client *c) {
+    listNode *ln = listSearchKey(server.clients_waiting_staleness,c);
+    serverAssert(ln != NULL);
+    listDelNode(server.clients_waiting_staleness,ln);
+}
+
+/* Unblock the clients blocked by their staleness bound that the replica
+ * now satisfies: their read is executed again by processUnblockedClients().
+ * Called in beforeSleep(). */
+void processClientsWaitingStaleness(void) {
+    int need_getack = 0;
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients_waiting_staleness,&li);
+    while((ln = listNext(&li))) {
+        client *c = ln->value;
+
+        if (clientReadBoundSatisfied(c))
+            unblockClient(c);
+        else if (c->read_max_lag != -1)
+            need_getack = 1;
+    }
+    /* Ask again if the master link was down, or the GETACK got lost. */
+    if (need_getack) replicationRequestGetack(NULL);
+}
+
 /* --------------------------- REPLICATION CRON  ---------------------------- */
 
 /* Replication cron function, called 1 time per second. */
@@ -3429,6 +4832,10 @@ void replicationCron(void) {
         }
     }
 
+    /* Release the blocks written to the disk backlog even when no new
+     * writes trim the backlog. */
+    reapReplicationBacklogDiskWrites();
+
     /* If this is a master without attached slaves and there is a replication
      * backlog active, in order to reclaim memory we can free it after some
      * (configured) time. Note that this cannot be done for slaves: slaves
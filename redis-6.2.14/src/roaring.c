@@ -0,0 +1,1179 @@
+/* roaring.c - Compressed bitmaps made of array, bitmap and run containers.
+ *
+ * Copyright (c) 2021, Redis Labs Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* A roaring bitmap splits the bit offsets space into chunks of 65536 bits.
+ * Every chunk that has at least one bit set is represented by a container,
+ * and containers are kept in an array sorted by chunk number (the 'key').
+ * Depending on its content a container is encoded in one of three ways:
+ *
+ * ARRAY:  a sorted array of the 16 bit low parts of the set offsets. Used
+ *         for sparse chunks, up to ROARING_ARRAY_MAX elements.
+ * BITMAP: a plain 8k bitmap, used for dense chunks.
+ * RUN:    a sorted array of (start,length-1) pairs, used when the chunk is
+ *         made of few long sequences of set bits.
+ *
+ * Chunks without bits set take no memory at all, so setting a bit at offset
+ * 4 billion costs a few bytes instead of a 512MB string.
+ *
+ * Incremental updates (roaringAdd/roaringRemove) only switch between ARRAY
+ * and BITMAP containers. RUN containers are produced when a container is
+ * rebuilt as a whole, that is by set operations, by roaringFromBytes() and
+ * by roaringFlip(), where the smallest of the three encodings is selected. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "roaring.h"
+#include "zmalloc.h"
+#include "endianconv.h"
+#include "redisassert.h"
+
+#define ROARING_BITMAP_BYTES (ROARING_BITMAP_WORDS*sizeof(uint64_t))
+
+/* Serialized sizes of the roaring header and of every container header. */
+#define ROARING_HDR_SIZE 12         /* bytes (8) + count (4) */
+#define ROARING_CONTAINER_HDR_SIZE 13 /* key (4) + type (1) + card (4) + len (4) */
+
+/* -----------------------------------------------------------------------------
+ * Container level functions
+ * -------------------------------------------------------------------------- */
+
+/* Return the index of the first array element >= v, or 'len' if none. */
+static uint32_t arrayLowerBound(const uint16_t *a, uint32_t len, uint32_t v) {
+    uint32_t lo = 0, hi = len;
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (a[mid] < v) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Return the index of the first run ending at or after v: such a run either
+ * contains v or starts after it. 'len' is returned if there is none. */
+static uint32_t runLowerBound(const uint16_t *runs, uint32_t len, uint32_t v) {
+    uint32_t lo = 0, hi = len;
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if ((uint32_t)runs[mid*2]+runs[mid*2+1] < v) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Return the number of bytes allocated for the container data. */
+static size_t containerDataSize(const roaringContainer *c) {
+    switch(c->type) {
+    case ROARING_ARRAY: return (size_t)c->cap*sizeof(uint16_t);
+    case ROARING_RUN: return (size_t)c->cap*sizeof(uint16_t)*2;
+    default: return ROARING_BITMAP_BYTES;
+    }
+}
+
+/* Set all the bits from 'start' to 'end' (both inclusive) in the words. */
+static void wordsSetRange(uint64_t *w, uint32_t start, uint32_t end) {
+    uint32_t first = start >> 6, last = end >> 6;
+    uint64_t fmask = ~0ULL << (start & 63);
+    uint64_t lmask = ~0ULL >> (63 - (end & 63));
+
+    if (first == last) {
+        w[first] |= fmask & lmask;
+        return;
+    }
+    w[first] |= fmask;
+    for (uint32_t j = first+1; j < last; j++) w[j] = ~0ULL;
+    w[last] |= lmask;
+}
+
+/* Return the number of runs of consecutive set bits in the words. */
+static uint32_t wordsRunCount(const uint64_t *w) {
+    uint32_t runs = 0;
+    uint64_t prev = 0;
+    for (int j = 0; j < ROARING_BITMAP_WORDS; j++) {
+        uint64_t cur = w[j];
+        runs += __builtin_popcountll(cur & ~((cur << 1) | (prev >> 63)));
+        prev = cur;
+    }
+    return runs;
+}
+
+/* Return the content of the container as 1024 64 bit words. Bitmap
+ * containers are returned as they are, otherwise 'buf' is populated and
+ * returned. */
+static const uint64_t *containerWords(const roaringContainer *c, uint64_t *buf) {
+    if (c->type == ROARING_BITMAP) return c->data;
+
+    memset(buf,0,ROARING_BITMAP_BYTES);
+    if (c->type == ROARING_ARRAY) {
+        const uint16_t *a = c->data;
+        for (uint32_t j = 0; j < c->len; j++)
+            buf[a[j] >> 6] |= 1ULL << (a[j] & 63);
+    } else {
+        const uint16_t *runs = c->data;
+        for (uint32_t j = 0; j < c->len; j++)
+            wordsSetRange(buf,runs[j*2],(uint32_t)runs[j*2]+runs[j*2+1]);
+    }
+    return buf;
+}
+
+/* Rebuild the container from the bitmap 'w' having 'card' bits set,
+ * selecting the smallest encoding. Run containers are only considered if
+ * 'allow_runs' is true. 'w' is allowed to point to the current container
+ * data, that is released only after the new representation is built. */
+static void containerSetFromWords(roaringContainer *c, const uint64_t *w,
+                                  uint32_t card, int allow_runs)
+{
+    void *old = c->data;
+    size_t bestsize = card <= ROARING_ARRAY_MAX ? card*sizeof(uint16_t) :
+                                                  ROARING_BITMAP_BYTES;
+    uint32_t nruns = allow_runs ? wordsRunCount(w) : 0;
+
+    if (allow_runs && nruns*sizeof(uint16_t)*2 < bestsize) {
+        uint16_t *runs = zmalloc(nruns*sizeof(uint16_t)*2);
+        uint32_t n = 0;
+        int64_t last = -2;
+        for (uint32_t j = 0; j < ROARING_BITMAP_WORDS; j++) {
+            uint64_t x = w[j];
+            while (x) {
+                uint32_t v = j*64 + __builtin_ctzll(x);
+                x &= x-1;
+                if (v == last+1) {
+                    runs[(n-1)*2+1]++;
+                } else {
+                    runs[n*2] = v;
+                    runs[n*2+1] = 0;
+                    n++;
+                }
+                last = v;
+            }
+        }
+        c->type = ROARING_RUN;
+        c->data = runs;
+        c->len = c->cap = nruns;
+    } else if (card <= ROARING_ARRAY_MAX) {
+        uint16_t *a = zmalloc(card*sizeof(uint16_t));
+        uint32_t n = 0;
+        for (uint32_t j = 0; j < ROARING_BITMAP_WORDS; j++) {
+            uint64_t x = w[j];
+            while (x) {
+                a[n++] = j*64 + __builtin_ctzll(x);
+                x &= x-1;
+            }
+        }
+        c->type = ROARING_ARRAY;
+        c->data = a;
+        c->len = c->cap = card;
+    } else {
+        uint64_t *bm = zmalloc(ROARING_BITMAP_BYTES);
+        memcpy(bm,w,ROARING_BITMAP_BYTES);
+        c->type = ROARING_BITMAP;
+        c->data = bm;
+        c->len = ROARING_BITMAP_WORDS;
+        c->cap = 0;
+    }
+    c->card = card;
+    zfree(old);
+}
+
+/* Turn a run container into an array or bitmap container, so that it can
+ * be modified one bit at a time. */
+static void containerUnrun(roaringContainer *c) {
+    uint64_t buf[ROARING_BITMAP_WORDS];
+    containerSetFromWords(c,containerWords(c,buf),c->card,0);
+}
+
+static int containerContains(const roaringContainer *c, uint32_t v) {
+    if (c->type == ROARING_ARRAY) {
+        const uint16_t *a = c->data;
+        uint32_t j = arrayLowerBound(a,c->len,v);
+        return j < c->len && a[j] == v;
+    } else if (c->type == ROARING_BITMAP) {
+        const uint64_t *w = c->data;
+        return (w[v >> 6] >> (v & 63)) & 1;
+    } else {
+        const uint16_t *runs = c->data;
+        uint32_t j = runLowerBound(runs,c->len,v);
+        return j < c->len && runs[j*2] <= v;
+    }
+}
+
+/* Set the bit 'v'. Returns 1 if the bit was clear, otherwise 0. */
+static int containerAdd(roaringContainer *c, uint32_t v) {
+    if (c->type == ROARING_RUN) {
+        if (containerContains(c,v)) return 0;
+        containerUnrun(c);
+    }
+
+    if (c->type == ROARING_ARRAY) {
+        uint16_t *a = c->data;
+        uint32_t j = arrayLowerBound(a,c->len,v);
+        if (j < c->len && a[j] == v) return 0;
+        if (c->len == ROARING_ARRAY_MAX) {
+            /* Full array: switch to a bitmap. */
+            uint64_t *w = zmalloc(ROARING_BITMAP_BYTES);
+            containerWords(c,w);
+            zfree(c->data);
+            c->type = ROARING_BITMAP;
+            c->data = w;
+            c->len = ROARING_BITMAP_WORDS;
+            c->cap = 0;
+            return containerAdd(c,v);
+        }
+        if (c->len == c->cap) {
+            c->cap = c->cap ? c->cap*2 : 4;
+            if (c->cap > ROARING_ARRAY_MAX) c->cap = ROARING_ARRAY_MAX;
+            c->data = a = zrealloc(a,c->cap*sizeof(uint16_t));
+        }
+        memmove(a+j+1,a+j,(c->len-j)*sizeof(uint16_t));
+        a[j] = v;
+        c->len++;
+    } else {
+        uint64_t *w = c->data, bit = 1ULL << (v & 63);
+        if (w[v >> 6] & bit) return 0;
+        w[v >> 6] |= bit;
+    }
+    c->card++;
+    return 1;
+}
+
+/* Clear the bit 'v'. Returns 1 if the bit was set, otherwise 0. When the
+ * container becomes empty its data is left allocated: the caller is in
+ * charge of removing the container. */
+static int containerRemove(roaringContainer *c, uint32_t v) {
+    if (!containerContains(c,v)) return 0;
+    if (c->type == ROARING_RUN) containerUnrun(c);
+
+    if (c->type == ROARING_ARRAY) {
+        uint16_t *a = c->data;
+        uint32_t j = arrayLowerBound(a,c->len,v);
+        memmove(a+j,a+j+1,(c->len-j-1)*sizeof(uint16_t));
+        c->len--;
+        c->card--;
+        if (c->cap > 4 && c->len*4 <= c->cap) {
+            c->cap /= 2;
+            c->data = zrealloc(a,c->cap*sizeof(uint16_t));
+        }
+    } else {
+        uint64_t *w = c->data;
+        w[v >> 6] &= ~(1ULL << (v & 63));
+        c->card--;
+        if (c->card <= ROARING_ARRAY_MAX && c->card != 0)
+            containerSetFromWords(c,w,c->card,0);
+    }
+    return 1;
+}
+
+/* Count the set bits from 'lo' to 'hi', both inclusive. */
+static uint32_t containerRangeCard(const roaringContainer *c, uint32_t lo, uint32_t hi) {
+    if (c->type == ROARING_ARRAY) {
+        return arrayLowerBound(c->data,c->len,hi+1) -
+               arrayLowerBound(c->data,c->len,lo);
+    } else if (c->type == ROARING_BITMAP) {
+        const uint64_t *w = c->data;
+        uint32_t first = lo >> 6, last = hi >> 6, count = 0;
+        uint64_t fmask = ~0ULL << (lo & 63);
+        uint64_t lmask = ~0ULL >> (63 - (hi & 63));
+        if (first == last)
+            return __builtin_popcountll(w[first] & fmask & lmask);
+        count += __builtin_popcountll(w[first] & fmask);
+        for (uint32_t j = first+1; j < last; j++)
+            count += __builtin_popcountll(w[j]);
+        count += __builtin_popcountll(w[last] & lmask);
+        return count;
+    } else {
+        const uint16_t *runs = c->data;
+        uint32_t count = 0;
+        for (uint32_t j = runLowerBound(runs,c->len,lo);
+             j < c->len && runs[j*2] <= hi; j++)
+        {
+            uint32_t s = runs[j*2], e = s+runs[j*2+1];
+            if (s < lo) s = lo;
+            if (e > hi) e = hi;
+            count += e-s+1;
+        }
+        return count;
+    }
+}
+
+/* Return the first bit set (or clear if 'bit' is 0) from 'lo' to 'hi',
+ * both inclusive, or -1 if there is none. */
+static int32_t containerNext(const roaringContainer *c, int bit, uint32_t lo, uint32_t hi) {
+    uint32_t v;
+
+    if (c->type == ROARING_ARRAY) {
+        const uint16_t *a = c->data;
+        uint32_t j = arrayLowerBound(a,c->len,lo);
+        if (bit) {
+            if (j == c->len) return -1;
+            v = a[j];
+        } else {
+            v = lo;
+            while (j < c->len && a[j] == v) {
+                v++;
+                j++;
+            }
+        }
+    } else if (c->type == ROARING_BITMAP) {
+        const uint64_t *w = c->data;
+        uint64_t flip = bit ? 0 : ~0ULL;
+        uint32_t j = lo >> 6;
+        uint64_t x = (w[j] ^ flip) & (~0ULL << (lo & 63));
+        while (x == 0) {
+            if (++j > (hi >> 6)) return -1;
+            x = w[j] ^ flip;
+        }
+        v = j*64 + __builtin_ctzll(x);
+    } else {
+        const uint16_t *runs = c->data;
+        uint32_t j = runLowerBound(runs,c->len,lo);
+        if (bit) {
+            if (j == c->len) return -1;
+            v = runs[j*2] > lo ? runs[j*2] : lo;
+        } else {
+            /* Runs are maximal, so the bit after a run is always clear. */
+            if (j < c->len && runs[j*2] <= lo)
+                v = (uint32_t)runs[j*2]+runs[j*2+1]+1;
+            else
+                v = lo;
+        }
+    }
+    return v <= hi ? (int32_t)v : -1;
+}
+
+/* Compute 'a op b' into 'dst', that is initialized with the key of 'a'.
+ * If the result is empty dst->card is set to zero and no data is
+ * allocated. */
+static void containerOp(int op, const roaringContainer *a,
+                        const roaringContainer *b, roaringContainer *dst)
+{
+    uint64_t bufa[ROARING_BITMAP_WORDS], bufb[ROARING_BITMAP_WORDS];
+    uint64_t res[ROARING_BITMAP_WORDS];
+
+    memset(dst,0,sizeof(*dst));
+    dst->key = a->key;
+
+    /* Intersections involving an array can only be as big as the array
+     * itself: filter it instead of going through the bitmaps. */
+    if (op == ROARING_OP_AND &&
+        (a->type == ROARING_ARRAY || b->type == ROARING_ARRAY))
+    {
+        if (a->type != ROARING_ARRAY) {
+            const roaringContainer *t = a;
+            a = b;
+            b = t;
+        }
+        const uint16_t *av = a->data;
+        uint16_t *out = zmalloc(a->len*sizeof(uint16_t));
+        uint32_t n = 0;
+        if (b->type == ROARING_ARRAY) {
+            const uint16_t *bv = b->data;
+            uint32_t i = 0, j = 0;
+            while (i < a->len && j < b->len) {
+                if (av[i] < bv[j]) i++;
+                else if (av[i] > bv[j]) j++;
+                else out[n++] = av[i++], j++;
+            }
+        } else {
+            for (uint32_t i = 0; i < a->len; i++)
+                if (containerContains(b,av[i])) out[n++] = av[i];
+        }
+        if (n == 0) {
+            zfree(out);
+            return;
+        }
+        dst->type = ROARING_ARRAY;
+        dst->data = out;
+        dst->len = dst->card = n;
+        dst->cap = a->len;
+        return;
+    }
+
+    const uint64_t *wa = containerWords(a,bufa), *wb = containerWords(b,bufb);
+    uint32_t card = 0;
+    for (int j = 0; j < ROARING_BITMAP_WORDS; j++) {
+        if (op == ROARING_OP_AND) res[j] = wa[j] & wb[j];
+        else if (op == ROARING_OP_OR) res[j] = wa[j] | wb[j];
+        else res[j] = wa[j] ^ wb[j];
+        card += __builtin_popcountll(res[j]);
+    }
+    if (card) containerSetFromWords(dst,res,card,1);
+}
+
+/* Return the cardinality of the intersection of two containers. */
+static uint32_t containerAndCard(const roaringContainer *a, const roaringContainer *b) {
+    uint64_t bufa[ROARING_BITMAP_WORDS], bufb[ROARING_BITMAP_WORDS];
+    uint32_t card = 0;
+
+    if (a->type == ROARING_ARRAY || b->type == ROARING_ARRAY) {
+        if (a->type != ROARING_ARRAY) {
+            const roaringContainer *t = a;
+            a = b;
+            b = t;
+        }
+        const uint16_t *av = a->data;
+        if (b->type == ROARING_ARRAY) {
+            const uint16_t *bv = b->data;
+            uint32_t i = 0, j = 0;
+            while (i < a->len && j < b->len) {
+                if (av[i] < bv[j]) i++;
+                else if (av[i] > bv[j]) j++;
+                else card++, i++, j++;
+            }
+        } else {
+            for (uint32_t i = 0; i < a->len; i++)
+                card += containerContains(b,av[i]);
+        }
+        return card;
+    }
+
+    const uint64_t *wa = containerWords(a,bufa), *wb = containerWords(b,bufb);
+    for (int j = 0; j < ROARING_BITMAP_WORDS; j++)
+        card += __builtin_popcountll(wa[j] & wb[j]);
+    return card;
+}
+
+/* Copy the container 'src' into 'dst', duplicating its data. */
+static void containerDup(roaringContainer *dst, const roaringContainer *src) {
+    *dst = *src;
+    if (src->type != ROARING_BITMAP) dst->cap = src->len;
+    size_t size = containerDataSize(dst);
+    dst->data = zmalloc(size);
+    memcpy(dst->data,src->data,size);
+}
+
+/* -----------------------------------------------------------------------------
+ * Roaring bitmap API
+ * -------------------------------------------------------------------------- */
+
+/* Search the container with the specified key. Returns 1 if found, otherwise
+ * 0. In both cases '*pos' is set to the index where the container is or
+ * should be inserted. */
+static int roaringFind(const roaring *r, uint32_t key, uint32_t *pos) {
+    uint32_t lo = 0, hi = r->count;
+    while (lo < hi) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (r->c[mid].key < key) lo = mid+1;
+        else hi = mid;
+    }
+    *pos = lo;
+    return lo < r->count && r->c[lo].key == key;
+}
+
+/* Make room for a new container at position 'pos' and return it. */
+static roaringContainer *roaringInsertContainer(roaring *r, uint32_t pos) {
+    if (r->count == r->alloc) {
+        r->alloc = r->alloc ? r->alloc*2 : 4;
+        r->c = zrealloc(r->c,r->alloc*sizeof(roaringContainer));
+    }
+    memmove(r->c+pos+1,r->c+pos,(r->count-pos)*sizeof(roaringContainer));
+    r->count++;
+    memset(r->c+pos,0,sizeof(roaringContainer));
+    return r->c+pos;
+}
+
+/* Append a non empty container to 'r', taking ownership of its data. */
+static void roaringAppendContainer(roaring *r, const roaringContainer *c) {
+    *roaringInsertContainer(r,r->count) = *c;
+    r->card += c->card;
+}
+
+roaring *roaringNew(void) {
+    roaring *r = zmalloc(sizeof(*r));
+    r->c = NULL;
+    r->count = r->alloc = 0;
+    r->card = 0;
+    r->bytes = 0;
+    return r;
+}
+
+void roaringFree(roaring *r) {
+    for (uint32_t j = 0; j < r->count; j++) zfree(r->c[j].data);
+    zfree(r->c);
+    zfree(r);
+}
+
+roaring *roaringDup(const roaring *r) {
+    roaring *d = roaringNew();
+    d->alloc = d->count = r->count;
+    d->c = d->alloc ? zmalloc(d->alloc*sizeof(roaringContainer)) : NULL;
+    for (uint32_t j = 0; j < r->count; j++) containerDup(d->c+j,r->c+j);
+    d->card = r->card;
+    d->bytes = r->bytes;
+    return d;
+}
+
+/* Set the bit at offset 'x'. Returns 1 if the bit was clear, otherwise 0. */
+int roaringAdd(roaring *r, uint64_t x) {
+    uint32_t pos;
+    assert(x < ROARING_MAX_BITS);
+    if (!roaringFind(r,x >> 16,&pos)) {
+        roaringContainer *c = roaringInsertContainer(r,pos);
+        c->key = x >> 16;
+        c->type = ROARING_ARRAY;
+    }
+    if (!containerAdd(r->c+pos,x & 0xffff)) return 0;
+    r->card++;
+    return 1;
+}
+
+/* Clear the bit at offset 'x'. Returns 1 if the bit was set, otherwise 0. */
+int roaringRemove(roaring *r, uint64_t x) {
+    uint32_t pos;
+    if (x >= ROARING_MAX_BITS || !roaringFind(r,x >> 16,&pos)) return 0;
+    if (!containerRemove(r->c+pos,x & 0xffff)) return 0;
+    r->card--;
+    if (r->c[pos].card == 0) {
+        zfree(r->c[pos].data);
+        memmove(r->c+pos,r->c+pos+1,(r->count-pos-1)*sizeof(roaringContainer));
+        r->count--;
+    }
+    return 1;
+}
+
+int roaringContains(const roaring *r, uint64_t x) {
+    uint32_t pos;
+    if (x >= ROARING_MAX_BITS || !roaringFind(r,x >> 16,&pos)) return 0;
+    return containerContains(r->c+pos,x & 0xffff);
+}
+
+uint64_t roaringCard(const roaring *r) {
+    return r->card;
+}
+
+/* Count the bits set from offset 'from' to 'to', both inclusive. */
+uint64_t roaringRangeCard(const roaring *r, uint64_t from, uint64_t to) {
+    uint64_t count = 0;
+    uint32_t pos;
+
+    if (from > to || from >= ROARING_MAX_BITS) return 0;
+    if (to >= ROARING_MAX_BITS) to = ROARING_MAX_BITS-1;
+    roaringFind(r,from >> 16,&pos);
+    for (; pos < r->count && r->c[pos].key <= (to >> 16); pos++) {
+        const roaringContainer *c = r->c+pos;
+        uint32_t lo = c->key == (from >> 16) ? (from & 0xffff) : 0;
+        uint32_t hi = c->key == (to >> 16) ? (to & 0xffff) : 0xffff;
+        if (lo == 0 && hi == 0xffff)
+            count += c->card;
+        else
+            count += containerRangeCard(c,lo,hi);
+    }
+    return count;
+}
+
+/* Return the offset of the first bit set from 'from' to 'to', both
+ * inclusive, or -1 if there is none. */
+int64_t roaringNextSet(const roaring *r, uint64_t from, uint64_t to) {
+    uint32_t pos;
+
+    if (from > to || from >= ROARING_MAX_BITS) return -1;
+    if (to >= ROARING_MAX_BITS) to = ROARING_MAX_BITS-1;
+    roaringFind(r,from >> 16,&pos);
+    for (; pos < r->count && r->c[pos].key <= (to >> 16); pos++) {
+        const roaringContainer *c = r->c+pos;
+        uint32_t lo = c->key == (from >> 16) ? (from & 0xffff) : 0;
+        uint32_t hi = c->key == (to >> 16) ? (to & 0xffff) : 0xffff;
+        int32_t v = containerNext(c,1,lo,hi);
+        if (v >= 0) return ((int64_t)c->key << 16) | v;
+    }
+    return -1;
+}
+
+/* Return the offset of the first bit clear from 'from' to 'to', both
+ * inclusive, or -1 if all the bits in the range are set. */
+int64_t roaringNextClear(const roaring *r, uint64_t from, uint64_t to) {
+    uint64_t x = from;
+    uint32_t pos;
+
+    if (from > to) return -1;
+    if (from >= ROARING_MAX_BITS) return from;
+    roaringFind(r,from >> 16,&pos);
+    while (x <= to) {
+        uint32_t key = x >> 16;
+        if (pos == r->count || r->c[pos].key != key) return x;
+        uint32_t hi = key == (to >> 16) ? (to & 0xffff) : 0xffff;
+        int32_t v = containerNext(r->c+pos,0,x & 0xffff,hi);
+        if (v >= 0) return ((int64_t)key << 16) | v;
+        x = ((uint64_t)key+1) << 16;
+        pos++;
+    }
+    return -1;
+}
+
+/* Return a new roaring bitmap with the result of 'a op b', where 'op' is
+ * one of ROARING_OP_AND, ROARING_OP_OR, ROARING_OP_XOR. The logical length
+ * of the result is the greatest of the two. */
+roaring *roaringOp(int op, const roaring *a, const roaring *b) {
+    roaring *r = roaringNew();
+    uint32_t i = 0, j = 0;
+    roaringContainer c;
+
+    while (i < a->count || j < b->count) {
+        if (j == b->count || (i < a->count && a->c[i].key < b->c[j].key)) {
+            if (op != ROARING_OP_AND) {
+                containerDup(&c,a->c+i);
+                roaringAppendContainer(r,&c);
+            }
+            i++;
+        } else if (i == a->count || b->c[j].key < a->c[i].key) {
+            if (op != ROARING_OP_AND) {
+                containerDup(&c,b->c+j);
+                roaringAppendContainer(r,&c);
+            }
+            j++;
+        } else {
+            containerOp(op,a->c+i,b->c+j,&c);
+            if (c.card) roaringAppendContainer(r,&c);
+            i++;
+            j++;
+        }
+    }
+    r->bytes = a->bytes > b->bytes ? a->bytes : b->bytes;
+    return r;
+}
+
+/* Return a new roaring bitmap with all the first 'nbits' bits of 'r'
+ * inverted, and the same logical length. Bits at 'nbits' or greater offsets
+ * are not part of the result. */
+roaring *roaringFlip(const roaring *r, uint64_t nbits) {
+    uint64_t buf[ROARING_BITMAP_WORDS], res[ROARING_BITMAP_WORDS];
+    roaring *f = roaringNew();
+    uint32_t pos = 0;
+
+    f->bytes = r->bytes;
+    if (nbits == 0) return f;
+    if (nbits > ROARING_MAX_BITS) nbits = ROARING_MAX_BITS;
+
+    uint32_t lastkey = (nbits-1) >> 16;
+    for (uint64_t key = 0; key <= lastkey; key++) {
+        uint32_t hi = key == lastkey ? ((nbits-1) & 0xffff) : 0xffff;
+        roaringContainer c;
+
+        memset(&c,0,sizeof(c));
+        c.key = key;
+        while (pos < r->count && r->c[pos].key < key) pos++;
+        if (pos == r->count || r->c[pos].key != key) {
+            /* Nothing set here: the result is a single run. */
+            uint16_t *runs = zmalloc(sizeof(uint16_t)*2);
+            runs[0] = 0;
+            runs[1] = hi;
+            c.type = ROARING_RUN;
+            c.data = runs;
+            c.len = c.cap = 1;
+            c.card = hi+1;
+        } else {
+            const uint64_t *w = containerWords(r->c+pos,buf);
+            uint32_t card = 0;
+            memset(res,0,sizeof(res));
+            wordsSetRange(res,0,hi);
+            for (int j = 0; j < ROARING_BITMAP_WORDS; j++) {
+                res[j] &= ~w[j];
+                card += __builtin_popcountll(res[j]);
+            }
+            if (card == 0) continue;
+            containerSetFromWords(&c,res,card,1);
+        }
+        roaringAppendContainer(f,&c);
+    }
+    return f;
+}
+
+/* Return the cardinality of the intersection of 'a' and 'b', without
+ * computing the intersection itself. */
+uint64_t roaringAndCard(const roaring *a, const roaring *b) {
+    uint64_t card = 0;
+    uint32_t i = 0, j = 0;
+
+    while (i < a->count && j < b->count) {
+        if (a->c[i].key < b->c[j].key) {
+            i++;
+        } else if (a->c[i].key > b->c[j].key) {
+            j++;
+        } else {
+            card += containerAndCard(a->c+i,b->c+j);
+            i++;
+            j++;
+        }
+    }
+    return card;
+}
+
+/* Return the cardinality of the union of 'a' and 'b'. */
+uint64_t roaringOrCard(const roaring *a, const roaring *b) {
+    return a->card + b->card - roaringAndCard(a,b);
+}
+
+/* Reverse the bits of a byte: Redis strings store the bit at offset 0 in
+ * the most significant bit of the first byte, while containers store it in
+ * the least significant bit of the first word. */
+static inline uint64_t reverseByte(unsigned char b) {
+    return ((b * 0x0202020202ULL) & 0x010884422010ULL) % 1023;
+}
+
+/* Create a roaring bitmap holding the same bits of the string 'p' of 'len'
+ * bytes, with the bits layout used by SETBIT and GETBIT. */
+roaring *roaringFromBytes(const unsigned char *p, size_t len) {
+    uint64_t w[ROARING_BITMAP_WORDS];
+    roaring *r = roaringNew();
+    const size_t chunk = ROARING_BITMAP_BYTES;
+
+    for (size_t off = 0; off < len; off += chunk) {
+        size_t n = len-off < chunk ? len-off : chunk;
+        uint32_t card = 0;
+
+        memset(w,0,sizeof(w));
+        for (size_t j = 0; j < n; j++) {
+            if (p[off+j] == 0) continue;
+            w[j >> 3] |= reverseByte(p[off+j]) << ((j & 7)*8);
+        }
+        for (int j = 0; j < ROARING_BITMAP_WORDS; j++)
+            card += __builtin_popcountll(w[j]);
+        if (card == 0) continue;
+
+        roaringContainer c;
+        memset(&c,0,sizeof(c));
+        c.key = off/chunk;
+        containerSetFromWords(&c,w,card,1);
+        roaringAppendContainer(r,&c);
+    }
+    r->bytes = len;
+    return r;
+}
+
+/* Write in 'p' the 'len' bytes starting at byte 'start' of the string
+ * holding the same bits of the roaring bitmap, with the bits layout used by
+ * SETBIT and GETBIT. This is the inverse of roaringFromBytes(). */
+void roaringToBytes(const roaring *r, unsigned char *p, size_t start,
+                    size_t len)
+{
+    uint64_t buf[ROARING_BITMAP_WORDS];
+    const size_t chunk = ROARING_BITMAP_BYTES;
+
+    memset(p,0,len);
+    for (uint32_t j = 0; j < r->count; j++) {
+        const roaringContainer *c = r->c+j;
+        size_t from = (size_t)c->key*chunk;
+
+        if (from+chunk <= start) continue;
+        if (from >= start+len) break;
+
+        const uint64_t *w = containerWords(c,buf);
+        size_t lo = from < start ? start : from;
+        size_t hi = from+chunk < start+len ? from+chunk : start+len;
+        for (size_t k = lo; k < hi; k++) {
+            size_t b = k-from;
+            unsigned char byte = (w[b >> 3] >> ((b & 7)*8)) & 0xff;
+            if (byte) p[k-start] = reverseByte(byte);
+        }
+    }
+}
+
+/* Return the total amount of memory used by the roaring bitmap. */
+size_t roaringAllocSize(const roaring *r) {
+    size_t size = sizeof(*r) + (size_t)r->alloc*sizeof(roaringContainer);
+    for (uint32_t j = 0; j < r->count; j++) size += containerDataSize(r->c+j);
+    return size;
+}
+
+/* -----------------------------------------------------------------------------
+ * Serialization
+ *
+ * The serialized format is little endian, and is composed of a header with
+ * the logical length in bytes (64 bit) and the number of containers (32 bit),
+ * followed by the containers. Every container has a header with its key
+ * (32 bit), type (8 bit), cardinality (32 bit) and len (32 bit), followed by
+ * len 16 bit values (array), len pairs of 16 bit values (run) or 1024 64
+ * bit words (bitmap).
+ * -------------------------------------------------------------------------- */
+
+static unsigned char *serializeU16(unsigned char *p, uint16_t v) {
+    v = intrev16ifbe(v);
+    memcpy(p,&v,sizeof(v));
+    return p+sizeof(v);
+}
+
+static unsigned char *serializeU32(unsigned char *p, uint32_t v) {
+    v = intrev32ifbe(v);
+    memcpy(p,&v,sizeof(v));
+    return p+sizeof(v);
+}
+
+static unsigned char *serializeU64(unsigned char *p, uint64_t v) {
+    v = intrev64ifbe(v);
+    memcpy(p,&v,sizeof(v));
+    return p+sizeof(v);
+}
+
+static uint16_t deserializeU16(const unsigned char *p) {
+    uint16_t v;
+    memcpy(&v,p,sizeof(v));
+    return intrev16ifbe(v);
+}
+
+static uint32_t deserializeU32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return intrev32ifbe(v);
+}
+
+static uint64_t deserializeU64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v,p,sizeof(v));
+    return intrev64ifbe(v);
+}
+
+/* Return the serialized size of the container payload. */
+static size_t containerPayloadSize(uint8_t type, uint32_t len) {
+    if (type == ROARING_ARRAY) return (size_t)len*sizeof(uint16_t);
+    if (type == ROARING_RUN) return (size_t)len*sizeof(uint16_t)*2;
+    return ROARING_BITMAP_BYTES;
+}
+
+/* Serialize the roaring bitmap into a newly allocated buffer, whose length
+ * is stored into '*len'. */
+unsigned char *roaringSerialize(const roaring *r, size_t *len) {
+    size_t size = ROARING_HDR_SIZE;
+    for (uint32_t j = 0; j < r->count; j++)
+        size += ROARING_CONTAINER_HDR_SIZE +
+                containerPayloadSize(r->c[j].type,r->c[j].len);
+
+    unsigned char *buf = zmalloc(size), *p = buf;
+    p = serializeU64(p,r->bytes);
+    p = serializeU32(p,r->count);
+    for (uint32_t j = 0; j < r->count; j++) {
+        const roaringContainer *c = r->c+j;
+        p = serializeU32(p,c->key);
+        *p++ = c->type;
+        p = serializeU32(p,c->card);
+        p = serializeU32(p,c->len);
+        if (c->type == ROARING_BITMAP) {
+            const uint64_t *w = c->data;
+            for (int i = 0; i < ROARING_BITMAP_WORDS; i++)
+                p = serializeU64(p,w[i]);
+        } else {
+            const uint16_t *v = c->data;
+            uint32_t n = c->type == ROARING_RUN ? c->len*2 : c->len;
+            for (uint32_t i = 0; i < n; i++)
+                p = serializeU16(p,v[i]);
+        }
+    }
+    *len = size;
+    return buf;
+}
+
+/* Validate the payload of a deserialized container, returning 1 if it is
+ * consistent with its type, cardinality and length, otherwise 0. */
+static int containerIsValid(const roaringContainer *c) {
+    if (c->card == 0 || c->card > 65536) return 0;
+    if (c->type == ROARING_ARRAY) {
+        const uint16_t *a = c->data;
+        if (c->len != c->card || c->len > ROARING_ARRAY_MAX) return 0;
+        for (uint32_t j = 1; j < c->len; j++)
+            if (a[j] <= a[j-1]) return 0;
+    } else if (c->type == ROARING_RUN) {
+        const uint16_t *runs = c->data;
+        uint32_t card = 0;
+        int64_t prevend = -2;
+        if (c->len == 0) return 0;
+        for (uint32_t j = 0; j < c->len; j++) {
+            uint32_t start = runs[j*2], end = start+runs[j*2+1];
+            /* Runs must be sorted, maximal and inside the chunk. */
+            if ((int64_t)start <= prevend+1 || end > 0xffff) return 0;
+            card += end-start+1;
+            prevend = end;
+        }
+        if (card != c->card) return 0;
+    } else if (c->type == ROARING_BITMAP) {
+        const uint64_t *w = c->data;
+        uint32_t card = 0;
+        if (c->len != ROARING_BITMAP_WORDS) return 0;
+        for (int j = 0; j < ROARING_BITMAP_WORDS; j++)
+            card += __builtin_popcountll(w[j]);
+        if (card != c->card) return 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Create a roaring bitmap from the serialized buffer 'p' of 'len' bytes.
+ * The buffer may come from an untrusted source (RDB file or RESTORE
+ * payload), so everything is validated, and NULL is returned if the
+ * buffer is not a valid serialized roaring bitmap. */
+roaring *roaringDeserialize(const unsigned char *p, size_t len) {
+    const unsigned char *end = p+len;
+    roaring *r;
+
+    if (len < ROARING_HDR_SIZE) return NULL;
+    r = roaringNew();
+    r->bytes = deserializeU64(p);
+    uint32_t count = deserializeU32(p+8);
+    p += ROARING_HDR_SIZE;
+
+    while (count--) {
+        roaringContainer c;
+
+        if ((size_t)(end-p) < ROARING_CONTAINER_HDR_SIZE) goto err;
+        memset(&c,0,sizeof(c));
+        c.key = deserializeU32(p);
+        c.type = p[4];
+        c.card = deserializeU32(p+5);
+        c.len = deserializeU32(p+9);
+        p += ROARING_CONTAINER_HDR_SIZE;
+        if (c.type > ROARING_RUN || c.len > 65536) goto err;
+        if (r->count && c.key <= r->c[r->count-1].key) goto err;
+
+        size_t payload = containerPayloadSize(c.type,c.len);
+        if ((size_t)(end-p) < payload) goto err;
+        c.data = zmalloc(payload ? payload : 1);
+        if (c.type == ROARING_BITMAP) {
+            uint64_t *w = c.data;
+            for (int i = 0; i < ROARING_BITMAP_WORDS; i++)
+                w[i] = deserializeU64(p+i*sizeof(uint64_t));
+        } else {
+            uint16_t *v = c.data;
+            c.cap = c.len;
+            for (size_t i = 0; i < payload/sizeof(uint16_t); i++)
+                v[i] = deserializeU16(p+i*sizeof(uint16_t));
+        }
+        p += payload;
+        roaringAppendContainer(r,&c);
+        if (!containerIsValid(&c)) goto err;
+    }
+    if (p != end) goto err;
+
+    /* The logical length must cover the highest bit set. */
+    if (r->bytes > ROARING_MAX_BITS/8) goto err;
+    if (r->count) {
+        const roaringContainer *last = r->c+r->count-1;
+        uint64_t maxbit = ((uint64_t)last->key << 16);
+        if (last->type == ROARING_ARRAY) {
+            maxbit |= ((uint16_t*)last->data)[last->len-1];
+        } else if (last->type == ROARING_RUN) {
+            const uint16_t *runs = last->data;
+            maxbit |= (uint32_t)runs[(last->len-1)*2]+runs[(last->len-1)*2+1];
+        } else {
+            const uint64_t *w = last->data;
+            int j = ROARING_BITMAP_WORDS-1;
+            while (w[j] == 0) j--; /* Valid bitmaps have at least a bit set. */
+            maxbit |= j*64 + 63 - __builtin_clzll(w[j]);
+        }
+        if (r->bytes < (maxbit >> 3)+1) goto err;
+    }
+    return r;
+
+err:
+    roaringFree(r);
+    return NULL;
+}
+
+#ifdef REDIS_TEST
+#include <time.h>
+
+#define UNUSED(x) (void)(x)
+
+/* The tests compare the roaring bitmap against a plain string bitmap with
+ * the same layout used by SETBIT. */
+static void naiveSet(unsigned char *p, uint64_t x, int on) {
+    if (on) p[x >> 3] |= 1 << (7 - (x & 7));
+    else p[x >> 3] &= ~(1 << (7 - (x & 7)));
+}
+
+static int naiveGet(const unsigned char *p, uint64_t x) {
+    return (p[x >> 3] >> (7 - (x & 7))) & 1;
+}
+
+static uint64_t naiveRangeCard(const unsigned char *p, uint64_t from, uint64_t to) {
+    uint64_t count = 0;
+    for (uint64_t x = from; x <= to; x++) count += naiveGet(p,x);
+    return count;
+}
+
+static int64_t naiveNext(const unsigned char *p, int bit, uint64_t from, uint64_t to) {
+    for (uint64_t x = from; x <= to; x++)
+        if (naiveGet(p,x) == bit) return x;
+    return -1;
+}
+
+/* Populate both representations with a mix of sparse bits, dense areas and
+ * long runs, in order to exercise all the container types. */
+static roaring *createRandom(unsigned char *p, uint64_t nbits) {
+    roaring *r = roaringNew();
+    for (int j = 0; j < 2000; j++) {
+        uint64_t x = rand() % nbits;
+        roaringAdd(r,x);
+        naiveSet(p,x,1);
+    }
+    uint64_t dense = rand() % (nbits-65536);
+    for (int j = 0; j < 20000; j++) {
+        uint64_t x = dense + rand() % 65536;
+        roaringAdd(r,x);
+        naiveSet(p,x,1);
+    }
+    uint64_t run = rand() % (nbits-100000);
+    for (uint64_t x = run; x < run+100000; x++) {
+        roaringAdd(r,x);
+        naiveSet(p,x,1);
+    }
+    r->bytes = nbits/8;
+    return r;
+}
+
+static void verify(const roaring *r, const unsigned char *p, uint64_t nbits) {
+    assert(roaringCard(r) == naiveRangeCard(p,0,nbits-1));
+    for (int j = 0; j < 200; j++) {
+        uint64_t from = rand() % nbits, to = rand() % nbits;
+        if (from > to) {
+            uint64_t t = from;
+            from = to;
+            to = t;
+        }
+        assert(roaringContains(r,from) == naiveGet(p,from));
+        assert(roaringRangeCard(r,from,to) == naiveRangeCard(p,from,to));
+        assert(roaringNextSet(r,from,to) == naiveNext(p,1,from,to));
+        assert(roaringNextClear(r,from,to) == naiveNext(p,0,from,to));
+    }
+}
+
+int roaringTest(int argc, char *argv[], int accurate) {
+    const uint64_t nbits = 1<<22;
+    unsigned char *p = zcalloc(nbits/8), *q = zcalloc(nbits/8);
+    unsigned char *res = zmalloc(nbits/8);
+    srand(time(NULL));
+
+    UNUSED(argc);
+    UNUSED(argv);
+    UNUSED(accurate);
+
+    printf("Add, remove and contains: "); {
+        roaring *r = roaringNew();
+        assert(roaringAdd(r,5) == 1);
+        assert(roaringAdd(r,5) == 0);
+        assert(roaringAdd(r,4000000000ULL) == 1);
+        assert(roaringContains(r,5) && roaringContains(r,4000000000ULL));
+        assert(!roaringContains(r,6));
+        assert(roaringCard(r) == 2 && r->count == 2);
+        assert(roaringRemove(r,5) == 1);
+        assert(roaringRemove(r,5) == 0);
+        assert(roaringCard(r) == 1 && r->count == 1);
+        assert(roaringAllocSize(r) < 256);
+        roaringFree(r);
+        printf("OK\n");
+    }
+
+    printf("Array to bitmap and back: "); {
+        roaring *r = roaringNew();
+        for (uint64_t x = 0; x < 10000; x++) roaringAdd(r,x*2);
+        assert(r->count == 1 && r->c[0].type == ROARING_BITMAP);
+        for (uint64_t x = 0; x < 9000; x++) roaringRemove(r,x*2);
+        assert(r->c[0].type == ROARING_ARRAY && roaringCard(r) == 1000);
+        roaringFree(r);
+        printf("OK\n");
+    }
+
+    printf("Range count and next bit against plain bitmap: "); {
+        roaring *r = createRandom(p,nbits);
+        verify(r,p,nbits);
+        roaringFree(r);
+        printf("OK\n");
+    }
+
+    printf("Conversion from string bitmap: "); {
+        roaring *r = roaringFromBytes(p,nbits/8);
+        int runs = 0;
+        for (uint32_t j = 0; j < r->count; j++)
+            runs += r->c[j].type == ROARING_RUN;
+        assert(runs > 0);
+        assert(r->bytes == nbits/8);
+        verify(r,p,nbits);
+        roaringFree(r);
+        printf("OK\n");
+    }
+
+    printf("Conversion to string bitmap: "); {
+        roaring *r = roaringFromBytes(p,nbits/8);
+        roaringToBytes(r,res,0,nbits/8);
+        assert(memcmp(res,p,nbits/8) == 0);
+        roaringToBytes(r,res,12345,100000);
+        assert(memcmp(res,p+12345,100000) == 0);
+        roaringFree(r);
+        printf("OK\n");
+    }
+
+    printf("AND, OR, XOR and NOT against plain bitmap: "); {
+        memset(p,0,nbits/8);
+        roaring *a = createRandom(p,nbits);
+        roaring *b = createRandom(q,nbits);
+        for (int op = ROARING_OP_AND; op <= ROARING_OP_XOR; op++) {
+            roaring *r = roaringOp(op,a,b);
+            for (uint64_t j = 0; j < nbits/8; j++) {
+                if (op == ROARING_OP_AND) res[j] = p[j] & q[j];
+                else if (op == ROARING_OP_OR) res[j] = p[j] | q[j];
+                else res[j] = p[j] ^ q[j];
+            }
+            verify(r,res,nbits);
+            if (op == ROARING_OP_AND) assert(roaringAndCard(a,b) == r->card);
+            if (op == ROARING_OP_OR) assert(roaringOrCard(a,b) == r->card);
+            roaringFree(r);
+        }
+        roaring *r = roaringFlip(a,nbits);
+        for (uint64_t j = 0; j < nbits/8; j++) res[j] = ~p[j];
+        verify(r,res,nbits);
+        roaringFree(r);
+        roaringFree(a);
+        roaringFree(b);
+        printf("OK\n");
+    }
+
+    printf("Serialization round trip and corruption detection: "); {
+        memset(p,0,nbits/8);
+        roaring *r = createRandom(p,nbits);
+        roaring *f = roaringFlip(r,nbits);
+        roaringFree(r);
+        size_t len;
+        unsigned char *buf = roaringSerialize(f,&len);
+        roaring *d = roaringDeserialize(buf,len);
+        assert(d != NULL && d->bytes == f->bytes && d->count == f->count);
+        for (uint64_t j = 0; j < nbits/8; j++) res[j] = ~p[j];
+        verify(d,res,nbits);
+        roaringFree(d);
+        assert(roaringDeserialize(buf,len-1) == NULL);
+        buf[ROARING_HDR_SIZE+4] = 7; /* Invalid container type. */
+        assert(roaringDeserialize(buf,len) == NULL);
+        zfree(buf);
+        roaringFree(f);
+        printf("OK\n");
+    }
+
+    zfree(p);
+    zfree(q);
+    zfree(res);
+    return 0;
+}
+#endif
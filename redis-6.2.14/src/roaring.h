@@ -0,0 +1,95 @@
+/* roaring.h - Compressed bitmaps made of array, bitmap and run containers.
+ *
+ * Copyright (c) 2021, Redis Labs Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Container types. Every container holds the set bits sharing the same high
+ * 48 bits of the offset, using the smallest of the three representations. */
+#define ROARING_ARRAY 0     /* Sorted array of 16 bit values. */
+#define ROARING_BITMAP 1    /* Plain 65536 bits bitmap. */
+#define ROARING_RUN 2       /* Sorted array of (start,length-1) pairs. */
+
+#define ROARING_ARRAY_MAX 4096      /* Max values in an array container. */
+#define ROARING_BITMAP_WORDS 1024   /* 64 bit words in a bitmap container. */
+#define ROARING_MAX_BITS (1ULL<<48) /* Offsets must be smaller than that. */
+
+/* Operations accepted by roaringOp(). */
+#define ROARING_OP_AND 0
+#define ROARING_OP_OR 1
+#define ROARING_OP_XOR 2
+
+typedef struct roaringContainer {
+    uint32_t key;   /* Offset >> 16 shared by all the values. */
+    uint8_t type;   /* ROARING_ARRAY, ROARING_BITMAP or ROARING_RUN. */
+    uint32_t card;  /* Number of set bits, from 1 to 65536. */
+    uint32_t len;   /* Values (array), runs (run) or words (bitmap). */
+    uint32_t cap;   /* Allocated slots for array and run containers. */
+    void *data;
+} roaringContainer;
+
+typedef struct roaring {
+    roaringContainer *c;    /* Containers sorted by key. */
+    uint32_t count;         /* Number of containers in use. */
+    uint32_t alloc;         /* Number of containers allocated. */
+    uint64_t card;          /* Total number of set bits. */
+    uint64_t bytes;         /* Logical length, like STRLEN of a string
+                               holding the same bits. */
+} roaring;
+
+roaring *roaringNew(void);
+void roaringFree(roaring *r);
+roaring *roaringDup(const roaring *r);
+int roaringAdd(roaring *r, uint64_t x);
+int roaringRemove(roaring *r, uint64_t x);
+int roaringContains(const roaring *r, uint64_t x);
+uint64_t roaringCard(const roaring *r);
+uint64_t roaringRangeCard(const roaring *r, uint64_t from, uint64_t to);
+int64_t roaringNextSet(const roaring *r, uint64_t from, uint64_t to);
+int64_t roaringNextClear(const roaring *r, uint64_t from, uint64_t to);
+roaring *roaringOp(int op, const roaring *a, const roaring *b);
+roaring *roaringFlip(const roaring *r, uint64_t nbits);
+uint64_t roaringAndCard(const roaring *a, const roaring *b);
+uint64_t roaringOrCard(const roaring *a, const roaring *b);
+roaring *roaringFromBytes(const unsigned char *p, size_t len);
+void roaringToBytes(const roaring *r, unsigned char *p, size_t start,
+                    size_t len);
+size_t roaringAllocSize(const roaring *r);
+unsigned char *roaringSerialize(const roaring *r, size_t *len);
+roaring *roaringDeserialize(const unsigned char *p, size_t len);
+
+#ifdef REDIS_TEST
+int roaringTest(int argc, char *argv[], int accurate);
+#endif
+
+#endif /* __ROARING_H */
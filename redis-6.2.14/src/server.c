@@ -403,6 +403,10 @@ struct redisCommand redisCommandTable[] = {
      "read-only to-sort @set",
      0,NULL,1,-1,1,0,0,0},
 
+    {"sintercard",sinterCardCommand,-3,
+     "read-only @set",
+     0,zunionInterDiffGetKeys,0,0,0,0,0,0},
+
     {"sinterstore",sinterstoreCommand,-3,
      "write use-memory @set",
      0,NULL,1,-1,1,0,0,0},
@@ -942,6 +946,10 @@ struct redisCommand redisCommandTable[] = {
      "read-only @bitmap",
      0,NULL,1,1,1,0,0,0},
 
+    {"bitopcard",bitopcardCommand,-3,
+     "read-only @bitmap",
+     0,NULL,2,-1,1,0,0,0},
+
     {"wait",waitCommand,3,
      "no-script @keyspace",
      0,NULL,0,0,0,0,0,0},
@@ -991,6 +999,10 @@ struct redisCommand redisCommandTable[] = {
      "write use-memory @geo",
       0,NULL,1,2,1,0,0,0},
 
+    {"geomsearch",geomsearchCommand,-9,
+     "read-only @geo",
+      0,NULL,1,1,1,0,0,0},
+
     {"pfselftest",pfselftestCommand,1,
      "admin @hyperloglog",
       0,NULL,0,0,0,0,0,0},
@@ -1750,7 +1762,9 @@ int clientsCronTrackExpansiveClients(client *c, int time_idx) {
 int clientsCronTrackClientsMemUsage(client *c) {
     size_t mem = 0;
     int type = getClientType(c);
-    mem += getClientOutputBufferMemoryUsage(c);
+    /* The output buffer of replicas is the shared replication buffer, that
+     * getMemoryOverheadData() accounts once for all the replicas. */
+    if (type != CLIENT_TYPE_SLAVE) mem += getClientOutputBufferMemoryUsage(c);
     mem += sdsZmallocSize(c->querybuf);
     mem += zmalloc_size(c);
     mem += c->argv_len_sum;
@@ -2144,10 +2158,20 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Handle background operations on Redis databases. */
     databasesCron();
 
+    /* Continue the halving of the TinyLFU sketch, if in progress. */
+    tinylfuCron();
+
+    /* Compute the slot digests of the keys modified, for diff resyncs. */
+    slotDigestCron();
+
+    /* Return to the slabs the objects released by the lazyfree threads. */
+    zslab_drain();
+
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (!hasActiveChildProcess() &&
-        server.aof_rewrite_scheduled)
+        server.aof_rewrite_scheduled &&
+        !aofRewriteLimited())
     {
         rewriteAppendOnlyFileBackground();
     }
@@ -2191,7 +2215,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             long long base = server.aof_rewrite_base_size ?
                 server.aof_rewrite_base_size : 1;
             long long growth = (server.aof_current_size*100/base) - 100;
-            if (growth >= server.aof_rewrite_perc) {
+            if (growth >= server.aof_rewrite_perc && !aofRewriteLimited()) {
                 serverLog(LL_NOTICE,"Starting automatic rewriting of AOF on %lld%% growth",growth);
                 rewriteAppendOnlyFileBackground();
             }
@@ -2204,16 +2228,22 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
     /* AOF postponed flush: Try at every cron cycle if the slow fsync
      * completed. */
-    if (server.aof_state == AOF_ON && server.aof_flush_postponed_start)
+    if ((server.aof_state == AOF_ON || server.aof_state == AOF_WAIT_REWRITE) &&
+        server.aof_flush_postponed_start)
+    {
         flushAppendOnlyFile(0);
+    }
 
     /* AOF write errors: in this case we have a buffer to flush as well and
      * clear the AOF error in case of success to make the DB writable again,
      * however to try every second is enough in case of 'hz' is set to
      * a higher frequency. */
     run_with_period(1000) {
-        if (server.aof_state == AOF_ON && server.aof_last_write_status == C_ERR)
+        if ((server.aof_state == AOF_ON || server.aof_state == AOF_WAIT_REWRITE) &&
+            server.aof_last_write_status == C_ERR)
+        {
             flushAppendOnlyFile(0);
+        }
     }
 
     /* Clear the paused clients state if needed. */
@@ -2230,6 +2260,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         run_with_period(1000) replicationCron();
     }
 
+    /* Give the replicas receiving a diskless RDB their share of the transfer
+     * rate for this period, and drop the ones that are too slow. */
+    if (server.rdb_pipe_conns) rdbPipeCron();
+
     /* Run the Redis Cluster cron. */
     run_with_period(100) {
         if (server.cluster_enabled) clusterCron();
@@ -2404,11 +2438,22 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
 
+    /* Release a slice of the huge values deleted synchronously. While some
+     * value is pending, don't wait for events, so that a slice is released
+     * at every event loop iteration. */
+    incrementalFreeCycle();
+    if (incrementalFreePendingObjects()) aeSetDontWait(server.el,1);
+
     /* Unblock all the clients blocked for synchronous replication
      * in WAIT. */
     if (listLength(server.clients_waiting_acks))
         processClientsWaitingReplicas();
 
+    /* Unblock the reads waiting for this replica to catch up with the
+     * staleness bound of their client. */
+    if (listLength(server.clients_waiting_staleness))
+        processClientsWaitingStaleness();
+
     /* Check if there are clients unblocked by modules that implement
      * blocking commands. */
     if (moduleCount()) moduleHandleBlockedClients();
@@ -2436,6 +2481,27 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
         server.get_ack_from_slaves = 0;
     }
 
+    /* Send the GETACKs the replicas with reads bounded by MAXLAG asked for,
+     * with their token, see replicationGetStaleness(). */
+    if (listLength(server.repl_getack_tokens) &&
+        !checkClientPauseTimeoutAndReturnIfPaused())
+    {
+        listIter li;
+        listNode *ln;
+        robj *argv[3];
+
+        argv[0] = shared.replconf;
+        argv[1] = shared.getack;
+        listRewind(server.repl_getack_tokens,&li);
+        while((ln = listNext(&li))) {
+            sds token = listNodeValue(ln);
+            argv[2] = createObject(OBJ_STRING,sdsdup(token));
+            replicationFeedSlaves(server.slaves, server.slaveseldb, argv, 3);
+            decrRefCount(argv[2]);
+        }
+        listEmpty(server.repl_getack_tokens);
+    }
+
     /* We may have recieved updates from clients about their current offset. NOTE:
      * this can't be done where the ACK is recieved since failover will disconnect 
      * our clients. */
@@ -2450,8 +2516,10 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
      * client side caching protocol in broadcasting (BCAST) mode. */
     trackingBroadcastInvalidationMessages();
 
-    /* Write the AOF buffer on disk */
-    if (server.aof_state == AOF_ON)
+    /* Write the AOF buffer on disk, must be done before handling clients
+     * with pending writes. While the AOF is being switched on, the buffer
+     * goes to the INCR file opened by the rewrite. */
+    if (server.aof_state == AOF_ON || server.aof_state == AOF_WAIT_REWRITE)
         flushAppendOnlyFile(0);
 
     /* Handle writes with pending output buffers. */
@@ -2531,6 +2599,8 @@ void createSharedObjects(void) {
         "-BUSY Redis is busy running a script. You can only call SCRIPT KILL or SHUTDOWN NOSAVE.\r\n"));
     shared.masterdownerr = createObject(OBJ_STRING,sdsnew(
         "-MASTERDOWN Link with MASTER is down and replica-serve-stale-data is set to 'no'.\r\n"));
+    shared.staleerr = createObject(OBJ_STRING,sdsnew(
+        "-STALE The replica data is staler than the CLIENT STALENESS bound.\r\n"));
     shared.bgsaveerr = createObject(OBJ_STRING,sdsnew(
         "-MISCONF Redis is configured to save RDB snapshots, but it is currently not able to persist on disk. Commands that may modify the data set are disabled, because this instance is configured to report errors during writes if RDB snapshotting fails (stop-writes-on-bgsave-error option). Please check the Redis logs for details about the RDB error.\r\n"));
     shared.roslaveerr = createObject(OBJ_STRING,sdsnew(
@@ -2689,7 +2759,12 @@ void initServerConfig(void) {
     server.aof_rewrite_time_last = -1;
     server.aof_rewrite_time_start = -1;
     server.aof_lastbgrewrite_status = C_OK;
+    server.stat_aofrw_consecutive_failures = 0;
     server.aof_delayed_fsync = 0;
+    server.aof_written_offset = 0;
+    server.aof_fsynced_offset = 0;
+    atomicSet(server.aof_bio_fsynced_offset,0);
+    server.aof_group_commit_inflight = 0;
     server.aof_fd = -1;
     server.aof_selected_db = -1; /* Make sure the first time will not match */
     server.aof_flush_postponed_start = 0;
@@ -2724,6 +2799,7 @@ void initServerConfig(void) {
     server.master_initial_offset = -1;
     server.repl_state = REPL_STATE_NONE;
     server.repl_transfer_tmpfile = NULL;
+    server.repl_transfer_diff = 0;
     server.repl_transfer_fd = -1;
     server.repl_transfer_s = NULL;
     server.repl_syncio_timeout = CONFIG_REPL_SYNCIO_TIMEOUT;
@@ -2732,9 +2808,8 @@ void initServerConfig(void) {
 
     /* Replication partial resync backlog */
     server.repl_backlog = NULL;
-    server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
-    server.repl_backlog_off = 0;
+    server.repl_buffer_blocks = NULL;
+    server.repl_buffer_mem = 0;
     server.repl_no_slaves_since = time(NULL);
 
     /* Failover related */
@@ -3139,11 +3214,16 @@ void resetServerStats(void) {
     server.stat_evictedkeys = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
+    server.stat_policy_keyspace_hits = 0;
+    server.stat_policy_keyspace_misses = 0;
+    server.stat_tinylfu_admitted = 0;
+    server.stat_tinylfu_rejected = 0;
     server.stat_active_defrag_hits = 0;
     server.stat_active_defrag_misses = 0;
     server.stat_active_defrag_key_hits = 0;
     server.stat_active_defrag_key_misses = 0;
     server.stat_active_defrag_scanned = 0;
+    server.stat_active_defrag_skipped = 0;
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
     server.stat_total_forks = 0;
@@ -3151,10 +3231,13 @@ void resetServerStats(void) {
     server.stat_sync_full = 0;
     server.stat_sync_partial_ok = 0;
     server.stat_sync_partial_err = 0;
+    server.stat_sync_diff = 0;
     server.stat_io_reads_processed = 0;
     atomicSet(server.stat_total_reads_processed, 0);
     server.stat_io_writes_processed = 0;
     atomicSet(server.stat_total_writes_processed, 0);
+    server.stat_repl_parse_usec = 0;
+    server.stat_repl_apply_usec = 0;
     for (j = 0; j < STATS_METRIC_COUNT; j++) {
         server.inst_metric[j].idx = 0;
         server.inst_metric[j].last_sample_time = mstime();
@@ -3168,6 +3251,7 @@ void resetServerStats(void) {
     server.stat_total_error_replies = 0;
     server.stat_dump_payload_sanitizations = 0;
     server.aof_delayed_fsync = 0;
+    server.stat_aof_group_commits = 0;
 }
 
 /* Make the thread killable at any time, so that kill threads functions
@@ -3210,6 +3294,8 @@ void initServer(void) {
     server.clients_to_close = listCreate();
     server.slaves = listCreate();
     server.monitors = listCreate();
+    server.repl_buffer_blocks = listCreate();
+    listSetFreeMethod(server.repl_buffer_blocks,zfree);
     server.clients_pending_write = listCreate();
     server.clients_pending_read = listCreate();
     server.clients_timeout_table = raxNew();
@@ -3220,6 +3306,13 @@ void initServer(void) {
     server.tracking_pending_keys = listCreate();
     server.clients_waiting_acks = listCreate();
     server.get_ack_from_slaves = 0;
+    server.clients_waiting_staleness = listCreate();
+    server.repl_fresh_time = 0;
+    server.repl_getack_request_time = 0;
+    server.repl_getack_token = NULL;
+    server.repl_getack_seq = 0;
+    server.repl_getack_tokens = listCreate();
+    listSetFreeMethod(server.repl_getack_tokens,(void (*)(void*))sdsfree);
     server.client_pause_type = 0;
     server.paused_clients = listCreate();
     server.events_processed_while_blocked = 0;
@@ -3233,6 +3326,9 @@ void initServer(void) {
         exit(1);
     }
 
+    if (server.slab_allocator) zslab_enable();
+    if (server.hugepage_regions) zhuge_enable();
+
     // 创建常用的字符集合，避免频繁的内存开辟和销毁
     createSharedObjects();
     // 会提高系统允许打开的文件描述符上限，避免由于大量的客户端连接导致错误
@@ -3289,6 +3385,8 @@ void initServer(void) {
         server.db[j].dict = dictCreate(&dbDictType,NULL);
         server.db[j].expires = dictCreate(&dbExpiresDictType,NULL);
         server.db[j].expires_cursor = 0;
+        server.db[j].expires_index = server.active_expire_index ? raxNew() : NULL;
+        server.db[j].expires_index_bytes = 0;
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
@@ -3297,6 +3395,7 @@ void initServer(void) {
         server.db[j].defrag_later = listCreate();
         listSetFreeMethod(server.db[j].defrag_later,(void (*)(void*))sdsfree);
     }
+    slotDigestSetEnabled(server.repl_diff_sync);
     // 初始化LRU样本池
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
@@ -3311,14 +3410,15 @@ void initServer(void) {
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
     server.rdb_pipe_conns = NULL;
     server.rdb_pipe_numconns = 0;
-    server.rdb_pipe_numconns_writing = 0;
     server.rdb_pipe_buff = NULL;
-    server.rdb_pipe_bufflen = 0;
+    server.rdb_pipe_buff_size = 0;
+    server.rdb_pipe_read_off = 0;
+    server.rdb_pipe_eof = 0;
+    server.rdb_pipe_stalled_since = 0;
     server.rdb_bgsave_scheduled = 0;
     server.child_info_pipe[0] = -1;
     server.child_info_pipe[1] = -1;
     server.child_info_nread = 0;
-    aofRewriteBufferReset();
     server.aof_buf = sdsempty();
     server.lastsave = time(NULL); /* At startup we consider the DB saved. */
     server.lastbgsave_try = 0;    /* At startup we never tried to BGSAVE. */
@@ -3380,22 +3480,14 @@ void initServer(void) {
                 "blocked clients subsystem.");
     }
 
+    /* Register the event woken up by the AOF group commit fsyncs. */
+    aofGroupCommitInit();
+
     /* Register before and after sleep handlers (note this needs to be done
      * before loading persistence since it is used by processEventsWhileBlocked. */
     aeSetBeforeSleepProc(server.el,beforeSleep);
     aeSetAfterSleepProc(server.el,afterSleep);
 
-    /* Open the AOF file if needed. */
-    if (server.aof_state == AOF_ON) {
-        server.aof_fd = open(server.aof_filename,
-                               O_WRONLY|O_APPEND|O_CREAT,0644);
-        if (server.aof_fd == -1) {
-            serverLog(LL_WARNING, "Can't open the append-only file: %s",
-                strerror(errno));
-            exit(1);
-        }
-    }
-
     /* 32 bit instances are limited to 4GB of address space, so if there is
      * no explicit limit in the user provided configuration we set a limit
      * at 3 GB using maxmemory with 'noeviction' policy'. This avoids
@@ -3424,6 +3516,7 @@ void initServer(void) {
 void InitServerLast() {
     bioInit();
     initThreadedIO();
+    replicaApplyInit();
     set_jemalloc_bg_thread(server.jemalloc_bg_thread);
     server.initial_memory_usage = zmalloc_used_memory();
 }
@@ -4317,6 +4410,27 @@ int processCommand(client *c) {
         return C_OK;       
     }
 
+    /* If the client bounded the staleness of its reads with CLIENT
+     * STALENESS and our data is behind the bound, block the client until we
+     * catch up with the master, or reject the read if it can't wait. The
+     * commands queued in a transaction are checked at EXEC time. Scripts
+     * are not flagged as reads, but on a replica they can only read. */
+    int is_script_command = c->cmd->proc == evalCommand ||
+                            c->cmd->proc == evalShaCommand ||
+                            (c->cmd->proc == execCommand &&
+                             (c->mstate.cmd_flags & CMD_MAY_REPLICATE));
+    if ((is_read_command || is_script_command) &&
+        !(c->flags & CLIENT_MULTI && c->cmd->proc != execCommand) &&
+        !clientReadBoundSatisfied(c))
+    {
+        if (c->read_bound_timeout == 0 || c->flags & CLIENT_DENY_BLOCKING) {
+            rejectCommand(c, shared.staleerr);
+        } else {
+            blockClientForStaleness(c);
+        }
+        return C_OK;
+    }
+
     /* Exec the command */
     if (c->flags & CLIENT_MULTI &&
         c->cmd->proc != execCommand && c->cmd->proc != discardCommand &&
@@ -4902,13 +5016,20 @@ sds genRedisInfoString(const char *section) {
             "mem_fragmentation_bytes:%zd\r\n"
             "mem_not_counted_for_evict:%zu\r\n"
             "mem_replication_backlog:%zu\r\n"
+            "mem_total_replication_buffers:%zu\r\n"
             "mem_clients_slaves:%zu\r\n"
             "mem_clients_normal:%zu\r\n"
             "mem_aof_buffer:%zu\r\n"
+            "mem_expire_index:%zu\r\n"
+            "mem_eviction_candidates:%zu\r\n"
+            "mem_tinylfu_sketch:%zu\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
             "lazyfree_pending_objects:%zu\r\n"
-            "lazyfreed_objects:%zu\r\n",
+            "lazyfree_pending_memory:%zu\r\n"
+            "lazyfree_incremental_objects:%zu\r\n"
+            "lazyfreed_objects:%zu\r\n"
+            "lazyfree_stolen_jobs:%llu\r\n",
             zmalloc_used,
             hmem,
             server.cron_malloc_stats.process_rss,
@@ -4946,14 +5067,36 @@ sds genRedisInfoString(const char *section) {
             mh->total_frag_bytes,
             freeMemoryGetNotCountedMemory(),
             mh->repl_backlog,
+            server.repl_buffer_mem,
             mh->clients_slaves,
             mh->clients_normal,
             mh->aof_buffer,
+            mh->expire_index,
+            evictionCandidatesMemory(),
+            tinylfuMemory(),
             ZMALLOC_LIB,
             server.active_defrag_running,
             lazyfreeGetPendingObjectsCount(),
-            lazyfreeGetFreedObjectsCount()
+            lazyfreeGetPendingMemory(),
+            incrementalFreePendingObjects(),
+            lazyfreeGetFreedObjectsCount(),
+            bioLazyfreeStolenJobs()
         );
+        size_t huge_regions, huge_memory;
+        zhuge_get_stats(&huge_regions,&huge_memory);
+        info = sdscatprintf(info,
+            "hugepage_regions:%zu\r\n"
+            "hugepage_memory:%zu\r\n",
+            huge_regions, huge_memory);
+        for (int j = 0; j < ZSLAB_CLASSES; j++) {
+            zslabStats st;
+            zslab_get_stats(j,&st);
+            if (st.pages == 0) continue;
+            info = sdscatprintf(info,
+                "slab_%s:size=%zu,objects=%zu,pages=%zu,utilization=%.2f\r\n",
+                st.name, st.size, st.objects, st.pages,
+                (double)st.objects*st.size*100/(st.pages*st.page_size));
+        }
         freeMemoryOverheadData(mh);
     }
 
@@ -4990,6 +5133,7 @@ sds genRedisInfoString(const char *section) {
             "aof_last_rewrite_time_sec:%jd\r\n"
             "aof_current_rewrite_time_sec:%jd\r\n"
             "aof_last_bgrewrite_status:%s\r\n"
+            "aof_rewrites_consecutive_failures:%lld\r\n"
             "aof_last_write_status:%s\r\n"
             "aof_last_cow_size:%zu\r\n"
             "module_fork_in_progress:%d\r\n"
@@ -5015,6 +5159,7 @@ sds genRedisInfoString(const char *section) {
             (intmax_t)((server.child_type != CHILD_TYPE_AOF) ?
                 -1 : time(NULL)-server.aof_rewrite_time_start),
             (server.aof_lastbgrewrite_status == C_OK) ? "ok" : "err",
+            server.stat_aofrw_consecutive_failures,
             (server.aof_last_write_status == C_OK &&
                 aof_bio_fsync_status == C_OK) ? "ok" : "err",
             server.stat_aof_cow_bytes,
@@ -5027,16 +5172,18 @@ sds genRedisInfoString(const char *section) {
                 "aof_base_size:%lld\r\n"
                 "aof_pending_rewrite:%d\r\n"
                 "aof_buffer_length:%zu\r\n"
-                "aof_rewrite_buffer_length:%lu\r\n"
                 "aof_pending_bio_fsync:%llu\r\n"
-                "aof_delayed_fsync:%lu\r\n",
+                "aof_delayed_fsync:%lu\r\n"
+                "aof_group_commits:%lld\r\n"
+                "aof_group_commit_waiting_clients:%lu\r\n",
                 (long long) server.aof_current_size,
                 (long long) server.aof_rewrite_base_size,
                 server.aof_rewrite_scheduled,
                 sdslen(server.aof_buf),
-                aofRewriteBufferSize(),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
-                server.aof_delayed_fsync);
+                server.aof_delayed_fsync,
+                server.stat_aof_group_commits,
+                listLength(server.clients_waiting_aof_fsync));
         }
 
         if (server.loading) {
@@ -5089,6 +5236,18 @@ sds genRedisInfoString(const char *section) {
         atomicGet(server.stat_net_input_bytes, stat_net_input_bytes);
         atomicGet(server.stat_net_output_bytes, stat_net_output_bytes);
 
+        /* Hit ratio, overall and since the maxmemory policy was selected. */
+        long long lookups = server.stat_keyspace_hits+server.stat_keyspace_misses;
+        long long policy_hits = server.stat_keyspace_hits -
+                                server.stat_policy_keyspace_hits;
+        long long policy_lookups = lookups -
+                                   server.stat_policy_keyspace_hits -
+                                   server.stat_policy_keyspace_misses;
+        double hits_perc = lookups ?
+            (double)server.stat_keyspace_hits*100/lookups : 0;
+        double policy_hits_perc = policy_lookups ?
+            (double)policy_hits*100/policy_lookups : 0;
+
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Stats\r\n"
@@ -5103,6 +5262,8 @@ sds genRedisInfoString(const char *section) {
             "sync_full:%lld\r\n"
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
+            "sync_diff:%lld\r\n"
+            "slot_digests_dirty:%d\r\n"
             "expired_keys:%lld\r\n"
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
@@ -5110,6 +5271,10 @@ sds genRedisInfoString(const char *section) {
             "evicted_keys:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
+            "keyspace_hits_perc:%.2f\r\n"
+            "policy_keyspace_hits_perc:%.2f\r\n"
+            "tinylfu_admitted_keys:%lld\r\n"
+            "tinylfu_rejected_keys:%lld\r\n"
             "pubsub_channels:%ld\r\n"
             "pubsub_patterns:%lu\r\n"
             "latest_fork_usec:%lld\r\n"
@@ -5120,6 +5285,8 @@ sds genRedisInfoString(const char *section) {
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
             "active_defrag_key_misses:%lld\r\n"
+            "active_defrag_skipped:%lld\r\n"
+            "active_defrag_target_bins:%d\r\n"
             "tracking_total_keys:%lld\r\n"
             "tracking_total_items:%lld\r\n"
             "tracking_total_prefixes:%lld\r\n"
@@ -5141,6 +5308,8 @@ sds genRedisInfoString(const char *section) {
             server.stat_sync_full,
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
+            server.stat_sync_diff,
+            slotDigestDirtyCount(),
             server.stat_expiredkeys,
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
@@ -5148,6 +5317,10 @@ sds genRedisInfoString(const char *section) {
             server.stat_evictedkeys,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
+            hits_perc,
+            policy_hits_perc,
+            server.stat_tinylfu_admitted,
+            server.stat_tinylfu_rejected,
             dictSize(server.pubsub_channels),
             dictSize(server.pubsub_patterns),
             server.stat_fork_time,
@@ -5158,6 +5331,8 @@ sds genRedisInfoString(const char *section) {
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
             server.stat_active_defrag_key_misses,
+            server.stat_active_defrag_skipped,
+            activeDefragTargetBins(),
             (unsigned long long) trackingGetTotalKeys(),
             (unsigned long long) trackingGetTotalItems(),
             (unsigned long long) trackingGetTotalPrefixes(),
@@ -5197,6 +5372,11 @@ sds genRedisInfoString(const char *section) {
                 "master_sync_in_progress:%d\r\n"
                 "slave_read_repl_offset:%lld\r\n"
                 "slave_repl_offset:%lld\r\n"
+                "slave_repl_apply_thread:%d\r\n"
+                "slave_repl_apply_lag_bytes:%lld\r\n"
+                "slave_repl_parse_usec:%lld\r\n"
+                "slave_repl_apply_usec:%lld\r\n"
+                "slave_repl_staleness_ms:%lld\r\n"
                 ,server.masterhost,
                 server.masterport,
                 (server.repl_state == REPL_STATE_CONNECTED) ?
@@ -5205,7 +5385,12 @@ sds genRedisInfoString(const char *section) {
                 ((int)(server.unixtime-server.master->lastinteraction)) : -1,
                 server.repl_state == REPL_STATE_TRANSFER,
                 slave_read_repl_offset,
-                slave_repl_offset
+                slave_repl_offset,
+                server.repl_apply_thread,
+                slave_read_repl_offset - slave_repl_offset,
+                server.stat_repl_parse_usec,
+                server.stat_repl_apply_usec,
+                (long long)replicationGetStaleness()
             );
 
             if (server.repl_state == REPL_STATE_TRANSFER) {
@@ -5306,7 +5491,10 @@ sds genRedisInfoString(const char *section) {
             "repl_backlog_active:%d\r\n"
             "repl_backlog_size:%lld\r\n"
             "repl_backlog_first_byte_offset:%lld\r\n"
-            "repl_backlog_histlen:%lld\r\n",
+            "repl_backlog_histlen:%lld\r\n"
+            "repl_backlog_disk_size:%lld\r\n"
+            "repl_backlog_disk_first_byte_offset:%lld\r\n"
+            "repl_backlog_disk_histlen:%lld\r\n",
             getFailoverStateString(),
             server.replid,
             server.replid2,
@@ -5314,8 +5502,11 @@ sds genRedisInfoString(const char *section) {
             server.second_replid_offset,
             server.repl_backlog != NULL,
             server.repl_backlog_size,
-            server.repl_backlog_off,
-            server.repl_backlog_histlen);
+            server.repl_backlog ? server.repl_backlog->offset : 0,
+            server.repl_backlog ? server.repl_backlog->histlen : 0,
+            server.repl_backlog_disk_size,
+            server.repl_backlog ? server.repl_backlog->disk_offset : 0,
+            server.repl_backlog ? server.repl_backlog->disk_histlen : 0);
     }
 
     /* CPU */
@@ -5510,6 +5701,9 @@ void linuxMemoryWarnings(void) {
     if (THPIsEnabled() && THPDisable()) {
         serverLog(LL_WARNING,"WARNING you have Transparent Huge Pages (THP) support enabled in your kernel. This will create latency and memory usage issues with Redis. To fix this issue run the command 'echo madvise > /sys/kernel/mm/transparent_hugepage/enabled' as root, and add it to your /etc/rc.local in order to retain the setting after a reboot. Redis must be restarted after THP is disabled (set to 'madvise' or 'never').");
     }
+    if (server.hugepage_regions && !THPIsMadviseEnabled()) {
+        serverLog(LL_WARNING,"WARNING hugepage-regions is enabled, but Transparent Huge Pages (THP) are not set to 'madvise' in your kernel, so the huge page regions will not be backed by huge pages, or all the memory will. To fix this issue run the command 'echo madvise > /sys/kernel/mm/transparent_hugepage/enabled' as root.");
+    }
 }
 
 #ifdef __arm64__
@@ -6030,7 +6224,10 @@ int checkForSentinelMode(int argc, char **argv) {
 void loadDataFromDisk(void) {
     long long start = ustime();
     if (server.aof_state == AOF_ON) {
-        if (loadAppendOnlyFile(server.aof_filename) == C_OK)
+        int ret = loadAppendOnlyFiles(server.aof_manifest);
+        if (ret == AOF_FAILED || ret == AOF_OPEN_ERR)
+            exit(1);
+        if (ret == AOF_OK || ret == AOF_TRUNCATED)
             serverLog(LL_NOTICE,"DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
     } else {
         rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
@@ -6237,6 +6434,7 @@ struct redisTest {
     {"ziplist", ziplistTest},
     {"quicklist", quicklistTest},
     {"intset", intsetTest},
+    {"roaring", roaringTest},
     {"zipmap", zipmapTest},
     {"sha1test", sha1Test},
     {"util", utilTest},
@@ -6480,7 +6678,10 @@ int main(int argc, char **argv) {
         ACLLoadUsersAtStartup();
         // 创建后台线程，I/O线程
         InitServerLast();
+        aofLoadManifestFromDisk();
         loadDataFromDisk();
+        aofOpenIfNeededOnServerStart();
+        aofDelHistoryFiles();
         if (server.cluster_enabled) {
             if (verifyClusterConfigWithData() == C_ERR) {
                 serverLog(LL_WARNING,
@@ -66,6 +66,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
 #include "intset.h"  /* Compact integer set structure */
+#include "roaring.h" /* Compressed bitmaps */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
 #include "latency.h" /* Latency monitor API */
@@ -108,11 +109,16 @@ typedef long long ustime_t; /* microsecond time type. */
 #define OBJ_SHARED_HDR_STRLEN(_len_) (((_len_) < 10) ? 4 : 5) /* see shared.mbulkhdr etc. */
 #define LOG_MAX_LEN    1024 /* Default maximum length of syslog messages.*/
 #define AOF_REWRITE_ITEMS_PER_CMD 64
-#define AOF_READ_DIFF_INTERVAL_BYTES (1024*10)
+#define AOF_REWRITE_LIMIT_THRESHOLD 3      /* Failed rewrites before limiting. */
+#define AOF_REWRITE_LIMIT_MAX_MINUTES 60   /* Max delay of limited rewrites. */
 #define CONFIG_AUTHPASS_MAX_LEN 512
 #define CONFIG_RUN_ID_SIZE 40
 #define RDB_EOF_MARK_SIZE 40
 #define CONFIG_REPL_BACKLOG_MIN_SIZE (1024*16)          /* 16k */
+#define REPL_BACKLOG_TRIM_BLOCKS_PER_CALL 64 /* Blocks released per trim. */
+#define REPL_BACKLOG_INDEX_PER_BLOCKS 64 /* Index one block every N blocks. */
+#define REPL_BACKLOG_DISK_SEGMENTS 8 /* Disk backlog is split in N segments. */
+#define REPL_BACKLOG_DISK_SEGMENT_MAX_SIZE (1024*1024*64) /* 64mb */
 #define CONFIG_BGSAVE_RETRY_DELAY 5 /* Wait a few secs before trying again. */
 #define CONFIG_DEFAULT_PID_FILE "/var/run/redis.pid"
 #define CONFIG_DEFAULT_CLUSTER_CONFIG_FILE "nodes.conf"
@@ -128,6 +134,7 @@ typedef long long ustime_t; /* microsecond time type. */
 
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
 #define ACTIVE_EXPIRE_CYCLE_FAST 1
+#define ACTIVE_EXPIRE_BATCH_MAX 1024 /* Max active-expire-batch-size. */
 
 /* Children process will exit with this status code to signal that the
  * process terminated without an error: this is useful in order to kill
@@ -229,6 +236,14 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define AOF_ON 1              /* AOF is on */
 #define AOF_WAIT_REWRITE 2    /* AOF waits rewrite to start appending */
 
+/* AOF return values for loadAppendOnlyFiles() and getAppendOnlyFileSize() */
+#define AOF_OK 0
+#define AOF_NOT_EXIST 1
+#define AOF_EMPTY 2
+#define AOF_OPEN_ERR 3
+#define AOF_FAILED 4
+#define AOF_TRUNCATED 5
+
 /* Client flags */
 #define CLIENT_SLAVE (1<<0)   /* This client is a replica */
 #define CLIENT_MASTER (1<<1)  /* This client is a master */
@@ -287,6 +302,8 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define CLIENT_REPL_RDBONLY (1ULL<<42) /* This client is a replica that only wants
                                           RDB without replication buffer. */
 #define CLIENT_PUSHING (1ULL<<43) /* This client is pushing notifications. */
+#define CLIENT_PENDING_AOF_FSYNC (1ULL<<44) /* Replies held until the AOF is
+                                               fsynced (aof-group-commit). */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -297,7 +314,8 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define BLOCKED_STREAM 4  /* XREAD. */
 #define BLOCKED_ZSET 5    /* BZPOP et al. */
 #define BLOCKED_PAUSE 6   /* Blocked by CLIENT PAUSE */
-#define BLOCKED_NUM 7     /* Number of blocked states. */
+#define BLOCKED_STALENESS 7 /* Read blocked by CLIENT STALENESS. */
+#define BLOCKED_NUM 8     /* Number of blocked states. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -355,6 +373,7 @@ typedef enum {
 #define SLAVE_CAPA_NONE 0
 #define SLAVE_CAPA_EOF (1<<0)    /* Can parse the RDB EOF streaming format. */
 #define SLAVE_CAPA_PSYNC2 (1<<1) /* Supports PSYNC2 protocol. */
+#define SLAVE_CAPA_SLOTDIFF (1<<2) /* Can load a diff of its slot digests. */
 
 /* Synchronous read timeout - slave side */
 #define CONFIG_REPL_SYNCIO_TIMEOUT 5
@@ -392,6 +411,16 @@ typedef enum {
 #define AOF_FSYNC_ALWAYS 1
 #define AOF_FSYNC_EVERYSEC 2
 
+/* Formats of the AOF INCR files */
+#define AOF_FORMAT_RESP 0
+#define AOF_FORMAT_BINARY 1
+
+/* Binary AOF files start with this signature, followed by the records, see
+ * catAppendOnlyBinaryCommand(). */
+#define AOF_BINARY_MAGIC "RAOFBIN1"
+#define AOF_BINARY_MAGIC_LEN 8
+#define AOF_BINARY_HDR_LEN 16   /* Body length and timestamp. */
+
 /* Replication diskless load defines */
 #define REPL_DISKLESS_LOAD_DISABLED 0
 #define REPL_DISKLESS_LOAD_WHEN_DB_EMPTY 1
@@ -423,6 +452,7 @@ typedef enum {
 #define MAXMEMORY_FLAG_LRU (1<<0)
 #define MAXMEMORY_FLAG_LFU (1<<1)
 #define MAXMEMORY_FLAG_ALLKEYS (1<<2)
+#define MAXMEMORY_FLAG_TINYLFU (1<<3)
 #define MAXMEMORY_FLAG_NO_SHARED_INTEGERS \
     (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU)
 
@@ -434,6 +464,9 @@ typedef enum {
 #define MAXMEMORY_ALLKEYS_LFU ((5<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_ALLKEYS_RANDOM ((6<<8)|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_NO_EVICTION (7<<8)
+/* TinyLFU policies also track the access time like the LRU ones. */
+#define MAXMEMORY_VOLATILE_TINYLFU ((8<<8)|MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_TINYLFU)
+#define MAXMEMORY_ALLKEYS_TINYLFU ((9<<8)|MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_TINYLFU|MAXMEMORY_FLAG_ALLKEYS)
 
 /* Units */
 #define UNIT_SECONDS 0
@@ -531,6 +564,7 @@ typedef enum {
  * encoding version. */
 #define OBJ_MODULE 5    /* Module object. */
 #define OBJ_STREAM 6    /* Stream object. */
+#define OBJ_BITMAP 7    /* Compressed (roaring) bitmap object. */
 
 /* Extract encver / signature from a module type ID. */
 #define REDISMODULE_TYPE_ENCVER_BITS 10
@@ -670,10 +704,15 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_ROARING 11 /* Encoded as a roaring bitmap */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
 #define LRU_CLOCK_RESOLUTION 1000 /* LRU clock resolution in ms */
+/* With TinyLFU policies the most significant bit of the LRU field is set
+ * when the key is in the main segment, see evict.c. */
+#define TINYLFU_ADMITTED (1<<(LRU_BITS-1))
+#define TINYLFU_CLOCK_MAX (TINYLFU_ADMITTED-1)
 
 #define OBJ_SHARED_REFCOUNT INT_MAX     /* Global object never destroyed. */
 #define OBJ_STATIC_REFCOUNT (INT_MAX-1) /* Object allocated in the stack. */
@@ -733,6 +772,18 @@ char *getObjectTypeName(robj*);
     _var.ptr = _ptr; \
 } while(0)
 
+/* Bracket attributing to a value the memory allocated while mutating it,
+ * see objectSizeTrackStart() in object.c. */
+typedef struct objectSizeTracker {
+    robj *o;                /* Tracked object, NULL for stream brackets. */
+    size_t *ref;            /* Tracked size field, NULL if not tracked. */
+    int encoding;           /* Encoding of 'o' at the start. */
+    int stale;              /* The tracked size was never computed. */
+    size_t untracked;       /* objectUntrackedSize() at the start. */
+    long long mem;          /* Memory used by the thread at the start. */
+    long long attributed;   /* Memory attributed by brackets at the start. */
+} objectSizeTracker;
+
 struct evictionPoolEntry; /* Defined in evict.c */
 
 /* This structure is used in order to represent the output buffer of a client,
@@ -742,6 +793,62 @@ typedef struct clientReplyBlock {
     char buf[];
 } clientReplyBlock;
 
+/* Replication buffer blocks are the list of buffer blocks to store the
+ * replication stream, they are shared by the replication backlog and the
+ * replicas: every replica only references the block it has to send next,
+ * and the position in it, instead of owning a private copy of the stream.
+ *
+ * The first block of the list is referenced by the replication backlog,
+ * every block is released once the backlog and all the replicas are done
+ * with it: this is tracked by 'refcount', that is the number of replicas
+ * (and the backlog) whose reference is on this block. */
+typedef struct replBufBlock {
+    int refcount;           /* Number of replicas or repl backlog using. */
+    long long id;           /* The unique incremental number. */
+    long long repl_offset;  /* Start replication offset of the block. */
+    size_t size, used;
+    char buf[];
+} replBufBlock;
+
+/* The replication backlog is the head of the replication buffer blocks:
+ * it keeps the blocks alive up to repl-backlog-size bytes, so that the
+ * replicas can partially resynchronize. */
+typedef struct replBacklog {
+    listNode *ref_repl_buf_node; /* Referenced the first node of replication
+                                    buffer blocks. */
+    size_t unindexed_count;      /* The count from last creating index block. */
+    rax *blocks_index;           /* The index of recorded blocks of replication
+                                    buffer for quickly searching replication
+                                    offset on partial resynchronization. */
+    long long histlen;           /* Backlog actual data length */
+    long long offset;            /* Replication "master offset" of first
+                                    byte in the replication backlog buffer.*/
+    list *disk_segments;         /* Segments of the disk backlog, oldest first,
+                                    see replBacklogSegment. */
+    long long disk_histlen;      /* Disk backlog actual data length. */
+    long long disk_offset;       /* Replication offset of the first byte in
+                                    the disk backlog. */
+    list *disk_pending;          /* Blocks the bio thread is writing to the
+                                    disk backlog, oldest first. They are
+                                    still counted in repl_buffer_mem. */
+    rax *disk_pending_index;     /* The same blocks, by replication offset. */
+} replBacklog;
+
+/* When repl-backlog-disk-size is set, the blocks trimmed from the head of
+ * the in memory backlog are appended to files on disk instead of being
+ * discarded, so that the backlog has two tiers: the disk one holds the
+ * stream from disk_offset up to the first byte of the in memory one.
+ * The files are unlinked as soon as they are created, so that nothing is
+ * left behind when the server exits. The writes are done by the
+ * BIO_REPL_BACKLOG thread: until a write is done, the block stays in
+ * disk_pending and the replicas are served from memory. */
+typedef struct replBacklogSegment {
+    long long id;           /* Unique segment id. */
+    int fd;                 /* Unlinked file holding the segment. */
+    long long offset;       /* Replication offset of the first byte. */
+    long long len;          /* Bytes stored in the segment. */
+} replBacklogSegment;
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
@@ -754,6 +861,9 @@ typedef struct redisDb {
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
     unsigned long expires_cursor; /* Cursor of the active expire cycle. */
+    rax *expires_index;         /* Keys with a timeout sorted by deadline, or
+                                   NULL if active-expire-index is off. */
+    size_t expires_index_bytes; /* Size of the keys in expires_index. */
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
 } redisDb;
 
@@ -938,20 +1048,41 @@ typedef struct client {
     sds replpreamble;       /* Replication DB preamble. */
     long long read_reploff; /* Read replication offset if this is a master. */
     long long reploff;      /* Applied replication offset if this is a master. */
+    long long repl_applying_off; /* Replication offset right after the command
+                                    being applied, when the replication stream
+                                    is parsed by the replica apply thread. */
     long long repl_ack_off; /* Replication ack offset, if this is a slave. */
     long long repl_ack_time;/* Replication ack time, if this is a slave. */
     long long repl_last_partial_write; /* The last time the server did a partial write from the RDB child pipe to this replica  */
+    long long repldb_budget; /* Bytes of the diskless RDB we can still send to
+                                this replica before the rate limit period ends. */
     long long psync_initial_offset; /* FULLRESYNC reply offset other slaves
                                        copying this slave output buffer
                                        should use. */
+    listNode *ref_repl_buf_node; /* Referenced node of replication buffer blocks,
+                                    see the definition of replBufBlock. */
+    size_t ref_block_pos;   /* Access position of referenced buffer block,
+                               i.e. the next offset to send. */
+    listNode *ref_disk_seg_node; /* Disk backlog segment the replica is
+                                    reading, when it is catching up from the
+                                    disk backlog. */
+    long long repl_disk_off; /* Next offset to send from the disk backlog,
+                                0 if not catching up from disk. */
     char replid[CONFIG_RUN_ID_SIZE+1]; /* Master replication ID (if master). */
     int slave_listening_port; /* As configured with: REPLCONF listening-port */
     char *slave_addr;       /* Optionally given by REPLCONF ip-address */
     int slave_capa;         /* Slave capabilities: SLAVE_CAPA_* bitwise OR. */
+    sds slot_digests;       /* As sent with: REPLCONF slot-digests, only
+                               kept until the diff resync starts. */
     multiState mstate;      /* MULTI/EXEC state */
     int btype;              /* Type of blocking op if CLIENT_BLOCKED. */
     blockingState bpop;     /* blocking state */
     long long woff;         /* Last write global replication offset. */
+    long long read_min_offset; /* CLIENT STALENESS MINOFFSET, or 0. */
+    mstime_t read_max_lag;  /* CLIENT STALENESS MAXLAG, or -1. */
+    mstime_t read_bound_timeout; /* CLIENT STALENESS TIMEOUT. */
+    long long aof_fsync_offset; /* AOF offset to fsync before replying,
+                                   see aof-group-commit. */
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
     list *pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
@@ -1023,7 +1154,7 @@ struct sharedObjectsStruct {
     *emptyarray, *wrongtypeerr, *nokeyerr, *syntaxerr, *sameobjecterr,
     *outofrangeerr, *noscripterr, *loadingerr, *slowscripterr, *bgsaveerr,
     *masterdownerr, *roslaveerr, *execaborterr, *noautherr, *noreplicaserr,
-    *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
+    *staleerr, *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
     *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *unlink,
     *rpop, *lpop, *lpush, *rpoplpush, *lmove, *blmove, *zpopmin, *zpopmax,
     *emptyscan, *multi, *exec, *left, *right, *hset, *srem, *xgroup, *xclaim,  
@@ -1105,6 +1236,7 @@ struct redisMemOverhead {
     size_t clients_normal;
     size_t aof_buffer;
     size_t lua_caches;
+    size_t expire_index;
     size_t overhead_total;
     size_t dataset;
     size_t total_keys;
@@ -1143,9 +1275,41 @@ typedef struct rdbSaveInfo {
     int repl_id_is_set;  /* True if repl_id field is set. */
     char repl_id[CONFIG_RUN_ID_SIZE+1];     /* Replication ID. */
     long long repl_offset;                  /* Replication offset. */
+
+    /* Used only saving. */
+    sds slot_digests;    /* Slot digests of the replica of a diff resync. */
 } rdbSaveInfo;
 
-#define RDB_SAVE_INFO_INIT {-1,0,"0000000000000000000000000000000000000000",-1}
+#define RDB_SAVE_INFO_INIT {-1,0,"0000000000000000000000000000000000000000",-1,NULL}
+
+/* The AOF is made of a BASE file, that is a snapshot of the dataset taken
+ * by the last AOF rewrite, followed by the INCR files logging the commands
+ * executed since then. The manifest tracks them, together with the HISTORY
+ * files, that are the BASE and INCR files obsoleted by a rewrite and that
+ * are about to be deleted. */
+typedef enum {
+    AOF_FILE_TYPE_BASE = 'b', /* BASE file */
+    AOF_FILE_TYPE_HIST = 'h', /* HISTORY file */
+    AOF_FILE_TYPE_INCR = 'i', /* INCR file */
+} aof_file_type;
+
+typedef struct {
+    sds file_name;                  /* file name */
+    long long file_seq;             /* file sequence */
+    aof_file_type file_type;        /* file type */
+} aofInfo;
+
+typedef struct {
+    aofInfo *base_aof_info;         /* BASE file information. NULL if there is no BASE file. */
+    list *incr_aof_list;            /* INCR AOFs list. We may have multiple INCR AOF when rewrite fails. */
+    list *history_aof_list;         /* HISTORY AOF list. When the AOFRW success, The aofInfo contained in
+                                       `base_aof_info` and `incr_aof_list` will be moved to this list. We
+                                       will delete these AOF files when AOFRW finish. */
+    long long curr_base_file_seq;   /* The sequence number used by the current BASE file. */
+    long long curr_incr_file_seq;   /* The sequence number used by the current INCR file. */
+    int dirty;                      /* 1 Indicates that the aofManifest in the memory is inconsistent with
+                                       disk, we need to persist it immediately. */
+} aofManifest;
 
 struct malloc_stats {
     size_t zmalloc_used;
@@ -1272,6 +1436,7 @@ struct redisServer {
     list *clients;              /* List of active clients */
     list *clients_to_close;     /* Clients to close asynchronously */
     list *clients_pending_write; /* There is to write or install handler. */
+    list *clients_waiting_aof_fsync; /* Replies held by aof-group-commit. */
     list *clients_pending_read;  /* Client has pending read socket buffers. */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client;     /* Current client executing the command. */
@@ -1317,11 +1482,16 @@ struct redisServer {
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
+    long long stat_policy_keyspace_hits;   /* Hits when the policy was set. */
+    long long stat_policy_keyspace_misses; /* Misses when the policy was set. */
+    long long stat_tinylfu_admitted; /* Window keys admitted by TinyLFU */
+    long long stat_tinylfu_rejected; /* Window keys evicted by TinyLFU */
     long long stat_active_defrag_hits;      /* number of allocations moved */
     long long stat_active_defrag_misses;    /* number of allocations scanned but not moved */
     long long stat_active_defrag_key_hits;  /* number of keys with moved allocations */
     long long stat_active_defrag_key_misses;/* number of keys scanned and not moved */
     long long stat_active_defrag_scanned;   /* number of dictEntries scanned */
+    long long stat_active_defrag_skipped;   /* allocations and keys skipped, not in fragmented size classes */
     size_t stat_peak_memory;        /* Max used memory record */
     long long stat_fork_time;       /* Time needed to perform latest fork() */
     double stat_fork_rate;          /* Fork rate in GB/sec. */
@@ -1330,6 +1500,7 @@ struct redisServer {
     long long stat_sync_full;       /* Number of full resyncs with slaves. */
     long long stat_sync_partial_ok; /* Number of accepted PSYNC requests. */
     long long stat_sync_partial_err;/* Number of unaccepted PSYNC requests. */
+    long long stat_sync_diff;       /* Number of diff resyncs with slaves. */
     list *slowlog;                  /* SLOWLOG list of commands */
     long long slowlog_entry_id;     /* SLOWLOG current entry ID */
     long long slowlog_log_slower_than; /* SLOWLOG time limit (to get logged) */
@@ -1353,6 +1524,8 @@ struct redisServer {
     long long stat_io_writes_processed; /* Number of write events processed by IO / Main threads */
     redisAtomic long long stat_total_reads_processed; /* Total number of read events processed */
     redisAtomic long long stat_total_writes_processed; /* Total number of write events processed */
+    long long stat_repl_parse_usec; /* Time spent parsing the master stream. */
+    long long stat_repl_apply_usec; /* Time spent applying the master stream. */
     /* The following two are used to track instantaneous metrics, like
      * number of operations per second, network traffic. */
     struct {
@@ -1367,10 +1540,15 @@ struct redisServer {
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
     int active_expire_effort;       /* From 1 (default) to 10, active effort. */
+    int active_expire_index;        /* Track keys with an expire by deadline. */
+    int active_expire_batch_size;   /* Keys expired and propagated together by
+                                       the active expire cycle, 0 = disabled. */
     int active_defrag_enabled;
     int sanitize_dump_payload;      /* Enables deep sanitization for ziplist and listpack in RDB and RESTORE. */
     int skip_checksum_validation;   /* Disables checksum validateion for RDB and RESTORE payload. */
     int jemalloc_bg_thread;         /* Enable jemalloc background thread */
+    int slab_allocator;             /* Allocate small objects from slabs. */
+    int hugepage_regions;           /* Allocate large tables from huge pages. */
     size_t active_defrag_ignore_bytes; /* minimum amount of fragmentation waste to start active defrag */
     int active_defrag_threshold_lower; /* minimum percentage of fragmentation to start active defrag */
     int active_defrag_threshold_upper; /* maximum percentage of fragmentation at which we use maximum effort */
@@ -1390,16 +1568,26 @@ struct redisServer {
     int aof_enabled;                /* AOF configuration */
     int aof_state;                  /* AOF_(ON|OFF|WAIT_REWRITE) */
     int aof_fsync;                  /* Kind of fsync() policy */
-    char *aof_filename;             /* Name of the AOF file */
+    char *aof_filename;             /* Basename of the AOF file and manifest */
+    char *aof_dirname;              /* Name of the AOF directory */
     int aof_no_fsync_on_rewrite;    /* Don't fsync if a rewrite is in prog. */
     int aof_rewrite_perc;           /* Rewrite AOF if % growth is > M and... */
     off_t aof_rewrite_min_size;     /* the AOF file is at least N bytes. */
     off_t aof_rewrite_base_size;    /* AOF size on latest startup or rewrite. */
-    off_t aof_current_size;         /* AOF current size. */
+    off_t aof_current_size;         /* AOF current size (Including BASE + INCRs). */
+    off_t aof_last_incr_size;       /* The size of the latest INCR AOF. */
     off_t aof_fsync_offset;         /* AOF offset which is already synced to disk. */
     int aof_flush_sleep;            /* Micros to sleep before flush. (used by tests) */
     int aof_rewrite_scheduled;      /* Rewrite once BGSAVE terminates. */
-    list *aof_rewrite_buf_blocks;   /* Hold changes during an AOF rewrite. */
+    aofManifest *aof_manifest;      /* Used to track AOFs. */
+    int aof_group_commit;           /* Fsync in a thread with appendfsync always. */
+    long long aof_written_offset;   /* Bytes written to the AOF since startup. */
+    long long aof_fsynced_offset;   /* Part of aof_written_offset fsynced. */
+    redisAtomic long long aof_bio_fsynced_offset; /* Set by the fsync thread. */
+    int aof_group_commit_inflight;  /* A group commit fsync is in progress. */
+    int aof_group_commit_pipe[2];   /* Wakes the event loop after a group
+                                       commit fsync. */
+    long long stat_aof_group_commits; /* Group commit fsyncs performed. */
     sds aof_buf;      /* AOF buffer, written before entering the event loop */
     int aof_fd;       /* File descriptor of currently selected AOF file */
     int aof_selected_db; /* Currently selected DB in AOF */
@@ -1408,25 +1596,19 @@ struct redisServer {
     time_t aof_rewrite_time_last;   /* Time used by last AOF rewrite run. */
     time_t aof_rewrite_time_start;  /* Current AOF rewrite start time. */
     int aof_lastbgrewrite_status;   /* C_OK or C_ERR */
+    long long stat_aofrw_consecutive_failures; /* Failed rewrites in a row */
     unsigned long aof_delayed_fsync;  /* delayed AOF fsync() counter */
     int aof_rewrite_incremental_fsync;/* fsync incrementally while aof rewriting? */
     int rdb_save_incremental_fsync;   /* fsync incrementally while rdb saving? */
     int aof_last_write_status;      /* C_OK or C_ERR */
     int aof_last_write_errno;       /* Valid if aof write/fsync status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
+    int aof_load_parse_thread;      /* Parse the AOF in a thread on loading. */
     int aof_use_rdb_preamble;       /* Use RDB preamble on AOF rewrites. */
+    int aof_format;                 /* Format of new INCR files, AOF_FORMAT_* */
+    int aof_incr_format;            /* Format of the INCR file we append to. */
     redisAtomic int aof_bio_fsync_status; /* Status of AOF fsync in bio job. */
     redisAtomic int aof_bio_fsync_errno;  /* Errno of AOF fsync in bio job. */
-    /* AOF pipes used to communicate between parent and child during rewrite. */
-    int aof_pipe_write_data_to_child;
-    int aof_pipe_read_data_from_parent;
-    int aof_pipe_write_ack_to_parent;
-    int aof_pipe_read_ack_from_child;
-    int aof_pipe_write_ack_to_child;
-    int aof_pipe_read_ack_from_parent;
-    int aof_stop_sending_diff;     /* If true stop sending accumulated diffs
-                                      to child process. */
-    sds aof_child_diff;             /* AOF diff accumulator child side. */
     /* RDB persistence */
     long long dirty;                /* Changes to DB from the last save */
     long long dirty_before_bgsave;  /* Used to restore dirty on failed BGSAVE */
@@ -1450,9 +1632,12 @@ struct redisServer {
     int rdb_child_exit_pipe;        /* Used by the diskless parent allow child exit. */
     connection **rdb_pipe_conns;    /* Connections which are currently the */
     int rdb_pipe_numconns;          /* target of diskless rdb fork child. */
-    int rdb_pipe_numconns_writing;  /* Number of rdb conns with pending writes. */
-    char *rdb_pipe_buff;            /* In diskless replication, this buffer holds data */
-    int rdb_pipe_bufflen;           /* that was read from the the rdb pipe. */
+    char *rdb_pipe_buff;            /* In diskless replication, this ring buffer */
+    size_t rdb_pipe_buff_size;      /* holds the data read from the rdb pipe, */
+    long long rdb_pipe_read_off;    /* that replicas send at their own pace. */
+    int rdb_pipe_eof;               /* The child closed the rdb pipe. */
+    time_t rdb_pipe_stalled_since;  /* Time the slowest replica filled the
+                                       ring buffer while others waited. */
     int rdb_key_save_delay;         /* Delay in microseconds between keys while
                                      * writing the RDB. (for testings). negative
                                      * value means fractions of microsecons (on average). */
@@ -1482,13 +1667,12 @@ struct redisServer {
     long long second_replid_offset; /* Accept offsets up to this for replid2. */
     int slaveseldb;                 /* Last SELECTed DB in replication output */
     int repl_ping_slave_period;     /* Master pings the slave every N seconds */
-    char *repl_backlog;             /* Replication backlog for partial syncs */
-    long long repl_backlog_size;    /* Backlog circular buffer size */
-    long long repl_backlog_histlen; /* Backlog actual data length */
-    long long repl_backlog_idx;     /* Backlog circular buffer current offset,
-                                       that is the next byte will'll write to.*/
-    long long repl_backlog_off;     /* Replication "master offset" of first
-                                       byte in the replication backlog buffer.*/
+    replBacklog *repl_backlog;      /* Replication backlog for partial syncs */
+    long long repl_backlog_size;    /* Backlog size */
+    long long repl_backlog_disk_size; /* Disk backlog size, 0 if disabled. */
+    list *repl_buffer_blocks;       /* Replication buffers blocks list
+                                       (serving replica clients and repl backlog) */
+    size_t repl_buffer_mem;         /* The memory of replication buffer. */
     time_t repl_backlog_time_limit; /* Time without slaves after the backlog
                                        gets released. */
     time_t repl_no_slaves_since;    /* We have no slaves since that time.
@@ -1500,7 +1684,13 @@ struct redisServer {
     int repl_diskless_load;         /* Slave parse RDB directly from the socket.
                                      * see REPL_DISKLESS_LOAD_* enum */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+    size_t repl_diskless_sync_buffer_size; /* Diskless transfer ring buffer size. */
+    long long repl_diskless_sync_max_rate; /* Diskless transfer bytes/sec limit. */
+    int repl_diskless_sync_slow_timeout; /* Drop replicas throttling the
+                                            others for this many seconds. */
+    int repl_diff_sync;             /* Resync only the slots that differ. */
     /* Replication (slave) */
+    int repl_apply_thread;          /* Parse the master stream in a thread. */
     char *masteruser;               /* AUTH with this user and masterauth with master */
     sds masterauth;                 /* AUTH with this password with master */
     char *masterhost;               /* Hostname of master */
@@ -1516,6 +1706,7 @@ struct redisServer {
     connection *repl_transfer_s;     /* Slave -> Master SYNC connection */
     int repl_transfer_fd;    /* Slave -> Master SYNC temp file descriptor */
     char *repl_transfer_tmpfile; /* Slave-> master SYNC temp file name */
+    int repl_transfer_diff;  /* The RDB only has the slots that differ. */
     time_t repl_transfer_lastio; /* Unix time of the latest read, for timeout */
     int repl_serve_stale_data; /* Serve stale data when link is down? */
     int repl_slave_ro;          /* Slave is read only? */
@@ -1539,12 +1730,26 @@ struct redisServer {
     /* Synchronous replication. */
     list *clients_waiting_acks;         /* Clients waiting in WAIT command. */
     int get_ack_from_slaves;            /* If true we send REPLCONF GETACK. */
+    /* Bounded staleness reads (CLIENT STALENESS), on replicas. */
+    list *clients_waiting_staleness;    /* Reads waiting for fresher data. */
+    mstime_t repl_fresh_time;           /* We had all the writes of the
+                                           master as of this time. */
+    mstime_t repl_getack_request_time;  /* When we asked the master for a
+                                           GETACK, or 0 if none pending. */
+    sds repl_getack_token;              /* Token of the GETACK we asked. */
+    long long repl_getack_seq;          /* Used to generate the tokens. */
+    list *repl_getack_tokens;           /* On masters: GETACK tokens asked by
+                                           the replicas, to send ASAP. */
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Precision of random sampling */
     int maxmemory_eviction_tenacity;/* Aggressiveness of eviction processing */
+    int maxmemory_eviction_candidates; /* Size of the eviction candidates set */
+    int maxmemory_tinylfu_window;   /* TinyLFU window, percentage of keys */
+    int maxmemory_eviction_size_aware; /* Prefer evicting the larger keys */
+    int memory_top_keys;            /* Size of the heavy keys set */
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
     int lfu_decay_time;             /* LFU counter decay factor. */
     long long proto_max_bulk_len;   /* Protocol bulk length maximum size. */
@@ -1574,8 +1779,10 @@ struct redisServer {
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
     size_t hll_sparse_max_bytes;
+    size_t pfcount_cache_max_entries; /* Cached multi-key PFCOUNT results. */
     size_t stream_node_max_bytes;
     long long stream_node_max_entries;
+    int compressed_bitmaps;         /* SETBIT creates roaring bitmaps. */
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
@@ -1643,6 +1850,9 @@ struct redisServer {
     int lazyfree_lazy_server_del;
     int lazyfree_lazy_user_del;
     int lazyfree_lazy_user_flush;
+    int lazyfree_threads;           /* Number of lazy free bio workers. */
+    long long lazyfree_incremental_budget; /* Max microseconds spent per
+                                              incremental free cycle. */
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
@@ -1822,6 +2032,7 @@ void moduleAcquireGIL(void);
 int moduleTryAcquireGIL(void);
 void moduleReleaseGIL(void);
 void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid);
+int moduleHasKeyspaceSubscribers(int type);
 void moduleCallCommandFilters(client *c);
 void ModuleForkDoneHandler(int exitcode, int bysignal);
 int TerminateModuleForkChild(int child_pid, int wait);
@@ -1905,7 +2116,7 @@ void addReplyPushLen(client *c, long length);
 void addReplyHelp(client *c, const char **help);
 void addReplySubcommandSyntaxError(client *c);
 void addReplyLoadedModules(client *c);
-void copyClientOutputBuffer(client *dst, client *src);
+void copyReplicaOutputBuffer(client *dst, client *src);
 void deferredAfterErrorReply(client *c, list *errors);
 size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
@@ -1944,6 +2155,7 @@ int handleClientsWithPendingWritesUsingThreads(void);
 int handleClientsWithPendingReadsUsingThreads(void);
 int stopThreadedIOIfNeeded(void);
 int clientHasPendingReplies(client *c);
+void clientInstallWriteHandler(client *c);
 void unlinkClient(client *c);
 int writeToClient(client *c, int handler_installed);
 void linkClient(client *c);
@@ -2048,6 +2260,10 @@ robj *createHashObject(void);
 robj *createZsetObject(void);
 robj *createZsetZiplistObject(void);
 robj *createStreamObject(void);
+robj *createBitmapObject(void);
+robj *createBitmapObjectFromRoaring(roaring *r);
+int bitmapObjectsExist(void);
+robj *createStringObjectFromBitmap(robj *o);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
 int getPositiveLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -2066,6 +2282,15 @@ int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long long estimateObjectIdleTime(robj *o);
 void trimStringObjectIfNeeded(robj *o);
+void objectSizeTrackStart(objectSizeTracker *t, robj *o);
+void streamSizeTrackStart(objectSizeTracker *t, stream *s);
+void objectSizeTrackAdd(objectSizeTracker *t, long long bytes);
+void objectSizeTrackEnd(objectSizeTracker *t);
+void objectSetTrackedSize(robj *o, long long total);
+void memoryTopKeysUpdate(redisDb *db, robj *key);
+void memoryTopKeysFlush(int dbid);
+void memoryTopKeysSwapDb(int id1, int id2);
+size_t objectGetMemory(robj *o);
 #define sdsEncodedObject(objptr) (objptr->encoding == OBJ_ENCODING_RAW || objptr->encoding == OBJ_ENCODING_EMBSTR)
 
 /* Synchronous I/O with timeout */
@@ -2093,6 +2318,12 @@ int replicationScriptCacheExists(sds sha1);
 void processClientsWaitingReplicas(void);
 void unblockClientWaitingReplicas(client *c);
 int replicationCountAcksByOffset(long long offset);
+mstime_t replicationGetStaleness(void);
+int clientReadBoundSatisfied(client *c);
+void replicationRequestGetack(sds token);
+void blockClientForStaleness(client *c);
+void processClientsWaitingStaleness(void);
+void unblockClientWaitingStaleness(client *c);
 void replicationSendNewlineToMaster(void);
 long long replicationGetSlaveOffset(void);
 char *replicationGetSlaveName(client *c);
@@ -2102,10 +2333,22 @@ void changeReplicationId(void);
 void clearReplicationId2(void);
 void chopReplicationBacklog(void);
 void replicationCacheMasterUsingMyself(void);
-void feedReplicationBacklog(void *ptr, size_t len);
+void feedReplicationBuffer(char *buf, size_t len);
+void freeReplicaReferencedReplBuffer(client *replica);
+void incrementalTrimReplicationBacklog(size_t blocks);
+void trimReplicationBacklogDisk(void);
+void reapReplicationBacklogDiskWrites(void);
+ssize_t writeToReplicaFromDiskBacklog(client *c);
 void showLatestBacklog(void);
+void replicaApplyInit(void);
+void replicaApplyReset(client *master);
+void replicaApplyFeed(client *master);
+void replicaApplyDrain(client *master);
+void replicaApplyParsedCommands(client *master);
+int replicaApplyHasPending(client *master);
 void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 void rdbPipeWriteHandlerConnRemoved(struct connection *conn);
+void rdbPipeCron(void);
 void clearFailoverState(void);
 void updateFailoverStatus(void);
 void abortFailover(const char *err);
@@ -2135,14 +2378,20 @@ void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
-int loadAppendOnlyFile(char *filename);
+int aofRewriteLimited(void);
+int loadAppendOnlyFiles(aofManifest *am);
 void stopAppendOnly(void);
 int startAppendOnly(void);
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
-void aofRewriteBufferReset(void);
-unsigned long aofRewriteBufferSize(void);
-ssize_t aofReadDiffFromParent(void);
 void killAppendOnlyChild(void);
+void aofLoadManifestFromDisk(void);
+void aofGroupCommitInit(void);
+int aofGroupCommitEnabled(void);
+int aofGroupCommitHoldClient(client *c);
+void aofGroupCommitWaitWrites(client *c);
+void aofGroupCommitReleaseAll(void);
+void aofOpenIfNeededOnServerStart(void);
+int aofDelHistoryFiles(void);
 void restartAOFAfterSYNC();
 
 /* Child info */
@@ -2259,6 +2508,7 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
 size_t freeMemoryGetNotCountedMemory();
 int overMaxmemoryAfterAlloc(size_t moremem);
 int processCommand(client *c);
+int processCommandAndResetClient(client *c);
 int processPendingCommandsAndResetClient(client *c);
 void setupSignalHandlers(void);
 void removeSignalHandlers(void);
@@ -2311,6 +2561,7 @@ int setOOMScoreAdj(int process_class);
 void rejectCommandFormat(client *c, const char *fmt, ...);
 void *activeDefragAlloc(void *ptr);
 robj *activeDefragStringOb(robj* ob, long *defragged);
+int activeDefragTargetBins(void);
 
 #define RESTART_SERVER_NONE 0
 #define RESTART_SERVER_GRACEFULLY (1<<0)     /* Do proper shutdown. */
@@ -2358,6 +2609,22 @@ int hashTypeSet(robj *o, sds field, sds value, int flags);
 robj *hashTypeDup(robj *o);
 int hashZiplistValidateIntegrity(unsigned char *zl, size_t size, int deep);
 
+/* HyperLogLog */
+void pfcountCacheInvalidateKey(robj *key);
+void pfcountCacheFlush(void);
+
+/* Slot digests */
+void slotDigestSetEnabled(int enabled);
+void slotDigestTouchKey(robj *key);
+void slotDigestTouchAll(void);
+int slotDigestDirtyCount(void);
+void slotDigestCron(void);
+sds slotDigestDump(void);
+int slotDigestDumpIsValid(sds dump);
+int slotDigestDiff(sds remote, unsigned char *slots);
+long long slotDigestPurge(unsigned char *slots);
+int slotBitmapTest(unsigned char *slots, unsigned int slot);
+
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(client *c, int notify);
 int pubsubUnsubscribeAllPatterns(client *c, int notify);
@@ -2381,6 +2648,8 @@ void initConfigValues();
 
 /* db.c -- Keyspace access API */
 int removeExpire(redisDb *db, robj *key);
+int dbDeleteExpire(redisDb *db, sds key);
+robj *dbUnlinkValue(redisDb *db, robj *key);
 void deleteExpiredKeyAndPropagate(redisDb *db, robj *keyobj);
 void propagateExpire(redisDb *db, robj *key, int lazy);
 int keyIsExpired(redisDb *db, robj *key);
@@ -2395,6 +2664,8 @@ robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags);
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags);
+#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
+size_t objectComputeSize(robj *o, size_t sample_size);
 robj *objectCommandLookup(client *c, robj *key);
 robj *objectCommandLookupOrReply(client *c, robj *key, robj *reply);
 void SentReplyOnKeyMiss(client *c, robj *reply);
@@ -2440,8 +2711,15 @@ void emptyDbAsync(redisDb *db);
 void slotToKeyFlush(int async);
 size_t lazyfreeGetPendingObjectsCount(void);
 size_t lazyfreeGetFreedObjectsCount(void);
+size_t lazyfreeGetPendingMemory(void);
+int freeObjIncrementally(robj *key, robj *obj);
+void incrementalFreeCycle(void);
+size_t incrementalFreePendingObjects(void);
 void freeObjAsync(robj *key, robj *obj);
 void freeSlotsToKeysMapAsync(rax *rt);
+void freeExpireIndexAsync(rax *rt);
+void freeObjectsAsync(robj **objs, size_t count);
+void freeReplicationBacklogRefMemAsync(list *blocks, rax *index);
 void freeSlotsToKeysMap(rax *rt, int async);
 
 
@@ -2468,6 +2746,7 @@ void clusterPropagatePublish(robj *channel, robj *message);
 void migrateCloseTimedoutSockets(void);
 void clusterBeforeSleep(void);
 int clusterSendModuleMessageToTarget(const char *target, uint64_t module_id, uint8_t type, unsigned char *payload, uint32_t len);
+void createDumpPayload(rio *payload, robj *o, robj *key);
 
 /* Sentinel */
 void initSentinelConfig(void);
@@ -2513,6 +2792,12 @@ int clientsCronHandleTimeout(client *c, mstime_t now_ms);
 
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
+void expireIndexAdd(redisDb *db, sds key, long long when);
+void expireIndexDel(redisDb *db, sds key, long long when);
+void expireIndexBuild(redisDb *db);
+void expireIndexRelease(redisDb *db, int async);
+void expireIndexReset(redisDb *db, int async);
+size_t expireIndexMemory(redisDb *db);
 void expireSlaveKeys(void);
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
@@ -2520,6 +2805,13 @@ size_t getSlaveKeyWithExpireCount(void);
 
 /* evict.c -- maxmemory handling and LRU eviction. */
 void evictionPoolAlloc(void);
+void evictionCandidatesRelease(void);
+size_t evictionCandidatesMemory(void);
+void tinylfuRelease(void);
+void tinylfuCron(void);
+size_t tinylfuMemory(void);
+void tinylfuRecordAccess(sds key);
+unsigned long tinylfuFrequency(sds key);
 #define LFU_INIT_VAL 5
 unsigned long LFUGetTimeInMinutes(void);
 uint8_t LFULogIncr(uint8_t value);
@@ -2605,6 +2897,7 @@ void spopCommand(client *c);
 void srandmemberCommand(client *c);
 void sinterCommand(client *c);
 void sinterstoreCommand(client *c);
+void sinterCardCommand(client *c);
 void sunionCommand(client *c);
 void sunionstoreCommand(client *c);
 void sdiffCommand(client *c);
@@ -2719,6 +3012,7 @@ void timeCommand(client *c);
 void bitopCommand(client *c);
 void bitcountCommand(client *c);
 void bitposCommand(client *c);
+void bitopcardCommand(client *c);
 void replconfCommand(client *c);
 void waitCommand(client *c);
 void geoencodeCommand(client *c);
@@ -2733,6 +3027,7 @@ void geoposCommand(client *c);
 void geodistCommand(client *c);
 void geosearchCommand(client *c);
 void geosearchstoreCommand(client *c);
+void geomsearchCommand(client *c);
 void pfselftestCommand(client *c);
 void pfaddCommand(client *c);
 void pfcountCommand(client *c);
@@ -2789,6 +3084,7 @@ void serverLogHexDump(int level, char *descr, void *value, size_t len);
 int memtest_preserving_test(unsigned long *m, size_t bytes, int passes);
 void mixDigest(unsigned char *digest, void *ptr, size_t len);
 void xorDigest(unsigned char *digest, void *ptr, size_t len);
+void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o);
 int populateCommandTableParseFlags(struct redisCommand *c, char *strflags);
 void debugDelay(int usec);
 void killIOThreads(void);
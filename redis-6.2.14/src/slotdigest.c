@@ -0,0 +1,334 @@
+/* slotdigest.c - Per hash slot digests of the dataset, used to resync a
+ * replica sending only the slots that differ from the master.
+ *
+ * Copyright (c) 2021, Redis Labs Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "cluster.h"
+
+/* Every key belongs to one of the CLUSTER_SLOTS hash slots, whether cluster
+ * mode is enabled or not. The digest of a slot is the xor of the digests of
+ * all its keys in all the DBs, every key digest being computed like DEBUG
+ * DIGEST does, with the DB id mixed in. Two instances with the same digest
+ * for a slot hold the same keys and values in that slot.
+ *
+ * Hashing values is too expensive to be done on every write, so writes just
+ * flag the slot of the key as dirty (slotDigestTouchKey(), called by the
+ * keyspace hooks of db.c), and the digests of the dirty slots are computed
+ * again incrementally by slotDigestCron(), that scans the keyspace a few
+ * keys at a time. Only the values of the keys in dirty slots are hashed:
+ * the other slots keep the digest computed the last time. A slot touched
+ * while the scan is in progress stays dirty, and is computed again by the
+ * next scan.
+ *
+ * The slots still dirty when the digests are dumped get a digest that
+ * matches no dataset, so that the master sends them again: the handshake
+ * never waits for the keyspace to be hashed.
+ *
+ * Unlike DEBUG DIGEST, the digest also covers the expire time of the keys,
+ * rounded to SLOT_DIGEST_EXPIRE_RES milliseconds: EXPIRE is propagated as a
+ * relative time, so the master and its replicas don't have the very same
+ * unix time for the same key. Keys whose expire times fall in different
+ * buckets just make their slot sent again. */
+
+#define SLOT_DIGEST_LEN 20
+#define SLOT_DIGEST_EXPIRE_RES 10000 /* Expire times granularity, in ms. */
+#define SLOT_DIGEST_CRON_USEC 1000   /* Time spent by every cron call. */
+
+typedef struct slotDigests {
+    unsigned char digest[CLUSTER_SLOTS][SLOT_DIGEST_LEN];
+    unsigned char dirty[CLUSTER_SLOTS/8]; /* Bitmap of the slots to update. */
+    int dirty_count;                      /* Number of bits set in 'dirty'. */
+
+    /* Scan in progress, see slotDigestCron(). */
+    int scan_active;
+    int scan_db;                          /* DB being scanned. */
+    unsigned long scan_cursor;            /* dictScan() cursor in scan_db. */
+    unsigned long scan_maxsize;           /* Biggest table seen in scan_db. */
+    unsigned char scan_slots[CLUSTER_SLOTS/8]; /* Slots computed by the scan,
+                                                  not touched since it began. */
+    unsigned char scan_digest[CLUSTER_SLOTS][SLOT_DIGEST_LEN];
+} slotDigests;
+
+static slotDigests *SlotDigests = NULL;
+
+/* Start or stop tracking the slot digests, according to the
+ * repl-diff-sync config. Digests start all dirty. */
+void slotDigestSetEnabled(int enabled) {
+    if (enabled && !SlotDigests) {
+        SlotDigests = zcalloc(sizeof(*SlotDigests));
+        slotDigestTouchAll();
+    } else if (!enabled && SlotDigests) {
+        zfree(SlotDigests);
+        SlotDigests = NULL;
+    }
+}
+
+int slotBitmapTest(unsigned char *slots, unsigned int slot) {
+    return (slots[slot>>3] & (1<<(slot&7))) != 0;
+}
+
+static void slotBitmapSet(unsigned char *slots, unsigned int slot) {
+    slots[slot>>3] |= 1<<(slot&7);
+}
+
+static void slotBitmapClear(unsigned char *slots, unsigned int slot) {
+    slots[slot>>3] &= ~(1<<(slot&7));
+}
+
+/* The key was added, modified or removed: its slot digest must be computed
+ * again. */
+void slotDigestTouchKey(robj *key) {
+    if (!SlotDigests) return;
+    unsigned int slot = keyHashSlot(key->ptr,sdslen(key->ptr));
+    /* The scan in progress may have hashed the old value already. */
+    slotBitmapClear(SlotDigests->scan_slots,slot);
+    if (slotBitmapTest(SlotDigests->dirty,slot)) return;
+    slotBitmapSet(SlotDigests->dirty,slot);
+    SlotDigests->dirty_count++;
+}
+
+/* Same as slotDigestTouchKey() for all the slots, used when whole DBs are
+ * flushed, swapped or loaded. The scan in progress, if any, is dropped. */
+void slotDigestTouchAll(void) {
+    if (!SlotDigests) return;
+    memset(SlotDigests->dirty,0xff,sizeof(SlotDigests->dirty));
+    SlotDigests->dirty_count = CLUSTER_SLOTS;
+    SlotDigests->scan_active = 0;
+}
+
+/* Return the number of slots whose digest is not computed yet. */
+int slotDigestDirtyCount(void) {
+    return SlotDigests ? SlotDigests->dirty_count : 0;
+}
+
+/* Mix the digest of a key into the digest of its slot. */
+static void slotDigestMixKey(redisDb *db, sds key, robj *val,
+                             unsigned char *slotdigest)
+{
+    unsigned char digest[SLOT_DIGEST_LEN];
+    uint32_t aux = htonl(db->id);
+    robj keyobj;
+
+    initStaticStringObject(keyobj,key);
+    memset(digest,0,SLOT_DIGEST_LEN);
+    mixDigest(digest,&aux,sizeof(aux));
+    mixDigest(digest,key,sdslen(key));
+    xorObjectDigest(db,&keyobj,digest,val);
+
+    long long expire = getExpire(db,&keyobj);
+    if (expire != -1) {
+        char buf[LONG_STR_SIZE];
+        int len = ll2string(buf,sizeof(buf),expire/SLOT_DIGEST_EXPIRE_RES);
+        mixDigest(digest,buf,len);
+    }
+    xorDigest(slotdigest,digest,SLOT_DIGEST_LEN);
+}
+
+/* Compute again the digests of the dirty slots, in a single pass. Only
+ * used by the child saving the RDB of a diff resync, the server uses
+ * slotDigestCron(). */
+static void slotDigestUpdate(void) {
+    slotDigests *sd = SlotDigests;
+    int all = sd->dirty_count == CLUSTER_SLOTS;
+
+    sd->scan_active = 0;
+    if (sd->dirty_count == 0) return;
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        if (all || slotBitmapTest(sd->dirty,slot))
+            memset(sd->digest[slot],0,SLOT_DIGEST_LEN);
+    }
+
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        dictIterator *di;
+        dictEntry *de;
+
+        if (dictSize(db->dict) == 0) continue;
+        di = dictGetSafeIterator(db->dict);
+        while((de = dictNext(di)) != NULL) {
+            sds key = dictGetKey(de);
+            unsigned int slot = keyHashSlot(key,sdslen(key));
+
+            if (!all && !slotBitmapTest(sd->dirty,slot)) continue;
+            slotDigestMixKey(db,key,dictGetVal(de),sd->digest[slot]);
+        }
+        dictReleaseIterator(di);
+    }
+    memset(sd->dirty,0,sizeof(sd->dirty));
+    sd->dirty_count = 0;
+}
+
+static void slotDigestScanCallback(void *privdata, const dictEntry *de) {
+    redisDb *db = privdata;
+    sds key = dictGetKey(de);
+    unsigned int slot = keyHashSlot(key,sdslen(key));
+
+    if (!slotBitmapTest(SlotDigests->scan_slots,slot)) return;
+    slotDigestMixKey(db,key,dictGetVal(de),SlotDigests->scan_digest[slot]);
+}
+
+/* Start scanning the keyspace to compute the digests of the dirty slots. */
+static void slotDigestScanStart(void) {
+    slotDigests *sd = SlotDigests;
+
+    memcpy(sd->scan_slots,sd->dirty,sizeof(sd->dirty));
+    memset(sd->scan_digest,0,sizeof(sd->scan_digest));
+    sd->scan_db = 0;
+    sd->scan_cursor = 0;
+    sd->scan_maxsize = 0;
+    sd->scan_active = 1;
+}
+
+/* The scan is over: the slots not touched since it began are up to date. */
+static void slotDigestScanDone(void) {
+    slotDigests *sd = SlotDigests;
+
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        if (!slotBitmapTest(sd->scan_slots,slot)) continue;
+        memcpy(sd->digest[slot],sd->scan_digest[slot],SLOT_DIGEST_LEN);
+        slotBitmapClear(sd->dirty,slot);
+        sd->dirty_count--;
+    }
+    sd->scan_active = 0;
+}
+
+/* Called by serverCron() to compute the digests of the dirty slots a bit
+ * at a time, for SLOT_DIGEST_CRON_USEC at most.
+ *
+ * dictScan() may return a key twice if the table shrinks between two
+ * calls, and that would cancel the key from the digest of its slot: in
+ * that case the scan starts again. */
+void slotDigestCron(void) {
+    slotDigests *sd = SlotDigests;
+    long long start = ustime();
+    int iterations = 0;
+
+    if (!sd || sd->dirty_count == 0) return;
+    if (!sd->scan_active) slotDigestScanStart();
+
+    while (sd->scan_db < server.dbnum) {
+        redisDb *db = server.db+sd->scan_db;
+        dict *d = db->dict;
+        unsigned long minsize = d->ht[0].size, maxsize = d->ht[0].size;
+
+        if (dictIsRehashing(d)) {
+            if (d->ht[1].size < minsize) minsize = d->ht[1].size;
+            if (d->ht[1].size > maxsize) maxsize = d->ht[1].size;
+        }
+        if (minsize < sd->scan_maxsize) {
+            slotDigestScanStart();
+            continue;
+        }
+        if (maxsize > sd->scan_maxsize) sd->scan_maxsize = maxsize;
+
+        sd->scan_cursor = dictScan(d,sd->scan_cursor,
+                                   slotDigestScanCallback,NULL,db);
+        if (sd->scan_cursor == 0) {
+            sd->scan_db++;
+            sd->scan_maxsize = 0;
+        }
+        if ((++iterations & 15) == 0 &&
+            ustime()-start > SLOT_DIGEST_CRON_USEC) return;
+    }
+    slotDigestScanDone();
+}
+
+/* Return the digests of all the slots, in the format sent by a replica to
+ * its master with REPLCONF SLOT-DIGESTS: CLUSTER_SLOTS digests of
+ * SLOT_DIGEST_LEN bytes each, in slot order. The slots still dirty get a
+ * digest that doesn't match any dataset, so that they are sent again. */
+sds slotDigestDump(void) {
+    slotDigests *sd = SlotDigests;
+
+    serverAssert(sd != NULL);
+    sds dump = sdsnewlen(sd->digest,sizeof(sd->digest));
+    if (sd->dirty_count == 0) return dump;
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        if (slotBitmapTest(sd->dirty,slot))
+            memset(dump+slot*SLOT_DIGEST_LEN,0xff,SLOT_DIGEST_LEN);
+    }
+    return dump;
+}
+
+/* Return true if 'dump' has the format of slotDigestDump(). */
+int slotDigestDumpIsValid(sds dump) {
+    return sdslen(dump) == sizeof(SlotDigests->digest);
+}
+
+/* Compare the digests dumped by slotDigestDump() on another instance with
+ * ours, setting in the 'slots' bitmap (CLUSTER_SLOTS/8 bytes) the slots
+ * that differ. Returns the number of such slots, or -1 if 'remote' is not
+ * a valid dump. */
+int slotDigestDiff(sds remote, unsigned char *slots) {
+    int count = 0;
+
+    if (!slotDigestDumpIsValid(remote)) return -1;
+    slotDigestUpdate();
+    memset(slots,0,CLUSTER_SLOTS/8);
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        if (memcmp(SlotDigests->digest[slot],remote+slot*SLOT_DIGEST_LEN,
+                   SLOT_DIGEST_LEN))
+        {
+            slotBitmapSet(slots,slot);
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Delete the keys of all the DBs that hash to the slots set in the
+ * 'slots' bitmap. Used by replicas before loading the keys of those slots
+ * from the master during a diff resync. Returns the number of keys
+ * removed. */
+long long slotDigestPurge(unsigned char *slots) {
+    long long removed = 0;
+
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        dictIterator *di;
+        dictEntry *de;
+
+        if (dictSize(db->dict) == 0) continue;
+        di = dictGetSafeIterator(db->dict);
+        while((de = dictNext(di)) != NULL) {
+            sds key = dictGetKey(de);
+            robj *keyobj;
+
+            if (!slotBitmapTest(slots,keyHashSlot(key,sdslen(key)))) continue;
+            keyobj = createStringObject(key,sdslen(key));
+            dbDelete(db,keyobj);
+            signalModifiedKey(NULL,db,keyobj);
+            decrRefCount(keyobj);
+            removed++;
+        }
+        dictReleaseIterator(di);
+    }
+    return removed;
+}
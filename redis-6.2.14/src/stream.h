@@ -18,6 +18,8 @@ typedef struct stream {
     uint64_t length;        /* Number of elements inside this stream. */
     streamID last_id;       /* Zero if there are yet no items. */
     rax *cgroups;           /* Consumer groups dictionary: name -> streamCG */
+    size_t tracked_size;    /* Memory used by the stream nodes and groups,
+                               see objectSizeTrackEnd(). */
 } stream;
 
 /* We define an iterator to iterate stream items in an abstract way, without
@@ -206,7 +206,14 @@ int hashTypeExists(robj *o, sds field) {
 #define HASH_SET_COPY 0
 int hashTypeSet(robj *o, sds field, sds value, int flags) {
     int update = 0;
-
+    objectSizeTracker tracker;
+
+    objectSizeTrackStart(&tracker,o);
+    /* The strings we take were allocated before we started tracking. */
+    if (flags & HASH_SET_TAKE_FIELD)
+        objectSizeTrackAdd(&tracker,sdsZmallocSize(field));
+    if (flags & HASH_SET_TAKE_VALUE)
+        objectSizeTrackAdd(&tracker,sdsZmallocSize(value));
     if (o->encoding == OBJ_ENCODING_ZIPLIST) {
         unsigned char *zl, *fptr, *vptr;
 
@@ -273,6 +280,7 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
      * want this function to be responsible. */
     if (flags & HASH_SET_TAKE_FIELD && field) sdsfree(field);
     if (flags & HASH_SET_TAKE_VALUE && value) sdsfree(value);
+    objectSizeTrackEnd(&tracker);
     return update;
 }
 
@@ -280,7 +288,9 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
  * Return 1 on deleted and 0 on not found. */
 int hashTypeDelete(robj *o, sds field) {
     int deleted = 0;
+    objectSizeTracker tracker;
 
+    objectSizeTrackStart(&tracker,o);
     if (o->encoding == OBJ_ENCODING_ZIPLIST) {
         unsigned char *zl, *fptr;
 
@@ -306,6 +316,7 @@ int hashTypeDelete(robj *o, sds field) {
     } else {
         serverPanic("Unknown hash encoding");
     }
+    objectSizeTrackEnd(&tracker);
     return deleted;
 }
 
@@ -542,6 +553,7 @@ robj *hashTypeDup(robj *o) {
             dictAdd(d,newfield,newvalue);
         }
         hashTypeReleaseIterator(hi);
+        d->tracked_size = ((dict*)o->ptr)->tracked_size;
 
         hobj = createObject(OBJ_HASH, d);
         hobj->encoding = OBJ_ENCODING_HT;
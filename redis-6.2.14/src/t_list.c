@@ -41,6 +41,9 @@
  * There is no need for the caller to increment the refcount of 'value' as
  * the function takes care of it if needed. */
 void listTypePush(robj *subject, robj *value, int where) {
+    objectSizeTracker tracker;
+
+    objectSizeTrackStart(&tracker,subject);
     if (subject->encoding == OBJ_ENCODING_QUICKLIST) {
         int pos = (where == LIST_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
         if (value->encoding == OBJ_ENCODING_INT) {
@@ -53,6 +56,7 @@ void listTypePush(robj *subject, robj *value, int where) {
     } else {
         serverPanic("Unknown list encoding");
     }
+    objectSizeTrackEnd(&tracker);
 }
 
 void *listPopSaver(unsigned char *data, unsigned int sz) {
@@ -62,17 +66,27 @@ void *listPopSaver(unsigned char *data, unsigned int sz) {
 robj *listTypePop(robj *subject, int where) {
     long long vlong;
     robj *value = NULL;
+    objectSizeTracker tracker;
 
     int ql_where = where == LIST_HEAD ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+    objectSizeTrackStart(&tracker,subject);
     if (subject->encoding == OBJ_ENCODING_QUICKLIST) {
         if (quicklistPopCustom(subject->ptr, ql_where, (unsigned char **)&value,
                                NULL, &vlong, listPopSaver)) {
-            if (!value)
+            /* The popped value is owned by the caller, not by the list. */
+            if (value) {
+                long long vsize = zslab_malloc_size(value);
+                if (value->encoding == OBJ_ENCODING_RAW)
+                    vsize += sdsZmallocSize(value->ptr);
+                objectSizeTrackAdd(&tracker,-vsize);
+            } else {
                 value = createStringObjectFromLongLong(vlong);
+            }
         }
     } else {
         serverPanic("Unknown list encoding");
     }
+    objectSizeTrackEnd(&tracker);
     return value;
 }
 
@@ -144,6 +158,9 @@ robj *listTypeGet(listTypeEntry *entry) {
 }
 
 void listTypeInsert(listTypeEntry *entry, robj *value, int where) {
+    objectSizeTracker tracker;
+
+    objectSizeTrackStart(&tracker,entry->li->subject);
     if (entry->li->encoding == OBJ_ENCODING_QUICKLIST) {
         value = getDecodedObject(value);
         sds str = value->ptr;
@@ -159,6 +176,7 @@ void listTypeInsert(listTypeEntry *entry, robj *value, int where) {
     } else {
         serverPanic("Unknown list encoding");
     }
+    objectSizeTrackEnd(&tracker);
 }
 
 /* Compare the given object with the entry at the current position. */
@@ -173,11 +191,15 @@ int listTypeEqual(listTypeEntry *entry, robj *o) {
 
 /* Delete the element pointed to. */
 void listTypeDelete(listTypeIterator *iter, listTypeEntry *entry) {
+    objectSizeTracker tracker;
+
+    objectSizeTrackStart(&tracker,iter->subject);
     if (entry->li->encoding == OBJ_ENCODING_QUICKLIST) {
         quicklistDelEntry(iter->iter, &entry->entry);
     } else {
         serverPanic("Unknown list encoding");
     }
+    objectSizeTrackEnd(&tracker);
 }
 
 /* Create a quicklist from a single ziplist */
@@ -378,8 +400,12 @@ void lsetCommand(client *c) {
 
     if (o->encoding == OBJ_ENCODING_QUICKLIST) {
         quicklist *ql = o->ptr;
+        objectSizeTracker tracker;
+
+        objectSizeTrackStart(&tracker,o);
         int replaced = quicklistReplaceAtIndex(ql, index,
                                                value->ptr, sdslen(value->ptr));
+        objectSizeTrackEnd(&tracker);
         if (!replaced) {
             addReplyErrorObject(c,shared.outofrangeerr);
         } else {
@@ -498,7 +524,10 @@ void popGenericCommand(client *c, int where) {
         int reverse = (where == LIST_HEAD) ? 0 : 1;
 
         addListRangeReply(c,o,rangestart,rangeend,reverse);
+        objectSizeTracker tracker;
+        objectSizeTrackStart(&tracker,o);
         quicklistDelRange(o->ptr,rangestart,rangelen);
+        objectSizeTrackEnd(&tracker);
         listElementsRemoved(c,c->argv[1],where,o,rangelen);
     }
 }
@@ -558,8 +587,12 @@ void ltrimCommand(client *c) {
 
     /* Remove list elements to perform the trim */
     if (o->encoding == OBJ_ENCODING_QUICKLIST) {
+        objectSizeTracker tracker;
+
+        objectSizeTrackStart(&tracker,o);
         quicklistDelRange(o->ptr,0,ltrim);
         quicklistDelRange(o->ptr,-rtrim,rtrim);
+        objectSizeTrackEnd(&tracker);
     } else {
         serverPanic("Unknown list encoding");
     }
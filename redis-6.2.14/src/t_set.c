@@ -51,13 +51,17 @@ robj *setTypeCreate(sds value) {
  * returned, otherwise the new element is added and 1 is returned. */
 int setTypeAdd(robj *subject, sds value) {
     long long llval;
+    int added = 0;
+    objectSizeTracker tracker;
+
+    objectSizeTrackStart(&tracker,subject);
     if (subject->encoding == OBJ_ENCODING_HT) {
         dict *ht = subject->ptr;
         dictEntry *de = dictAddRaw(ht,value,NULL);
         if (de) {
             dictSetKey(ht,de,sdsdup(value));
             dictSetVal(ht,de,NULL);
-            return 1;
+            added = 1;
         }
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
@@ -71,7 +75,7 @@ int setTypeAdd(robj *subject, sds value) {
                 if (max_entries >= 1<<30) max_entries = 1<<30;
                 if (intsetLen(subject->ptr) > max_entries)
                     setTypeConvert(subject,OBJ_ENCODING_HT);
-                return 1;
+                added = 1;
             }
         } else {
             /* Failed to get integer from object, convert to regular set. */
@@ -80,31 +84,37 @@ int setTypeAdd(robj *subject, sds value) {
             /* The set *was* an intset and this value is not integer
              * encodable, so dictAdd should always work. */
             serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
-            return 1;
+            added = 1;
         }
     } else {
         serverPanic("Unknown set encoding");
     }
-    return 0;
+    objectSizeTrackEnd(&tracker);
+    return added;
 }
 
 int setTypeRemove(robj *setobj, sds value) {
     long long llval;
+    int removed = 0;
+    objectSizeTracker tracker;
+
+    objectSizeTrackStart(&tracker,setobj);
     if (setobj->encoding == OBJ_ENCODING_HT) {
         if (dictDelete(setobj->ptr,value) == DICT_OK) {
             if (htNeedsResize(setobj->ptr)) dictResize(setobj->ptr);
-            return 1;
+            removed = 1;
         }
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             int success;
             setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
-            if (success) return 1;
+            if (success) removed = 1;
         }
     } else {
         serverPanic("Unknown set encoding");
     }
-    return 0;
+    objectSizeTrackEnd(&tracker);
+    return removed;
 }
 
 int setTypeIsMember(robj *subject, sds value) {
@@ -854,8 +864,13 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return 0;
 }
 
+/* SINTER, SINTERSTORE and SINTERCARD implementation. When 'cardinality_only'
+ * is true only the number of elements of the intersection is replied, and
+ * the computation stops as soon as 'limit' elements are found (0 means no
+ * limit). */
 void sinterGenericCommand(client *c, robj **setkeys,
-                          unsigned long setnum, robj *dstkey) {
+                          unsigned long setnum, robj *dstkey,
+                          int cardinality_only, unsigned long limit) {
     robj **sets = zmalloc(sizeof(robj*)*setnum);
     setTypeIterator *si;
     robj *dstset = NULL;
@@ -886,7 +901,9 @@ void sinterGenericCommand(client *c, robj **setkeys,
      * Return ASAP if there is an empty set. */
     if (empty > 0) {
         zfree(sets);
-        if (dstkey) {
+        if (cardinality_only) {
+            addReply(c,shared.czero);
+        } else if (dstkey) {
             if (dbDelete(c->db,dstkey)) {
                 signalModifiedKey(c,c->db,dstkey);
                 notifyKeyspaceEvent(NOTIFY_GENERIC,"del",dstkey,c->db->id);
@@ -908,12 +925,46 @@ void sinterGenericCommand(client *c, robj **setkeys,
      * the intersection set size, so we use a trick, append an empty object
      * to the output list and save the pointer to later modify it with the
      * right length */
-    if (!dstkey) {
-        replylen = addReplyDeferredLen(c);
-    } else {
+    if (dstkey) {
         /* If we have a target key where to store the resulting set
          * create this key with an empty set inside */
         dstset = createIntsetObject();
+    } else if (!cardinality_only) {
+        replylen = addReplyDeferredLen(c);
+    }
+
+    /* When all the sets are intsets, walk the smallest set in order and
+     * gallop forward in the other sets, that are sorted as well, instead
+     * of looking up every element from scratch. */
+    for (j = 0; j < setnum; j++)
+        if (sets[j]->encoding != OBJ_ENCODING_INTSET) break;
+    if (j == setnum) {
+        uint32_t *cursors = zcalloc(sizeof(uint32_t)*setnum), pos = 0;
+
+        while (intsetGet(sets[0]->ptr,pos++,&intobj)) {
+            for (j = 1; j < setnum; j++) {
+                if (sets[j] == sets[0]) continue;
+                if (!intsetFindFrom(sets[j]->ptr,intobj,&cursors[j])) break;
+            }
+            if (j < setnum) {
+                /* No more elements in common if the set is exhausted. */
+                if (cursors[j] == intsetLen(sets[j]->ptr)) break;
+                continue;
+            }
+            if (cardinality_only) {
+                cardinality++;
+                if (limit && cardinality >= limit) break;
+            } else if (!dstkey) {
+                addReplyBulkLongLong(c,intobj);
+                cardinality++;
+            } else {
+                elesds = sdsfromlonglong(intobj);
+                setTypeAdd(dstset,elesds);
+                sdsfree(elesds);
+            }
+        }
+        zfree(cursors);
+        goto done;
     }
 
     /* Iterate all the elements of the first (smallest) set, and test
@@ -949,7 +1000,10 @@ void sinterGenericCommand(client *c, robj **setkeys,
 
         /* Only take action when all sets contain the member */
         if (j == setnum) {
-            if (!dstkey) {
+            if (cardinality_only) {
+                cardinality++;
+                if (limit && cardinality >= limit) break;
+            } else if (!dstkey) {
                 if (encoding == OBJ_ENCODING_HT)
                     addReplyBulkCBuffer(c,elesds,sdslen(elesds));
                 else
@@ -968,7 +1022,10 @@ void sinterGenericCommand(client *c, robj **setkeys,
     }
     setTypeReleaseIterator(si);
 
-    if (dstkey) {
+done:
+    if (cardinality_only) {
+        addReplyLongLong(c,cardinality);
+    } else if (dstkey) {
         /* Store the resulting set into the target, if the intersection
          * is not an empty set. */
         if (setTypeSize(dstset) > 0) {
@@ -994,18 +1051,146 @@ void sinterGenericCommand(client *c, robj **setkeys,
 
 /* SINTER key [key ...] */
 void sinterCommand(client *c) {
-    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL);
+    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL,0,0);
+}
+
+/* SINTERCARD numkeys key [key ...] [LIMIT limit] */
+void sinterCardCommand(client *c) {
+    long j;
+    long numkeys = 0; /* Number of keys. */
+    long limit = 0;   /* 0 means no limit. */
+
+    if (getRangeLongFromObjectOrReply(c,c->argv[1],1,LONG_MAX,
+        &numkeys,"numkeys should be greater than 0") != C_OK)
+        return;
+    if (numkeys > (c->argc - 2)) {
+        addReplyError(c,"Number of keys can't be greater than number of args");
+        return;
+    }
+
+    for (j = 2 + numkeys; j < c->argc; j++) {
+        char *opt = c->argv[j]->ptr;
+        int moreargs = (c->argc - 1) - j;
+
+        if (!strcasecmp(opt,"LIMIT") && moreargs) {
+            j++;
+            if (getPositiveLongFromObjectOrReply(c,c->argv[j],&limit,
+                "LIMIT can't be negative") != C_OK)
+                return;
+        } else {
+            addReplyErrorObject(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    sinterGenericCommand(c,c->argv+2,numkeys,NULL,1,limit);
 }
 
 /* SINTERSTORE destination key [key ...] */
 void sinterstoreCommand(client *c) {
-    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
+    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1],0,0);
 }
 
 #define SET_OP_UNION 0
 #define SET_OP_DIFF 1
 #define SET_OP_INTER 2
 
+/* SUNION replies are streamed without building a temporary set when all
+ * the sets are intsets, or when there are at most this number of sets. */
+#define SET_UNION_STREAM_MAX_SETS 4
+
+/* Cursor into an intset for the k-way merge of sunionStreamReply(). */
+typedef struct intsetCursor {
+    int64_t val;        /* Element at 'pos'. */
+    uint32_t pos;       /* Position in the intset. */
+    intset *is;
+} intsetCursor;
+
+/* Restore the min-heap property of the 'len' cursors of 'heap' ordered by
+ * value, moving down the cursor at index 'j'. */
+static void intsetCursorHeapify(intsetCursor *heap, int len, int j) {
+    while (1) {
+        int min = j, l = j*2+1, r = j*2+2;
+
+        if (l < len && heap[l].val < heap[min].val) min = l;
+        if (r < len && heap[r].val < heap[min].val) min = r;
+        if (min == j) return;
+        intsetCursor tmp = heap[j];
+        heap[j] = heap[min];
+        heap[min] = tmp;
+        j = min;
+    }
+}
+
+/* Reply with the union of the sets without materializing it. When all the
+ * sets are intsets, that are sorted, a k-way merge using a min-heap of
+ * cursors emits every element once in ascending order, in O(N*log(M))
+ * where N is the total number of elements and M the number of sets.
+ * Otherwise every element of a set is emitted unless it is a member of one
+ * of the previous sets, which trades a membership check per previous set
+ * with the insertion into a temporary set: so this is only used with few
+ * sets. 'sets' may contain NULLs for non existing keys. */
+static void sunionStreamReply(client *c, robj **sets, int setnum) {
+    void *replylen = addReplyDeferredLen(c);
+    unsigned long cardinality = 0;
+    setTypeIterator *si;
+    int j, i;
+
+    for (j = 0; j < setnum; j++)
+        if (sets[j] && sets[j]->encoding != OBJ_ENCODING_INTSET) break;
+
+    if (j == setnum) {
+        intsetCursor *heap = zmalloc(sizeof(intsetCursor)*setnum);
+        int len = 0;
+
+        for (j = 0; j < setnum; j++) {
+            if (sets[j] == NULL) continue;
+            heap[len].is = sets[j]->ptr;
+            heap[len].pos = 0;
+            if (intsetGet(heap[len].is,0,&heap[len].val)) len++;
+        }
+        for (j = len/2-1; j >= 0; j--) intsetCursorHeapify(heap,len,j);
+
+        while (len) {
+            int64_t min = heap[0].val;
+
+            addReplyBulkLongLong(c,min);
+            cardinality++;
+            /* Advance all the cursors at this element. */
+            while (len && heap[0].val == min) {
+                heap[0].pos++;
+                if (!intsetGet(heap[0].is,heap[0].pos,&heap[0].val))
+                    heap[0] = heap[--len];
+                intsetCursorHeapify(heap,len,0);
+            }
+        }
+        zfree(heap);
+    } else {
+        for (j = 0; j < setnum; j++) {
+            sds ele;
+
+            if (!sets[j]) continue; /* non existing keys are like empty sets */
+            /* Skip sets already emitted. */
+            for (i = 0; i < j; i++) if (sets[i] == sets[j]) break;
+            if (i < j) continue;
+
+            si = setTypeInitIterator(sets[j]);
+            while((ele = setTypeNextObject(si)) != NULL) {
+                for (i = 0; i < j; i++) {
+                    if (sets[i] && setTypeIsMember(sets[i],ele)) break;
+                }
+                if (i == j) {
+                    addReplyBulkCBuffer(c,ele,sdslen(ele));
+                    cardinality++;
+                }
+                sdsfree(ele);
+            }
+            setTypeReleaseIterator(si);
+        }
+    }
+    setDeferredSetLen(c,replylen,cardinality);
+}
+
 void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
                               robj *dstkey, int op) {
     robj **sets = zmalloc(sizeof(robj*)*setnum);
@@ -1063,6 +1248,17 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
         }
     }
 
+    /* SUNION can reply while merging the sets, see sunionStreamReply(). */
+    if (op == SET_OP_UNION && !dstkey) {
+        for (j = 0; j < setnum; j++)
+            if (sets[j] && sets[j]->encoding != OBJ_ENCODING_INTSET) break;
+        if (j == setnum || setnum <= SET_UNION_STREAM_MAX_SETS) {
+            sunionStreamReply(c,sets,setnum);
+            zfree(sets);
+            return;
+        }
+    }
+
     /* We need a temp set object to store our union. If the dstkey
      * is not NULL (that is, we are inside an SUNIONSTORE operation) then
      * this set object will be the resulting object to set into the target key*/
@@ -71,6 +71,7 @@ stream *streamNew(void) {
     s->last_id.ms = 0;
     s->last_id.seq = 0;
     s->cgroups = NULL; /* Created on demand to save memory when not used. */
+    s->tracked_size = 0;
     return s;
 }
 
@@ -444,7 +445,7 @@ void streamGetEdgeID(stream *s, int first, streamID *edge_id)
  *    current top ID is greater or equal. errno will be set to EDOM.
  * 2. If a size of a single element or the sum of the elements is too big to
  *    be stored into the stream. errno will be set to ERANGE. */
-int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_id, streamID *use_id) {
+static int streamAppendItemUntracked(stream *s, robj **argv, int64_t numfields, streamID *added_id, streamID *use_id) {
 
     /* Generate the new entry ID. */
     streamID id;
@@ -669,6 +670,17 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     return C_OK;
 }
 
+/* Append an entry to the stream, see streamAppendItemUntracked(), updating
+ * the tracked size of the stream. */
+int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_id, streamID *use_id) {
+    objectSizeTracker tracker;
+
+    streamSizeTrackStart(&tracker,s);
+    int retval = streamAppendItemUntracked(s,argv,numfields,added_id,use_id);
+    objectSizeTrackEnd(&tracker);
+    return retval;
+}
+
 typedef struct {
     /* XADD options */
     streamID id; /* User-provided ID, for XADD only. */
@@ -715,7 +727,7 @@ typedef struct {
  * that should be trimmed, there is a chance we will still have entries with
  * IDs < 'id' (or number of elements >= maxlen in case of MAXLEN).
  */
-int64_t streamTrim(stream *s, streamAddTrimArgs *args) {
+static int64_t streamTrimUntracked(stream *s, streamAddTrimArgs *args) {
     size_t maxlen = args->maxlen;
     streamID *id = &args->minid;
     int approx = args->approx_trim;
@@ -868,6 +880,17 @@ int64_t streamTrim(stream *s, streamAddTrimArgs *args) {
     return deleted;
 }
 
+/* Trim the stream, see streamTrimUntracked(), updating the tracked size of
+ * the stream. */
+int64_t streamTrim(stream *s, streamAddTrimArgs *args) {
+    objectSizeTracker tracker;
+
+    streamSizeTrackStart(&tracker,s);
+    int64_t deleted = streamTrimUntracked(s,args);
+    objectSizeTrackEnd(&tracker);
+    return deleted;
+}
+
 /* Trims a stream by length. Returns the number of deleted items. */
 int64_t streamTrimByLength(stream *s, long long maxlen, int approx) {
     streamAddTrimArgs args = {
@@ -1325,6 +1348,8 @@ void streamIteratorStop(streamIterator *si) {
 int streamDeleteItem(stream *s, streamID *id) {
     int deleted = 0;
     streamIterator si;
+    objectSizeTracker tracker;
+    streamSizeTrackStart(&tracker,s);
     streamIteratorStart(&si,s,id,id,0);
     streamID myid;
     int64_t numfields;
@@ -1333,6 +1358,7 @@ int streamDeleteItem(stream *s, streamID *id) {
         deleted = 1;
     }
     streamIteratorStop(&si);
+    objectSizeTrackEnd(&tracker);
     return deleted;
 }
 
@@ -288,17 +288,29 @@ void psetexCommand(client *c) {
     setGenericCommand(c,OBJ_PX,c->argv[1],c->argv[3],c->argv[2],UNIT_MILLISECONDS,NULL,NULL);
 }
 
+/* Reply with the string value 'o'. Compressed bitmaps are also accepted,
+ * the string commands reading them as the string of their bits. */
+static void addReplyStringValue(client *c, robj *o) {
+    if (o->type == OBJ_BITMAP) {
+        robj *decoded = createStringObjectFromBitmap(o);
+        addReplyBulk(c,decoded);
+        decrRefCount(decoded);
+    } else {
+        addReplyBulk(c,o);
+    }
+}
+
 int getGenericCommand(client *c) {
     robj *o;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.null[c->resp])) == NULL)
         return C_OK;
 
-    if (checkType(c,o,OBJ_STRING)) {
+    if (o->type != OBJ_BITMAP && checkType(c,o,OBJ_STRING)) {
         return C_ERR;
     }
 
-    addReplyBulk(c,o);
+    addReplyStringValue(c,o);
     return C_OK;
 }
 
@@ -340,7 +352,7 @@ void getexCommand(client *c) {
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.null[c->resp])) == NULL)
         return;
 
-    if (checkType(c,o,OBJ_STRING)) {
+    if (o->type != OBJ_BITMAP && checkType(c,o,OBJ_STRING)) {
         return;
     }
 
@@ -367,7 +379,7 @@ void getexCommand(client *c) {
     }
 
     /* We need to do this before we expire the key or delete it */
-    addReplyBulk(c,o);
+    addReplyStringValue(c,o);
 
     /* This command is never propagated as is. It is either propagated as PEXPIRE[AT],DEL,UNLINK or PERSIST.
      * This why it doesn't need special handling in feedAppendOnlyFile to convert relative expire time to absolute one. */
@@ -458,7 +470,7 @@ void setrangeCommand(client *c) {
         size_t olen;
 
         /* Key exists, check type */
-        if (checkType(c,o,OBJ_STRING))
+        if (o->type != OBJ_BITMAP && checkType(c,o,OBJ_STRING))
             return;
 
         /* Return existing string length when setting nothing */
@@ -498,9 +510,13 @@ void getrangeCommand(client *c) {
     if (getLongLongFromObjectOrReply(c,c->argv[3],&end,NULL) != C_OK)
         return;
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptybulk)) == NULL ||
-        checkType(c,o,OBJ_STRING)) return;
+        (o->type != OBJ_BITMAP && checkType(c,o,OBJ_STRING))) return;
 
-    if (o->encoding == OBJ_ENCODING_INT) {
+    if (o->type == OBJ_BITMAP) {
+        /* Only the bytes in the range are converted, see below. */
+        str = NULL;
+        strlen = ((roaring*)o->ptr)->bytes;
+    } else if (o->encoding == OBJ_ENCODING_INT) {
         str = llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
     } else {
@@ -523,6 +539,10 @@ void getrangeCommand(client *c) {
      * nothing can be returned is: start > end. */
     if (start > end || strlen == 0) {
         addReply(c,shared.emptybulk);
+    } else if (str == NULL) {
+        sds range = sdsnewlen(SDS_NOINIT,end-start+1);
+        roaringToBytes(o->ptr,(unsigned char*)range,start,end-start+1);
+        addReplyBulkSds(c,range);
     } else {
         addReplyBulkCBuffer(c,(char*)str+start,end-start+1);
     }
@@ -537,10 +557,10 @@ void mgetCommand(client *c) {
         if (o == NULL) {
             addReplyNull(c);
         } else {
-            if (o->type != OBJ_STRING) {
+            if (o->type != OBJ_STRING && o->type != OBJ_BITMAP) {
                 addReplyNull(c);
             } else {
-                addReplyBulk(c,o);
+                addReplyStringValue(c,o);
             }
         }
     }
@@ -688,7 +708,7 @@ void appendCommand(client *c) {
         totlen = stringObjectLen(c->argv[2]);
     } else {
         /* Key exists, check type */
-        if (checkType(c,o,OBJ_STRING))
+        if (o->type != OBJ_BITMAP && checkType(c,o,OBJ_STRING))
             return;
 
         /* "append" is an argument, so always an sds */
@@ -710,7 +730,7 @@ void appendCommand(client *c) {
 void strlenCommand(client *c) {
     robj *o;
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
-        checkType(c,o,OBJ_STRING)) return;
+        (o->type != OBJ_BITMAP && checkType(c,o,OBJ_STRING))) return;
     addReplyLongLong(c,stringObjectLen(o));
 }
 
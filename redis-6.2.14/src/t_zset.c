@@ -69,8 +69,9 @@ int zslLexValueLteMax(sds value, zlexrangespec *spec);
 /* Create a skiplist node with the specified number of levels.
  * The SDS string 'ele' is referenced by the node after the call. */
 zskiplistNode *zslCreateNode(int level, double score, sds ele) {
-    zskiplistNode *zn =
-        zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
+    size_t size = sizeof(zskiplistNode)+level*sizeof(struct zskiplistLevel);
+    zskiplistNode *zn = level <= ZSLAB_SKIPLIST_LEVELS ?
+        zslab_malloc(ZSLAB_SKIPLIST_NODE+level-1,size) : zmalloc(size);
     zn->score = score;
     zn->ele = ele;
     return zn;
@@ -1322,7 +1323,7 @@ int zsetScore(robj *zobj, sds member, double *score) {
  *
  * The function does not take ownership of the 'ele' SDS string, but copies
  * it if needed. */
-int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, double *newscore) {
+static int zsetAddUntracked(robj *zobj, double score, sds ele, int in_flags, int *out_flags, double *newscore) {
     /* Turn options into simple to check vars. */
     int incr = (in_flags & ZADD_IN_INCR) != 0;
     int nx = (in_flags & ZADD_IN_NX) != 0;
@@ -1454,6 +1455,17 @@ int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, dou
     return 0; /* Never reached. */
 }
 
+/* Add an element to the sorted set, see zsetAddUntracked(), updating the
+ * tracked size of the object. */
+int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, double *newscore) {
+    objectSizeTracker tracker;
+
+    objectSizeTrackStart(&tracker,zobj);
+    int retval = zsetAddUntracked(zobj,score,ele,in_flags,out_flags,newscore);
+    objectSizeTrackEnd(&tracker);
+    return retval;
+}
+
 /* Deletes the element 'ele' from the sorted set encoded as a skiplist+dict,
  * returning 1 if the element existed and was deleted, 0 otherwise (the
  * element was not there). It does not resize the dict after deleting the
@@ -1487,23 +1499,28 @@ static int zsetRemoveFromSkiplist(zset *zs, sds ele) {
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
+    int deleted = 0;
+    objectSizeTracker tracker;
+
+    objectSizeTrackStart(&tracker,zobj);
     if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,NULL)) != NULL) {
             zobj->ptr = zzlDelete(zobj->ptr,eptr);
-            return 1;
+            deleted = 1;
         }
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         if (zsetRemoveFromSkiplist(zs, ele)) {
             if (htNeedsResize(zs->dict)) dictResize(zs->dict);
-            return 1;
+            deleted = 1;
         }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
-    return 0; /* No such element found. */
+    objectSizeTrackEnd(&tracker);
+    return deleted; /* 0 if no such element found. */
 }
 
 /* Given a sorted set object returns the 0-based rank of the object or
@@ -1616,6 +1633,7 @@ robj *zsetDup(robj *o) {
             dictAdd(new_zs->dict,new_ele,&znode->score);
             ln = ln->backward;
         }
+        new_zs->dict->tracked_size = zs->dict->tracked_size;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1961,6 +1979,9 @@ void zremrangeGenericCommand(client *c, zrange_type rangetype) {
         }
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
+        objectSizeTracker tracker;
+
+        objectSizeTrackStart(&tracker,zobj);
         switch(rangetype) {
         case ZRANGE_AUTO:
         case ZRANGE_RANK:
@@ -1974,6 +1995,7 @@ void zremrangeGenericCommand(client *c, zrange_type rangetype) {
             break;
         }
         if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+        objectSizeTrackEnd(&tracker);
         if (dictSize(zs->dict) == 0) {
             dbDelete(c->db,key);
             keyremoved = 1;
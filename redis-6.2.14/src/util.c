@@ -40,9 +40,13 @@
 #include <stdint.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
 
 #include "util.h"
 #include "sha256.h"
+#include "config.h"
 
 /* Glob-style pattern matching. */
 static int stringmatchlen_impl(const char *pattern, int patternLen,
@@ -816,6 +820,79 @@ int pathIsBaseName(char *path) {
     return strchr(path,'/') == NULL && strchr(path,'\\') == NULL;
 }
 
+/* Return 1 if the specified path exists and is a regular file, otherwise
+ * 0 is returned. */
+int fileExist(char *filename) {
+    struct stat statbuf;
+    return stat(filename, &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+}
+
+/* Return 1 if the specified path exists and is a directory. */
+int dirExists(char *dname) {
+    struct stat statbuf;
+    return stat(dname, &statbuf) == 0 && S_ISDIR(statbuf.st_mode);
+}
+
+/* Create the directory 'dname' if it does not exist yet. Returns 0 on
+ * success and -1 on error, with errno set accordingly. */
+int dirCreateIfMissing(char *dname) {
+    if (mkdir(dname, 0755) != 0) {
+        if (errno != EEXIST) return -1;
+        if (!dirExists(dname)) {
+            errno = ENOTDIR;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Return a new sds string with the path 'path/filename'. */
+sds makePath(char *path, char *filename) {
+    return sdscatfmt(sdsempty(), "%s/%s", path, filename);
+}
+
+/* Given the path of a file, fsync the directory containing it, so that
+ * a file that was just created or renamed there can't be lost on a
+ * power failure. Returns 0 on success and -1 on error. */
+int fsyncFileDir(const char *filename) {
+#ifdef _AIX
+    /* AIX is unable to fsync a directory */
+    return 0;
+#endif
+    char temp_filename[PATH_MAX + 1];
+    char *dname;
+    int dir_fd;
+
+    if (strlen(filename) > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    /* In the glibc implementation dirname may modify the param
+     * and return a pointer to it, so we use a copy of the param. */
+    memcpy(temp_filename, filename, strlen(filename) + 1);
+    dname = dirname(temp_filename);
+
+    dir_fd = open(dname, O_RDONLY);
+    if (dir_fd == -1) {
+        /* Some OSs don't allow us to open directories at all, just
+         * ignore the error in that case */
+        if (errno == EISDIR) return 0;
+        return -1;
+    }
+    /* Some OSs don't allow us to fsync directories at all, so we can
+     * ignore those errors. */
+    if (redis_fsync(dir_fd) == -1 && !(errno == EBADF || errno == EINVAL)) {
+        int save_errno = errno;
+        close(dir_fd);
+        errno = save_errno;
+        return -1;
+    }
+
+    close(dir_fd);
+    return 0;
+}
+
 #ifdef REDIS_TEST
 #include <assert.h>
 
@@ -33,11 +33,13 @@
  * zmalloc本质上是对 jemalloc、tcmalloc、libc（ptmalloc2）等内存分配器（算法库）的简单抽象封装，
  * 提供了统一的内存管理函数，屏蔽底层不同分配器的差异。
  */
+#include "fmacros.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 /* This function provide us access to the original libc free(). This is useful
  * for instance to free results obtained by backtrace_symbols(). We need
@@ -82,6 +84,7 @@ void zlibc_free(void *ptr) {
 #define calloc(count,size) tc_calloc(count,size)
 #define realloc(ptr,size) tc_realloc(ptr,size)
 #define free(ptr) tc_free(ptr)
+#define posix_memalign(ptr,align,size) tc_posix_memalign(ptr,align,size)
 #elif defined(USE_JEMALLOC)
 #define malloc(size) je_malloc(size)
 #define calloc(count,size) je_calloc(count,size)
@@ -89,6 +92,7 @@ void zlibc_free(void *ptr) {
 #define free(ptr) je_free(ptr)
 #define mallocx(size,flags) je_mallocx(size,flags)
 #define dallocx(ptr,flags) je_dallocx(ptr,flags)
+#define posix_memalign(ptr,align,size) je_posix_memalign(ptr,align,size)
 #endif
 
 /*
@@ -96,9 +100,21 @@ void zlibc_free(void *ptr) {
  * update_zmalloc_stat_alloc(n)和update_zmalloc_stat_free(n)式
  * 用来增减used_memory的宏。每次malloc和free的相关操作后都要调用一下
  */
-#define update_zmalloc_stat_alloc(__n) atomicIncr(used_memory,(__n))
-#define update_zmalloc_stat_free(__n) atomicDecr(used_memory,(__n))
+#define update_zmalloc_stat_alloc(__n) do { \
+    size_t _n = (__n); \
+    atomicIncr(used_memory,_n); \
+    thread_used_memory += _n; \
+} while(0)
+#define update_zmalloc_stat_free(__n) do { \
+    size_t _n = (__n); \
+    atomicDecr(used_memory,_n); \
+    thread_used_memory -= _n; \
+} while(0)
 static redisAtomic size_t used_memory = 0;
+/* Memory allocated minus memory released by the current thread, used to
+ * measure the memory used by a data structure across an operation, see
+ * zmalloc_thread_used_memory(). */
+static __thread long long thread_used_memory = 0;
 
 static void zmalloc_default_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
@@ -109,6 +125,515 @@ static void zmalloc_default_oom(size_t size) {
 
 static void (*zmalloc_oom_handler)(size_t) = zmalloc_default_oom;
 
+/* ----------------------------------------------------------------------------
+ * Slab allocator
+ *
+ * Small fixed size objects allocated at a very high rate (robj, dictEntry,
+ * skiplist nodes) can be allocated with zslab_malloc() from slabs: pages of
+ * ZSLAB_PAGE_SIZE bytes, aligned to their size, carved into objects of the
+ * same class. This avoids the per allocation overhead of the allocator and
+ * the rounding to its size classes, and improves the locality, since the
+ * objects allocated together share the same pages.
+ *
+ * Only the thread calling zslab_enable() (the Redis main thread) allocates
+ * from the slabs, zslab_malloc() calls by other threads fall back to
+ * zmalloc(). Slab objects are released with zfree() by any thread: a radix
+ * tree maps every page of the address space to a flag telling if it is a
+ * slab page, so that zfree() can tell the slab objects apart from the other
+ * allocations. Objects released by other threads are queued in their class,
+ * and returned to their page by the main thread at the next allocation of
+ * the class, or by zslab_drain().
+ *
+ * The used memory counts the size of the allocated objects, like for the
+ * other allocations, and not the size of the pages: the memory of the
+ * released objects, that are reused by the next allocations, is free memory
+ * even if their page is not released, so the pages not fully used are
+ * fragmentation, in the same way as the allocator's own partially used
+ * pages.
+ * -------------------------------------------------------------------------- */
+
+#define ZSLAB_PAGE_BITS 16
+#define ZSLAB_PAGE_SIZE (1<<ZSLAB_PAGE_BITS)
+#define ZSLAB_MAP_BITS 16   /* Both levels of the radix tree have 2^16
+                               entries, mapping 48 bits addresses. */
+#define ZSLAB_MAP_SIZE (1<<ZSLAB_MAP_BITS)
+
+typedef struct zslabPage {
+    struct zslabPage *prev, *next;  /* Pages of the class with free objects. */
+    void *free;                     /* Released objects. */
+    char *bump;                     /* Objects never allocated start here. */
+    uint32_t unused;                /* Objects never allocated. */
+    uint32_t used;                  /* Allocated objects. */
+    int cls;
+} zslabPage;
+
+#define ZSLAB_PAGE_HDR ((sizeof(zslabPage)+15) & ~(size_t)15)
+
+typedef struct zslabClass {
+    size_t size;                /* Object size, set by the first allocation. */
+    zslabPage *partial;         /* Pages with free objects: the allocations
+                                   use the head, that is the oldest. */
+    zslabPage *partial_tail;
+    size_t pages;
+    size_t used;
+    pthread_mutex_t remote_mutex;
+    void *remote;               /* Objects released by other threads. */
+    redisAtomic size_t remote_count;
+} zslabClass;
+
+static const char *zslab_names[ZSLAB_CLASSES] = {
+    "robj", "dictEntry",
+    "zskiplistNode1", "zskiplistNode2", "zskiplistNode3", "zskiplistNode4"
+};
+static zslabClass zslab_classes[ZSLAB_CLASSES];
+static unsigned char *zslab_map[ZSLAB_MAP_SIZE];
+static int zslab_enabled = 0;
+static pthread_t zslab_thread;
+
+/* Return the slab page of 'ptr', or NULL if 'ptr' was not allocated from
+ * a slab. */
+static inline zslabPage *zslabPageOf(const void *ptr) {
+    uintptr_t pn = (uintptr_t)ptr >> ZSLAB_PAGE_BITS;
+    uintptr_t top = pn >> ZSLAB_MAP_BITS;
+    if (top >= ZSLAB_MAP_SIZE) return NULL;
+    unsigned char *leaf = zslab_map[top];
+    if (leaf == NULL || !leaf[pn & (ZSLAB_MAP_SIZE-1)]) return NULL;
+    return (zslabPage*)(pn << ZSLAB_PAGE_BITS);
+}
+
+static void zslabMapSet(zslabPage *p, unsigned char val) {
+    uintptr_t pn = (uintptr_t)p >> ZSLAB_PAGE_BITS;
+    uintptr_t top = pn >> ZSLAB_MAP_BITS;
+    if (zslab_map[top] == NULL) zslab_map[top] = zcalloc(ZSLAB_MAP_SIZE);
+    zslab_map[top][pn & (ZSLAB_MAP_SIZE-1)] = val;
+}
+
+static void zslabLinkPartial(zslabClass *c, zslabPage *p) {
+    p->next = NULL;
+    p->prev = c->partial_tail;
+    if (c->partial_tail) c->partial_tail->next = p;
+    else c->partial = p;
+    c->partial_tail = p;
+}
+
+static void zslabUnlinkPartial(zslabClass *c, zslabPage *p) {
+    if (p->prev) p->prev->next = p->next;
+    else c->partial = p->next;
+    if (p->next) p->next->prev = p->prev;
+    else c->partial_tail = p->prev;
+    p->prev = p->next = NULL;
+}
+
+static zslabPage *zslabPageCreate(zslabClass *c) {
+    void *mem;
+    if (posix_memalign(&mem,ZSLAB_PAGE_SIZE,ZSLAB_PAGE_SIZE) != 0) return NULL;
+    if (((uintptr_t)mem >> ZSLAB_PAGE_BITS >> ZSLAB_MAP_BITS) >= ZSLAB_MAP_SIZE) {
+        /* Outside of the address range mapped by the radix tree. */
+        free(mem);
+        return NULL;
+    }
+
+    zslabPage *p = mem;
+    p->free = NULL;
+    p->bump = (char*)p+ZSLAB_PAGE_HDR;
+    p->unused = (ZSLAB_PAGE_SIZE-ZSLAB_PAGE_HDR)/c->size;
+    p->used = 0;
+    p->cls = c-zslab_classes;
+    zslabMapSet(p,1);
+    zslabLinkPartial(c,p);
+    c->pages++;
+    return p;
+}
+
+static void zslabPageRelease(zslabClass *c, zslabPage *p) {
+    zslabUnlinkPartial(c,p);
+    zslabMapSet(p,0);
+    c->pages--;
+    free(p);
+}
+
+/* Return an object to its page. Called by the main thread only. */
+static void zslabRelease(zslabPage *p, void *ptr) {
+    zslabClass *c = zslab_classes+p->cls;
+    int was_full = p->free == NULL && p->unused == 0;
+
+    *(void**)ptr = p->free;
+    p->free = ptr;
+    p->used--;
+    c->used--;
+    if (was_full) zslabLinkPartial(c,p);
+
+    /* Release empty pages, but the last page with free objects, to avoid
+     * creating and releasing a page over and over. */
+    if (p->used == 0 && (c->partial != p || p->next != NULL))
+        zslabPageRelease(c,p);
+}
+
+/* Return to their pages the objects released by other threads. */
+static void zslabDrainRemote(zslabClass *c) {
+    pthread_mutex_lock(&c->remote_mutex);
+    void *ptr = c->remote;
+    c->remote = NULL;
+    atomicSet(c->remote_count,0);
+    pthread_mutex_unlock(&c->remote_mutex);
+
+    while (ptr) {
+        void *next = *(void**)ptr;
+        zslabRelease(zslabPageOf(ptr),ptr);
+        ptr = next;
+    }
+}
+
+/* Release 'ptr' if it was allocated from a slab, returning 1, otherwise
+ * 0 is returned. '*usable' is set to the object size if non NULL. */
+static int zslabFree(void *ptr, size_t *usable) {
+    zslabPage *p = zslabPageOf(ptr);
+    if (p == NULL) return 0;
+    zslabClass *c = zslab_classes+p->cls;
+
+    if (usable) *usable = c->size;
+    update_zmalloc_stat_free(c->size);
+    if (pthread_equal(pthread_self(),zslab_thread)) {
+        zslabRelease(p,ptr);
+    } else {
+        pthread_mutex_lock(&c->remote_mutex);
+        *(void**)ptr = c->remote;
+        c->remote = ptr;
+        atomicIncr(c->remote_count,1);
+        pthread_mutex_unlock(&c->remote_mutex);
+    }
+    return 1;
+}
+
+/* Enable the slab allocator: only the calling thread will allocate objects
+ * from slabs. */
+void zslab_enable(void) {
+    for (int j = 0; j < ZSLAB_CLASSES; j++)
+        pthread_mutex_init(&zslab_classes[j].remote_mutex,NULL);
+    zslab_thread = pthread_self();
+    zslab_enabled = 1;
+}
+
+/* Allocate an object of 'size' bytes of the slab class 'cls': all the
+ * allocations of a class must have the same size. */
+void *zslab_malloc(int cls, size_t size) {
+    if (!zslab_enabled || size < sizeof(void*) ||
+        !pthread_equal(pthread_self(),zslab_thread)) return zmalloc(size);
+
+    zslabClass *c = zslab_classes+cls;
+    size_t remote;
+    if (c->size == 0) c->size = (size+sizeof(void*)-1) & ~(sizeof(void*)-1);
+    assert(size <= c->size);
+    atomicGet(c->remote_count,remote);
+    if (remote) zslabDrainRemote(c);
+
+    zslabPage *p = c->partial;
+    if (p == NULL && (p = zslabPageCreate(c)) == NULL) return zmalloc(size);
+
+    void *ptr;
+    if (p->free) {
+        ptr = p->free;
+        p->free = *(void**)ptr;
+    } else {
+        ptr = p->bump;
+        p->bump += c->size;
+        p->unused--;
+    }
+    p->used++;
+    c->used++;
+    if (p->free == NULL && p->unused == 0) zslabUnlinkPartial(c,p);
+    update_zmalloc_stat_alloc(c->size);
+    return ptr;
+}
+
+/* Return to their pages the objects released by other threads, so that the
+ * pages left empty can be released. Must be called by the main thread, that
+ * otherwise does it only when allocating objects of the same class. */
+void zslab_drain(void) {
+    if (!zslab_enabled) return;
+    for (int j = 0; j < ZSLAB_CLASSES; j++) {
+        size_t remote;
+        atomicGet(zslab_classes[j].remote_count,remote);
+        if (remote) zslabDrainRemote(zslab_classes+j);
+    }
+}
+
+/* Like zmalloc_size(), but also works for the objects allocated from the
+ * slabs, that have no allocator metadata. */
+size_t zslab_malloc_size(void *ptr) {
+    zslabPage *p = zslab_enabled ? zslabPageOf(ptr) : NULL;
+    if (p) return zslab_classes[p->cls].size;
+    return zmalloc_size(ptr);
+}
+
+/* Move 'ptr' to a page with a higher utilization if its page is sparse,
+ * returning the new pointer, and releasing the old one, or NULL if the
+ * object was not moved or it is not a slab object. Called by the active
+ * defragmentation, in the main thread. Since the allocations are served
+ * from the oldest pages with free objects first, moving the objects of
+ * the sparse pages eventually empties them, and the empty pages are
+ * released. */
+void *zslab_defrag(void *ptr) {
+    zslabPage *p = zslab_enabled ? zslabPageOf(ptr) : NULL;
+    if (p == NULL) return NULL;
+    zslabClass *c = zslab_classes+p->cls;
+    zslabPage *target = c->partial;
+    uint32_t capacity = (ZSLAB_PAGE_SIZE-ZSLAB_PAGE_HDR)/c->size;
+
+    if (p->used > capacity/2 || target == NULL || target == p ||
+        target->used <= p->used) return NULL;
+    void *newptr = zslab_malloc(p->cls,c->size);
+    memcpy(newptr,ptr,c->size);
+    zslabRelease(p,ptr);
+    update_zmalloc_stat_free(c->size);
+    return newptr;
+}
+
+/* Return 1 if 'ptr' was allocated from a slab. */
+int zslab_owns(void *ptr) {
+    return zslab_enabled && zslabPageOf(ptr) != NULL;
+}
+
+/* Fill 'stats' with the usage of the slab class 'cls'. */
+void zslab_get_stats(int cls, zslabStats *stats) {
+    zslabClass *c = zslab_classes+cls;
+    stats->name = zslab_names[cls];
+    stats->size = c->size;
+    stats->objects = c->used;
+    stats->pages = c->pages;
+    stats->page_size = ZSLAB_PAGE_SIZE;
+    atomicGet(c->remote_count,stats->remote);
+}
+
+/* ----------------------------------------------------------------------------
+ * Huge page regions
+ *
+ * Large and long lived allocations, like the hash tables of the big
+ * dictionaries or the big ziplists, can be allocated with the
+ * *_huge() functions from their own mappings, aligned to ZHUGE_PAGE_SIZE
+ * and flagged with MADV_HUGEPAGE. With transparent huge pages set to
+ * "madvise" these regions are backed by 2MB pages, so that random accesses
+ * to them cost a TLB entry every 2MB instead of every 4KB, while the rest
+ * of the heap, and notably the small objects that are written all the
+ * time, stays in 4KB pages, and doesn't suffer the copy on write
+ * amplification of huge pages when the server forks.
+ *
+ * Only allocations of at least ZHUGE_PAGE_SIZE bytes requested by the
+ * thread calling zhuge_enable() get a region, the others fall back to the
+ * allocator. The regions are rounded to ZHUGE_PAGE_SIZE, and the used
+ * memory counts their full size. Since regions are aligned, zfree() only
+ * needs to look up the aligned pointers in the table of the regions, that
+ * is protected by a mutex since regions may be released by other threads.
+ * -------------------------------------------------------------------------- */
+
+#define ZHUGE_PAGE_BITS 21
+#define ZHUGE_PAGE_SIZE ((size_t)1<<ZHUGE_PAGE_BITS)
+#define zhugeIsAligned(ptr) (((uintptr_t)(ptr) & (ZHUGE_PAGE_SIZE-1)) == 0)
+
+typedef struct zhugeRegion {
+    void *ptr;
+    size_t size;
+} zhugeRegion;
+
+static int zhuge_enabled = 0;
+static pthread_t zhuge_thread;
+static pthread_mutex_t zhuge_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Open addressing table of the regions, with linear probing. */
+static zhugeRegion *zhuge_table = NULL;
+static size_t zhuge_table_size = 0;
+static size_t zhuge_regions = 0;
+static size_t zhuge_memory = 0;
+
+static size_t zhugeSlot(void *ptr, size_t table_size) {
+    uint64_t h = ((uintptr_t)ptr >> ZHUGE_PAGE_BITS) * 11400714819323198485ULL;
+    return (h >> 32) & (table_size-1);
+}
+
+/* Return the slot of the region starting at 'ptr', or -1 if there is no
+ * such region. Must be called with the mutex held. */
+static long zhugeLookup(void *ptr) {
+    if (zhuge_table_size == 0) return -1;
+    size_t j = zhugeSlot(ptr,zhuge_table_size);
+    while (zhuge_table[j].ptr) {
+        if (zhuge_table[j].ptr == ptr) return j;
+        j = (j+1) & (zhuge_table_size-1);
+    }
+    return -1;
+}
+
+/* Add a region to the table, growing it when half full. Return 0 on out of
+ * memory. Must be called with the mutex held. */
+static int zhugeInsert(void *ptr, size_t size) {
+    if ((zhuge_regions+1)*2 > zhuge_table_size) {
+        size_t newsize = zhuge_table_size ? zhuge_table_size*2 : 64;
+        zhugeRegion *newtable = calloc(newsize,sizeof(zhugeRegion));
+        if (newtable == NULL) return 0;
+        for (size_t j = 0; j < zhuge_table_size; j++) {
+            if (zhuge_table[j].ptr == NULL) continue;
+            size_t k = zhugeSlot(zhuge_table[j].ptr,newsize);
+            while (newtable[k].ptr) k = (k+1) & (newsize-1);
+            newtable[k] = zhuge_table[j];
+        }
+        free(zhuge_table);
+        zhuge_table = newtable;
+        zhuge_table_size = newsize;
+    }
+    size_t j = zhugeSlot(ptr,zhuge_table_size);
+    while (zhuge_table[j].ptr) j = (j+1) & (zhuge_table_size-1);
+    zhuge_table[j].ptr = ptr;
+    zhuge_table[j].size = size;
+    zhuge_regions++;
+    zhuge_memory += size;
+    return 1;
+}
+
+/* Remove the region at slot 'j', shifting back the following entries of
+ * the probe sequence. Must be called with the mutex held. */
+static void zhugeRemove(size_t j) {
+    size_t mask = zhuge_table_size-1;
+    zhuge_regions--;
+    zhuge_memory -= zhuge_table[j].size;
+    zhuge_table[j].ptr = NULL;
+    for (size_t k = (j+1) & mask; zhuge_table[k].ptr; k = (k+1) & mask) {
+        size_t home = zhugeSlot(zhuge_table[k].ptr,zhuge_table_size);
+        /* Move the entry to the hole unless its home slot is cyclically
+         * in (j, k], in which case it is still reachable. */
+        if ((k > j && (home <= j || home > k)) ||
+            (k < j && (home <= j && home > k)))
+        {
+            zhuge_table[j] = zhuge_table[k];
+            zhuge_table[k].ptr = NULL;
+            j = k;
+        }
+    }
+}
+
+/* Return the size of the region starting at 'ptr', or 0 if 'ptr' is not a
+ * region. */
+static size_t zhugeSize(void *ptr) {
+    size_t size = 0;
+    if (!zhuge_enabled || !zhugeIsAligned(ptr)) return 0;
+    pthread_mutex_lock(&zhuge_mutex);
+    long j = zhugeLookup(ptr);
+    if (j != -1) size = zhuge_table[j].size;
+    pthread_mutex_unlock(&zhuge_mutex);
+    return size;
+}
+
+/* Map a new zeroed region of at least 'size' bytes, or return NULL if the
+ * region can't or shouldn't be used for this allocation. */
+static void *zhugeAlloc(size_t size, size_t *usable) {
+    if (!zhuge_enabled || size < ZHUGE_PAGE_SIZE ||
+        !pthread_equal(pthread_self(),zhuge_thread)) return NULL;
+
+    /* Map an extra huge page to align the region, and trim the excess. */
+    size = (size+ZHUGE_PAGE_SIZE-1) & ~(ZHUGE_PAGE_SIZE-1);
+    char *mem = mmap(NULL,size+ZHUGE_PAGE_SIZE,PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (mem == MAP_FAILED) return NULL;
+    char *ptr = (char*)(((uintptr_t)mem+ZHUGE_PAGE_SIZE-1) &
+                        ~(ZHUGE_PAGE_SIZE-1));
+    if (ptr != mem) munmap(mem,ptr-mem);
+    munmap(ptr+size,mem+ZHUGE_PAGE_SIZE-ptr);
+#ifdef MADV_HUGEPAGE
+    madvise(ptr,size,MADV_HUGEPAGE);
+#endif
+
+    pthread_mutex_lock(&zhuge_mutex);
+    int added = zhugeInsert(ptr,size);
+    pthread_mutex_unlock(&zhuge_mutex);
+    if (!added) {
+        munmap(ptr,size);
+        return NULL;
+    }
+    update_zmalloc_stat_alloc(size);
+    if (usable) *usable = size;
+    return ptr;
+}
+
+/* Release 'ptr' if it is a region, returning 0 otherwise. */
+static int zhugeFree(void *ptr, size_t *usable) {
+    size_t size = 0;
+    if (!zhugeIsAligned(ptr)) return 0;
+    pthread_mutex_lock(&zhuge_mutex);
+    long j = zhugeLookup(ptr);
+    if (j != -1) {
+        size = zhuge_table[j].size;
+        zhugeRemove(j);
+    }
+    pthread_mutex_unlock(&zhuge_mutex);
+    if (j == -1) return 0;
+
+    munmap(ptr,size);
+    update_zmalloc_stat_free(size);
+    if (usable) *usable = size;
+    return 1;
+}
+
+/* Enable the huge page regions: only the allocations of the calling thread
+ * will get regions. */
+void zhuge_enable(void) {
+    zhuge_thread = pthread_self();
+    zhuge_enabled = 1;
+}
+
+/* Allocate 'size' bytes, from a huge page region if the allocation is big
+ * enough and the regions are enabled, or panic. */
+void *zmalloc_huge(size_t size) {
+    void *ptr = zhugeAlloc(size,NULL);
+    return ptr ? ptr : zmalloc(size);
+}
+
+/* Like zmalloc_huge(), but the memory is zeroed. */
+void *zcalloc_huge(size_t size) {
+    void *ptr = zhugeAlloc(size,NULL);
+    return ptr ? ptr : zcalloc(size);
+}
+
+/* Like zcalloc_huge() but returns NULL on out of memory. */
+void *ztrycalloc_huge(size_t size) {
+    void *ptr = zhugeAlloc(size,NULL);
+    return ptr ? ptr : ztrycalloc(size);
+}
+
+/* Like zrealloc(), but moves the allocation to a huge page region when it
+ * grows big enough. Regions are resized by zrealloc() too, in place while
+ * the new size fits, and moved back to the allocator when they shrink
+ * below the size of a huge page. */
+void *zrealloc_huge(void *ptr, size_t size) {
+    if (zhuge_enabled && size >= ZHUGE_PAGE_SIZE && ptr && !zhugeSize(ptr)) {
+        void *newptr = zhugeAlloc(size,NULL);
+        if (newptr) {
+            size_t oldsize = zslab_owns(ptr) ? zslab_malloc_size(ptr) :
+                                               zmalloc_usable_size(ptr);
+            memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+            zfree(ptr);
+            return newptr;
+        }
+    }
+    return zrealloc(ptr,size);
+}
+
+/* Like zmalloc_size(), but also works for huge page regions. */
+size_t zhuge_malloc_size(void *ptr) {
+    size_t size = zhugeSize(ptr);
+    return size ? size : zslab_malloc_size(ptr);
+}
+
+/* Return 1 if 'ptr' is a huge page region. */
+int zhuge_owns(void *ptr) {
+    return zhugeSize(ptr) != 0;
+}
+
+/* Fill 'regions' and 'memory' with the number of huge page regions and
+ * their total size. */
+void zhuge_get_stats(size_t *regions, size_t *memory) {
+    pthread_mutex_lock(&zhuge_mutex);
+    *regions = zhuge_regions;
+    *memory = zhuge_memory;
+    pthread_mutex_unlock(&zhuge_mutex);
+}
+
 /* Try allocating memory, and return NULL if failed.
  * '*usable' is set to the usable size if non NULL. */
 /**
@@ -267,6 +792,32 @@ void *ztryrealloc_usable(void *ptr, size_t size, size_t *usable) {
     if (ptr == NULL)
         return ztrymalloc_usable(size, usable);
 
+    /* Huge page regions are resized in place while the new size fits, and
+     * otherwise moved to a new region, or to a regular allocation when they
+     * become too small for a region. */
+    if ((oldsize = zhugeSize(ptr)) != 0) {
+        if (size <= oldsize && size > oldsize-ZHUGE_PAGE_SIZE) {
+            if (usable) *usable = oldsize;
+            return ptr;
+        }
+        newptr = zhugeAlloc(size,usable);
+        if (newptr == NULL) newptr = ztrymalloc_usable(size,usable);
+        if (newptr == NULL) return NULL;
+        memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+        zfree(ptr);
+        return newptr;
+    }
+
+    /* Slab objects are moved to a regular allocation. */
+    if (zslab_enabled && zslabPageOf(ptr)) {
+        oldsize = zslab_classes[zslabPageOf(ptr)->cls].size;
+        newptr = ztrymalloc_usable(size, usable);
+        if (newptr == NULL) return NULL;
+        memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+        zfree(ptr);
+        return newptr;
+    }
+
 #ifdef HAVE_MALLOC_SIZE
     oldsize = zmalloc_size(ptr);
     newptr = realloc(ptr,size);
@@ -339,6 +890,8 @@ void zfree(void *ptr) {
 #endif
 
     if (ptr == NULL) return;
+    if (zslab_enabled && zslabFree(ptr,NULL)) return;
+    if (zhuge_enabled && zhugeFree(ptr,NULL)) return;
 #ifdef HAVE_MALLOC_SIZE
     update_zmalloc_stat_free(zmalloc_size(ptr));
     free(ptr);
@@ -358,6 +911,8 @@ void zfree_usable(void *ptr, size_t *usable) {
 #endif
 
     if (ptr == NULL) return;
+    if (zslab_enabled && zslabFree(ptr,usable)) return;
+    if (zhuge_enabled && zhugeFree(ptr,usable)) return;
 #ifdef HAVE_MALLOC_SIZE
     update_zmalloc_stat_free(*usable = zmalloc_size(ptr));
     free(ptr);
@@ -396,6 +951,13 @@ size_t zmalloc_used_memory(void) {
     return um;
 }
 
+/* Return the memory allocated minus the memory released by the calling
+ * thread: the difference of two calls is the memory the thread allocated
+ * in between. */
+long long zmalloc_thread_used_memory(void) {
+    return thread_used_memory;
+}
+
 /**
  * 设置内存溢出处理函数
  * @param oom_handler
@@ -576,6 +1138,38 @@ int zmalloc_get_allocator_info(size_t *allocated,
     return 1;
 }
 
+/* Fill 'bins' with the stats of up to 'maxbins' jemalloc bins (the small
+ * size classes), in ascending size order, and return the number of bins.
+ * The stats are the ones cached at the last "epoch" update, see
+ * zmalloc_get_allocator_info(). */
+int zmalloc_get_bin_stats(zmallocBinStats *bins, int maxbins) {
+    unsigned nbins;
+    size_t sz = sizeof(nbins);
+    char name[128];
+
+    if (je_mallctl("arenas.nbins", &nbins, &sz, NULL, 0)) return 0;
+    if ((int)nbins > maxbins) nbins = maxbins;
+    for (unsigned j = 0; j < nbins; j++) {
+        uint32_t nregs;
+        zmallocBinStats *b = bins+j;
+        memset(b,0,sizeof(*b));
+        sz = sizeof(size_t);
+        snprintf(name,sizeof(name),"arenas.bin.%u.size",j);
+        je_mallctl(name, &b->size, &sz, NULL, 0);
+        sz = sizeof(nregs);
+        snprintf(name,sizeof(name),"arenas.bin.%u.nregs",j);
+        if (je_mallctl(name, &nregs, &sz, NULL, 0) == 0) b->nregs = nregs;
+        sz = sizeof(size_t);
+        snprintf(name,sizeof(name),"stats.arenas.%d.bins.%u.curregs",
+                 MALLCTL_ARENAS_ALL,j);
+        je_mallctl(name, &b->curregs, &sz, NULL, 0);
+        snprintf(name,sizeof(name),"stats.arenas.%d.bins.%u.curslabs",
+                 MALLCTL_ARENAS_ALL,j);
+        je_mallctl(name, &b->curslabs, &sz, NULL, 0);
+    }
+    return nbins;
+}
+
 void set_jemalloc_bg_thread(int enable) {
     /* let jemalloc do purging asynchronously, required when there's no traffic 
      * after flushdb */
@@ -605,6 +1199,12 @@ int zmalloc_get_allocator_info(size_t *allocated,
     return 1;
 }
 
+int zmalloc_get_bin_stats(zmallocBinStats *bins, int maxbins) {
+    ((void)(bins));
+    ((void)(maxbins));
+    return 0;
+}
+
 void set_jemalloc_bg_thread(int enable) {
     ((void)(enable));
 }
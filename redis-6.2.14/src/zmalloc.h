@@ -131,11 +131,21 @@ char *zstrdup(const char *s);
 
 // 获取内存大小
 size_t zmalloc_used_memory(void);
+long long zmalloc_thread_used_memory(void);
 
 // 内存溢出处理
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t));
 size_t zmalloc_get_rss(void);
 int zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident);
+
+/* Usage of an allocator size class, see zmalloc_get_bin_stats(). */
+typedef struct zmallocBinStats {
+    size_t size;        /* Size of the allocations of the class. */
+    size_t nregs;       /* Allocations fitting in a slab of the class. */
+    size_t curregs;     /* Current allocations. */
+    size_t curslabs;    /* Current slabs. */
+} zmallocBinStats;
+int zmalloc_get_bin_stats(zmallocBinStats *bins, int maxbins);
 void set_jemalloc_bg_thread(int enable);
 int jemalloc_purge();
 size_t zmalloc_get_private_dirty(long pid);
@@ -156,6 +166,41 @@ size_t zmalloc_usable_size(void *ptr);
 #define zmalloc_usable_size(p) zmalloc_size(p)
 #endif
 
+/* Slab allocator classes, see zslab_malloc(). */
+#define ZSLAB_ROBJ 0
+#define ZSLAB_DICT_ENTRY 1
+#define ZSLAB_SKIPLIST_NODE 2   /* Skiplist nodes of level N use the class
+                                   ZSLAB_SKIPLIST_NODE+N-1. */
+#define ZSLAB_SKIPLIST_LEVELS 4
+#define ZSLAB_CLASSES (ZSLAB_SKIPLIST_NODE+ZSLAB_SKIPLIST_LEVELS)
+
+typedef struct zslabStats {
+    const char *name;
+    size_t size;        /* Object size. */
+    size_t objects;     /* Allocated objects. */
+    size_t pages;
+    size_t page_size;
+    size_t remote;      /* Objects released by other threads, not yet
+                           returned to their pages. */
+} zslabStats;
+
+void zslab_enable(void);
+void *zslab_malloc(int cls, size_t size);
+void zslab_drain(void);
+size_t zslab_malloc_size(void *ptr);
+void *zslab_defrag(void *ptr);
+int zslab_owns(void *ptr);
+void zslab_get_stats(int cls, zslabStats *stats);
+
+void zhuge_enable(void);
+void *zmalloc_huge(size_t size);
+void *zcalloc_huge(size_t size);
+void *ztrycalloc_huge(size_t size);
+void *zrealloc_huge(void *ptr, size_t size);
+size_t zhuge_malloc_size(void *ptr);
+int zhuge_owns(void *ptr);
+void zhuge_get_stats(size_t *regions, size_t *memory);
+
 #ifdef REDIS_TEST
 int zmalloc_test(int argc, char **argv, int accurate);
 #endif
@@ -1,11 +1,10 @@
 set defaults { appendonly {yes} appendfilename {appendonly.aof} aof-use-rdb-preamble {no} }
 set server_path [tmpdir server.aof]
-set aof_path "$server_path/appendonly.aof"
 
 proc start_server_aof {overrides code} {
     upvar defaults defaults srv srv server_path server_path
     set config [concat $defaults $overrides]
-    start_server [list overrides $config] $code
+    start_server [list overrides $config keep_persistence true] $code
 }
 
 tags {"aof"} {
@@ -31,6 +30,7 @@ tags {"aof"} {
     # Restart server to replay AOF
     start_server_aof [list dir $server_path] {
         set client [redis [srv host] [srv port] 0 $::tls]
+        wait_done_loading $client
         assert_equal 20000 [$client get foo]
     }
 }
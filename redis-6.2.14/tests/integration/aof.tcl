@@ -1,19 +1,35 @@
 set defaults { appendonly {yes} appendfilename {appendonly.aof} }
 set server_path [tmpdir server.aof]
-set aof_path "$server_path/appendonly.aof"
+set aof_dirpath "$server_path/appendonlydir"
+set aof_path "$aof_dirpath/appendonly.aof.1.incr.aof"
+set aof_manifest "$aof_dirpath/appendonly.aof.manifest"
 
 proc append_to_aof {str} {
     upvar fp fp
     puts -nonewline $fp $str
 }
 
+# Create an AOF made of a single INCR file, and the manifest listing it.
 proc create_aof {code} {
-    upvar fp fp aof_path aof_path
+    upvar fp fp aof_path aof_path aof_dirpath aof_dirpath aof_manifest aof_manifest
+    file mkdir $aof_dirpath
+    set fp [open $aof_manifest w+]
+    puts $fp "file [file tail $aof_path] seq 1 type i"
+    close $fp
     set fp [open $aof_path w+]
     uplevel 1 $code
     close $fp
 }
 
+proc wait_for_aofrw {client} {
+    wait_for_condition 100 100 {
+        [status $client aof_rewrite_in_progress] eq 0 &&
+        [status $client aof_rewrite_scheduled] eq 0
+    } else {
+        fail "AOF rewrite did not finish"
+    }
+}
+
 proc start_server_aof {overrides code} {
     upvar defaults defaults srv srv server_path server_path
     set config [concat $defaults $overrides]
@@ -272,7 +288,7 @@ tags {"aof"} {
                 r del x
                 r setrange x [expr {int(rand()*5000000)+10000000}] x
                 r debug aof-flush-sleep 500000
-                set aof [file join [lindex [r config get dir] 1] appendonly.aof]
+                set aof [get_last_incr_aof_path r]
                 set size1 [file size $aof]
                 $rd get x
                 after [expr {int(rand()*30)}]
@@ -287,7 +303,7 @@ tags {"aof"} {
 
     start_server {overrides {appendonly {yes} appendfilename {appendonly.aof}}} {
         test {GETEX should not append to AOF} {
-            set aof [file join [lindex [r config get dir] 1] appendonly.aof]
+            set aof [get_last_incr_aof_path r]
             r set foo bar
             set before [file size $aof]
             r getex foo
@@ -295,4 +311,326 @@ tags {"aof"} {
             assert_equal $before $after
         }
     }
+
+    start_server {overrides {appendonly {yes} aof-use-rdb-preamble no}} {
+        test {AOF loading gives the same dataset with and without the parse thread} {
+            r config set aof-load-parse-thread yes
+            # Arguments crossing the read chunks, and one bigger than them.
+            for {set j 0} {$j < 2000} {incr j} {
+                r set key:$j [string repeat x [expr {$j*7}]]
+                r rpush list:[expr {$j%10}] $j
+            }
+            r set bigkey [string repeat y 10000000]
+            r multi
+            r incr counter
+            r hset hash field [string repeat z 100000]
+            r exec
+            set digest [r debug digest]
+
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+            r config set aof-load-parse-thread no
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+            r config set aof-load-parse-thread yes
+        }
+    }
+
+    start_server {overrides {appendonly {yes} appendfsync always aof-group-commit yes}} {
+        test {AOF group commit: replies are sent in order once fsynced} {
+            set clients {}
+            for {set j 0} {$j < 10} {incr j} {
+                lappend clients [redis_deferring_client]
+            }
+            # Every client pipelines its writes, so that the event loop
+            # processes the writes of several clients at once.
+            set commits [status r aof_group_commits]
+            foreach rd $clients {
+                set cmds {}
+                for {set j 0} {$j < 200} {incr j} {
+                    append cmds "*2\r\n\$4\r\nincr\r\n\$7\r\ncounter\r\n"
+                    append cmds "*2\r\n\$3\r\nget\r\n\$7\r\ncounter\r\n"
+                }
+                $rd write $cmds
+            }
+            foreach rd $clients {
+                $rd flush
+            }
+            foreach rd $clients {
+                set last 0
+                for {set j 0} {$j < 200} {incr j} {
+                    set val [$rd read]
+                    assert {$val > $last}
+                    assert {[$rd read] >= $val}
+                    set last $val
+                }
+                $rd close
+            }
+            assert_equal 2000 [r get counter]
+
+            # Fsyncs are shared by the writes performed meanwhile.
+            set commits [expr {[status r aof_group_commits]-$commits}]
+            assert {$commits > 0 && $commits < 200}
+            assert_equal 0 [status r aof_group_commit_waiting_clients]
+            r debug loadaof
+            assert_equal 2000 [r get counter]
+        }
+
+        test {AOF group commit: clients unblocked by other writes are served} {
+            set rd [redis_deferring_client]
+            set rd2 [redis_deferring_client]
+            $rd blpop mylist 0
+            $rd2 xread block 0 streams mystream $
+            wait_for_blocked_clients_count 2
+            r lpush mylist a
+            r xadd mystream 1-1 f v
+            assert_equal {mylist a} [$rd read]
+            assert_equal {{mystream {{1-1 {f v}}}}} [$rd2 read]
+            assert_equal 0 [status r aof_group_commit_waiting_clients]
+            $rd close
+            $rd2 close
+        }
+
+        test {AOF group commit: can be disabled at runtime} {
+            r config set aof-group-commit no
+            set commits [status r aof_group_commits]
+            r incr counter
+            assert_equal $commits [status r aof_group_commits]
+            r config set aof-group-commit yes
+            r incr counter
+            assert_equal [expr {$commits+1}] [status r aof_group_commits]
+        }
+    }
+
+    test {Multi-part AOF: a rewrite replaces the BASE and INCR files} {
+        exec rm -rf $aof_dirpath
+        start_server_aof [list dir $server_path] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            $client set foo bar
+            $client rpush list a b c
+
+            # The AOF created at startup has a BASE and an INCR file.
+            set manifest [get_aof_manifest $client]
+            assert_equal {appendonly.aof.1.base.rdb 1 b} \
+                [lmap i {1 3 5} {lindex $manifest 0 $i}]
+            assert_equal {appendonly.aof.1.incr.aof 1 i} \
+                [lmap i {1 3 5} {lindex $manifest 1 $i}]
+
+            $client bgrewriteaof
+            wait_for_aofrw $client
+            $client incr counter
+
+            # The new BASE and the INCR file opened by the rewrite replace
+            # the previous files, that are deleted.
+            assert_equal {{file appendonly.aof.2.base.rdb seq 2 type b} {file appendonly.aof.2.incr.aof seq 2 type i}} \
+                [get_aof_manifest $client]
+            wait_for_condition 50 100 {
+                [lsort [glob -tails -directory $aof_dirpath *]] eq
+                {appendonly.aof.2.base.rdb appendonly.aof.2.incr.aof appendonly.aof.manifest}
+            } else {
+                fail "History AOF files were not deleted"
+            }
+        }
+
+        start_server_aof [list dir $server_path] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal bar [$client get foo]
+            assert_equal {a b c} [$client lrange list 0 -1]
+            assert_equal 1 [$client get counter]
+        }
+    }
+
+    test {Multi-part AOF: an AOF of a previous version is migrated} {
+        exec rm -rf $aof_dirpath
+        set fp [open $server_path/appendonly.aof w]
+        puts -nonewline $fp [formatCommand set foo old]
+        close $fp
+
+        start_server_aof [list dir $server_path] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal old [$client get foo]
+            assert_equal 0 [file exists $server_path/appendonly.aof]
+            assert_equal {{file appendonly.aof seq 1 type b} {file appendonly.aof.1.incr.aof seq 1 type i}} \
+                [get_aof_manifest $client]
+        }
+    }
+
+    test {Multi-part AOF: switching the AOF on at runtime} {
+        exec rm -rf $aof_dirpath
+        start_server_aof [list dir $server_path appendonly no] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            $client set foo bar
+            $client config set appendonly yes
+            wait_for_aofrw $client
+            $client set foo baz
+            assert_equal {{file appendonly.aof.1.base.rdb seq 1 type b} {file appendonly.aof.1.incr.aof seq 1 type i}} \
+                [get_aof_manifest $client]
+            $client debug loadaof
+            assert_equal baz [$client get foo]
+        }
+    }
+
+    proc read_aof_signature {path} {
+        set fp [open $path r]
+        fconfigure $fp -translation binary
+        set sig [read $fp 8]
+        close $fp
+        return $sig
+    }
+
+    test {Binary AOF: the dataset is the same after a reload} {
+        exec rm -rf $aof_dirpath
+        start_server_aof [list dir $server_path aof-format binary] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            $client set foo bar
+            $client setex tmp 1000 val
+            $client multi
+            $client incr counter
+            $client rpush list a b c
+            $client exec
+            $client select 1
+            $client set big [string repeat x 100000]
+            set digest [$client debug digest]
+            assert_equal RAOFBIN1 [read_aof_signature [get_last_incr_aof_path $client]]
+
+            $client debug loadaof
+            assert_equal $digest [$client debug digest]
+        }
+
+        start_server_aof [list dir $server_path aof-format binary] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal $digest [$client debug digest]
+        }
+    }
+
+    test {Binary AOF: aof-format applies to the next INCR file} {
+        exec rm -rf $aof_dirpath
+        start_server_aof [list dir $server_path] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            $client set foo bar
+            $client config set aof-format binary
+            $client set foo baz
+            assert_equal "*2\r\n\$6\r\n" [read_aof_signature [get_last_incr_aof_path $client]]
+
+            $client bgrewriteaof
+            wait_for_aofrw $client
+            $client set foo qux
+            assert_equal RAOFBIN1 [read_aof_signature [get_last_incr_aof_path $client]]
+            $client debug loadaof
+            assert_equal qux [$client get foo]
+        }
+    }
+
+    test {Binary AOF: a truncated record is discarded} {
+        exec rm -rf $aof_dirpath
+        start_server_aof [list dir $server_path aof-format binary] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            $client set foo bar
+            $client set last value
+            set path [get_last_incr_aof_path $client]
+        }
+
+        set fp [open $path r+]
+        chan truncate $fp [expr {[file size $path]-3}]
+        close $fp
+
+        start_server_aof [list dir $server_path aof-format binary aof-load-truncated yes] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal bar [$client get foo]
+            assert_equal {} [$client get last]
+        }
+    }
+
+    test {Binary AOF: redis-check-aof truncates to a timestamp} {
+        exec rm -rf $aof_dirpath
+        start_server_aof [list dir $server_path aof-format binary] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            $client set foo bar
+            after 50
+            set ts [clock milliseconds]
+            after 50
+            $client set foo baz
+            $client set other value
+            set path [get_last_incr_aof_path $client]
+        }
+
+        catch {exec src/redis-check-aof $path} result
+        assert_match "*AOF is valid*" $result
+        set result [exec src/redis-check-aof --truncate-to-timestamp $ts $path]
+        assert_match "*Successfully truncated AOF to timestamp*" $result
+
+        start_server_aof [list dir $server_path aof-format binary] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            assert_equal bar [$client get foo]
+            assert_equal {} [$client get other]
+        }
+    }
+
+    test {Binary AOF: redis-check-aof only truncates the last INCR file} {
+        exec rm -rf $aof_dirpath
+        start_server_aof [list dir $server_path aof-format binary] {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_done_loading $client
+            $client set foo bar
+            set first [get_last_incr_aof_path $client]
+            # A failed rewrite leaves two INCR files in the manifest.
+            $client config set rdb-key-save-delay 10000000
+            $client bgrewriteaof
+            wait_for_condition 50 100 {
+                [status $client aof_rewrite_in_progress] == 1
+            } else {
+                fail "AOF rewrite did not start"
+            }
+            exec kill -9 [exec pgrep -P [dict get $srv pid]]
+            wait_for_condition 50 100 {
+                [status $client aof_rewrite_in_progress] == 0
+            } else {
+                fail "AOF rewrite did not terminate"
+            }
+            $client set foo baz
+            set last [get_last_incr_aof_path $client]
+            assert {$first ne $last}
+            # The signature of the new INCR file is part of the AOF size.
+            set size 0
+            foreach line [get_aof_manifest $client] {
+                incr size [file size [file join [get_aof_dir $client] [lindex $line 1]]]
+            }
+            assert_equal $size [status $client aof_current_size]
+        }
+
+        catch {exec src/redis-check-aof --truncate-to-timestamp 0 $first} result
+        assert_match "*is not the last INCR file*" $result
+        set result [exec src/redis-check-aof --truncate-to-timestamp 0 $last]
+        assert_match "*Successfully truncated AOF to timestamp*" $result
+    }
+
+    test {Binary AOF: a corrupted record is detected by its checksum} {
+        set fp [open $path r+]
+        fconfigure $fp -translation binary
+        seek $fp 40
+        puts -nonewline $fp "!"
+        close $fp
+
+        catch {exec src/redis-check-aof $path} result
+        assert_match "*Checksum mismatch*" $result
+
+        start_server_aof [list dir $server_path aof-format binary aof-load-truncated yes] {
+            wait_for_condition 50 100 {
+                [string match "*Checksum mismatch of the record at offset 8*" \
+                    [exec cat [dict get $srv stdout]]]
+            } else {
+                fail "The corrupted record was not detected"
+            }
+        }
+    }
 }
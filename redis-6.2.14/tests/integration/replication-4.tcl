@@ -154,3 +154,212 @@ start_server {tags {"repl"}} {
         }
     }
 }
+
+start_server {tags {"repl"}} {
+    start_server {overrides {replica-apply-thread yes}} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set slave [srv 0 client]
+
+        test {Replica apply thread: replication with parallel clients writing} {
+            set load_handle0 [start_bg_complex_data $master_host $master_port 9 100000]
+            set load_handle1 [start_bg_complex_data $master_host $master_port 11 100000]
+            $slave slaveof $master_host $master_port
+            wait_for_sync $slave
+
+            # Transactions and scripts are applied as a whole
+            for {set j 0} {$j < 1000} {incr j} {
+                $master multi
+                $master incr counter
+                $master rpush list $j
+                $master exec
+                $master eval {redis.call('incr',KEYS[1]); redis.call('rpush',KEYS[2],ARGV[1])} 2 counter list $j
+            }
+            after 1000
+            stop_bg_complex_data $load_handle0
+            stop_bg_complex_data $load_handle1
+            wait_for_ofs_sync $master $slave
+            assert_equal [$master debug digest] [$slave debug digest]
+            assert_equal 2000 [$slave get counter]
+            assert_equal [s 0 slave_read_repl_offset] [s 0 slave_repl_offset]
+            assert_equal 0 [s 0 slave_repl_apply_lag_bytes]
+            assert_equal 1 [s 0 slave_repl_apply_thread]
+            assert {[s 0 slave_repl_parse_usec] > 0}
+            assert {[s 0 slave_repl_apply_usec] > 0}
+        }
+
+        test {Replica apply thread: partial resync after the link is dropped} {
+            set psync_ok [s -1 sync_partial_ok]
+            $master client kill type replica
+            populate 1000 psync 100 -1
+            wait_for_condition 50 100 {
+                [s -1 sync_partial_ok] == $psync_ok+1
+            } else {
+                fail "replica didn't partially resynchronize"
+            }
+            wait_for_ofs_sync $master $slave
+            assert_equal [$master debug digest] [$slave debug digest]
+        }
+
+        test {Replica apply thread: the stream is applied after a pause} {
+            $slave client pause 1000 write
+            $master set paused 1
+            $master incr counter
+            after 200
+            assert_equal {} [$slave get paused]
+            wait_for_ofs_sync $master $slave
+            assert_equal 1 [$slave get paused]
+            assert_equal 2001 [$slave get counter]
+        }
+    }
+}
+
+foreach dl {disabled on-empty-db} {
+    start_server {tags {"repl"}} {
+        start_server {} {
+            set master [srv -1 client]
+            set master_host [srv -1 host]
+            set master_port [srv -1 port]
+            set replica [srv 0 client]
+
+            $master config set repl-diff-sync yes
+            $replica config set repl-diff-sync yes
+            $replica config set repl-diskless-load $dl
+            $master select 0
+            $master sadd myset a b c
+            $master select 9
+            populate 1000 key: 10 -1
+            $replica replicaof $master_host $master_port
+            wait_for_sync $replica
+            wait_for_ofs_sync $master $replica
+
+            test "Diff resync transfers only the slots that differ (diskless load: $dl)" {
+                # Make the replica a master, so that it can't PSYNC any more
+                # when attached again, and let the two datasets diverge.
+                $replica replicaof no one
+                $master set key:1 changed
+                $master del key:2
+                $master set newkey 1
+                $master expire key:4 1000
+                $replica expire key:4 100000
+                $replica set replica-only 1
+                # The digests are computed by the cron, the slots still
+                # dirty at the handshake would be sent again.
+                wait_for_condition 50 100 {
+                    [s 0 slot_digests_dirty] == 0
+                } else {
+                    fail "slot digests not computed"
+                }
+
+                set full [s -1 sync_full]
+                set diff [s -1 sync_diff]
+                set lines [count_log_lines 0]
+                set master_lines [count_log_lines -1]
+                $replica replicaof $master_host $master_port
+                wait_for_condition 50 100 {
+                    [s -1 sync_diff] == $diff+1 &&
+                    [lindex [$replica role] 3] eq {connected}
+                } else {
+                    fail "replica didn't diff resync"
+                }
+                wait_for_ofs_sync $master $replica
+                assert_equal [$master debug digest] [$replica debug digest]
+                assert_equal $full [s -1 sync_full]
+
+                # Only the slots of the 5 keys modified are sent, and the 4
+                # keys that existed in those slots on the replica dropped.
+                verify_log_message -1 "*Diff resync: 5 of 16384 slots differ*" $master_lines
+                verify_log_message 0 "*Diff resync: 4 keys removed*" $lines
+                assert_range [$replica ttl key:4] 900 1000
+                assert_equal {} [$replica get replica-only]
+                assert_equal changed [$replica get key:1]
+                assert_equal 1000 [$replica dbsize]
+            }
+
+            test "Diff resync keeps replicating after the transfer (diskless load: $dl)" {
+                $master set key:3 after
+                $master select 0
+                $master sadd myset d
+                $master select 9
+                wait_for_ofs_sync $master $replica
+                assert_equal [$master debug digest] [$replica debug digest]
+            }
+        }
+    }
+}
+
+start_server {tags {"repl"}} {
+    start_server {} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set master_pid [srv -1 pid]
+        set replica [srv 0 client]
+
+        # Only the GETACK requested by the replica can make it fresh.
+        $master config set repl-ping-replica-period 60
+        $replica replicaof $master_host $master_port
+        wait_for_sync $replica
+        $master set foo bar
+        wait_for_ofs_sync $master $replica
+
+        test {CLIENT STALENESS MINOFFSET serves reads the replica applied} {
+            $replica client staleness minoffset [lindex [$master role] 1]
+            assert_equal bar [$replica get foo]
+            $replica client staleness minoffset [expr {[lindex [$master role] 1]+1}]
+            assert_error "STALE*" {$replica get foo}
+            # Masters are never stale.
+            $master client staleness minoffset 1000000000
+            assert_equal bar [$master get foo]
+            $replica client staleness off
+            $master client staleness off
+            assert_equal bar [$replica get foo]
+        }
+
+        test {CLIENT STALENESS blocks the read until the replica catches up} {
+            set rd [redis_deferring_client]
+            $rd client staleness minoffset [expr {[lindex [$master role] 1]+1}] timeout 10000
+            assert_equal OK [$rd read]
+            $rd get foo
+            wait_for_blocked_clients_count 1
+            $master set foo baz
+            assert_equal baz [$rd read]
+            wait_for_blocked_clients_count 0
+
+            # The read fails with -STALE on timeout, without being executed.
+            $rd client staleness minoffset 1000000000 timeout 100
+            assert_equal OK [$rd read]
+            $rd get foo
+            assert_error "STALE*" {$rd read}
+            wait_for_blocked_clients_count 0
+            $rd close
+        }
+
+        test {CLIENT STALENESS MAXLAG asks an idle master for a GETACK} {
+            after 300
+            $replica client staleness maxlag 100 timeout 5000
+            assert_equal baz [$replica get foo]
+            assert {[s slave_repl_staleness_ms] < 5000}
+        }
+
+        test {CLIENT STALENESS MAXLAG times out while the master is down} {
+            exec kill -SIGSTOP $master_pid
+            after 300
+            $replica client staleness maxlag 100 timeout 200
+            assert_error "STALE*" {$replica get foo}
+            # Scripts read too.
+            assert_error "STALE*" {$replica eval {return redis.call('get','foo')} 1 foo}
+            exec kill -SIGCONT $master_pid
+            $replica client staleness maxlag 100 timeout 5000
+            assert_equal baz [$replica get foo]
+            $replica client staleness off
+        }
+
+        test {CLIENT STALENESS argument validation} {
+            assert_error "*MAXLAG or MINOFFSET*" {$replica client staleness timeout 10}
+            assert_error "*negative*" {$replica client staleness maxlag -1}
+            assert_error "*syntax*" {$replica client staleness maxlag}
+        }
+    }
+}
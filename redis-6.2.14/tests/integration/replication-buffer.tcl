@@ -0,0 +1,172 @@
+# The replication backlog and the replicas share one replication buffer:
+# the replication stream is stored once, whatever the number of replicas.
+start_server {tags {"repl"}} {
+start_server {} {
+start_server {} {
+start_server {} {
+    set replica1 [srv -3 client]
+    set replica2 [srv -2 client]
+    set replica3 [srv -1 client]
+
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+
+    $master config set save ""
+    $master config set repl-backlog-size 16384
+    $master config set client-output-buffer-limit "replica 0 0 0"
+
+    # Make sure replica3 is synchronized with master
+    $replica3 replicaof $master_host $master_port
+    wait_for_sync $replica3
+
+    # Generating the RDB will take some 10 seconds, so that replica1 and
+    # replica2 accumulate the replication stream meanwhile
+    $master config set rdb-key-save-delay 10000
+    populate 1000 master 10000
+    $replica1 replicaof $master_host $master_port
+    $replica2 replicaof $master_host $master_port
+
+    # Make sure replica1 and replica2 are waiting the bgsave
+    wait_for_condition 50 100 {
+        ([s rdb_bgsave_in_progress] == 1) &&
+        [lindex [$replica1 role] 3] eq {sync} &&
+        [lindex [$replica2 role] 3] eq {sync}
+    } else {
+        fail "fail to sync with replicas"
+    }
+
+    test {All replicas share one global replication buffer} {
+        set before_used [s used_memory]
+        populate 1024 "" 1024 ; # Write 1M data into replication buffer
+        set after_used [s used_memory]
+        set diff [expr $after_used-$before_used]
+
+        # The memory grows by 1M of keys, plus 1M of replication stream
+        # stored once, not once per replica
+        assert {$diff < 3*1024*1024}
+        assert {[s mem_total_replication_buffers] > 1024*1024}
+        assert {[s mem_total_replication_buffers] < 1.5*1024*1024}
+        # Both the replicas waiting the bgsave reference all of it
+        set clients [$master client list type replica]
+        assert_equal 2 [regexp -all {omem=1[0-9]{6} } $clients]
+    }
+
+    test {Replication buffer is released once replicas are synchronized} {
+        $master config set rdb-key-save-delay 0
+        catch {exec kill -9 [get_child_pid 0]}
+        wait_for_condition 500 100 {
+            [lindex [$replica1 role] 3] eq {connected} &&
+            [lindex [$replica2 role] 3] eq {connected}
+        } else {
+            fail "replicas didn't sync"
+        }
+        $master set foo bar
+        wait_for_ofs_sync $master $replica1
+        wait_for_ofs_sync $master $replica2
+        wait_for_ofs_sync $master $replica3
+
+        # Only the backlog is retained, that is, repl-backlog-size plus at
+        # most one block
+        wait_for_condition 50 100 {
+            [s mem_total_replication_buffers] < 64*1024
+        } else {
+            fail "replication buffer not released"
+        }
+        assert_equal [$master debug digest] [$replica1 debug digest]
+        assert_equal [$master debug digest] [$replica2 debug digest]
+        assert_equal [$master debug digest] [$replica3 debug digest]
+    }
+
+    test {Partial resynchronization is served from the replication buffer} {
+        set psync_ok [s sync_partial_ok]
+        $master client kill type replica
+        populate 100 psync 10
+        wait_for_condition 50 100 {
+            [s sync_partial_ok] == $psync_ok+3
+        } else {
+            fail "replicas didn't partially resynchronize"
+        }
+        wait_for_ofs_sync $master $replica1
+        wait_for_ofs_sync $master $replica2
+        wait_for_ofs_sync $master $replica3
+        assert_equal [$master debug digest] [$replica1 debug digest]
+        assert_equal [$master debug digest] [$replica3 debug digest]
+    }
+
+    test {Offsets no longer in the trimmed backlog need a full resync} {
+        set full_sync [s sync_full]
+        $replica1 replicaof no one
+        # Write much more than the backlog size, so that the offset of
+        # replica1 is trimmed away
+        populate 100 trim 1024
+        $replica1 replicaof $master_host $master_port
+        wait_for_sync $replica1
+        assert_equal [expr {$full_sync+1}] [s sync_full]
+        assert {[s repl_backlog_histlen] < 64*1024}
+        wait_for_ofs_sync $master $replica1
+        assert_equal [$master debug digest] [$replica1 debug digest]
+    }
+}
+}
+}
+}
+
+# The part of the replication stream trimmed from the in memory backlog is
+# kept in the disk backlog, that can serve partial resynchronizations too.
+start_server {tags {"repl"}} {
+start_server {} {
+    set replica [srv -1 client]
+    set replica_pid [srv -1 pid]
+
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+
+    $master config set save ""
+    $master config set repl-backlog-size 16384
+    $master config set repl-backlog-disk-size 8mb
+    $replica replicaof $master_host $master_port
+    wait_for_sync $replica
+
+    proc disconnect_and_write {master replica_pid prefix} {
+        # Write much more than the in memory backlog while the replica
+        # is disconnected and can't reconnect
+        exec kill -SIGSTOP $replica_pid
+        $master client kill type replica
+        populate 1000 $prefix 1000
+        exec kill -SIGCONT $replica_pid
+    }
+
+    test {Partial resynchronization is served from the disk backlog} {
+        set psync_ok [s sync_partial_ok]
+        set psync_ofs [expr {[s master_repl_offset]+1}]
+        disconnect_and_write $master $replica_pid disk
+        # The offset the replica will ask is only in the disk backlog
+        assert {[s repl_backlog_disk_histlen] > 1000*1000}
+        assert {[s repl_backlog_disk_first_byte_offset] <= $psync_ofs}
+        assert {[s repl_backlog_first_byte_offset] > $psync_ofs}
+        wait_for_condition 50 100 {
+            [s sync_partial_ok] == $psync_ok+1
+        } else {
+            fail "replica didn't partially resynchronize"
+        }
+        wait_for_ofs_sync $master $replica
+        assert_equal [$master debug digest] [$replica debug digest]
+    }
+
+    test {The disk backlog is released when disabled} {
+        $master config set repl-backlog-disk-size 0
+        assert_equal 0 [s repl_backlog_disk_histlen]
+        set full_sync [s sync_full]
+        disconnect_and_write $master $replica_pid nodisk
+        wait_for_condition 50 100 {
+            [s sync_full] == $full_sync+1
+        } else {
+            fail "replica didn't fully resynchronize"
+        }
+        wait_for_ofs_sync $master $replica
+        assert_equal [$master debug digest] [$replica debug digest]
+    }
+}
+}
@@ -527,8 +527,12 @@ test {diskless loading short read} {
                     $master multi
                     $master client kill type replica
                     $master set asdf asdf
-                    # the side effect of resizing the backlog is that it is flushed (16k is the min size)
-                    $master config set repl-backlog-size [expr {16384 + $i}]
+                    # fill the replication backlog with new content, so that
+                    # the offset of the replica is no longer in it
+                    $master config set repl-backlog-size 16384
+                    for {set keyid 0} {$keyid < 10} {incr keyid} {
+                        $master set "$keyid string_$keyid" [string repeat A 16384]
+                    }
                     $master exec
                 }
                 # wait for loading to stop (fail)
@@ -728,6 +732,50 @@ start_server {tags {"repl"}} {
             }
         }
     }
+
+    test "diskless slow replica is dropped when it throttles the others" {
+        $master config set repl-diskless-sync-buffer-size 1mb
+        $master config set repl-diskless-sync-slow-timeout 1
+        start_server {} {
+            set slow [srv 0 client]
+            start_server {} {
+                set fast [srv 0 client]
+                set loglines [count_log_lines -2]
+                $slow config set repl-diskless-load swapdb
+                $slow config set key-load-delay 100
+                $slow replicaof $master_host $master_port
+                $fast replicaof $master_host $master_port
+
+                # the fast replica gets the whole rdb without waiting for the slow one
+                wait_for_log_messages -2 {"*behind the others, disconnecting it*"} $loglines 100 100
+                wait_for_condition 150 100 {
+                    [lindex [$fast role] 3] eq {connected}
+                } else {
+                    fail "fast replica still not connected after some time"
+                }
+                assert_equal [$master debug digest] [$fast debug digest]
+            }
+        }
+        $master config set repl-diskless-sync-slow-timeout 0
+        $master config set repl-diskless-sync-buffer-size 8mb
+    }
+
+    test "diskless rdb transfer is rate limited" {
+        $master config set repl-diskless-sync-max-rate 50mb
+        start_server {} {
+            set replica [srv 0 client]
+            $replica replicaof $master_host $master_port
+            wait_for_condition 500 100 {
+                [lindex [$replica role] 3] eq {connected}
+            } else {
+                fail "replica still not connected after some time"
+            }
+            # 200mb at 50mb per second
+            assert {[s -1 rdb_last_bgsave_time_sec] >= 3}
+            assert_equal [$master debug digest] [$replica debug digest]
+        }
+        $master config set repl-diskless-sync-max-rate 0
+    }
 }
 
 test "diskless replication child being killed is collected" {
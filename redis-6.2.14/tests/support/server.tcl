@@ -24,9 +24,9 @@ proc clean_persistence config {
     # files right away, since they can accumulate and take up a lot of space
     set config [dict get $config "config"]
     set rdb [format "%s/%s" [dict get $config "dir"] "dump.rdb"]
-    set aof [format "%s/%s" [dict get $config "dir"] "appendonly.aof"]
+    set aof_dir [format "%s/%s" [dict get $config "dir"] "appendonlydir"]
     catch {exec rm -rf $rdb}
-    catch {exec rm -rf $aof}
+    catch {exec rm -rf $aof_dir}
 }
 
 proc kill_server config {
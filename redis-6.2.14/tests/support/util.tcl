@@ -113,6 +113,30 @@ proc wait_done_loading r {
     }
 }
 
+# Return the path of the AOF directory of the server.
+proc get_aof_dir r {
+    set dir [lindex [$r config get dir] 1]
+    set dirname [lindex [$r config get appenddirname] 1]
+    return [file join $dir $dirname]
+}
+
+# Return the content of the AOF manifest, one list per line.
+proc get_aof_manifest r {
+    set filename [lindex [$r config get appendfilename] 1]
+    set fp [open [file join [get_aof_dir $r] $filename.manifest] r]
+    set lines [split [string trim [read $fp]] "\n"]
+    close $fp
+    return $lines
+}
+
+# Return the path of the INCR file the server is currently appending to.
+proc get_last_incr_aof_path r {
+    foreach line [get_aof_manifest $r] {
+        if {[lindex $line 5] eq "i"} {set last [lindex $line 1]}
+    }
+    return [file join [get_aof_dir $r] $last]
+}
+
 # count current log lines in server's stdout
 proc count_log_lines {srv_idx} {
     set _ [string trim [exec wc -l < [srv $srv_idx stdout]]]
@@ -178,6 +178,28 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
         }
     }
 
+    test "AOF rewrite of compressed bitmap" {
+        r flushall
+        r config set compressed-bitmaps yes
+        for {set j 0} {$j < 1000} {incr j} {
+            r setbit key [randomInt 4000000000] 1
+        }
+        r setbit key 100 0
+        r pexpire key 1000000
+        assert_equal [r object encoding key] roaring
+        set d1 [r debug digest]
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        set d2 [r debug digest]
+        if {$d1 ne $d2} {
+            error "assertion:$d1 is not equal to $d2"
+        }
+        assert_equal [r type key] bitmap
+        assert {[r pttl key] > 0}
+        r config set compressed-bitmaps no
+    }
+
     test {BGREWRITEAOF is delayed if BGSAVE is in progress} {
         r multi
         r bgsave
@@ -204,3 +226,53 @@ start_server {tags {"aofrw"} overrides {aof-use-rdb-preamble no}} {
         }
     }
 }
+
+start_server {tags {"aofrw"} overrides {appendonly yes auto-aof-rewrite-percentage 0}} {
+    proc count_incr_aofs {} {
+        set count 0
+        foreach line [get_aof_manifest r] {
+            if {[lindex $line 5] eq "i"} {incr count}
+        }
+        return $count
+    }
+
+    test {Failed AOF rewrites reuse the empty INCR file and get limited} {
+        waitForBgrewriteaof r
+        r set foo bar
+        set incrs [count_incr_aofs]
+        r config set rdb-key-save-delay 10000000
+        for {set j 0} {$j < 3} {incr j} {
+            r bgrewriteaof
+            wait_for_condition 50 100 {
+                [s aof_rewrite_in_progress] == 1
+            } else {
+                fail "AOF rewrite did not start"
+            }
+            exec kill -9 [get_child_pid 0]
+            wait_for_condition 50 100 {
+                [s aof_rewrite_in_progress] == 0
+            } else {
+                fail "AOF rewrite did not terminate"
+            }
+        }
+        assert_equal 3 [s aof_rewrites_consecutive_failures]
+        # Only the first attempt opened a new INCR file.
+        assert_equal [expr {$incrs+1}] [count_incr_aofs]
+
+        # The automatic rewrite is delayed.
+        set loglines [count_log_lines 0]
+        r config set auto-aof-rewrite-min-size 0
+        r config set auto-aof-rewrite-percentage 1
+        r set foo [string repeat x 1000]
+        wait_for_log_messages 0 {"*will retry in 1 minutes*"} $loglines 50 100
+        assert_equal 0 [s aof_rewrite_in_progress]
+        r config set auto-aof-rewrite-percentage 0
+
+        # BGREWRITEAOF is not limited, and a success resets the counter.
+        r config set rdb-key-save-delay 0
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        assert_equal 0 [s aof_rewrites_consecutive_failures]
+        assert_equal ok [s aof_last_bgrewrite_status]
+    }
+}
@@ -38,6 +38,26 @@ proc simulate_bit_op {op args} {
     binary format b* $out
 }
 
+# Helpers to move the bits of a string into a compressed bitmap and back.
+proc string_to_bitmap {key str} {
+    r del $key
+    binary scan $str B* bits
+    set len [string length $bits]
+    for {set x 0} {$x < $len} {incr x} {
+        if {[string index $bits $x]} {r setbit $key $x 1}
+    }
+    # Setting the last bit makes the logical length match the string.
+    if {$len} {r setbit $key [expr {$len-1}] [string index $bits end]}
+}
+
+proc bitmap_to_string {key len} {
+    set bits {}
+    for {set x 0} {$x < $len*8} {incr x} {
+        append bits [r getbit $key $x]
+    }
+    binary format B* $bits
+}
+
 start_server {tags {"bitops"}} {
     test {BITCOUNT returns 0 against non existing key} {
         r bitcount no-key
@@ -350,6 +370,180 @@ start_server {tags {"bitops"}} {
     }
 }
 
+start_server {tags {"bitops"}} {
+    r config set compressed-bitmaps yes
+
+    test {SETBIT creates a compressed bitmap if compressed-bitmaps is enabled} {
+        r del mykey
+        r setbit mykey 4000000000 1
+        assert_type bitmap mykey
+        assert_encoding roaring mykey
+        assert {[r memory usage mykey] < 1024}
+        list [r getbit mykey 4000000000] [r getbit mykey 3999999999] \
+             [r bitcount mykey] [r bitpos mykey 1] [r bitpos mykey 0]
+    } {1 0 1 4000000000 0}
+
+    test {SETBIT against compressed bitmap returns the old bit value} {
+        r del mykey
+        list [r setbit mykey 100 1] [r setbit mykey 100 1] \
+             [r setbit mykey 100 0] [r setbit mykey 100 0] [r bitcount mykey]
+    } {0 1 1 0 0}
+
+    test {SETBIT does not convert existing strings} {
+        r del mykey
+        r set mykey foo
+        r setbit mykey 100 1
+        r type mykey
+    } {string}
+
+    test {Compressed bitmap: string commands read it as a string} {
+        r set s foobar
+        string_to_bitmap mykey foobar
+        assert_equal bitmap [r type mykey]
+        assert_equal foobar [r get mykey]
+        assert_equal {foobar {}} [r mget mykey nokey]
+        assert_equal 6 [r strlen mykey]
+        assert_equal oba [r getrange mykey 2 4]
+        assert_equal [r bitfield s get u8 8 get i5 13 get u16 40] \
+                     [r bitfield_ro mykey get u8 8 get i5 13 get u16 40]
+        assert_error "WRONGTYPE*" {r incr mykey}
+        assert_equal bitmap [r type mykey]
+
+        # Only the bytes read are converted.
+        r del big
+        r setbit big 4000000000 1
+        assert_equal 500000001 [r strlen big]
+        assert_equal "\x00\x80" [r getrange big -2 -1]
+        assert_equal bitmap [r type big]
+    }
+
+    test {Compressed bitmap: string commands writing it convert it to a string} {
+        string_to_bitmap mykey foobar
+        assert_equal 9 [r append mykey baz]
+        assert_equal string [r type mykey]
+        assert_equal foobarbaz [r get mykey]
+
+        string_to_bitmap mykey foobar
+        assert_equal 6 [r setrange mykey 0 F]
+        assert_equal string [r type mykey]
+        assert_equal Foobar [r get mykey]
+
+        string_to_bitmap mykey foobar
+        assert_equal {102 102} [r bitfield mykey get u8 0 set u8 0 70]
+        assert_equal string [r type mykey]
+        assert_equal Foobar [r get mykey]
+    }
+
+    test {Compressed bitmap: GETBIT, BITCOUNT and BITPOS fuzzing} {
+        for {set i 0} {$i < 20} {incr i} {
+            set str [randstring 1 64]
+            if {$i % 2} {set str [string repeat "\xff" [string length $str]]}
+            set len [string length $str]
+            r set s $str
+            string_to_bitmap b $str
+            assert_equal [r bitcount s] [r bitcount b]
+            assert_equal [r bitpos s 0] [r bitpos b 0]
+            assert_equal [r bitpos s 1] [r bitpos b 1]
+            for {set j 0} {$j < 20} {incr j} {
+                set start [expr {[randomInt [expr {$len*2+10}]]-$len-5}]
+                set end [expr {[randomInt [expr {$len*2+10}]]-$len-5}]
+                assert_equal [r bitcount s $start $end] [r bitcount b $start $end]
+                assert_equal [r bitpos s 0 $start] [r bitpos b 0 $start]
+                assert_equal [r bitpos s 1 $start] [r bitpos b 1 $start]
+                assert_equal [r bitpos s 0 $start $end] [r bitpos b 0 $start $end]
+                assert_equal [r bitpos s 1 $start $end] [r bitpos b 1 $start $end]
+            }
+        }
+    }
+
+    foreach op {and or xor not} {
+        test "Compressed bitmap: BITOP $op fuzzing" {
+            for {set i 0} {$i < 10} {incr i} {
+                set numkeys [expr {$op eq {not} ? 1 : [randomInt 4]+1}]
+                set strkeys {}
+                set mixkeys {}
+                for {set j 0} {$j < $numkeys} {incr j} {
+                    set str [randstring 1 32]
+                    r set s$j $str
+                    lappend strkeys s$j
+                    # Mix compressed bitmaps and strings as sources.
+                    if {$j % 2 == 0} {
+                        string_to_bitmap b$j $str
+                        lappend mixkeys b$j
+                    } else {
+                        lappend mixkeys s$j
+                    }
+                }
+                set len [r bitop $op dest1 {*}$strkeys]
+                assert_equal $len [r bitop $op dest2 {*}$mixkeys]
+                assert_type bitmap dest2
+                assert_equal [r get dest1] [bitmap_to_string dest2 $len]
+            }
+        }
+    }
+
+    test {BITOPCARD matches BITCOUNT of BITOP results} {
+        r flushall
+        for {set j 0} {$j < 3} {incr j} {
+            for {set x 0} {$x < 5000} {incr x} {
+                r setbit b$j [randomInt 200000] 1
+            }
+            r setbit b$j [expr {$j*65536+1000}] 1
+        }
+        r set str [randstring 100 1000]
+        foreach op {and or} {
+            foreach keys {{b0} {b0 b1} {b0 b1 b2} {b0 str b2 nokey}} {
+                r bitop $op dest {*}$keys
+                assert_equal [r bitcount dest] [r bitopcard $op {*}$keys]
+            }
+        }
+        assert_error "*syntax*" {r bitopcard xor b0 b1}
+    }
+
+    test {Compressed bitmap: DEBUG RELOAD and DUMP/RESTORE} {
+        r flushall
+        for {set x 0} {$x < 10000} {incr x} {
+            r setbit mykey [randomInt 4000000000] 1
+        }
+        # Dense area and long runs.
+        for {set x 0} {$x < 70000} {incr x 3} {r setbit mykey $x 1}
+        r bitop not mykey2 mykey
+        set count [r bitcount mykey]
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        set dump [r dump mykey]
+        r del mykey
+        r restore mykey 0 $dump
+        assert_type bitmap mykey
+        assert_equal $count [r bitcount mykey]
+        assert_equal $digest [r debug digest]
+    }
+
+    test {Compressed bitmap: only RDB files holding them use their version} {
+        proc rdb_header {} {
+            r save
+            set fd [open [file join [lindex [r config get dir] 1] \
+                                    [lindex [r config get dbfilename] 1]] rb]
+            set header [read $fd 9]
+            close $fd
+            return $header
+        }
+        proc dump_version {key} {
+            binary scan [string range [r dump $key] end-9 end-8] s ver
+            return $ver
+        }
+        r set mystring foo
+        assert_equal REDIS0064 [rdb_header]
+        assert_equal 64 [dump_version mykey]
+        assert_equal 9 [dump_version mystring]
+        r del mykey mykey2
+        assert_equal REDIS0009 [rdb_header]
+    }
+
+    r config set compressed-bitmaps no
+}
+
 start_server {tags {"bitops large-memory"}} {
     test "BIT pos larger than UINT_MAX" {
         set bytes [expr (1 << 29) + 1]
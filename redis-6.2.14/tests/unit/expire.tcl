@@ -423,3 +423,152 @@ start_server {tags {"expire"}} {
         }
     }
 }
+
+start_server {tags {"expire"} overrides {active-expire-index yes}} {
+    test {Deadline index: only the due keys are actively expired} {
+        r flushall
+        r config resetstat
+        for {set j 0} {$j < 2000} {incr j} {
+            r set long:$j x ex 1000
+            r set short:$j x px 100
+            r set persistent:$j x
+        }
+        assert {[s mem_expire_index] > 0}
+        wait_for_condition 50 100 {
+            [r dbsize] == 4000
+        } else {
+            fail "Keys due were not actively expired"
+        }
+        assert_equal 2000 [s expired_keys]
+        assert_equal 2000 [scan [regexp -inline {expires\=([0-9]*)} [r info keyspace]] expires=%d]
+    }
+
+    test {Deadline index: updated expires are honored} {
+        r flushall
+        r debug set-active-expire 0
+        r set a x ex 1000
+        r pexpire a 50
+        r set b x px 50
+        r persist b
+        r set c x px 50
+        r set c y
+        r set d x px 50
+        r rename d e
+        r set f x px 50
+        r getex f ex 1000
+        after 100
+        r debug set-active-expire 1
+        wait_for_condition 50 100 {
+            [r exists a e] == 0
+        } else {
+            fail "Keys due were not actively expired"
+        }
+        assert_equal {x y x} [r mget b c f]
+        assert_equal -1 [r ttl b]
+    }
+
+    test {Deadline index: memory is released on FLUSHALL and DEL} {
+        r flushall
+        set empty [s mem_expire_index]
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j x ex 1000
+        }
+        assert {[s mem_expire_index] > $empty + 1000*8}
+        for {set j 0} {$j < 500} {incr j} {
+            r del key:$j
+        }
+        for {set j 500} {$j < 1000} {incr j} {
+            r persist key:$j
+        }
+        assert_equal $empty [s mem_expire_index]
+        r set key x ex 1000
+        r flushall async
+        assert_equal $empty [s mem_expire_index]
+    }
+
+    test {Deadline index: SWAPDB and DEBUG RELOAD} {
+        r flushall
+        r select 10
+        r set x y px 500
+        r select 9
+        r swapdb 9 10
+        r debug reload
+        wait_for_condition 50 100 {
+            [r dbsize] == 0
+        } else {
+            fail "Swapped key was not actively expired"
+        }
+    }
+
+    test {Deadline index can be turned off and on at runtime} {
+        r flushall
+        r config set active-expire-index no
+        assert_equal 0 [s mem_expire_index]
+        r set a x px 100
+        r set b x ex 1000
+        r config set active-expire-index yes
+        assert {[s mem_expire_index] > 0}
+        wait_for_condition 50 100 {
+            [r dbsize] == 1
+        } else {
+            fail "Keys due were not actively expired"
+        }
+        assert_equal 1 [r exists b]
+    }
+}
+
+start_server {tags {"expire"} overrides {active-expire-batch-size 100}} {
+    foreach index {no yes} {
+        test "Batched expiry propagates a single UNLINK per batch (index: $index)" {
+            r config set active-expire-index $index
+            r flushall
+            r debug set-active-expire 0
+            set repl [attach_to_replication_stream]
+            r set a x px 50
+            r set b x px 50
+            r hset c f1 v1 f2 v2
+            r pexpire c 50
+            after 100
+            r debug set-active-expire 1
+            wait_for_condition 50 100 {
+                [r dbsize] == 0
+            } else {
+                fail "Keys due were not actively expired"
+            }
+            assert_replication_stream $repl {
+                {select *}
+                {set a x PX 50}
+                {set b x PX 50}
+                {hset c f1 v1 f2 v2}
+                {pexpire c 50}
+            }
+            set cmd [read_from_replication_stream $repl]
+            assert_equal unlink [lindex $cmd 0]
+            assert_equal {a b c} [lsort [lrange $cmd 1 end]]
+            close_replication_stream $repl
+        }
+    }
+
+    test {Batched expiry of many keys frees the values in the background} {
+        r flushall
+        r config resetstat
+        set lazyfreed [s lazyfreed_objects]
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j x px 100
+            r hset hash:$j a 1 b 2
+            r pexpire hash:$j 100
+        }
+        wait_for_condition 50 100 {
+            [r dbsize] == 0
+        } else {
+            fail "Keys due were not actively expired"
+        }
+        assert_equal 2000 [s expired_keys]
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0
+        } else {
+            fail "Values were not released"
+        }
+        assert_equal 2000 [expr {[s lazyfreed_objects] - $lazyfreed}]
+    }
+}
@@ -715,4 +715,87 @@ start_server {tags {"geo"}} {
             unset -nocomplain debuginfo
         }
     }
+
+    test {GEOSEARCH dense set matches a brute force search} {
+        r del dense
+        set argv {}
+        for {set j 0} {$j < 3000} {incr j} {
+            lappend argv [expr {-73.99 + rand()*0.1}] [expr {40.70 + rand()*0.1}] p:$j
+        }
+        r geoadd dense {*}$argv
+        assert_encoding skiplist dense
+        # Use the coordinates as stored, to compare with the same points.
+        set members [r zrange dense 0 -1]
+        set coords [r geopos dense {*}$members]
+        for {set i 0} {$i < 20} {incr i} {
+            set lon [expr {-73.99 + rand()*0.1}]
+            set lat [expr {40.70 + rand()*0.1}]
+            set radius [expr {100 + [randomInt 3000]}]
+            set expected {}
+            set border {}
+            foreach m $members xy $coords {
+                set d [geo_distance [lindex $xy 0] [lindex $xy 1] $lon $lat]
+                # Points on the border are subject to rounding errors.
+                if {abs($d - $radius) < 0.001} {
+                    lappend border $m
+                } elseif {$d < $radius} {
+                    lappend expected $m
+                }
+            }
+            set res {}
+            foreach m [r geosearch dense fromlonlat $lon $lat byradius $radius m] {
+                if {[lsearch -exact $border $m] == -1} {lappend res $m}
+            }
+            assert_equal [lsort $expected] [lsort $res]
+
+            set expected {}
+            foreach m $members xy $coords {
+                if {[pointInRectangle [expr {$radius/1000.0}] [expr {$radius/2000.0}] \
+                        [lindex $xy 0] [lindex $xy 1] $lon $lat 0.999]} {
+                    lappend expected $m
+                }
+            }
+            set res [r geosearch dense fromlonlat $lon $lat bybox $radius [expr {$radius/2.0}] m]
+            foreach m $expected {assert {[lsearch -exact $res $m] != -1}}
+            foreach m $res {
+                set xy [lindex [r geopos dense $m] 0]
+                assert {[pointInRectangle [expr {$radius/1000.0}] [expr {$radius/2000.0}] \
+                        [lindex $xy 0] [lindex $xy 1] $lon $lat 1.001]}
+            }
+        }
+    }
+
+    test {GEOMSEARCH replies like GEOSEARCH for every center} {
+        set centers {}
+        set expected {}
+        for {set i 0} {$i < 10} {incr i} {
+            set lon [expr {-73.99 + rand()*0.1}]
+            set lat [expr {40.70 + rand()*0.1}]
+            lappend centers $lon $lat
+            lappend expected [r geosearch dense fromlonlat $lon $lat byradius 1500 m asc withdist withcoord]
+        }
+        assert_equal $expected [r geomsearch dense centers 10 {*}$centers byradius 1500 m asc withdist withcoord]
+
+        set expected {}
+        foreach {lon lat} $centers {
+            lappend expected [r geosearch dense fromlonlat $lon $lat bybox 2 1 km count 5 desc withhash]
+        }
+        assert_equal $expected [r geomsearch dense bybox 2 1 km count 5 desc withhash centers 10 {*}$centers]
+
+        foreach res [r geomsearch dense centers 10 {*}$centers byradius 3 km count 7 any] {
+            assert_equal 7 [llength $res]
+        }
+    }
+
+    test {GEOMSEARCH with missing key and wrong arguments} {
+        r del nokey
+        assert_equal {{} {}} [r geomsearch nokey centers 2 1 1 2 2 byradius 1 km]
+        assert_error "*numcenters*" {r geomsearch dense centers 4 1 1 2 2 byradius 1 km}
+        assert_error "*CENTERS*" {r geomsearch dense byradius 1 km withdist withhash withcoord asc}
+        assert_error "*BYRADIUS and BYBOX*" {r geomsearch dense centers 1 1 1 withdist withhash asc}
+        assert_error "*invalid longitude*" {r geomsearch dense centers 1 200 1 byradius 1 km}
+        assert_error "*ANY*" {r geomsearch dense centers 1 1 1 byradius 1 km any}
+        r set wrongtype foo
+        assert_error "WRONGTYPE*" {r geomsearch wrongtype centers 1 1 1 byradius 1 km}
+    }
 }
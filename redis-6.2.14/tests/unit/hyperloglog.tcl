@@ -210,4 +210,61 @@ start_server {tags {"hll"}} {
         r pfadd hll 1 2 3
         assert {[r getrange hll 15 15] eq "\x80"}
     }
+
+    test {PFMERGE / PFCOUNT with and without SIMD kernels give the same results} {
+        r del hll1 hll2 hll3 hll
+        for {set j 1} {$j <= 3} {incr j} {
+            for {set x 0} {$x < 2000} {incr x} {
+                r pfadd hll$j [randomInt 1000000]
+            }
+        }
+        # Mix dense and sparse sources.
+        r pfdebug todense hll1
+        r pfdebug todense hll2
+        r config set pfcount-cache-max-entries 0
+        set res {}
+        foreach simd {on off} {
+            r pfdebug simd $simd
+            r del hll
+            r pfmerge hll hll1 hll2 hll3
+            lappend res [r pfcount hll1 hll2 hll3] \
+                        [r pfdebug getreg hll] [r pfcount hll]
+        }
+        r pfdebug simd on
+        r config set pfcount-cache-max-entries 128
+        assert_equal [lrange $res 0 2] [lrange $res 3 5]
+    }
+
+    test {PFCOUNT multiple-keys cached result is invalidated on writes} {
+        r del hll1 hll2 hll3
+        r pfadd hll1 a b c
+        r pfadd hll2 c d e
+        assert_equal 5 [r pfcount hll1 hll2 hll3]
+        assert_equal 5 [r pfcount hll1 hll2 hll3]
+        r pfadd hll3 f g
+        assert_equal 7 [r pfcount hll1 hll2 hll3]
+        r pfadd hll1 h
+        assert_equal 8 [r pfcount hll1 hll2 hll3]
+        r del hll2
+        assert_equal 6 [r pfcount hll1 hll2 hll3]
+        r pfmerge hll2 hll1 hll3
+        r pfadd hll2 i
+        assert_equal 7 [r pfcount hll1 hll2 hll3]
+        r rename hll3 hll4
+        assert_equal 7 [r pfcount hll1 hll2 hll3]
+        r flushdb
+        assert_equal 0 [r pfcount hll1 hll2 hll3]
+    }
+
+    test {PFCOUNT multiple-keys cached result is not used after expire} {
+        r del hll1 hll2
+        r debug set-active-expire 0
+        r pfadd hll1 a b c
+        r pfadd hll2 c d e
+        r pexpire hll2 100
+        assert_equal 5 [r pfcount hll1 hll2]
+        after 200
+        assert_equal 3 [r pfcount hll1 hll2]
+        r debug set-active-expire 1
+    } {OK} {needs:debug}
 }
@@ -185,10 +185,15 @@ start_server {tags {"introspection"}} {
             pidfile
             syslog-ident
             appendfilename
+            appenddirname
             supervised
             syslog-facility
             databases
             io-threads
+            lazyfree-threads
+            slab-allocator
+            hugepage-regions
+            replica-apply-thread
             logfile
             unixsocketperm
             slaveof
@@ -37,3 +37,111 @@ start_server {tags {"lazyfree"}} {
         }
     }
 }
+
+start_server {tags {"lazyfree"} overrides {lazyfree-threads 4}} {
+    test "UNLINK of huge objects with multiple lazyfree threads" {
+        set orig_mem [s used_memory]
+        set args {}
+        for {set i 0} {$i < 100000} {incr i} {
+            lappend args $i $i
+        }
+        r zadd myzset {*}$args
+        r hset myhash {*}$args
+        r sadd myset {*}[lrange $args 0 99999]
+        # Unlink the set while its hash table is rehashing.
+        r sadd myset a b c
+        set peak_mem [s used_memory]
+        assert {$peak_mem > $orig_mem+10000000}
+        assert {[r unlink myzset myhash myset] == 3}
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s lazyfree_pending_memory] == 0 &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed by UNLINK"
+        }
+        assert {[s lazyfreed_objects] >= 3}
+        assert {[r dbsize] == 0}
+    }
+
+    test "FLUSHALL ASYNC with multiple lazyfree threads" {
+        set orig_mem [s used_memory]
+        r debug populate 200000 key 10
+        for {set i 0} {$i < 1000} {incr i} {
+            r expire key:$i 1000
+        }
+        set peak_mem [s used_memory]
+        r flushall async
+        assert {[r dbsize] == 0}
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s lazyfree_pending_memory] == 0 &&
+            [s used_memory] < $peak_mem &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed by FLUSHALL ASYNC"
+        }
+        # The server is still fully functional after the background release.
+        r set foo bar
+        assert_equal bar [r get foo]
+    }
+}
+
+start_server {tags {"lazyfree"} overrides {lazyfree-incremental-budget 1000}} {
+    test "DEL releases huge values incrementally" {
+        set orig_mem [s used_memory]
+        set args {}
+        for {set i 0} {$i < 100000} {incr i} {
+            lappend args $i $i
+        }
+        r zadd myzset {*}$args
+        r hset myhash {*}$args
+        r sadd myset {*}[lrange $args 0 99999]
+        r rpush mylist {*}$args
+        for {set i 0} {$i < 20000} {incr i} {
+            r xadd mystream * item $i
+        }
+        r set small foo
+        set peak_mem [s used_memory]
+        assert {[r del myzset myhash myset mylist mystream small] == 6}
+        assert {[r exists myzset myhash myset mylist mystream small] == 0}
+        wait_for_condition 50 100 {
+            [s lazyfree_incremental_objects] == 0 &&
+            [s lazyfree_pending_objects] == 0 &&
+            [s lazyfree_pending_memory] == 0 &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed incrementally"
+        }
+        assert {[s lazyfreed_objects] >= 5}
+    }
+
+    test "Overwritten huge values are released incrementally" {
+        set args {}
+        for {set i 0} {$i < 10000} {incr i} {
+            lappend args $i
+        }
+        r sadd myset {*}$args
+        r set myset foo
+        assert_equal foo [r get myset]
+        wait_for_condition 50 100 {
+            [s lazyfree_incremental_objects] == 0 &&
+            [s lazyfree_pending_memory] == 0
+        } else {
+            fail "Overwritten value is not reclaimed incrementally"
+        }
+        r del myset
+    }
+
+    test "Small values are not released incrementally" {
+        set freed [s lazyfreed_objects]
+        r sadd myset a b c
+        r del myset
+        assert_equal $freed [s lazyfreed_objects]
+        r config set lazyfree-incremental-budget 0
+        r sadd myset {*}$args
+        r del myset
+        assert_equal $freed [s lazyfreed_objects]
+        r config set lazyfree-incremental-budget 1000
+    }
+}
@@ -25,6 +25,7 @@ start_server {tags {"maxmemory"}} {
 
     foreach policy {
         allkeys-random allkeys-lru allkeys-lfu volatile-lru volatile-lfu volatile-random volatile-ttl
+        allkeys-tinylfu volatile-tinylfu
     } {
         test "maxmemory - is the memory limit honoured? (policy $policy)" {
             # make sure to start with a blank instance
@@ -55,6 +56,98 @@ start_server {tags {"maxmemory"}} {
         }
     }
 
+    foreach policy {
+        allkeys-lru allkeys-lfu volatile-lru volatile-lfu volatile-ttl
+    } {
+        test "maxmemory - is the memory limit honoured with eviction candidates? (policy $policy)" {
+            r flushall
+            r config set maxmemory-eviction-candidates 128
+            set used [s used_memory]
+            set limit [expr {$used+200*1024}]
+            r config set maxmemory $limit
+            r config set maxmemory-policy $policy
+            set numkeys 0
+            while 1 {
+                r setex [randomKey] 10000 x
+                incr numkeys
+                if {[s used_memory]+4096 > $limit} {
+                    assert {$numkeys > 10}
+                    break
+                }
+            }
+            for {set j 0} {$j < $numkeys} {incr j} {
+                r setex [randomKey] 10000 x
+            }
+            # The candidates set is counted as used memory.
+            assert {[s used_memory] < ($limit+4096)}
+            assert {[s mem_eviction_candidates] > 0}
+            assert {[r dbsize] > 0}
+            r config set maxmemory-eviction-candidates 0
+            assert_equal 0 [s mem_eviction_candidates]
+        }
+    }
+
+    test "maxmemory - eviction candidates evict the least recently used keys" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-lru
+        r config set maxmemory-eviction-candidates 1024
+        for {set j 0} {$j < 2000} {incr j} {
+            r set "cold:$j" [string repeat x 100]
+        }
+        # The LRU clock resolution is one second.
+        after 2000
+        for {set j 0} {$j < 100} {incr j} {
+            r set "hot:$j" [string repeat x 100]
+        }
+        r config set maxmemory [expr {[s used_memory]-50*1024}]
+        for {set j 0} {$j < 500} {incr j} {
+            r set "new:$j" [string repeat x 100]
+        }
+        assert {[s evicted_keys] > 0}
+        for {set j 0} {$j < 100} {incr j} {
+            assert_equal 1 [r exists "hot:$j"]
+        }
+        r config set maxmemory 0
+        r config set maxmemory-eviction-candidates 0
+    }
+
+    test "maxmemory - allkeys-tinylfu keeps frequently used keys during scans" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-tinylfu
+        r config resetstat
+        for {set j 0} {$j < 200} {incr j} {
+            r set "hot:$j" [string repeat x 100]
+        }
+        for {set i 0} {$i < 10} {incr i} {
+            for {set j 0} {$j < 200} {incr j} {
+                r get "hot:$j"
+            }
+        }
+        assert {[r object freq hot:0] > 1}
+        r config set maxmemory [expr {[s used_memory]+50*1024}]
+        # A scan of keys that are accessed just once.
+        for {set j 0} {$j < 3000} {incr j} {
+            r set "scan:$j" [string repeat x 100]
+        }
+        assert {[s evicted_keys] > 0}
+        assert {[s tinylfu_rejected_keys] > 0}
+        set hot 0
+        for {set j 0} {$j < 200} {incr j} {
+            incr hot [r exists "hot:$j"]
+        }
+        assert {$hot >= 180}
+        assert {[s policy_keyspace_hits_perc] > 90}
+        r config set maxmemory 0
+        r config set maxmemory-policy noeviction
+        assert_equal 0 [s mem_tinylfu_sketch]
+        # The policy hit ratio only counts lookups after the policy change.
+        r get nokey
+        assert {[s policy_keyspace_hits_perc] == 0}
+        assert {[s keyspace_hits_perc] > 90}
+    }
+
     foreach policy {
         allkeys-random allkeys-lru volatile-lru volatile-random volatile-ttl
     } {
@@ -98,7 +191,7 @@ start_server {tags {"maxmemory"}} {
     }
 
     foreach policy {
-        volatile-lru volatile-lfu volatile-random volatile-ttl
+        volatile-lru volatile-lfu volatile-random volatile-ttl volatile-tinylfu
     } {
         test "maxmemory - policy $policy should only remove volatile keys." {
             # make sure to start with a blank instance
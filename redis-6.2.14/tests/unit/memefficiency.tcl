@@ -36,6 +36,207 @@ start_server {tags {"memefficiency"}} {
     }
 }
 
+proc slab_stat {class field} {
+    if {[regexp "\r\nslab_$class:(.*?)\r\n" [r info memory] -> stats]} {
+        foreach kv [split $stats ,] {
+            lassign [split $kv =] k v
+            if {$k eq $field} {return $v}
+        }
+    }
+    return 0
+}
+
+proc populate_small_objects {} {
+    set base_mem [s used_memory]
+    r debug populate 50000 key 10
+    # Integers not shared are stored in plain objects, not embedded strings.
+    set args {}
+    for {set j 0} {$j < 10000} {incr j} {
+        lappend args int:$j [expr {100000+$j}]
+    }
+    r mset {*}$args
+    set args {}
+    for {set j 0} {$j < 20000} {incr j} {
+        lappend args $j member:$j
+    }
+    r zadd myzset {*}$args
+    return [expr {[s used_memory]-$base_mem}]
+}
+
+start_server {tags {"memefficiency"} overrides {slab-allocator yes}} {
+    test "Slab allocator serves objects, entries and skiplist nodes" {
+        set slab_used [populate_small_objects]
+        assert {[slab_stat robj objects] >= 10000}
+        assert {[slab_stat dictEntry objects] >= 80000}
+        assert {[slab_stat zskiplistNode1 objects] > 10000}
+        assert_equal 60001 [r dbsize]
+        assert_equal 19999 [r zscore myzset member:19999]
+        assert_equal 109999 [r get int:9999]
+
+        # The same dataset uses more memory without slabs.
+        start_server {overrides {slab-allocator no}} {
+            set plain_used [populate_small_objects]
+            assert_equal 0 [slab_stat robj pages]
+        }
+        assert {$slab_used < $plain_used}
+    }
+
+    test "Slab pages are released when the objects are deleted" {
+        set pages [slab_stat dictEntry pages]
+        r flushall sync
+        assert {[slab_stat dictEntry pages] < $pages/10}
+        assert {[slab_stat zskiplistNode1 objects] == 0}
+        r debug populate 50000 key 10
+        r flushall async
+        wait_for_condition 50 100 {
+            [slab_stat dictEntry objects] < 100 &&
+            [slab_stat dictEntry pages] < $pages/10
+        } else {
+            fail "Objects released by the lazyfree threads are not reclaimed"
+        }
+    }
+}
+
+start_server {tags {"memefficiency"} overrides {hugepage-regions yes}} {
+    test "Huge page regions hold the big hash tables and ziplists" {
+        r debug populate 300000
+        assert {[s hugepage_regions] >= 1}
+        assert {[s hugepage_memory] >= 4*1024*1024}
+        set regions [s hugepage_regions]
+
+        # A quicklist node bigger than a huge page moves to its own region,
+        # and back to the allocator when it shrinks.
+        set big [string repeat x 3000000]
+        r rpush biglist $big
+        r rpush biglist foo
+        assert_equal [expr {$regions+1}] [s hugepage_regions]
+        r rpop biglist
+        assert_equal $big [r lindex biglist 0]
+        r lset biglist 0 bar
+        assert_equal $regions [s hugepage_regions]
+        assert_equal bar [r lindex biglist 0]
+
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r flushall sync
+        assert_equal 0 [s hugepage_regions]
+        assert_equal 0 [s hugepage_memory]
+    }
+}
+
+# The tracked usage of a key should be close to the exact one. For streams
+# the radix tree size computed by MEMORY USAGE SAMPLES is an estimation, as
+# well as the size of the values created without tracking ('estimated').
+proc assert_tracked_usage {key {estimated 0}} {
+    set tracked [r memory usage $key]
+    set exact [r memory usage $key samples 0]
+    set error [expr {[r type $key] eq {stream} || $estimated ? 0.25 : 0.05}]
+    assert_range $tracked [expr {$exact*(1-$error)}] \
+                          [expr {$exact*(1+$error)+512}]
+}
+
+start_server {tags {"memefficiency"}} {
+    test "MEMORY USAGE tracks the size of the values incrementally" {
+        r config set hash-max-ziplist-entries 16
+        r config set set-max-intset-entries 16
+        r config set zset-max-ziplist-entries 16
+        for {set j 0} {$j < 5000} {incr j} {
+            set val [string repeat x [expr {$j % 100}]]
+            r hset myhash field:$j $val
+            r sadd myset member:$j
+            r zadd myzset $j member:$j
+            r rpush mylist $val
+            r xadd mystream * field $val
+        }
+        for {set j 0} {$j < 5000} {incr j 3} {
+            r hdel myhash field:$j
+            r srem myset member:$j
+            r zrem myzset member:$j
+            r lpop mylist
+        }
+        r zremrangebyscore myzset 0 1000
+        r ltrim mylist 0 2000
+        r xtrim mystream maxlen 1000
+        foreach key {myhash myset myzset mylist mystream} {
+            assert_tracked_usage $key
+        }
+
+        # Values created without tracking are estimated on demand, sampling
+        # them, and loaded values are measured while created.
+        r sunionstore myset2 myset
+        assert_tracked_usage myset2 1
+        r sadd myset2 foo
+        assert_tracked_usage myset2 1
+        r debug reload
+        foreach key {myhash myset myzset mylist mystream} {
+            assert_tracked_usage $key
+        }
+        r hset myhash foo bar
+        assert_tracked_usage myhash
+    }
+
+    test "MEMORY TOP-KEYS reports the largest keys" {
+        r flushall
+        r config set memory-top-keys 3
+        for {set j 0} {$j < 10} {incr j} {
+            r set key:$j [string repeat x [expr {($j+1)*1000}]]
+        }
+        set top [r memory top-keys]
+        assert_equal 3 [llength $top]
+        assert_equal {key:9 key:8 key:7} [lmap e $top {lindex $e 1}]
+        assert_equal [r memory usage key:9] [lindex $top 0 2]
+
+        # Growing and deleting keys updates the set. The keys that left
+        # the set are not considered again until modified.
+        r append key:0 [string repeat x 20000]
+        r del key:9
+        assert_equal {key:0 key:8} [lmap e [r memory top-keys] {lindex $e 1}]
+        r append key:7 y
+        assert_equal {key:0 key:8 key:7} [lmap e [r memory top-keys] {lindex $e 1}]
+        assert_equal 1 [llength [r memory top-keys 1]]
+
+        assert_equal 9 [lindex [r memory top-keys] 0 0]
+        r swapdb 0 9
+        assert_equal 0 [lindex [r memory top-keys] 0 0]
+        r swapdb 0 9
+        r config set memory-top-keys 1
+        set top [r memory top-keys]
+        assert_equal {9 key:0} [lrange [lindex $top 0] 0 1]
+        assert_equal 1 [llength $top]
+        r flushall
+        assert_equal {} [r memory top-keys]
+        r config set memory-top-keys 0
+        r set key:0 x
+        assert_equal {} [r memory top-keys]
+        r flushall
+    } {OK}
+
+    test "Size aware eviction prefers the larger keys" {
+        r flushall
+        r config set maxmemory-policy allkeys-lfu
+        r config set maxmemory-eviction-size-aware yes
+        r config set maxmemory-samples 10
+        for {set j 0} {$j < 500} {incr j} {
+            r set small:$j x
+            r set big:$j [string repeat x 4000]
+        }
+        # All the keys have the same initial LFU counter.
+        r config set maxmemory [expr {[s used_memory]-100000}]
+        r set foo bar
+        set small 0
+        set big 0
+        foreach key [r keys *:*] {
+            if {[string match small:* $key]} {incr small} else {incr big}
+        }
+        r config set maxmemory 0
+        r config set maxmemory-eviction-size-aware no
+        r config set maxmemory-policy noeviction
+        assert_equal 500 $small
+        assert {$big < 500}
+    }
+}
+
 run_solo {defrag} {
 start_server {tags {"defrag"} overrides {appendonly yes auto-aof-rewrite-percentage 0 save ""}} {
     if {[string match {*jemalloc*} [s mem_allocator]] && [r debug mallctl arenas.page] <= 8192} {
@@ -389,6 +590,47 @@ start_server {tags {"defrag"} overrides {appendonly yes auto-aof-rewrite-percent
             r del biglist1 ;# coverage for quicklistBookmarksClear
         } {1}
 
+        test "Active defrag skips the size classes with little fragmentation" {
+            r flushdb
+            r config set activedefrag no
+            r config set active-defrag-threshold-lower 5
+            r config set active-defrag-ignore-bytes 1mb
+            r config set maxmemory 0
+            r config resetstat
+
+            # Two key populations using different size classes, only the
+            # first one gets fragmented.
+            r debug populate 300000 frag 40
+            r debug populate 300000 dense 300
+            for {set j 0} {$j < 300000} {incr j 2} {
+                r del frag:$j
+            }
+            set digest [r debug digest]
+            r config set activedefrag yes
+            wait_for_condition 50 100 {
+                [s active_defrag_running] ne 0
+            } else {
+                fail "defrag not started."
+            }
+            wait_for_condition 150 100 {
+                [s active_defrag_running] eq 0
+            } else {
+                fail "defrag didn't stop."
+            }
+            r config set activedefrag no
+            if {$::verbose} {
+                puts "hits: [s active_defrag_hits]"
+                puts "misses: [s active_defrag_misses]"
+                puts "skipped: [s active_defrag_skipped]"
+                puts "target bins: [s active_defrag_target_bins]"
+            }
+            assert {[s active_defrag_hits] > 0}
+            assert {[s active_defrag_skipped] > 0}
+            assert {[s active_defrag_target_bins] > 0}
+            assert_equal $digest [r debug digest]
+            r flushdb
+        }
+
         test "Active defrag edge case" {
             # there was an edge case in defrag where all the slabs of a certain bin are exact the same
             # % utilization, with the exception of the current slab from which new allocations are made
@@ -107,8 +107,12 @@ tags "modules" {
                             $master multi
                             $master client kill type replica
                             $master set asdf asdf
-                            # the side effect of resizing the backlog is that it is flushed (16k is the min size)
-                            $master config set repl-backlog-size [expr {16384 + $i}]
+                            # fill the replication backlog with new content, so
+                            # that the offset of the replica is no longer in it
+                            $master config set repl-backlog-size 16384
+                            for {set keyid 0} {$keyid < 10} {incr keyid} {
+                                $master set "$keyid string_$keyid" [string repeat A 16384]
+                            }
                             $master exec
                         }
                         # wait for loading to stop (fail)
@@ -180,6 +180,13 @@ start_server {
             assert_equal [list 195 196 197 198 199 $large] [lsort [r sinter set1 set2]]
         }
 
+        test "SINTERCARD with two sets - $type" {
+            assert_equal 6 [r sintercard 2 set1 set2]
+            assert_equal 6 [r sintercard 2 set1 set2 limit 0]
+            assert_equal 3 [r sintercard 2 set1 set2 limit 3]
+            assert_equal 6 [r sintercard 2 set1 set2 limit 10]
+        }
+
         test "SINTERSTORE with two sets - $type" {
             r sinterstore setres set1 set2
             assert_encoding $type setres
@@ -209,6 +216,16 @@ start_server {
             assert_equal [list 195 199 $large] [lsort [r sinter set1 set2 set3]]
         }
 
+        test "SINTERCARD against three sets - $type" {
+            assert_equal 3 [r sintercard 3 set1 set2 set3]
+            assert_equal 2 [r sintercard 3 set1 set2 set3 limit 2]
+        }
+
+        test "SUNION with many sets - $type" {
+            set expected [lsort -uniq "[r smembers set1] [r smembers set2] [r smembers set3] [r smembers set4] [r smembers set5]"]
+            assert_equal $expected [lsort [r sunion set1 set2 set3 set4 set5 set1 nokey]]
+        }
+
         test "SINTERSTORE with three sets - $type" {
             r sinterstore setres set1 set2 set3
             assert_equal [list 195 199 $large] [lsort [r smembers setres]]
@@ -365,6 +382,33 @@ start_server {
         r sinter set1 set2 set3
     } {}
 
+    test "SINTERCARD against non-set should throw error" {
+        r del set{t} key1{t}
+        r set key1{t} x
+        r sadd set{t} a b c
+        assert_error "WRONGTYPE*" {r sintercard 2 key1{t} set{t}}
+        assert_error "WRONGTYPE*" {r sintercard 2 set{t} key1{t}}
+    }
+
+    test "SINTERCARD should handle non existing key as empty" {
+        r del set1{t} set2{t}
+        r sadd set1{t} a b c
+        r sintercard 2 set1{t} set2{t}
+    } {0}
+
+    test "SINTERCARD with illegal arguments" {
+        assert_error "ERR wrong number of arguments*" {r sintercard}
+        assert_error "ERR wrong number of arguments*" {r sintercard 1}
+        assert_error "*numkeys*" {r sintercard 0 myset{t}}
+        assert_error "*numkeys*" {r sintercard a myset{t}}
+        assert_error "*Number of keys*" {r sintercard 2 myset{t}}
+        assert_error "*syntax*" {r sintercard 1 myset{t} myset2{t}}
+        assert_error "*syntax*" {r sintercard 1 myset{t} bar_arg}
+        assert_error "*syntax*" {r sintercard 1 myset{t} LIMIT}
+        assert_error "*LIMIT*" {r sintercard 1 myset{t} LIMIT -1}
+        assert_error "*LIMIT*" {r sintercard 1 myset{t} LIMIT a}
+    }
+
     test "SINTER with same integer elements but different encoding" {
         r del set1 set2
         r sadd set1 1 2 3
@@ -967,4 +1011,83 @@ start_server {
             }
         }
     }
+
+    test {Large intsets: basic operations and DEBUG RELOAD} {
+        r config set set-max-intset-entries 100000
+        r del s
+        unset -nocomplain s
+        array set s {}
+        set elements {}
+        for {set i 0} {$i < 5000} {incr i} {
+            randpath {
+                set data [randomInt 65536]
+            } {
+                set data [expr {[randomInt 4294967296]-2147483648}]
+            } {
+                set data [randomInt 18446744073709551616]
+            } {
+                set data [expr {1000000000000+$i}]
+            }
+            set s($data) {}
+            lappend elements $data
+        }
+        r sadd s {*}$elements
+        assert_encoding intset s
+        assert_equal [array size s] [r scard s]
+        assert_equal [lsort [r smembers s]] [lsort [array names s]]
+        foreach e [lrange $elements 0 1999] {
+            array unset s $e
+            r srem s $e
+            assert_equal 0 [r sismember s $e]
+        }
+        assert_equal [array size s] [r scard s]
+        foreach e [lrange $elements 2000 2100] {
+            assert_equal [info exists s($e)] [r sismember s $e]
+        }
+        r debug reload
+        assert_encoding intset s
+        assert_equal [lsort [r smembers s]] [lsort [array names s]]
+        for {set i 0} {$i < 100} {incr i} {
+            assert {[info exists s([r srandmember s])]}
+        }
+        r config set set-max-intset-entries 512
+    } {OK} {needs:debug}
+
+    test {Large intsets: SINTER / SINTERSTORE gallop across intsets} {
+        r config set set-max-intset-entries 100000
+        r del a b c dst
+        set la {}
+        set lb {}
+        set lc {}
+        for {set i 0} {$i < 20000} {incr i} {
+            lappend la [expr {$i*2}]
+            lappend lb [expr {$i*3}]
+        }
+        for {set i 0} {$i < 50} {incr i} {
+            lappend lc [expr {[randomInt 20000]*6}]
+        }
+        lappend lc 7 -1 999999999999
+        r sadd a {*}$la
+        r sadd b {*}$lb
+        r sadd c {*}$lc
+        assert_encoding intset a
+        set expected {}
+        foreach e [lsort -unique -integer $lc] {
+            if {$e >= 0 && $e % 6 == 0 && $e < 40000} {lappend expected $e}
+        }
+        assert_equal $expected [lsort -integer [r sinter a b c]]
+        assert_equal $expected [lsort -integer [r sinter c a b]]
+        assert_equal 6667 [llength [r sinter a b]]
+        assert_equal [llength $expected] [r sinterstore dst a c b]
+        assert_equal $expected [lsort -integer [r smembers dst]]
+        assert_equal {} [r sinter a b {c} nokey]
+        assert_equal [llength $expected] [r sintercard 3 a b c]
+        assert_equal 6667 [r sintercard 2 b a]
+        assert_equal 100 [r sintercard 2 b a limit 100]
+        set union [r sunion a b nokey]
+        assert_equal 33333 [llength $union]
+        assert_equal 33333 [llength [lsort -unique $union]]
+        assert_equal 33333 [r sunionstore dst a b]
+        r config set set-max-intset-entries 512
+    } {OK}
 }
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Compare the data TLB misses and the GET throughput of random key lookups
+# in a large keyspace, with and without the huge page regions (see the
+# hugepage-regions directive in redis.conf).
+#
+# Usage: utils/hugepage-benchmark.sh [keys] [requests]
+#
+# Run it from the Redis source root after building Redis, on Linux with
+# Transparent Huge Pages set to 'madvise'. For every configuration a new
+# server is started on port 21112 (set PORT to change it) and populated
+# with 'keys' keys, then redis-benchmark runs 'requests' GET requests of
+# random keys, while "perf stat" counts the dTLB misses of the server. When
+# perf is not available only the throughput is reported. The anon_huge
+# column is the memory of the server backed by huge pages.
+
+KEYS=${1:-10000000}
+REQUESTS=${2:-2000000}
+PORT=${PORT:-21112}
+SERVER=${SERVER:-src/redis-server}
+CLI="${CLI:-src/redis-cli} -p $PORT"
+BENCHMARK="${BENCHMARK:-src/redis-benchmark} -p $PORT"
+PIDFILE=/tmp/hugepage-benchmark-$PORT.pid
+PERF=$(command -v perf)
+
+echo "THP: $(cat /sys/kernel/mm/transparent_hugepage/enabled 2>/dev/null)"
+[ -z "$PERF" ] && echo "perf not found, TLB misses will not be reported"
+
+printf "%-8s %14s %14s %16s %12s %12s\n" \
+    regions hugepage_mem anon_huge dtlb_misses misses/req get_rps
+for regions in no yes; do
+    $SERVER --port $PORT --save "" --appendonly no \
+            --hugepage-regions $regions --daemonize yes \
+            --logfile /dev/null --pidfile $PIDFILE
+    until $CLI ping >/dev/null 2>&1; do sleep 0.1; done
+    pid=$(cat $PIDFILE)
+
+    $CLI debug populate $KEYS key 10 >/dev/null
+    hugemem=$($CLI info memory | tr -d '\r' | grep "^hugepage_memory:" | \
+              cut -d: -f2)
+    anon=$(awk '/^AnonHugePages:/ {kb += $2} END {print kb*1024}' \
+           /proc/$pid/smaps 2>/dev/null)
+
+    misses=-
+    perreq=-
+    if [ -n "$PERF" ]; then
+        $PERF stat -x, -e dTLB-load-misses -p $pid \
+            -o /tmp/hugepage-benchmark-$PORT.perf &
+        perfpid=$!
+        sleep 1
+    fi
+    rps=$($BENCHMARK -q -n $REQUESTS -r $KEYS -t get --csv | tail -1 | \
+          cut -d, -f2 | tr -d '"')
+    if [ -n "$PERF" ]; then
+        kill -INT $perfpid
+        wait $perfpid
+        misses=$(grep dTLB-load-misses /tmp/hugepage-benchmark-$PORT.perf | \
+                 cut -d, -f1)
+        perreq=$(awk "BEGIN {printf \"%.2f\", $misses/$REQUESTS}")
+        rm -f /tmp/hugepage-benchmark-$PORT.perf
+    fi
+    printf "%-8s %14s %14s %16s %12s %12s\n" \
+        $regions $hugemem $anon $misses $perreq $rps
+
+    $CLI shutdown nosave >/dev/null 2>&1
+    while $CLI ping >/dev/null 2>&1; do sleep 0.1; done
+done
@@ -0,0 +1,185 @@
+#!/usr/bin/env tclsh8.5
+#
+# Replay an access trace against a running Redis instance configured as an
+# allkeys-lru cache, and compare its hit ratio with the one of a true LRU
+# cache of the same number of keys, for different eviction configurations.
+#
+# Every line of the trace is an access: the first field is the key name,
+# the rest of the line is ignored. An access is a GET, followed by a SET
+# of the key on misses, like a cache would do. When no trace is given a
+# synthetic one is generated, with a skewed popularity and periodic scans.
+#
+# See the README in this directory for the details.
+
+source [file join [file dirname [info script]] ../../tests/support/redis.tcl]
+
+set ::host 127.0.0.1
+set ::port 6379
+set ::trace {}
+set ::record {}
+set ::keys 100000
+set ::accesses 500000
+set ::cache_keys 10000
+set ::value_size 100
+set ::samples 5
+set ::candidates {0 1024 16384}
+
+proc usage {} {
+    puts "Usage: lru-trace-accuracy.tcl \[options\]"
+    puts "  --host <host>          Server hostname (default: $::host)"
+    puts "  --port <port>          Server port (default: $::port)"
+    puts "  --trace <file>         Replay the recorded trace in <file>"
+    puts "  --record <file>        Save the synthetic trace to <file>"
+    puts "  --keys <n>             Synthetic trace keyspace (default: $::keys)"
+    puts "  --accesses <n>         Synthetic trace length (default: $::accesses)"
+    puts "  --cache-keys <n>       Keys fitting in maxmemory (default: $::cache_keys)"
+    puts "  --value-size <n>       Size of the values (default: $::value_size)"
+    puts "  --samples <n>          maxmemory-samples (default: $::samples)"
+    puts "  --candidates <list>    maxmemory-eviction-candidates values to test,"
+    puts "                         0 is the eviction pool (default: \"$::candidates\")"
+    exit 1
+}
+
+proc parse_options {argv} {
+    foreach {opt val} $argv {
+        switch -- $opt {
+            --host {set ::host $val}
+            --port {set ::port $val}
+            --trace {set ::trace $val}
+            --record {set ::record $val}
+            --keys {set ::keys $val}
+            --accesses {set ::accesses $val}
+            --cache-keys {set ::cache_keys $val}
+            --value-size {set ::value_size $val}
+            --samples {set ::samples $val}
+            --candidates {set ::candidates $val}
+            default {usage}
+        }
+    }
+}
+
+proc load_trace {filename} {
+    set trace {}
+    set fd [open $filename]
+    while {[gets $fd line] >= 0} {
+        set key [lindex [split [string trim $line]] 0]
+        if {$key ne {}} {lappend trace $key}
+    }
+    close $fd
+    return $trace
+}
+
+# Most accesses hit a small set of popular keys, while one access every
+# 100 is part of a sequential scan of the keyspace, that a good LRU
+# approximation should not let evict the popular keys too much.
+proc synthetic_trace {keys accesses} {
+    set trace {}
+    set scan 0
+    for {set j 0} {$j < $accesses} {incr j} {
+        if {$j % 100 == 0} {
+            lappend trace "key:[expr {$scan % $keys}]"
+            incr scan
+        } else {
+            lappend trace "key:[expr {int($keys*pow(rand(),4))}]"
+        }
+    }
+    return $trace
+}
+
+# Return the number of hits of a true LRU cache of 'capacity' keys.
+# Tcl dictionaries preserve the insertion order, so the first key is
+# always the least recently used one.
+proc true_lru_hits {trace capacity} {
+    set cache [dict create]
+    set hits 0
+    foreach key $trace {
+        if {[dict exists $cache $key]} {
+            incr hits
+            dict unset cache $key
+        } elseif {[dict size $cache] >= $capacity} {
+            dict for {oldest _} $cache break
+            dict unset cache $oldest
+        }
+        dict set cache $key 1
+    }
+    return $hits
+}
+
+proc info_field {r field} {
+    if {[regexp "\r\n$field:(.*?)\r\n" [$r info] -> value]} {
+        return $value
+    }
+    return 0
+}
+
+# Set maxmemory so that about 'cache_keys' keys fit in memory.
+proc configure_maxmemory {r} {
+    $r config set maxmemory 0
+    $r flushall
+    set value [string repeat x $::value_size]
+    for {set j 0} {$j < $::cache_keys} {incr j} {
+        $r set "key:$j" $value
+    }
+    set used [info_field $r used_memory]
+    $r flushall
+    $r config set maxmemory $used
+}
+
+proc replay {r trace candidates} {
+    $r config set maxmemory-policy allkeys-lru
+    $r config set maxmemory-samples $::samples
+    $r config set maxmemory-eviction-candidates $candidates
+    configure_maxmemory $r
+    $r config resetstat
+
+    set value [string repeat x $::value_size]
+    set hits 0
+    set start [clock milliseconds]
+    foreach key $trace {
+        if {[$r get $key] ne {}} {
+            incr hits
+        } else {
+            $r set $key $value
+        }
+    }
+    set elapsed [expr {[clock milliseconds]-$start}]
+    return [list $hits [$r dbsize] [info_field $r evicted_keys] $elapsed]
+}
+
+parse_options $argv
+if {$::trace ne {}} {
+    set trace [load_trace $::trace]
+} else {
+    set trace [synthetic_trace $::keys $::accesses]
+    if {$::record ne {}} {
+        set fd [open $::record w]
+        puts $fd [join $trace "\n"]
+        close $fd
+    }
+}
+
+set r [redis $::host $::port]
+if {[lindex [$r config get maxmemory-eviction-candidates] 1] eq {}} {
+    puts "This Redis version does not support maxmemory-eviction-candidates"
+    exit 1
+}
+
+set total [llength $trace]
+puts "Replaying $total accesses, about $::cache_keys keys fit in memory"
+puts ""
+puts [format "%-12s %10s %10s %10s %12s %10s" \
+    candidates hit-ratio true-lru accuracy evicted ms]
+foreach c $::candidates {
+    lassign [replay $r $trace $c] hits capacity evicted elapsed
+    # Compare with a true LRU holding the keys Redis was able to hold.
+    set lru_hits [true_lru_hits $trace $capacity]
+    set ratio [expr {double($hits)/$total}]
+    set lru_ratio [expr {double($lru_hits)/$total}]
+    puts [format "%-12s %9.2f%% %9.2f%% %9.2f%% %12s %10s" $c \
+        [expr {$ratio*100}] [expr {$lru_ratio*100}] \
+        [expr {$lru_hits ? double($hits)/$lru_hits*100 : 100}] \
+        $evicted $elapsed]
+}
+$r config set maxmemory-eviction-candidates 0
+$r config set maxmemory 0
+$r flushall
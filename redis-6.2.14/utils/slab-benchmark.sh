@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Compare the memory used by small keys, sorted set elements and their
+# allocations, and the GET/SET throughput, of redis-server with and without
+# the slab allocator (see the slab-allocator directive in redis.conf).
+#
+# Usage: utils/slab-benchmark.sh [keys] [requests]
+#
+# Run it from the Redis source root after building Redis. For every
+# configuration a new server is started on port 21111 (set PORT to change
+# it), populated with 'keys' small string keys and a sorted set of 'keys'
+# elements, then redis-benchmark runs 'requests' GET and SET requests
+# against the populated keyspace.
+
+KEYS=${1:-1000000}
+REQUESTS=${2:-1000000}
+PORT=${PORT:-21111}
+SERVER=${SERVER:-src/redis-server}
+CLI="${CLI:-src/redis-cli} -p $PORT"
+BENCHMARK="${BENCHMARK:-src/redis-benchmark} -p $PORT"
+
+info_field() {
+    $CLI info memory | tr -d '\r' | grep "^$1:" | cut -d: -f2
+}
+
+bench_rps() {
+    $BENCHMARK -q -n $REQUESTS -r $KEYS -t $1 --csv | tail -1 | \
+        cut -d, -f2 | tr -d '"'
+}
+
+printf "%-6s %14s %14s %12s %12s\n" slabs used_memory rss set_rps get_rps
+for slabs in no yes; do
+    $SERVER --port $PORT --save "" --appendonly no \
+            --slab-allocator $slabs --daemonize yes \
+            --logfile /dev/null --pidfile /tmp/slab-benchmark-$PORT.pid
+    until $CLI ping >/dev/null 2>&1; do sleep 0.1; done
+
+    base=$(info_field used_memory)
+    base_rss=$(info_field used_memory_rss)
+    $CLI debug populate $KEYS key 10 >/dev/null
+    $BENCHMARK -q -n $KEYS -r $KEYS -t zadd >/dev/null
+    used=$(( $(info_field used_memory) - base ))
+    rss=$(( $(info_field used_memory_rss) - base_rss ))
+    set_rps=$(bench_rps set)
+    get_rps=$(bench_rps get)
+    printf "%-6s %14s %14s %12s %12s\n" $slabs $used $rss $set_rps $get_rps
+
+    $CLI shutdown nosave >/dev/null 2>&1
+    while $CLI ping >/dev/null 2>&1; do sleep 0.1; done
+done